@@ -37,9 +37,19 @@
 #include <drm_fourcc.h>
 
 #include "capture.h"
+#include "log.h"
+#include "stage.h"
+#include "pyramid.h"
+#include "fingerprint.h"
+#include "scope.h"
+#include "crop.h"
+#include "slides.h"
 #include "kms.h"
 #include "status.h"
+#include "frc.h"
 #include "projector.h"
+#include "nv12.h"
+#include "thread.h"
 #include "juggler.h"
 
 static int capture_fd = -1;
@@ -56,9 +66,34 @@ static int capture_voffset = -1;
 
 static int capture_frame_offset = -1;
 
+/*
+ * Bits that our test pattern checks have looked at, and how many of those
+ * were wrong. Only touched by capture, a copy is kept for others.
+ */
+static uint64_t capture_test_bits;
+static uint64_t capture_test_errors;
+static pthread_mutex_t capture_test_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+static uint64_t capture_test_bits_last;
+static uint64_t capture_test_errors_last;
+
+static bool capture_calibrate = false;
+static int capture_hoffset_min, capture_hoffset_max;
+static int capture_voffset_min, capture_voffset_max;
+
+static bool capture_nv12 = false;
+
 static int capture_buffer_count;
 static struct capture_buffer *capture_buffers;
 
+/* frames it takes to build a pyramid image */
+#define CAPTURE_PYRAMID_BANDS 8
+
+static struct stage *capture_stage;
+static struct pyramid *capture_pyramid;
+static struct fingerprint *capture_fingerprint;
+static struct scope *capture_scope;
+static struct crop *capture_crop;
+
 static pthread_t capture_thread[1];
 
 static int
@@ -184,6 +219,9 @@ v4l2_hv_offsets_set(void)
 	       hctrl->value, hquery->default_value, hquery->minimum,
 	       hquery->maximum);
 
+	capture_hoffset_min = hquery->minimum;
+	capture_hoffset_max = hquery->maximum;
+
 	if (capture_hoffset == -1) {
 		capture_hoffset = hctrl->value;
 	} else if ((capture_hoffset < hquery->minimum) ||
@@ -221,6 +259,9 @@ v4l2_hv_offsets_set(void)
 	       vctrl->value, vquery->default_value, vquery->minimum,
 	       vquery->maximum);
 
+	capture_voffset_min = vquery->minimum;
+	capture_voffset_max = vquery->maximum;
+
 	if (capture_voffset == -1) {
 		capture_voffset = vctrl->value;
 	} else if ((capture_voffset < vquery->minimum) ||
@@ -243,6 +284,57 @@ v4l2_hv_offsets_set(void)
 	return 0;
 }
 
+/*
+ * Update the offsets while streaming, used by the calibration code.
+ */
+static int
+v4l2_hv_offsets_update(int hoffset, int voffset)
+{
+	struct v4l2_control hctrl[1] = {{
+			.id = SUN4I_CSI1_HDISPLAY_START,
+		}};
+	struct v4l2_control vctrl[1] = {{
+			.id = SUN4I_CSI1_VDISPLAY_START,
+		}};
+	int ret;
+
+	if (hoffset < capture_hoffset_min)
+		hoffset = capture_hoffset_min;
+	else if (hoffset > capture_hoffset_max)
+		hoffset = capture_hoffset_max;
+
+	if (voffset < capture_voffset_min)
+		voffset = capture_voffset_min;
+	else if (voffset > capture_voffset_max)
+		voffset = capture_voffset_max;
+
+	if (hoffset != capture_hoffset) {
+		hctrl->value = hoffset;
+
+		ret = ioctl(capture_fd, VIDIOC_S_CTRL, hctrl);
+		if (ret) {
+			log_error("Error: ioctl(VIDIOC_S_CTRL) failed: %s\n",
+				  strerror(errno));
+			return ret;
+		}
+		capture_hoffset = hoffset;
+	}
+
+	if (voffset != capture_voffset) {
+		vctrl->value = voffset;
+
+		ret = ioctl(capture_fd, VIDIOC_S_CTRL, vctrl);
+		if (ret) {
+			log_error("Error: ioctl(VIDIOC_S_CTRL) failed: %s\n",
+				  strerror(errno));
+			return ret;
+		}
+		capture_voffset = voffset;
+	}
+
+	return 0;
+}
+
 /*
  * Again, assuming that all planes have the same size.
  */
@@ -297,9 +389,11 @@ v4l2_buffers_alloc(int width, int height, int pitch, int plane_size,
 
 		capture_buffers[i].v4l2_fourcc = fourcc;
 		capture_buffers[i].drm_format = drm_format;
+		capture_buffers[i].plane_count = 3;
 
 		pthread_mutex_init(capture_buffers[i].reference_count_mutex,
 				   NULL);
+		pthread_mutex_init(capture_buffers[i].map_mutex, NULL);
 	}
 
 	return 0;
@@ -357,6 +451,7 @@ v4l2_buffers_release(void)
 				       __func__, i);
 				pthread_mutex_destroy(buffer->
 						      reference_count_mutex);
+				pthread_mutex_destroy(buffer->map_mutex);
 				break;
 			}
 
@@ -381,8 +476,13 @@ v4l2_buffers_release(void)
 	return 0;
 }
 
+/*
+ * Only get the plane offsets here, the actual mapping is done on demand
+ * by capture_buffer_plane_map(). Our display path is pure dmabuf, so
+ * most planes will never be mapped at all.
+ */
 static int
-v4l2_buffer_mmap(int index, struct capture_buffer *buffer)
+v4l2_buffer_query(int index, struct capture_buffer *buffer)
 {
 	struct v4l2_plane planes[3] = {{ 0 }};
 	struct v4l2_buffer query[1] = {{
@@ -402,25 +502,47 @@ v4l2_buffer_mmap(int index, struct capture_buffer *buffer)
 	}
 
 	for (i = 0; i < 3; i++) {
-		off_t offset = query->m.planes[i].m.mem_offset;
-		void *map;
+		buffer->planes[i].offset = query->m.planes[i].m.mem_offset;
+		buffer->planes[i].map = NULL;
+	}
 
-		map = mmap(NULL, capture_plane_size, PROT_READ, MAP_SHARED,
-			   capture_fd, offset);
-		if (map == MAP_FAILED) {
-			fprintf(stderr, "Error: failed to mmap buffer %d[%d]:"
-				" %s\n", buffer->index, i, strerror(errno));
-			return errno;
-		}
+	return 0;
+}
+
+/*
+ * Map a plane of a capture buffer, the first time it is asked for. The
+ * mapping is then kept until the buffers are torn down.
+ */
+void *
+capture_buffer_plane_map(struct capture_buffer *buffer, int plane)
+{
+	void *map;
 
-		printf("Mapped buffer %02d[%d] @ 0x%08lX to %p.\n",
-		       buffer->index, i, offset, map);
+	pthread_mutex_lock(buffer->map_mutex);
 
-		buffer->planes[i].offset = offset;
-		buffer->planes[i].map = map;
+	map = buffer->planes[plane].map;
+	if (map) {
+		pthread_mutex_unlock(buffer->map_mutex);
+		return map;
 	}
 
-	return 0;
+	map = mmap(NULL, buffer->plane_size, PROT_READ, MAP_SHARED,
+		   capture_fd, buffer->planes[plane].offset);
+	if (map == MAP_FAILED) {
+		log_error("Error: failed to mmap buffer %d[%d]: %s\n",
+			  buffer->index, plane, strerror(errno));
+		pthread_mutex_unlock(buffer->map_mutex);
+		return NULL;
+	}
+
+	log_info("Mapped buffer %02d[%d] @ 0x%08lX to %p.\n",
+		 buffer->index, plane, buffer->planes[plane].offset, map);
+
+	buffer->planes[plane].map = map;
+
+	pthread_mutex_unlock(buffer->map_mutex);
+
+	return map;
 }
 
 static int
@@ -445,12 +567,12 @@ v4l2_buffer_munmap(int index, struct capture_buffer *buffer)
 }
 
 static int
-v4l2_buffers_mmap(void)
+v4l2_buffers_query(void)
 {
 	int ret, i;
 
 	for (i = 0; i < capture_buffer_count; i++) {
-		ret = v4l2_buffer_mmap(i, &capture_buffers[i]);
+		ret = v4l2_buffer_query(i, &capture_buffers[i]);
 		if (ret)
 			return ret;
 	}
@@ -601,8 +723,8 @@ v4l2_buffer_queue(int index)
 
 	ret = ioctl(capture_fd, VIDIOC_QBUF, queue);
 	if (ret) {
-		fprintf(stderr, "Error: ioctl(VIDIOC_QBUF(%d)) failed: "
-			"%s\n", index, strerror(errno));
+		log_error("Error: ioctl(VIDIOC_QBUF(%d)) failed: "
+			  "%s\n", index, strerror(errno));
 		return ret;
 	}
 
@@ -672,8 +794,8 @@ v4l2_buffer_dequeue(struct capture_buffer **buffer_return)
 
 	ret = ioctl(capture_fd, VIDIOC_DQBUF, dequeue);
 	if (ret) {
-		fprintf(stderr, "Error: ioctl(VIDIOC_DQBUF) failed: %s\n",
-			strerror(errno));
+		log_error("Error: ioctl(VIDIOC_DQBUF) failed: %s\n",
+			  strerror(errno));
 		*buffer_return = NULL;
 		return ret;
 	}
@@ -692,127 +814,342 @@ v4l2_buffer_dequeue(struct capture_buffer **buffer_return)
 	return ret;
 }
 
+/*
+ * We have swapped blue and red channels on our system.
+ */
 static void
-capture_buffer_test_frame(int frame,
-			  uint8_t *red, uint8_t *green, uint8_t *blue,
-			  int x, int y)
+capture_buffer_test_frame(struct stage *stage, int frame, int x, int y)
 {
-	int offset = x + (y * capture_width);
+	const uint8_t *blue = stage_row(stage, 0, y);
+	const uint8_t *green = stage_row(stage, 1, y);
+	const uint8_t *red = stage_row(stage, 2, y);
 
 	if (capture_frame_offset == -1) {
-		capture_frame_offset = (blue[offset] - frame) & 0xFF;
-		printf("frame: 0x%02X, blue: 0x%02X, offset: 0x%02X\n",
-		       frame & 0xFF, blue[offset], capture_frame_offset);
+		capture_frame_offset = (blue[x] - frame) & 0xFF;
+		log_info("frame: 0x%02X, blue: 0x%02X, offset: 0x%02X\n",
+			 frame & 0xFF, blue[x], capture_frame_offset);
 	} else {
 		int count = (frame + capture_frame_offset) & 0xFF;
 
-		if (count != blue[offset])
-			printf("Frame %d: frame mismatch (%4d,%4d):"
-			       " 0x%02X should be 0x%02X.\n",
-			       frame, x, y, blue[offset], count);
+		if (count != blue[x]) {
+			log_ratelimited(LOG_WARNING, "Frame %d: frame "
+					"mismatch (%4d,%4d): 0x%02X should be "
+					"0x%02X.\n", frame, x, y, blue[x],
+					count);
+			capture_test_errors +=
+				__builtin_popcount(count ^ blue[x]);
+		}
+		capture_test_bits += 8;
 	}
 
-	if (((x & 0xFF) != red[offset]) ||
-	    ((y & 0xFF) != green[offset]))
-		printf("Frame %d: position mismatch: (%4d,%4d)"
-		       "(0x%02X,0x%02X) should be (0x%02X,0x%02X)\n",
-		       frame, x, y, red[offset], green[offset],
-		       (x & 0xFF), (y & 0xFF));
+	if (((x & 0xFF) != red[x]) ||
+	    ((y & 0xFF) != green[x])) {
+		log_ratelimited(LOG_WARNING, "Frame %d: position mismatch:"
+				" (%4d,%4d)(0x%02X,0x%02X) should be "
+				"(0x%02X,0x%02X)\n", frame, x, y, red[x],
+				green[x], (x & 0xFF), (y & 0xFF));
+		capture_test_errors +=
+			__builtin_popcount((x & 0xFF) ^ red[x]) +
+			__builtin_popcount((y & 0xFF) ^ green[x]);
+	}
+	capture_test_bits += 16;
 }
 
 static __maybe_unused void
-capture_buffer_test_empty(int frame,
-			  uint8_t *red, uint8_t *green, uint8_t *blue,
-			  int x, int y)
+capture_buffer_test_empty(struct stage *stage, int frame, int x, int y)
 {
-	int offset = x + (y * capture_width);
-
-	if (blue[offset])
-		printf("Frame %d: blue channel mismatch (%4d,%4d):"
-		       " 0x%02X should be 0.\n", frame, x, y, blue[offset]);
-
-	if (((x & 0xFF) != red[offset]) ||
-	    ((y & 0xFF) != green[offset]))
-		printf("Frame %d: position mismatch: (%4d,%4d)"
-		       "(0x%02X,0x%02X) should be (0x%02X,0x%02X)\n",
-		       frame, x, y, red[offset], green[offset],
-		       (x & 0xFF), (y & 0xFF));
+	const uint8_t *blue = stage_row(stage, 0, y);
+	const uint8_t *green = stage_row(stage, 1, y);
+	const uint8_t *red = stage_row(stage, 2, y);
+
+	if (blue[x])
+		log_ratelimited(LOG_WARNING, "Frame %d: blue channel "
+				"mismatch (%4d,%4d): 0x%02X should be 0.\n",
+				frame, x, y, blue[x]);
+
+	if (((x & 0xFF) != red[x]) ||
+	    ((y & 0xFF) != green[x]))
+		log_ratelimited(LOG_WARNING, "Frame %d: position mismatch:"
+				" (%4d,%4d)(0x%02X,0x%02X) should be "
+				"(0x%02X,0x%02X)\n", frame, x, y, red[x],
+				green[x], (x & 0xFF), (y & 0xFF));
 }
 
 static  __maybe_unused void
-capture_buffer_test(struct capture_buffer *buffer)
+capture_buffer_test(struct stage *stage, struct capture_buffer *buffer)
 {
-	uint8_t *red, *green, *blue;
 	int center_x = (capture_width >> 1);
 	int center_y = (capture_height >> 1);
 	int frame = buffer->sequence;
 
-	/* we have swapped blue and red channels on our system */
-	blue = buffer->planes[0].map;
-	green = buffer->planes[1].map;
-	red = buffer->planes[2].map;
-
-	printf("\rTesting frame %4d (%2d):", frame, buffer->index);
+	/* once a second is plenty for progress */
+	if (!(frame % 60))
+		log_info("Testing frame %4d (%2d).\n", frame, buffer->index);
 
 	/*
 	 * Test 16x16 pixels in the lower right corner, this will also
 	 * initialize the frame counter, so make it the lower corner to
 	 * work around the tfp401s limitations.
 	 */
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 16, capture_height - 16);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 1, capture_height - 16);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 16, capture_height - 1);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 1, capture_height - 1);
 
 	/* Test 16x16 pixels in the upper left corner */
-	capture_buffer_test_frame(frame, red, green, blue, 0, 0);
-	capture_buffer_test_frame(frame, red, green, blue, 15, 0);
-	capture_buffer_test_frame(frame, red, green, blue, 0, 15);
-	capture_buffer_test_frame(frame, red, green, blue, 15, 15);
+	capture_buffer_test_frame(stage, frame, 0, 0);
+	capture_buffer_test_frame(stage, frame, 15, 0);
+	capture_buffer_test_frame(stage, frame, 0, 15);
+	capture_buffer_test_frame(stage, frame, 15, 15);
 
 	/* Test 16x16 pixels in the upper right corner */
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 16, 0);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 1, 0);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 16, 15);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 1, 15);
 
 	/* Test 16x16 pixels in the lower left corner */
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  0, capture_height - 16);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  15, capture_height - 16);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  0, capture_height - 1);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  15, capture_height - 1);
 
 	/* Test 16x16 pixels in the lower right corner */
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 16, capture_height - 16);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 1, capture_height - 16);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 16, capture_height - 1);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  capture_width - 1, capture_height - 1);
 
 	/* Test 16x16 pixels in the center */
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  center_x - 8, center_y - 8);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  center_x + 7, center_y - 8);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  center_x - 8, center_y + 7);
-	capture_buffer_test_frame(frame, red, green, blue,
+	capture_buffer_test_frame(stage, frame,
 				  center_x + 7, center_y + 7);
+
+	pthread_mutex_lock(capture_test_mutex);
+	capture_test_bits_last = capture_test_bits;
+	capture_test_errors_last = capture_test_errors;
+	pthread_mutex_unlock(capture_test_mutex);
+}
+
+/*
+ * Automatic calibration of the CSI h/v display start offsets.
+ *
+ * test_output shows a 16x16 block in the middle of the screen, where the
+ * (swapped) red channel holds the x coordinate, and green holds the y
+ * coordinate of each pixel. So every pixel of that block that we capture
+ * directly tells us by how much our capture window is shifted (modulo
+ * 256). We let all consistent pixels in a window around the center vote
+ * for a shift, verify the winner against the full block, and then correct
+ * the offsets until we hit the pattern dead on.
+ */
+#define CALIBRATE_WINDOW 256 /* limits us to shifts of +-120 */
+#define CALIBRATE_BLOCK 16
+#define CALIBRATE_VOTES_MIN 128
+#define CALIBRATE_MATCH_MIN 192
+#define CALIBRATE_SETTLE_FRAMES 3
+#define CALIBRATE_ITERATIONS_MAX 8
+#define CALIBRATE_FRAMES_MAX 180 /* 3s at 60Hz */
+
+static int capture_calibrate_frames;
+static int capture_calibrate_settle;
+static int capture_calibrate_iterations;
+
+static const uint8_t *capture_calibrate_red[CALIBRATE_WINDOW];
+static const uint8_t *capture_calibrate_green[CALIBRATE_WINDOW];
+static uint16_t capture_calibrate_votes[256 * 256];
+
+/*
+ * Returns the number of block pixels matching, and the shift in dx/dy,
+ * in that a captured pixel x shows the pixel x + dx of the source.
+ */
+static int
+capture_calibrate_measure(struct stage *stage, int *dx, int *dy)
+{
+	int block_x = (capture_width - CALIBRATE_BLOCK) / 2;
+	int block_y = (capture_height - CALIBRATE_BLOCK) / 2;
+	int window_x = (capture_width - CALIBRATE_WINDOW) / 2;
+	int window_y = (capture_height - CALIBRATE_WINDOW) / 2;
+	int x, y, best = 0, best_votes = 0, match = 0;
+
+	if ((window_x < 0) || (window_y < 0))
+		return 0;
+
+	for (y = 0; y < CALIBRATE_WINDOW; y++) {
+		capture_calibrate_red[y] =
+			stage_row(stage, 2, window_y + y) + window_x;
+		capture_calibrate_green[y] =
+			stage_row(stage, 1, window_y + y) + window_x;
+	}
+
+	memset(capture_calibrate_votes, 0, sizeof(capture_calibrate_votes));
+
+	for (y = 0; y < (CALIBRATE_WINDOW - 1); y++) {
+		const uint8_t *red = capture_calibrate_red[y];
+		const uint8_t *green = capture_calibrate_green[y];
+		const uint8_t *red_next = capture_calibrate_red[y + 1];
+		const uint8_t *green_next = capture_calibrate_green[y + 1];
+
+		for (x = 0; x < (CALIBRATE_WINDOW - 1); x++) {
+			uint8_t r = red[x];
+			uint8_t g = green[x];
+			int vote;
+
+			/* only pixels which fit into our gradients vote. */
+			if ((red[x + 1] != ((r + 1) & 0xFF)) ||
+			    (green[x + 1] != g) ||
+			    (green_next[x] != ((g + 1) & 0xFF)) ||
+			    (red_next[x] != r))
+				continue;
+
+			vote = (((g - (window_y + y)) & 0xFF) << 8) |
+				((r - (window_x + x)) & 0xFF);
+
+			capture_calibrate_votes[vote]++;
+			if (capture_calibrate_votes[vote] > best_votes) {
+				best_votes = capture_calibrate_votes[vote];
+				best = vote;
+			}
+		}
+	}
+
+	if (best_votes < CALIBRATE_VOTES_MIN)
+		return 0;
+
+	*dx = (int8_t) (best & 0xFF);
+	*dy = (int8_t) (best >> 8);
+
+	/* Now check whether the whole block is where we think it is. */
+	for (y = 0; y < CALIBRATE_BLOCK; y++) {
+		int line = block_y + y - *dy - window_y;
+		const uint8_t *red, *green;
+
+		if ((line < 0) || (line >= CALIBRATE_WINDOW))
+			continue;
+
+		red = capture_calibrate_red[line];
+		green = capture_calibrate_green[line];
+
+		for (x = 0; x < CALIBRATE_BLOCK; x++) {
+			int column = block_x + x - *dx - window_x;
+
+			if ((column < 0) || (column >= CALIBRATE_WINDOW))
+				continue;
+
+			if ((red[column] == ((block_x + x) & 0xFF)) &&
+			    (green[column] == ((block_y + y) & 0xFF)))
+				match++;
+		}
+	}
+
+	return match;
+}
+
+static void
+capture_calibrate_frame(struct stage *stage)
+{
+	int dx = 0, dy = 0, match;
+
+	capture_calibrate_frames++;
+
+	if (capture_calibrate_settle) {
+		capture_calibrate_settle--;
+		return;
+	}
+
+	match = capture_calibrate_measure(stage, &dx, &dy);
+	if (match < CALIBRATE_MATCH_MIN) {
+		if (capture_calibrate_frames < CALIBRATE_FRAMES_MAX)
+			return;
+
+		log_error("Calibration: no test pattern found after %d "
+			  "frames, keeping offsets %d,%d.\n",
+			  capture_calibrate_frames, capture_hoffset,
+			  capture_voffset);
+		capture_calibrate = false;
+		return;
+	}
+
+	if (!dx && !dy) {
+		log_info("Calibration: done in %d frames, offsets are %d,%d.\n",
+			 capture_calibrate_frames, capture_hoffset,
+			 capture_voffset);
+		capture_calibrate = false;
+		return;
+	}
+
+	if ((capture_calibrate_iterations >= CALIBRATE_ITERATIONS_MAX) ||
+	    (capture_calibrate_frames >= CALIBRATE_FRAMES_MAX)) {
+		log_error("Calibration: failed to converge, still off "
+			  "by %d,%d at offsets %d,%d.\n", dx, dy,
+			  capture_hoffset, capture_voffset);
+		capture_calibrate = false;
+		return;
+	}
+
+	log_info("Calibration: pattern off by %d,%d (%d/%d pixels) at offsets"
+		 " %d,%d.\n", dx, dy, match, CALIBRATE_BLOCK * CALIBRATE_BLOCK,
+		 capture_hoffset, capture_voffset);
+
+	if (v4l2_hv_offsets_update(capture_hoffset - dx,
+				   capture_voffset - dy)) {
+		capture_calibrate = false;
+		return;
+	}
+
+	capture_calibrate_iterations++;
+	capture_calibrate_settle = CALIBRATE_SETTLE_FRAMES;
+}
+
+/*
+ * All cpu side looking at pixels happens here, on cached copies of the
+ * rows that are needed.
+ */
+static void
+capture_buffer_analyse(struct capture_buffer *buffer)
+{
+	struct pyramid_image *image;
+
+	if (stage_begin(capture_stage, buffer))
+		return;
+
+	image = pyramid_frame(capture_pyramid, capture_stage, buffer);
+	if (image) {
+		fingerprint_frame(capture_fingerprint, image, buffer->queued);
+		scope_frame(capture_scope, image);
+		slides_capture_frame(image, buffer);
+	}
+
+	if (capture_crop)
+		crop_frame(capture_crop, capture_stage, buffer->queued);
+
+	if (capture_calibrate)
+		capture_calibrate_frame(capture_stage);
+
+	if (capture_test)
+		capture_buffer_test(capture_stage, buffer);
+
+	stage_end(capture_stage);
 }
 
 int
@@ -821,28 +1158,44 @@ capture_buffer_display_release(struct capture_buffer *buffer)
 	pthread_mutex_lock(buffer->reference_count_mutex);
 
 	if (buffer->reference_count <= 0) {
-		fprintf(stderr, "%s(%d): Error: reference count <= 0\n",
-			__func__, buffer->index);
+		log_error("%s(%d): Error: reference count <= 0\n",
+			  __func__, buffer->index);
 		buffer->reference_count = 0;
 	} else
 		buffer->reference_count--;
 
-	if (!buffer->reference_count)
-		v4l2_buffer_queue(buffer->index);
+	if (!buffer->reference_count) {
+		if (buffer->requeue)
+			buffer->requeue(buffer);
+		else
+			v4l2_buffer_queue(buffer->index);
+	}
 
 	pthread_mutex_unlock(buffer->reference_count_mutex);
 
 	return 0;
 }
 
+/*
+ * Keep a buffer from being requeued, beyond the displays. Hand it back with
+ * capture_buffer_display_release().
+ */
+void
+capture_buffer_display_hold(struct capture_buffer *buffer)
+{
+	pthread_mutex_lock(buffer->reference_count_mutex);
+	buffer->reference_count++;
+	pthread_mutex_unlock(buffer->reference_count_mutex);
+}
+
 static int
 capture_buffer_display(struct capture_buffer *buffer)
 {
 	pthread_mutex_lock(buffer->reference_count_mutex);
 
 	if (buffer->reference_count)
-		fprintf(stderr, "%s(%d): Error: reference count = %d\n",
-			__func__, buffer->index, buffer->reference_count);
+		log_error("%s(%d): Error: reference count = %d\n",
+			  __func__, buffer->index, buffer->reference_count);
 
 	/*
 	 * Claim all users at once, and avoid one returning too soon and
@@ -852,11 +1205,16 @@ capture_buffer_display(struct capture_buffer *buffer)
 
 	pthread_mutex_unlock(buffer->reference_count_mutex);
 
-	kms_projector_capture_display(buffer);
+	buffer->queued = thread_time_get();
+
+	/* with nv12, the projector gets the converted buffer instead. */
+	if (capture_nv12)
+		nv12_capture_display(buffer);
+	else
+		kms_projector_capture_display(buffer);
 	kms_status_capture_display(buffer);
 
-	if (capture_test)
-		capture_buffer_test(buffer);
+	capture_buffer_analyse(buffer);
 	capture_buffer_display_release(buffer);
 
 	return 0;
@@ -865,6 +1223,8 @@ capture_buffer_display(struct capture_buffer *buffer)
 static void
 capture_buffer_display_stop(void)
 {
+	if (capture_nv12)
+		nv12_capture_stop();
 	kms_projector_capture_stop();
 	kms_status_capture_stop();
 }
@@ -887,13 +1247,26 @@ capture_thread_handler(void *arg)
 		if (ret)
 			return NULL;
 
+		capture_stage = stage_create(capture_width, capture_height);
+		if (!capture_stage)
+			return NULL;
+
+		capture_pyramid = pyramid_create(capture_width, capture_height,
+						 CAPTURE_PYRAMID_BANDS);
+		if (!capture_pyramid)
+			return NULL;
+
+		fingerprint_reset(capture_fingerprint);
+		if (capture_crop)
+			crop_reset(capture_crop);
+
 		ret = v4l2_buffers_alloc(capture_width, capture_height,
 					 capture_pitch,
 					 capture_plane_size, capture_fourcc);
 		if (ret)
 			return NULL;
 
-		ret = v4l2_buffers_mmap();
+		ret = v4l2_buffers_query();
 		if (ret)
 			return NULL;
 
@@ -918,20 +1291,24 @@ capture_thread_handler(void *arg)
 
 			ret = v4l2_buffer_dequeue(&buffer);
 			if (ret) {
-				fprintf(stderr, "%s(): stopping thread.\n", __func__);
+				log_error("%s(): stopping thread.\n", __func__);
 				break;
 			}
 
 			if (buffer->last) {
-				printf("%s(): stream ended at %ld.%06ld (%dframes)\n",
-				       __func__, buffer->timestamp.tv_sec,
-				       buffer->timestamp.tv_usec, buffer->sequence);
+				log_info("%s(): stream ended at %ld.%06ld "
+					 "(%dframes)\n", __func__,
+					 buffer->timestamp.tv_sec,
+					 buffer->timestamp.tv_usec,
+					 buffer->sequence);
 				break;
 			}
 
 			/* frame 0 starts at a random line anyway, so skip it */
-			if (buffer->sequence)
-				capture_buffer_display(buffer);
+			if (!buffer->sequence)
+				continue;
+
+			capture_buffer_display(buffer);
 		}
 
 		printf("Restart %d: Captured %d buffers.\n", restarts, i);
@@ -964,14 +1341,65 @@ capture_thread_handler(void *arg)
 		if (ret)
 			return NULL;
 
+		pyramid_destroy(capture_pyramid);
+		capture_pyramid = NULL;
+
+		stage_destroy(capture_stage);
+		capture_stage = NULL;
+
 		printf("%s(): restarting!\n", __func__);
 	}
 
 	return NULL;
 }
 
+/*
+ * How the frames that we capture look, for the display policies.
+ */
+struct fingerprint *
+capture_fingerprint_get(void)
+{
+	return capture_fingerprint;
+}
+
+/*
+ * Signal levels of what we capture, for the status lcd.
+ */
+struct scope *
+capture_scope_get(void)
+{
+	return capture_scope;
+}
+
+/*
+ * The active area of what we capture, when we are looking for borders.
+ */
+struct crop *
+capture_crop_get(void)
+{
+	return capture_crop;
+}
+
+/*
+ * Bits checked and bit errors seen by -t, since we started.
+ */
 int
-capture_init(bool test, int hoffset, int voffset)
+capture_test_errors_get(uint64_t *bits, uint64_t *errors)
+{
+	if (!capture_test)
+		return -ENODEV;
+
+	pthread_mutex_lock(capture_test_mutex);
+	*bits = capture_test_bits_last;
+	*errors = capture_test_errors_last;
+	pthread_mutex_unlock(capture_test_mutex);
+
+	return 0;
+}
+
+int
+capture_init(bool test, bool calibrate, int hoffset, int voffset,
+	     bool nv12, bool crop)
 {
 	int ret;
 
@@ -979,14 +1407,38 @@ capture_init(bool test, int hoffset, int voffset)
 	if (capture_test)
 		printf("Capture: verifying integrity of picture.\n");
 
+	capture_calibrate = calibrate;
+	if (capture_calibrate)
+		printf("Capture: calibrating CSI engine offsets.\n");
+
 	capture_hoffset = hoffset;
 	capture_voffset = voffset;
 	if ((capture_hoffset != -1) || (capture_voffset != -1))
 		printf("Capture: using CSI engine offset %d,%d\n",
 		       capture_hoffset, capture_voffset);
 
-	ret = pthread_create(capture_thread, NULL, capture_thread_handler,
-			     NULL);
+	capture_nv12 = nv12;
+	if (capture_nv12)
+		printf("Capture: converting to NV12 for the projector.\n");
+
+	capture_fingerprint = fingerprint_create();
+	if (!capture_fingerprint)
+		return -ENOMEM;
+
+	capture_scope = scope_create();
+	if (!capture_scope)
+		return -ENOMEM;
+
+	if (crop) {
+		printf("Capture: cropping black borders for the projector.\n");
+
+		capture_crop = crop_create();
+		if (!capture_crop)
+			return -ENOMEM;
+	}
+
+	ret = thread_create(capture_thread, THREAD_ROLE_CAPTURE,
+			    capture_thread_handler, NULL);
 	if (ret)
 		fprintf(stderr, "%s() failed: %s\n", __func__, strerror(ret));
 
@@ -33,6 +33,7 @@ struct capture_buffer {
 
 	uint32_t kms_fb_id;
 
+	int plane_count;
 	struct plane {
 		off_t offset;
 		void *map;
@@ -42,15 +43,38 @@ struct capture_buffer {
 
 	uint32_t sequence;
 	struct timeval timestamp;
+	/* CLOCK_MONOTONIC ns at which this was handed to the displays */
+	uint64_t queued;
 	uint32_t bytes_used;
 	bool last;
 
 	pthread_mutex_t reference_count_mutex[1];
 	int reference_count;
+
+	/* planes are only mapped when someone needs to look at pixels */
+	pthread_mutex_t map_mutex[1];
+
+	/*
+	 * Hands the buffer back to whoever produced it, once all displays
+	 * are done with it. Our own v4l2 buffers get requeued directly.
+	 */
+	void (*requeue)(struct capture_buffer *buffer);
 };
 
+struct fingerprint;
+struct scope;
+struct crop;
+
+void *capture_buffer_plane_map(struct capture_buffer *buffer, int plane);
 int capture_buffer_display_release(struct capture_buffer *buffer);
+void capture_buffer_display_hold(struct capture_buffer *buffer);
+
+struct fingerprint *capture_fingerprint_get(void);
+struct scope *capture_scope_get(void);
+struct crop *capture_crop_get(void);
+int capture_test_errors_get(uint64_t *bits, uint64_t *errors);
 
-int capture_init(bool test, int hoffset, int voffset);
+int capture_init(bool test, bool calibrate, int hoffset, int voffset,
+		 bool nv12, bool crop);
 
 #endif /* _HAVE_CAPTURE_H_ */
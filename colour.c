@@ -0,0 +1,563 @@
+/*
+ * Copyright (c) 2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Colour correction for the projector of a given room, done by the display
+ * engine on its way out, so it costs neither cpu nor memory bandwidth.
+ *
+ * A profile is a small text file, with one setting per line:
+ *
+ *	# K.1.105: washed out, and too blue
+ *	gamma 1.1
+ *	gain 1.0 0.97 0.9
+ *	lift 0.02
+ *	saturation 1.15
+ *
+ * gamma, lift and gain take either one value, or one per channel. Also
+ * understood are degamma, ctm with 9 values, encoding (bt601, bt709 or
+ * bt2020) and range (limited or full).
+ *
+ * These get turned into the DEGAMMA_LUT, CTM and GAMMA_LUT blobs of the
+ * crtc, once, at startup. They are then added to the next frame commit,
+ * and again after every modeset. Where the crtc does not have these
+ * properties, the best we can still do is tell yuv planes how their
+ * content was encoded, through COLOR_ENCODING and COLOR_RANGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "juggler.h"
+#include "kms.h"
+#include "colour.h"
+
+struct colour_name {
+	const char *name;
+	const char *kms;
+};
+
+static const struct colour_name colour_encodings[] = {
+	{ "bt601", "ITU-R BT.601 YCbCr" },
+	{ "bt709", "ITU-R BT.709 YCbCr" },
+	{ "bt2020", "ITU-R BT.2020 YCbCr" },
+	{ NULL, NULL },
+};
+
+static const struct colour_name colour_ranges[] = {
+	{ "limited", "YCbCr limited range" },
+	{ "full", "YCbCr full range" },
+	{ NULL, NULL },
+};
+
+/* bt.709 luma weights, for saturation */
+static const double colour_luma[3] = { 0.2126, 0.7152, 0.0722 };
+
+static const char *
+colour_name_get(const struct colour_name *names, const char *name)
+{
+	int i;
+
+	for (i = 0; names[i].name; i++)
+		if (!strcmp(names[i].name, name))
+			return names[i].kms;
+
+	return NULL;
+}
+
+/*
+ * Returns how many values were found, or -1 on garbage.
+ */
+static int
+colour_values_parse(char *string, double *values, int max)
+{
+	int count = 0;
+
+	while (true) {
+		char *end;
+		double value;
+
+		while ((*string == ' ') || (*string == '\t'))
+			string++;
+		if (!*string)
+			return count;
+
+		if (count == max)
+			return -1;
+
+		value = strtod(string, &end);
+		if (end == string)
+			return -1;
+
+		values[count++] = value;
+		string = end;
+	}
+}
+
+/*
+ * Takes either one value for all channels, or one per channel.
+ */
+static int
+colour_channels_parse(char *string, double *values)
+{
+	int count = colour_values_parse(string, values, 3);
+
+	if (count == 1) {
+		values[1] = values[0];
+		values[2] = values[0];
+	} else if (count != 3)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Desaturating pulls towards luma, oversaturating pushes away from it.
+ */
+static void
+colour_saturation_apply(double *ctm, double saturation)
+{
+	double matrix[9], result[9];
+	int i, j, k;
+
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			matrix[3 * i + j] = (1.0 - saturation) *
+				colour_luma[j] + ((i == j) ? saturation : 0.0);
+
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++) {
+			result[3 * i + j] = 0.0;
+			for (k = 0; k < 3; k++)
+				result[3 * i + j] += matrix[3 * i + k] *
+					ctm[3 * k + j];
+		}
+
+	memcpy(ctm, result, sizeof(result));
+}
+
+static int
+colour_profile_line_parse(struct colour_profile *profile, double *saturation,
+			  char *line)
+{
+	char key[16], word[16];
+	char *values;
+	int offset = 0, i;
+
+	values = strchr(line, '#');
+	if (values)
+		*values = 0;
+
+	if (sscanf(line, " %15s %n", key, &offset) < 1)
+		return 0;
+	values = line + offset;
+
+	if (!strcmp(key, "gamma")) {
+		if (colour_channels_parse(values, profile->gamma))
+			return -1;
+		for (i = 0; i < 3; i++)
+			if (profile->gamma[i] <= 0.0)
+				return -1;
+	} else if (!strcmp(key, "lift")) {
+		if (colour_channels_parse(values, profile->lift))
+			return -1;
+	} else if (!strcmp(key, "gain")) {
+		if (colour_channels_parse(values, profile->gain))
+			return -1;
+	} else if (!strcmp(key, "degamma")) {
+		if ((colour_values_parse(values, &profile->degamma, 1) != 1) ||
+		    (profile->degamma <= 0.0))
+			return -1;
+	} else if (!strcmp(key, "ctm")) {
+		if (colour_values_parse(values, profile->ctm, 9) != 9)
+			return -1;
+	} else if (!strcmp(key, "saturation")) {
+		if ((colour_values_parse(values, saturation, 1) != 1) ||
+		    (*saturation < 0.0))
+			return -1;
+	} else if (!strcmp(key, "encoding")) {
+		if (sscanf(values, "%15s", word) != 1)
+			return -1;
+		profile->encoding = colour_name_get(colour_encodings, word);
+		if (!profile->encoding)
+			return -1;
+	} else if (!strcmp(key, "range")) {
+		if (sscanf(values, "%15s", word) != 1)
+			return -1;
+		profile->range = colour_name_get(colour_ranges, word);
+		if (!profile->range)
+			return -1;
+	} else
+		return -1;
+
+	return 0;
+}
+
+struct colour_profile *
+colour_profile_read(const char *filename)
+{
+	struct colour_profile *profile;
+	double saturation = 1.0;
+	char line[256];
+	FILE *file;
+	int number, i;
+
+	profile = calloc(1, sizeof(struct colour_profile));
+	if (!profile)
+		return NULL;
+
+	profile->degamma = 1.0;
+	for (i = 0; i < 3; i++) {
+		profile->ctm[4 * i] = 1.0;
+		profile->gamma[i] = 1.0;
+		profile->gain[i] = 1.0;
+	}
+
+	file = fopen(filename, "r");
+	if (!file) {
+		fprintf(stderr, "%s: failed to open colour profile %s: %s\n",
+			__func__, filename, strerror(errno));
+		free(profile);
+		return NULL;
+	}
+
+	for (number = 1; fgets(line, sizeof(line), file); number++) {
+		line[strcspn(line, "\n")] = 0;
+
+		if (colour_profile_line_parse(profile, &saturation, line)) {
+			fprintf(stderr, "%s:%d: invalid line \"%s\".\n",
+				filename, number, line);
+			goto error;
+		}
+	}
+
+	for (i = 0; i < 3; i++)
+		if ((profile->lift[i] < 0.0) || (profile->gain[i] > 1.0) ||
+		    (profile->lift[i] >= profile->gain[i])) {
+			fprintf(stderr, "%s: lift and gain need to be in "
+				"0.0-1.0, with lift below gain.\n", filename);
+			goto error;
+		}
+
+	colour_saturation_apply(profile->ctm, saturation);
+
+	fclose(file);
+	return profile;
+
+ error:
+	fclose(file);
+	free(profile);
+	return NULL;
+}
+
+static int
+colour_blob_create(struct colour *colour, const void *data, size_t size,
+		   uint32_t *blob_id)
+{
+	int ret;
+
+	ret = drmModeCreatePropertyBlob(kms_fd, data, size, blob_id);
+	if (ret) {
+		fprintf(stderr, "%s: failed to create colour blob: %s\n",
+			colour->name, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int
+colour_degamma_create(struct colour *colour, struct colour_profile *profile)
+{
+	uint32_t size = colour->crtc->degamma_lut_size;
+	struct drm_color_lut *lut;
+	uint32_t i;
+	int ret;
+
+	if (profile->degamma == 1.0)
+		return 0;
+
+	if (!colour->crtc->property_degamma_lut) {
+		printf("%s: no DEGAMMA_LUT, ignoring degamma.\n",
+		       colour->name);
+		return 0;
+	}
+
+	lut = calloc(size, sizeof(struct drm_color_lut));
+	if (!lut)
+		return -ENOMEM;
+
+	for (i = 0; i < size; i++) {
+		double x = (double) i / (size - 1);
+		uint16_t value = 0xFFFF * pow(x, profile->degamma) + 0.5;
+
+		lut[i].red = value;
+		lut[i].green = value;
+		lut[i].blue = value;
+	}
+
+	ret = colour_blob_create(colour, lut,
+				 size * sizeof(struct drm_color_lut),
+				 &colour->degamma_blob);
+	free(lut);
+	return ret;
+}
+
+/*
+ * S31.32 sign-magnitude, which is what the kernel takes.
+ */
+static uint64_t
+colour_ctm_fixed(double value)
+{
+	uint64_t fixed = fabs(value) * 4294967296.0 + 0.5;
+
+	if (value < 0.0)
+		fixed |= 1ULL << 63;
+
+	return fixed;
+}
+
+static int
+colour_ctm_create(struct colour *colour, struct colour_profile *profile)
+{
+	struct drm_color_ctm ctm[1];
+	bool identity = true;
+	int i;
+
+	for (i = 0; i < 9; i++)
+		if (profile->ctm[i] != ((i % 4) ? 0.0 : 1.0))
+			identity = false;
+	if (identity)
+		return 0;
+
+	if (!colour->crtc->property_ctm) {
+		printf("%s: no CTM, ignoring ctm and saturation.\n",
+		       colour->name);
+		return 0;
+	}
+
+	for (i = 0; i < 9; i++)
+		ctm->matrix[i] = colour_ctm_fixed(profile->ctm[i]);
+
+	return colour_blob_create(colour, ctm, sizeof(struct drm_color_ctm),
+				  &colour->ctm_blob);
+}
+
+static uint16_t
+colour_gamma_value(struct colour_profile *profile, int channel, double x)
+{
+	double lift = profile->lift[channel];
+	double gain = profile->gain[channel];
+
+	return 0xFFFF * (lift + (gain - lift) *
+			 pow(x, 1.0 / profile->gamma[channel])) + 0.5;
+}
+
+static int
+colour_gamma_create(struct colour *colour, struct colour_profile *profile)
+{
+	uint32_t size = colour->crtc->gamma_lut_size;
+	struct drm_color_lut *lut;
+	bool identity = true;
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < 3; i++)
+		if ((profile->gamma[i] != 1.0) || (profile->lift[i] != 0.0) ||
+		    (profile->gain[i] != 1.0))
+			identity = false;
+	if (identity)
+		return 0;
+
+	if (!colour->crtc->property_gamma_lut) {
+		printf("%s: no GAMMA_LUT, ignoring gamma, lift and gain.\n",
+		       colour->name);
+		return 0;
+	}
+
+	lut = calloc(size, sizeof(struct drm_color_lut));
+	if (!lut)
+		return -ENOMEM;
+
+	for (i = 0; i < size; i++) {
+		double x = (double) i / (size - 1);
+
+		lut[i].red = colour_gamma_value(profile, 0, x);
+		lut[i].green = colour_gamma_value(profile, 1, x);
+		lut[i].blue = colour_gamma_value(profile, 2, x);
+	}
+
+	ret = colour_blob_create(colour, lut,
+				 size * sizeof(struct drm_color_lut),
+				 &colour->gamma_blob);
+	free(lut);
+	return ret;
+}
+
+static void
+colour_plane_get(struct colour *colour, struct colour_profile *profile)
+{
+	struct kms_plane *plane = colour->plane;
+
+	if (profile->encoding) {
+		if (plane->property_color_encoding &&
+		    !kms_property_enum_get(plane->property_color_encoding,
+					   profile->encoding,
+					   &colour->encoding))
+			colour->encoding_set = true;
+		else
+			printf("%s: plane 0x%02X cannot do %s.\n", colour->name,
+			       plane->plane_id, profile->encoding);
+	}
+
+	if (profile->range) {
+		if (plane->property_color_range &&
+		    !kms_property_enum_get(plane->property_color_range,
+					   profile->range, &colour->range))
+			colour->range_set = true;
+		else
+			printf("%s: plane 0x%02X cannot do %s.\n", colour->name,
+			       plane->plane_id, profile->range);
+	}
+}
+
+/*
+ * Add our colour management to the commit, when it is not in place yet.
+ * It only counts as in place once colour_commit_done() was called.
+ */
+void
+colour_set(struct colour *colour, drmModeAtomicReqPtr request)
+{
+	struct kms_crtc_colour *crtc = colour->crtc;
+	struct kms_plane *plane = colour->plane;
+
+	if (colour->active)
+		return;
+
+	if (crtc->property_degamma_lut)
+		drmModeAtomicAddProperty(request, colour->crtc_id,
+					 crtc->property_degamma_lut,
+					 colour->degamma_blob);
+	if (crtc->property_ctm)
+		drmModeAtomicAddProperty(request, colour->crtc_id,
+					 crtc->property_ctm,
+					 colour->ctm_blob);
+	if (crtc->property_gamma_lut)
+		drmModeAtomicAddProperty(request, colour->crtc_id,
+					 crtc->property_gamma_lut,
+					 colour->gamma_blob);
+
+	if (colour->encoding_set)
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_color_encoding,
+					 colour->encoding);
+	if (colour->range_set)
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_color_range,
+					 colour->range);
+}
+
+/*
+ * Called right after a commit with our colour management in it went
+ * through.
+ */
+void
+colour_commit_done(struct colour *colour)
+{
+	colour->active = true;
+}
+
+/*
+ * Have everything reprogrammed on our next commit.
+ */
+void
+colour_reset(struct colour *colour)
+{
+	colour->active = false;
+}
+
+struct colour *
+colour_create(const char *name, uint32_t crtc_id, struct kms_plane *plane,
+	      struct colour_profile *profile)
+{
+	struct colour *colour;
+	int ret;
+
+	colour = calloc(1, sizeof(struct colour));
+	if (!colour)
+		return NULL;
+
+	colour->crtc = calloc(1, sizeof(struct kms_crtc_colour));
+	if (!colour->crtc) {
+		free(colour);
+		return NULL;
+	}
+
+	colour->name = name;
+	colour->crtc_id = crtc_id;
+	colour->plane = plane;
+
+	ret = kms_crtc_colour_get(crtc_id, colour->crtc);
+	if (ret)
+		goto error;
+
+	ret = colour_degamma_create(colour, profile);
+	if (ret)
+		goto error;
+
+	ret = colour_ctm_create(colour, profile);
+	if (ret)
+		goto error;
+
+	ret = colour_gamma_create(colour, profile);
+	if (ret)
+		goto error;
+
+	colour_plane_get(colour, profile);
+
+	if (!colour->degamma_blob && !colour->ctm_blob &&
+	    !colour->gamma_blob && !colour->encoding_set &&
+	    !colour->range_set)
+		printf("%s: no colour correction to be done.\n", name);
+	else
+		printf("%s: colour correction through%s%s%s%s%s.\n", name,
+		       colour->degamma_blob ? " DEGAMMA_LUT" : "",
+		       colour->ctm_blob ? " CTM" : "",
+		       colour->gamma_blob ? " GAMMA_LUT" : "",
+		       colour->encoding_set ? " COLOR_ENCODING" : "",
+		       colour->range_set ? " COLOR_RANGE" : "");
+
+	return colour;
+
+ error:
+	if (colour->degamma_blob)
+		drmModeDestroyPropertyBlob(kms_fd, colour->degamma_blob);
+	if (colour->ctm_blob)
+		drmModeDestroyPropertyBlob(kms_fd, colour->ctm_blob);
+	if (colour->gamma_blob)
+		drmModeDestroyPropertyBlob(kms_fd, colour->gamma_blob);
+	free(colour->crtc);
+	free(colour);
+	return NULL;
+}
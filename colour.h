@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_COLOUR_H_
+#define _HAVE_COLOUR_H_ 1
+
+struct kms_plane;
+struct kms_crtc_colour;
+struct _drmModeAtomicReq;
+
+/*
+ * How the projector of a given room needs its colours corrected. Per
+ * channel values are in red, green, blue order.
+ */
+struct colour_profile {
+	/* linearize with x^degamma, before the ctm */
+	double degamma;
+	/* 3x3, row major, applied to red, green and blue */
+	double ctm[9];
+	/* lift + (gain - lift) * x^(1 / gamma), after the ctm */
+	double gamma[3];
+	double lift[3];
+	double gain[3];
+
+	/* for yuv planes, when the crtc cannot do any of the above. */
+	const char *encoding;
+	const char *range;
+};
+
+struct colour {
+	const char *name;
+	uint32_t crtc_id;
+	struct kms_crtc_colour *crtc;
+
+	/* 0 means bypass, which also clears what others left behind. */
+	uint32_t degamma_blob;
+	uint32_t ctm_blob;
+	uint32_t gamma_blob;
+
+	struct kms_plane *plane;
+	bool encoding_set;
+	uint64_t encoding;
+	bool range_set;
+	uint64_t range;
+
+	bool active;
+};
+
+struct colour_profile *colour_profile_read(const char *filename);
+
+struct colour *colour_create(const char *name, uint32_t crtc_id,
+			     struct kms_plane *plane,
+			     struct colour_profile *profile);
+
+void colour_set(struct colour *colour, struct _drmModeAtomicReq *request);
+void colour_commit_done(struct colour *colour);
+void colour_reset(struct colour *colour);
+
+#endif /* _HAVE_COLOUR_H_ */
@@ -0,0 +1,823 @@
+/*
+ * Copyright (c) 2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pixel format conversion, for all the places where the cpu has to touch
+ * pixels: loading pngs into planar buffers, software colour conversion,
+ * and the like.
+ *
+ * Every kernel has a scalar reference, which defines the result. The NEON
+ * (A20) and SSE2 (development machines) versions use exactly the same
+ * fixed point maths, so that their output is bit exact with the scalar
+ * version, and convert_bench can simply compare. The simd versions work on
+ * 16 pixels at a time, the scalar code picks up the rest of each row.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONVERT_SIMD_NAME "NEON"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CONVERT_SIMD_NAME "SSE2"
+#endif
+
+#include "convert.h"
+
+static bool convert_simd = true;
+
+/*
+ * 8 bit fixed point coefficients, rows sum up to 0 for chroma, so that
+ * grey ends up at exactly 0x80. Every coefficient fits in 8 bits, and
+ * every partial sum fits in 16 bits (signed for chroma), which is what
+ * the simd versions depend on.
+ */
+struct convert_coefficients {
+	int y[3];
+	int u[3];
+	int v[3];
+	int y_offset;
+};
+
+static const struct convert_coefficients
+convert_coefficients[2][2] = {
+	[CONVERT_BT601] = {
+		[CONVERT_RANGE_LIMITED] = {
+			.y = { 66, 129, 25 },
+			.u = { -38, -74, 112 },
+			.v = { 112, -94, -18 },
+			.y_offset = 16,
+		},
+		[CONVERT_RANGE_FULL] = {
+			.y = { 77, 150, 29 },
+			.u = { -43, -85, 128 },
+			.v = { 128, -107, -21 },
+			.y_offset = 0,
+		},
+	},
+	[CONVERT_BT709] = {
+		[CONVERT_RANGE_LIMITED] = {
+			.y = { 47, 157, 16 },
+			.u = { -26, -86, 112 },
+			.v = { 112, -102, -10 },
+			.y_offset = 16,
+		},
+		[CONVERT_RANGE_FULL] = {
+			.y = { 54, 183, 19 },
+			.u = { -29, -99, 128 },
+			.v = { 128, -116, -12 },
+			.y_offset = 0,
+		},
+	},
+};
+
+void
+convert_simd_set(bool enable)
+{
+	convert_simd = enable;
+}
+
+const char *
+convert_simd_name(void)
+{
+#ifdef CONVERT_SIMD_NAME
+	return CONVERT_SIMD_NAME;
+#else
+	return "none";
+#endif
+}
+
+static inline uint8_t
+convert_clamp(int value)
+{
+	if (value < 0)
+		return 0;
+	if (value > 0xFF)
+		return 0xFF;
+	return value;
+}
+
+static inline uint8_t
+convert_luma(const struct convert_coefficients *coefficients,
+	     int red, int green, int blue)
+{
+	const int *y = coefficients->y;
+
+	return convert_clamp(((y[0] * red + y[1] * green + y[2] * blue +
+			       0x80) >> 8) + coefficients->y_offset);
+}
+
+/*
+ * For full range, 0x80 * 0xFF rounds up to 0x80, and the result gets
+ * clamped to 0xFF. The simd versions saturate at the same spot.
+ */
+static inline uint8_t
+convert_chroma(const int *k, int red, int green, int blue)
+{
+	return convert_clamp(((k[0] * red + k[1] * green + k[2] * blue +
+			       0x80) >> 8) + 0x80);
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static int
+convert_rgba_planar_simd(const uint8_t *rgba, uint8_t *red, uint8_t *green,
+			 uint8_t *blue, int count)
+{
+	int i;
+
+	for (i = 0; (i + 16) <= count; i += 16) {
+		uint8x16x4_t pixels = vld4q_u8(rgba + 4 * i);
+
+		vst1q_u8(red + i, pixels.val[0]);
+		vst1q_u8(green + i, pixels.val[1]);
+		vst1q_u8(blue + i, pixels.val[2]);
+	}
+
+	return i;
+}
+
+static int
+convert_planar_rgba_simd(const uint8_t *red, const uint8_t *green,
+			 const uint8_t *blue, uint8_t *rgba, int count)
+{
+	int i;
+
+	for (i = 0; (i + 16) <= count; i += 16) {
+		uint8x16x4_t pixels;
+
+		pixels.val[0] = vld1q_u8(red + i);
+		pixels.val[1] = vld1q_u8(green + i);
+		pixels.val[2] = vld1q_u8(blue + i);
+		pixels.val[3] = vdupq_n_u8(0xFF);
+
+		vst4q_u8(rgba + 4 * i, pixels);
+	}
+
+	return i;
+}
+
+static inline uint8x8_t
+convert_luma_neon(const struct convert_coefficients *coefficients,
+		  uint8x8_t red, uint8x8_t green, uint8x8_t blue)
+{
+	const int *y = coefficients->y;
+	uint16x8_t sum;
+
+	sum = vmull_u8(red, vdup_n_u8(y[0]));
+	sum = vmlal_u8(sum, green, vdup_n_u8(y[1]));
+	sum = vmlal_u8(sum, blue, vdup_n_u8(y[2]));
+
+	return vadd_u8(vrshrn_n_u16(sum, 8),
+		       vdup_n_u8(coefficients->y_offset));
+}
+
+static inline uint8x16_t
+convert_luma16_neon(const struct convert_coefficients *coefficients,
+		    uint8x16_t red, uint8x16_t green, uint8x16_t blue)
+{
+	uint8x8_t low, high;
+
+	low = convert_luma_neon(coefficients, vget_low_u8(red),
+				vget_low_u8(green), vget_low_u8(blue));
+	high = convert_luma_neon(coefficients, vget_high_u8(red),
+				 vget_high_u8(green), vget_high_u8(blue));
+
+	return vcombine_u8(low, high);
+}
+
+static inline uint8x8_t
+convert_chroma_neon(const int *k, uint16x8_t red, uint16x8_t green,
+		    uint16x8_t blue)
+{
+	int16x8_t sum;
+
+	sum = vmulq_n_s16(vreinterpretq_s16_u16(red), k[0]);
+	sum = vmlaq_n_s16(sum, vreinterpretq_s16_u16(green), k[1]);
+	sum = vmlaq_n_s16(sum, vreinterpretq_s16_u16(blue), k[2]);
+
+	/* the rounding shift does not overflow, the narrowing saturates */
+	sum = vaddq_s16(vrshrq_n_s16(sum, 8), vdupq_n_s16(0x80));
+
+	return vqmovun_s16(sum);
+}
+
+static int
+convert_nv12_simd(const struct convert_coefficients *coefficients,
+		  const uint8_t *top[3], const uint8_t *bottom[3],
+		  uint8_t *luma_top, uint8_t *luma_bottom, uint8_t *chroma,
+		  int width)
+{
+	int i;
+
+	for (i = 0; (i + 16) <= width; i += 16) {
+		uint8x16_t red[2], green[2], blue[2];
+		uint16x8_t red_sum, green_sum, blue_sum;
+		uint8x8x2_t uv;
+
+		red[0] = vld1q_u8(top[0] + i);
+		green[0] = vld1q_u8(top[1] + i);
+		blue[0] = vld1q_u8(top[2] + i);
+		red[1] = vld1q_u8(bottom[0] + i);
+		green[1] = vld1q_u8(bottom[1] + i);
+		blue[1] = vld1q_u8(bottom[2] + i);
+
+		vst1q_u8(luma_top + i,
+			 convert_luma16_neon(coefficients, red[0], green[0],
+					     blue[0]));
+		vst1q_u8(luma_bottom + i,
+			 convert_luma16_neon(coefficients, red[1], green[1],
+					     blue[1]));
+
+		red_sum = vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(red[0]),
+						  red[1]), 2);
+		green_sum = vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(green[0]),
+						    green[1]), 2);
+		blue_sum = vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(blue[0]),
+						   blue[1]), 2);
+
+		uv.val[0] = convert_chroma_neon(coefficients->u, red_sum,
+						green_sum, blue_sum);
+		uv.val[1] = convert_chroma_neon(coefficients->v, red_sum,
+						green_sum, blue_sum);
+		vst2_u8(chroma + i, uv);
+	}
+
+	return i;
+}
+
+static int
+convert_yuyv_simd(const struct convert_coefficients *coefficients,
+		  const uint8_t *rgb[3], uint8_t *yuyv, int width)
+{
+	int i;
+
+	for (i = 0; (i + 16) <= width; i += 16) {
+		uint8x16_t red, green, blue, luma;
+		uint16x8_t red_sum, green_sum, blue_sum;
+		uint8x8x2_t luma_split;
+		uint8x8x4_t out;
+
+		red = vld1q_u8(rgb[0] + i);
+		green = vld1q_u8(rgb[1] + i);
+		blue = vld1q_u8(rgb[2] + i);
+
+		luma = convert_luma16_neon(coefficients, red, green, blue);
+		luma_split = vuzp_u8(vget_low_u8(luma), vget_high_u8(luma));
+
+		red_sum = vrshrq_n_u16(vpaddlq_u8(red), 1);
+		green_sum = vrshrq_n_u16(vpaddlq_u8(green), 1);
+		blue_sum = vrshrq_n_u16(vpaddlq_u8(blue), 1);
+
+		out.val[0] = luma_split.val[0];
+		out.val[1] = convert_chroma_neon(coefficients->u, red_sum,
+						 green_sum, blue_sum);
+		out.val[2] = luma_split.val[1];
+		out.val[3] = convert_chroma_neon(coefficients->v, red_sum,
+						 green_sum, blue_sum);
+		vst4_u8(yuyv + 2 * i, out);
+	}
+
+	return i;
+}
+
+static int
+convert_rgb565_simd(const uint8_t *argb, uint16_t *rgb565, int count)
+{
+	int i;
+
+	for (i = 0; (i + 8) <= count; i += 8) {
+		/* little endian ARGB8888 is B, G, R, A in memory */
+		uint8x8x4_t pixels = vld4_u8(argb + 4 * i);
+		uint16x8_t out;
+
+		out = vshlq_n_u16(vmovl_u8(vshr_n_u8(pixels.val[2], 3)), 11);
+		out = vorrq_u16(out, vshlq_n_u16(vmovl_u8(vshr_n_u8(
+						 pixels.val[1], 2)), 5));
+		out = vorrq_u16(out, vmovl_u8(vshr_n_u8(pixels.val[0], 3)));
+
+		vst1q_u16(rgb565 + i, out);
+	}
+
+	return i;
+}
+#elif defined(__SSE2__)
+static int
+convert_rgba_planar_simd(const uint8_t *rgba, uint8_t *red, uint8_t *green,
+			 uint8_t *blue, int count)
+{
+	__m128i mask = _mm_set1_epi32(0xFF);
+	int i, j;
+
+	for (i = 0; (i + 16) <= count; i += 16) {
+		__m128i pixels[4], channel[4];
+
+		for (j = 0; j < 4; j++)
+			pixels[j] = _mm_loadu_si128((const __m128i *)
+						    (rgba + 4 * i + 16 * j));
+
+		for (j = 0; j < 4; j++)
+			channel[j] = _mm_and_si128(pixels[j], mask);
+		_mm_storeu_si128((__m128i *) (red + i),
+				 _mm_packus_epi16(
+				 _mm_packs_epi32(channel[0], channel[1]),
+				 _mm_packs_epi32(channel[2], channel[3])));
+
+		for (j = 0; j < 4; j++)
+			channel[j] = _mm_and_si128(
+				_mm_srli_epi32(pixels[j], 8), mask);
+		_mm_storeu_si128((__m128i *) (green + i),
+				 _mm_packus_epi16(
+				 _mm_packs_epi32(channel[0], channel[1]),
+				 _mm_packs_epi32(channel[2], channel[3])));
+
+		for (j = 0; j < 4; j++)
+			channel[j] = _mm_and_si128(
+				_mm_srli_epi32(pixels[j], 16), mask);
+		_mm_storeu_si128((__m128i *) (blue + i),
+				 _mm_packus_epi16(
+				 _mm_packs_epi32(channel[0], channel[1]),
+				 _mm_packs_epi32(channel[2], channel[3])));
+	}
+
+	return i;
+}
+
+static int
+convert_planar_rgba_simd(const uint8_t *red, const uint8_t *green,
+			 const uint8_t *blue, uint8_t *rgba, int count)
+{
+	__m128i alpha = _mm_set1_epi8(0xFF);
+	int i;
+
+	for (i = 0; (i + 16) <= count; i += 16) {
+		__m128i r = _mm_loadu_si128((const __m128i *) (red + i));
+		__m128i g = _mm_loadu_si128((const __m128i *) (green + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (blue + i));
+		__m128i rg_low = _mm_unpacklo_epi8(r, g);
+		__m128i rg_high = _mm_unpackhi_epi8(r, g);
+		__m128i ba_low = _mm_unpacklo_epi8(b, alpha);
+		__m128i ba_high = _mm_unpackhi_epi8(b, alpha);
+		__m128i *out = (__m128i *) (rgba + 4 * i);
+
+		_mm_storeu_si128(out, _mm_unpacklo_epi16(rg_low, ba_low));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rg_low, ba_low));
+		_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rg_high, ba_high));
+		_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rg_high, ba_high));
+	}
+
+	return i;
+}
+
+/* 8 lanes of zero extended red, green and blue, to 8 lanes of luma. */
+static inline __m128i
+convert_luma_sse2(const struct convert_coefficients *coefficients,
+		  __m128i red, __m128i green, __m128i blue)
+{
+	const int *y = coefficients->y;
+	__m128i sum;
+
+	/* unsigned, but it fits in 16 bits, so the wrapping is harmless */
+	sum = _mm_mullo_epi16(red, _mm_set1_epi16(y[0]));
+	sum = _mm_add_epi16(sum, _mm_mullo_epi16(green, _mm_set1_epi16(y[1])));
+	sum = _mm_add_epi16(sum, _mm_mullo_epi16(blue, _mm_set1_epi16(y[2])));
+	sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(0x80)), 8);
+
+	return _mm_add_epi16(sum, _mm_set1_epi16(coefficients->y_offset));
+}
+
+static inline __m128i
+convert_luma16_sse2(const struct convert_coefficients *coefficients,
+		    __m128i red, __m128i green, __m128i blue)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i low, high;
+
+	low = convert_luma_sse2(coefficients, _mm_unpacklo_epi8(red, zero),
+				_mm_unpacklo_epi8(green, zero),
+				_mm_unpacklo_epi8(blue, zero));
+	high = convert_luma_sse2(coefficients, _mm_unpackhi_epi8(red, zero),
+				 _mm_unpackhi_epi8(green, zero),
+				 _mm_unpackhi_epi8(blue, zero));
+
+	return _mm_packus_epi16(low, high);
+}
+
+/* 8 lanes of chroma, still 16 bits wide. */
+static inline __m128i
+convert_chroma_sse2(const int *k, __m128i red, __m128i green, __m128i blue)
+{
+	__m128i sum;
+
+	sum = _mm_mullo_epi16(red, _mm_set1_epi16(k[0]));
+	sum = _mm_add_epi16(sum, _mm_mullo_epi16(green, _mm_set1_epi16(k[1])));
+	sum = _mm_add_epi16(sum, _mm_mullo_epi16(blue, _mm_set1_epi16(k[2])));
+	/* only saturates at the spot where the scalar code clamps anyway */
+	sum = _mm_srai_epi16(_mm_adds_epi16(sum, _mm_set1_epi16(0x80)), 8);
+
+	return _mm_add_epi16(sum, _mm_set1_epi16(0x80));
+}
+
+/* sums of horizontally neighbouring bytes, as 8 lanes of 16 bits. */
+static inline __m128i
+convert_pairs_sse2(__m128i value)
+{
+	return _mm_add_epi16(_mm_and_si128(value, _mm_set1_epi16(0xFF)),
+			     _mm_srli_epi16(value, 8));
+}
+
+/* interleaved chroma bytes, 8 pairs. */
+static inline __m128i
+convert_uv_sse2(const struct convert_coefficients *coefficients,
+		__m128i red, __m128i green, __m128i blue)
+{
+	__m128i u = convert_chroma_sse2(coefficients->u, red, green, blue);
+	__m128i v = convert_chroma_sse2(coefficients->v, red, green, blue);
+
+	return _mm_unpacklo_epi8(_mm_packus_epi16(u, u),
+				 _mm_packus_epi16(v, v));
+}
+
+static int
+convert_nv12_simd(const struct convert_coefficients *coefficients,
+		  const uint8_t *top[3], const uint8_t *bottom[3],
+		  uint8_t *luma_top, uint8_t *luma_bottom, uint8_t *chroma,
+		  int width)
+{
+	__m128i two = _mm_set1_epi16(2);
+	int i, j;
+
+	for (i = 0; (i + 16) <= width; i += 16) {
+		__m128i upper[3], lower[3], sum[3];
+
+		for (j = 0; j < 3; j++) {
+			upper[j] = _mm_loadu_si128((const __m128i *)
+						   (top[j] + i));
+			lower[j] = _mm_loadu_si128((const __m128i *)
+						   (bottom[j] + i));
+			sum[j] = _mm_add_epi16(convert_pairs_sse2(upper[j]),
+					       convert_pairs_sse2(lower[j]));
+			sum[j] = _mm_srli_epi16(_mm_add_epi16(sum[j], two), 2);
+		}
+
+		_mm_storeu_si128((__m128i *) (luma_top + i),
+				 convert_luma16_sse2(coefficients, upper[0],
+						     upper[1], upper[2]));
+		_mm_storeu_si128((__m128i *) (luma_bottom + i),
+				 convert_luma16_sse2(coefficients, lower[0],
+						     lower[1], lower[2]));
+		_mm_storeu_si128((__m128i *) (chroma + i),
+				 convert_uv_sse2(coefficients, sum[0], sum[1],
+						 sum[2]));
+	}
+
+	return i;
+}
+
+static int
+convert_yuyv_simd(const struct convert_coefficients *coefficients,
+		  const uint8_t *rgb[3], uint8_t *yuyv, int width)
+{
+	__m128i one = _mm_set1_epi16(1);
+	int i, j;
+
+	for (i = 0; (i + 16) <= width; i += 16) {
+		__m128i pixels[3], sum[3], luma, uv;
+		__m128i *out = (__m128i *) (yuyv + 2 * i);
+
+		for (j = 0; j < 3; j++) {
+			pixels[j] = _mm_loadu_si128((const __m128i *)
+						    (rgb[j] + i));
+			sum[j] = _mm_add_epi16(convert_pairs_sse2(pixels[j]),
+					       one);
+			sum[j] = _mm_srli_epi16(sum[j], 1);
+		}
+
+		luma = convert_luma16_sse2(coefficients, pixels[0], pixels[1],
+					   pixels[2]);
+		uv = convert_uv_sse2(coefficients, sum[0], sum[1], sum[2]);
+
+		_mm_storeu_si128(out, _mm_unpacklo_epi8(luma, uv));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi8(luma, uv));
+	}
+
+	return i;
+}
+
+static inline __m128i
+convert_rgb565_sse2(__m128i pixels)
+{
+	__m128i red, green, blue, out;
+
+	red = _mm_and_si128(_mm_srli_epi32(pixels, 8),
+			    _mm_set1_epi32(0xF800));
+	green = _mm_and_si128(_mm_srli_epi32(pixels, 5),
+			      _mm_set1_epi32(0x07E0));
+	blue = _mm_and_si128(_mm_srli_epi32(pixels, 3),
+			     _mm_set1_epi32(0x001F));
+	out = _mm_or_si128(_mm_or_si128(red, green), blue);
+
+	/* sign extend, so that the signed saturating pack leaves it be */
+	return _mm_srai_epi32(_mm_slli_epi32(out, 16), 16);
+}
+
+static int
+convert_rgb565_simd(const uint8_t *argb, uint16_t *rgb565, int count)
+{
+	int i;
+
+	for (i = 0; (i + 8) <= count; i += 8) {
+		__m128i low = _mm_loadu_si128((const __m128i *)
+					      (argb + 4 * i));
+		__m128i high = _mm_loadu_si128((const __m128i *)
+					       (argb + 4 * i + 16));
+
+		_mm_storeu_si128((__m128i *) (rgb565 + i),
+				 _mm_packs_epi32(convert_rgb565_sse2(low),
+						 convert_rgb565_sse2(high)));
+	}
+
+	return i;
+}
+#else
+static int
+convert_rgba_planar_simd(const uint8_t *rgba, uint8_t *red, uint8_t *green,
+			 uint8_t *blue, int count)
+{
+	return 0;
+}
+
+static int
+convert_planar_rgba_simd(const uint8_t *red, const uint8_t *green,
+			 const uint8_t *blue, uint8_t *rgba, int count)
+{
+	return 0;
+}
+
+static int
+convert_nv12_simd(const struct convert_coefficients *coefficients,
+		  const uint8_t *top[3], const uint8_t *bottom[3],
+		  uint8_t *luma_top, uint8_t *luma_bottom, uint8_t *chroma,
+		  int width)
+{
+	return 0;
+}
+
+static int
+convert_yuyv_simd(const struct convert_coefficients *coefficients,
+		  const uint8_t *rgb[3], uint8_t *yuyv, int width)
+{
+	return 0;
+}
+
+static int
+convert_rgb565_simd(const uint8_t *argb, uint16_t *rgb565, int count)
+{
+	return 0;
+}
+#endif
+
+static int
+convert_image_check(const struct convert_image *in,
+		    const struct convert_image *out,
+		    bool even_width, bool even_height)
+{
+	if ((in->width != out->width) || (in->height != out->height))
+		return -EINVAL;
+
+	if ((in->width <= 0) || (in->height <= 0))
+		return -EINVAL;
+
+	if (even_width && (in->width & 1))
+		return -EINVAL;
+
+	if (even_height && (in->height & 1))
+		return -EINVAL;
+
+	return 0;
+}
+
+int
+convert_rgba_to_planar(const struct convert_image *in,
+		       struct convert_image *out)
+{
+	int ret, x, y;
+
+	ret = convert_image_check(in, out, false, false);
+	if (ret)
+		return ret;
+
+	for (y = 0; y < in->height; y++) {
+		const uint8_t *rgba = in->planes[0] + y * in->pitches[0];
+		uint8_t *red = out->planes[0] + y * out->pitches[0];
+		uint8_t *green = out->planes[1] + y * out->pitches[1];
+		uint8_t *blue = out->planes[2] + y * out->pitches[2];
+
+		x = 0;
+		if (convert_simd)
+			x = convert_rgba_planar_simd(rgba, red, green, blue,
+						     in->width);
+
+		for (; x < in->width; x++) {
+			red[x] = rgba[4 * x + 0];
+			green[x] = rgba[4 * x + 1];
+			blue[x] = rgba[4 * x + 2];
+		}
+	}
+
+	return 0;
+}
+
+int
+convert_planar_to_rgba(const struct convert_image *in,
+		       struct convert_image *out)
+{
+	int ret, x, y;
+
+	ret = convert_image_check(in, out, false, false);
+	if (ret)
+		return ret;
+
+	for (y = 0; y < in->height; y++) {
+		const uint8_t *red = in->planes[0] + y * in->pitches[0];
+		const uint8_t *green = in->planes[1] + y * in->pitches[1];
+		const uint8_t *blue = in->planes[2] + y * in->pitches[2];
+		uint8_t *rgba = out->planes[0] + y * out->pitches[0];
+
+		x = 0;
+		if (convert_simd)
+			x = convert_planar_rgba_simd(red, green, blue, rgba,
+						     in->width);
+
+		for (; x < in->width; x++) {
+			rgba[4 * x + 0] = red[x];
+			rgba[4 * x + 1] = green[x];
+			rgba[4 * x + 2] = blue[x];
+			rgba[4 * x + 3] = 0xFF;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Chroma is sited in the centre of each 2x2 block, and is taken from the
+ * rounded average of the four pixels.
+ */
+int
+convert_planar_to_nv12(const struct convert_image *in,
+		       struct convert_image *out,
+		       enum convert_matrix matrix, enum convert_range range)
+{
+	const struct convert_coefficients *coefficients =
+		&convert_coefficients[matrix][range];
+	int ret, i, x, y;
+
+	ret = convert_image_check(in, out, true, true);
+	if (ret)
+		return ret;
+
+	for (y = 0; y < in->height; y += 2) {
+		const uint8_t *top[3], *bottom[3];
+		uint8_t *luma_top = out->planes[0] + y * out->pitches[0];
+		uint8_t *luma_bottom = luma_top + out->pitches[0];
+		uint8_t *chroma = out->planes[1] + (y / 2) * out->pitches[1];
+
+		for (i = 0; i < 3; i++) {
+			top[i] = in->planes[i] + y * in->pitches[i];
+			bottom[i] = top[i] + in->pitches[i];
+		}
+
+		x = 0;
+		if (convert_simd)
+			x = convert_nv12_simd(coefficients, top, bottom,
+					      luma_top, luma_bottom, chroma,
+					      in->width);
+
+		for (; x < in->width; x += 2) {
+			int sum[3];
+
+			luma_top[x] = convert_luma(coefficients, top[0][x],
+						   top[1][x], top[2][x]);
+			luma_top[x + 1] =
+				convert_luma(coefficients, top[0][x + 1],
+					     top[1][x + 1], top[2][x + 1]);
+			luma_bottom[x] =
+				convert_luma(coefficients, bottom[0][x],
+					     bottom[1][x], bottom[2][x]);
+			luma_bottom[x + 1] =
+				convert_luma(coefficients, bottom[0][x + 1],
+					     bottom[1][x + 1],
+					     bottom[2][x + 1]);
+
+			for (i = 0; i < 3; i++)
+				sum[i] = (top[i][x] + top[i][x + 1] +
+					  bottom[i][x] + bottom[i][x + 1] +
+					  2) >> 2;
+
+			chroma[x] = convert_chroma(coefficients->u, sum[0],
+						   sum[1], sum[2]);
+			chroma[x + 1] = convert_chroma(coefficients->v, sum[0],
+						       sum[1], sum[2]);
+		}
+	}
+
+	return 0;
+}
+
+int
+convert_planar_to_yuyv(const struct convert_image *in,
+		       struct convert_image *out,
+		       enum convert_matrix matrix, enum convert_range range)
+{
+	const struct convert_coefficients *coefficients =
+		&convert_coefficients[matrix][range];
+	int ret, i, x, y;
+
+	ret = convert_image_check(in, out, true, false);
+	if (ret)
+		return ret;
+
+	for (y = 0; y < in->height; y++) {
+		const uint8_t *rgb[3];
+		uint8_t *yuyv = out->planes[0] + y * out->pitches[0];
+
+		for (i = 0; i < 3; i++)
+			rgb[i] = in->planes[i] + y * in->pitches[i];
+
+		x = 0;
+		if (convert_simd)
+			x = convert_yuyv_simd(coefficients, rgb, yuyv,
+					      in->width);
+
+		for (; x < in->width; x += 2) {
+			int sum[3];
+
+			for (i = 0; i < 3; i++)
+				sum[i] = (rgb[i][x] + rgb[i][x + 1] + 1) >> 1;
+
+			yuyv[2 * x + 0] = convert_luma(coefficients, rgb[0][x],
+						       rgb[1][x], rgb[2][x]);
+			yuyv[2 * x + 1] = convert_chroma(coefficients->u,
+							 sum[0], sum[1],
+							 sum[2]);
+			yuyv[2 * x + 2] =
+				convert_luma(coefficients, rgb[0][x + 1],
+					     rgb[1][x + 1], rgb[2][x + 1]);
+			yuyv[2 * x + 3] = convert_chroma(coefficients->v,
+							 sum[0], sum[1],
+							 sum[2]);
+		}
+	}
+
+	return 0;
+}
+
+int
+convert_argb_to_rgb565(const struct convert_image *in,
+		       struct convert_image *out)
+{
+	int ret, x, y;
+
+	ret = convert_image_check(in, out, false, false);
+	if (ret)
+		return ret;
+
+	for (y = 0; y < in->height; y++) {
+		const uint8_t *argb = in->planes[0] + y * in->pitches[0];
+		uint16_t *rgb565 = (uint16_t *)
+			(out->planes[0] + y * out->pitches[0]);
+
+		x = 0;
+		if (convert_simd)
+			x = convert_rgb565_simd(argb, rgb565, in->width);
+
+		for (; x < in->width; x++) {
+			const uint8_t *pixel = argb + 4 * x;
+
+			rgb565[x] = ((pixel[2] & 0xF8) << 8) |
+				((pixel[1] & 0xFC) << 3) | (pixel[0] >> 3);
+		}
+	}
+
+	return 0;
+}
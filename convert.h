@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_CONVERT_H_
+#define _HAVE_CONVERT_H_ 1
+
+/*
+ * A plain description of a (possibly planar) image in cpu memory. Pitches
+ * are in bytes. Rows of a band can be handed out by offsetting the plane
+ * pointers and reducing the height.
+ */
+struct convert_image {
+	int width;
+	int height;
+
+	uint8_t *planes[3];
+	int pitches[3];
+};
+
+enum convert_matrix {
+	CONVERT_BT601 = 0,
+	CONVERT_BT709,
+};
+
+enum convert_range {
+	CONVERT_RANGE_LIMITED = 0,
+	CONVERT_RANGE_FULL,
+};
+
+/*
+ * Unless explicitly disabled, the NEON or SSE2 kernels are used when they
+ * were built in. Both are bit exact with the scalar reference.
+ */
+void convert_simd_set(bool enable);
+const char *convert_simd_name(void);
+
+/* rgba is bytes in R, G, B, A order, which is PNG_FORMAT_RGBA. */
+int convert_rgba_to_planar(const struct convert_image *in,
+			   struct convert_image *out);
+int convert_planar_to_rgba(const struct convert_image *in,
+			   struct convert_image *out);
+
+/* width and height need to be even. */
+int convert_planar_to_nv12(const struct convert_image *in,
+			   struct convert_image *out,
+			   enum convert_matrix matrix,
+			   enum convert_range range);
+/* width needs to be even. */
+int convert_planar_to_yuyv(const struct convert_image *in,
+			   struct convert_image *out,
+			   enum convert_matrix matrix,
+			   enum convert_range range);
+
+/* argb is DRM_FORMAT_ARGB8888, so PNG_FORMAT_BGRA. */
+int convert_argb_to_rgb565(const struct convert_image *in,
+			   struct convert_image *out);
+
+#endif /* _HAVE_CONVERT_H_ */
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Time every conversion kernel, both the scalar reference and the simd
+ * version, on the same random image, and check that both produce exactly
+ * the same bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sysexits.h>
+
+#include "convert.h"
+
+enum bench_format {
+	BENCH_PLANAR = 0,
+	BENCH_RGBA,
+	BENCH_NV12,
+	BENCH_YUYV,
+	BENCH_RGB565,
+};
+
+static const struct bench_kernel {
+	const char *name;
+	enum bench_format in;
+	enum bench_format out;
+	int (*convert)(const struct convert_image *in,
+		       struct convert_image *out);
+	int (*convert_yuv)(const struct convert_image *in,
+			   struct convert_image *out,
+			   enum convert_matrix matrix,
+			   enum convert_range range);
+	enum convert_matrix matrix;
+	enum convert_range range;
+} bench_kernels[] = {
+	{
+		.name = "rgba -> planar",
+		.in = BENCH_RGBA,
+		.out = BENCH_PLANAR,
+		.convert = convert_rgba_to_planar,
+	}, {
+		.name = "planar -> rgba",
+		.in = BENCH_PLANAR,
+		.out = BENCH_RGBA,
+		.convert = convert_planar_to_rgba,
+	}, {
+		.name = "planar -> nv12 601",
+		.in = BENCH_PLANAR,
+		.out = BENCH_NV12,
+		.convert_yuv = convert_planar_to_nv12,
+		.matrix = CONVERT_BT601,
+		.range = CONVERT_RANGE_LIMITED,
+	}, {
+		.name = "planar -> nv12 601 full",
+		.in = BENCH_PLANAR,
+		.out = BENCH_NV12,
+		.convert_yuv = convert_planar_to_nv12,
+		.matrix = CONVERT_BT601,
+		.range = CONVERT_RANGE_FULL,
+	}, {
+		.name = "planar -> nv12 709",
+		.in = BENCH_PLANAR,
+		.out = BENCH_NV12,
+		.convert_yuv = convert_planar_to_nv12,
+		.matrix = CONVERT_BT709,
+		.range = CONVERT_RANGE_LIMITED,
+	}, {
+		.name = "planar -> nv12 709 full",
+		.in = BENCH_PLANAR,
+		.out = BENCH_NV12,
+		.convert_yuv = convert_planar_to_nv12,
+		.matrix = CONVERT_BT709,
+		.range = CONVERT_RANGE_FULL,
+	}, {
+		.name = "planar -> yuyv 601",
+		.in = BENCH_PLANAR,
+		.out = BENCH_YUYV,
+		.convert_yuv = convert_planar_to_yuyv,
+		.matrix = CONVERT_BT601,
+		.range = CONVERT_RANGE_LIMITED,
+	}, {
+		.name = "planar -> yuyv 709 full",
+		.in = BENCH_PLANAR,
+		.out = BENCH_YUYV,
+		.convert_yuv = convert_planar_to_yuyv,
+		.matrix = CONVERT_BT709,
+		.range = CONVERT_RANGE_FULL,
+	}, {
+		.name = "argb -> rgb565",
+		.in = BENCH_RGBA,
+		.out = BENCH_RGB565,
+		.convert = convert_argb_to_rgb565,
+	},
+};
+
+static int bench_width = 1920;
+static int bench_height = 1080;
+static int bench_iterations = 50;
+
+/* every format fits in 4 bytes per pixel. */
+static uint8_t *bench_rgba;
+static uint8_t *bench_planar;
+static uint8_t *bench_reference;
+static uint8_t *bench_simd;
+
+static uint64_t
+time_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/* returns the number of bytes this image spans. */
+static size_t
+bench_image_setup(struct convert_image *image, enum bench_format format,
+		  uint8_t *memory)
+{
+	size_t size = bench_width * bench_height;
+	int i;
+
+	memset(image, 0, sizeof(struct convert_image));
+	image->width = bench_width;
+	image->height = bench_height;
+
+	switch (format) {
+	case BENCH_PLANAR:
+		for (i = 0; i < 3; i++) {
+			image->planes[i] = memory + i * size;
+			image->pitches[i] = bench_width;
+		}
+		return 3 * size;
+	case BENCH_RGBA:
+		image->planes[0] = memory;
+		image->pitches[0] = 4 * bench_width;
+		return 4 * size;
+	case BENCH_NV12:
+		image->planes[0] = memory;
+		image->pitches[0] = bench_width;
+		image->planes[1] = memory + size;
+		image->pitches[1] = bench_width;
+		return size + size / 2;
+	case BENCH_YUYV:
+	case BENCH_RGB565:
+		image->planes[0] = memory;
+		image->pitches[0] = 2 * bench_width;
+		return 2 * size;
+	}
+
+	return 0;
+}
+
+static int
+bench_run(const struct bench_kernel *kernel, uint8_t *memory,
+	  uint64_t *elapsed)
+{
+	struct convert_image in[1], out[1];
+	uint64_t start;
+	int ret = 0, i;
+
+	bench_image_setup(in, kernel->in, (kernel->in == BENCH_PLANAR) ?
+			  bench_planar : bench_rgba);
+	bench_image_setup(out, kernel->out, memory);
+
+	start = time_us();
+
+	for (i = 0; i < bench_iterations; i++) {
+		if (kernel->convert)
+			ret = kernel->convert(in, out);
+		else
+			ret = kernel->convert_yuv(in, out, kernel->matrix,
+						  kernel->range);
+		if (ret)
+			return ret;
+	}
+
+	*elapsed = time_us() - start;
+
+	return 0;
+}
+
+/* returns 1 when the simd output differs from the reference. */
+static int
+bench_kernel(const struct bench_kernel *kernel)
+{
+	struct convert_image out[1];
+	uint64_t reference_us, simd_us;
+	size_t size, i;
+	int ret;
+
+	size = bench_image_setup(out, kernel->out, bench_reference);
+	memset(bench_reference, 0, size);
+	memset(bench_simd, 0, size);
+
+	convert_simd_set(false);
+	ret = bench_run(kernel, bench_reference, &reference_us);
+	if (ret)
+		return ret;
+
+	convert_simd_set(true);
+	ret = bench_run(kernel, bench_simd, &simd_us);
+	if (ret)
+		return ret;
+
+	printf("%-24s: C %7.3fms, %s %7.3fms (%5.2fx): ", kernel->name,
+	       reference_us / (1000.0 * bench_iterations), convert_simd_name(),
+	       simd_us / (1000.0 * bench_iterations),
+	       (double) reference_us / (simd_us ? simd_us : 1));
+
+	for (i = 0; i < size; i++)
+		if (bench_reference[i] != bench_simd[i])
+			break;
+
+	if (i < size) {
+		printf("MISMATCH at byte %zu: 0x%02X instead of 0x%02X.\n",
+		       i, bench_simd[i], bench_reference[i]);
+		return 1;
+	}
+
+	printf("bit exact.\n");
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	printf("Usage:\n");
+	printf("%s [width height [iterations]]\n", name);
+	printf("Times all conversion kernels on a random width x height image"
+	       "\n(default 1920x1080), iterations times (default 50), and "
+	       "checks\nthat the %s kernels match the scalar reference.\n",
+	       convert_simd_name());
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t size;
+	int ret = 0, failed = 0;
+	unsigned int i;
+
+	if ((argc != 1) && (argc != 3) && (argc != 4)) {
+		usage(argv[0]);
+		return EX_USAGE;
+	}
+
+	if ((argc > 2) &&
+	    ((sscanf(argv[1], "%d", &bench_width) != 1) ||
+	     (sscanf(argv[2], "%d", &bench_height) != 1) ||
+	     (bench_width < 2) || (bench_height < 2) ||
+	     (bench_width & 1) || (bench_height & 1))) {
+		fprintf(stderr, "Error: width and height need to be even.\n");
+		usage(argv[0]);
+		return EX_USAGE;
+	}
+
+	if ((argc > 3) &&
+	    ((sscanf(argv[3], "%d", &bench_iterations) != 1) ||
+	     (bench_iterations < 1))) {
+		usage(argv[0]);
+		return EX_USAGE;
+	}
+
+	size = 4 * bench_width * bench_height;
+	bench_rgba = malloc(size);
+	bench_planar = malloc(size);
+	bench_reference = malloc(size);
+	bench_simd = malloc(size);
+	if (!bench_rgba || !bench_planar || !bench_reference || !bench_simd) {
+		fprintf(stderr, "Error: failed to allocate 4x %zubytes.\n",
+			size);
+		return EX_OSERR;
+	}
+
+	/* random, so that every corner of the maths gets hit. */
+	srand(0x4A55);
+	for (i = 0; i < size; i++) {
+		bench_rgba[i] = rand();
+		bench_planar[i] = rand();
+	}
+
+	printf("%dx%d, %d iterations:\n", bench_width, bench_height,
+	       bench_iterations);
+
+	for (i = 0; i < (sizeof(bench_kernels) / sizeof(bench_kernels[0]));
+	     i++) {
+		ret = bench_kernel(&bench_kernels[i]);
+		if (ret > 0)
+			failed++;
+		else if (ret) {
+			fprintf(stderr, "Error: %s: %s\n",
+				bench_kernels[i].name, strerror(-ret));
+			return EX_SOFTWARE;
+		}
+	}
+
+	free(bench_rgba);
+	free(bench_planar);
+	free(bench_reference);
+	free(bench_simd);
+
+	if (failed) {
+		fprintf(stderr, "Error: %d kernels do not match the scalar "
+			"reference.\n", failed);
+		return EX_SOFTWARE;
+	}
+
+	return 0;
+}
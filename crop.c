@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Active area detection: laptops often send 4:3 content pillarboxed
+ * inside 16:9, or a wide movie letterboxed, and then the projector wastes
+ * a good part of its pixels on black borders.
+ *
+ * Edges need the full resolution, so this does not use the pyramid, but we
+ * never scan a whole frame either. The left and right edges come from
+ * CROP_LINES lines spread over the frame. The top and bottom edges are
+ * tracked from where they were on the previous frame: we only look at the
+ * rows right around them, and move at most CROP_SCAN_MAX rows per frame.
+ *
+ * Dark slides look a lot like borders, so we only accept a crop which is
+ * centered, which keeps at least half of the frame, and we only shrink
+ * the area once it was stable for a while. Growing is immediate, so that
+ * content never gets cut off.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "juggler.h"
+#include "log.h"
+#include "stage.h"
+#include "crop.h"
+
+/* lines which we look at for the left and right edges */
+#define CROP_LINES 16
+/* how far we move the top or bottom edge in a single frame */
+#define CROP_SCAN_MAX 32
+
+/*
+ * Anything up to this is border. This is per pixel, so it allows for
+ * limited range black at 16, plus some noise from the source.
+ */
+#define CROP_BLACK_MAX 24
+/* how far off center a border is allowed to be */
+#define CROP_SYMMETRY 8
+/* how long a smaller area needs to be stable, in ns */
+#define CROP_SHRINK_TIME 2000000000ULL
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline bool
+crop_chunk_content(const uint8_t *data)
+{
+	uint8x16_t over = vqsubq_u8(vld1q_u8(data),
+				    vdupq_n_u8(CROP_BLACK_MAX));
+	uint8x8_t fold = vorr_u8(vget_low_u8(over), vget_high_u8(over));
+
+	return vget_lane_u64(vreinterpret_u64_u8(fold), 0);
+}
+#elif defined(__SSE2__)
+static inline bool
+crop_chunk_content(const uint8_t *data)
+{
+	__m128i over = _mm_subs_epu8(_mm_loadu_si128((const __m128i *) data),
+				     _mm_set1_epi8(CROP_BLACK_MAX));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(over, _mm_setzero_si128()))
+		!= 0xFFFF;
+}
+#endif
+
+/*
+ * Returns the index of the first byte which is not border, or count.
+ */
+static int
+crop_first(const uint8_t *data, int count)
+{
+	int i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__SSE2__)
+	for (; (i + 16) <= count; i += 16)
+		if (crop_chunk_content(data + i))
+			break;
+#endif
+
+	for (; i < count; i++)
+		if (data[i] > CROP_BLACK_MAX)
+			break;
+
+	return i;
+}
+
+/*
+ * Returns the index right after the last byte which is not border, or 0.
+ */
+static int
+crop_last(const uint8_t *data, int count)
+{
+	int i = count;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__SSE2__)
+	for (; i >= 16; i -= 16)
+		if (crop_chunk_content(data + i - 16))
+			break;
+#endif
+
+	for (; i > 0; i--)
+		if (data[i - 1] > CROP_BLACK_MAX)
+			break;
+
+	return i;
+}
+
+static bool
+crop_row_black(struct stage *stage, int y)
+{
+	int plane;
+
+	for (plane = 0; plane < 3; plane++)
+		if (crop_first(stage_row(stage, plane, y), stage->width) <
+		    stage->width)
+			return false;
+
+	return true;
+}
+
+static void
+crop_edges_vertical(struct crop *crop, struct stage *stage)
+{
+	int top = crop->top, bottom = crop->bottom, i;
+
+	if ((top > 0) && !crop_row_black(stage, top - 1)) {
+		for (i = 0; (i < CROP_SCAN_MAX) && (top > 0) &&
+			     !crop_row_black(stage, top - 1); i++)
+			top--;
+	} else {
+		for (i = 0; (i < CROP_SCAN_MAX) && (top < stage->height) &&
+			     crop_row_black(stage, top); i++)
+			top++;
+	}
+
+	if ((bottom < stage->height) && !crop_row_black(stage, bottom)) {
+		for (i = 0; (i < CROP_SCAN_MAX) &&
+			     (bottom < stage->height) &&
+			     !crop_row_black(stage, bottom); i++)
+			bottom++;
+	} else {
+		for (i = 0; (i < CROP_SCAN_MAX) && (bottom > 0) &&
+			     crop_row_black(stage, bottom - 1); i++)
+			bottom--;
+	}
+
+	crop->top = top;
+	crop->bottom = bottom;
+}
+
+/*
+ * Only keep what looks like a real letterbox or pillarbox, and keep
+ * things even for the sake of NV12.
+ */
+static void
+crop_area_sanitize(struct crop_area *area, int width, int height)
+{
+	int left = area->x, right = width - area->x - area->width;
+	int top = area->y, bottom = height - area->y - area->height;
+
+	if ((abs(left - right) > CROP_SYMMETRY) ||
+	    (area->width < (width / 2))) {
+		area->x = 0;
+		area->width = width;
+	}
+
+	if ((abs(top - bottom) > CROP_SYMMETRY) ||
+	    (area->height < (height / 2))) {
+		area->y = 0;
+		area->height = height;
+	}
+
+	area->width += area->x & 1;
+	area->x &= ~1;
+	area->width = (area->width + 1) & ~1;
+	if ((area->x + area->width) > width)
+		area->width = width - area->x;
+
+	area->height += area->y & 1;
+	area->y &= ~1;
+	area->height = (area->height + 1) & ~1;
+	if ((area->y + area->height) > height)
+		area->height = height - area->y;
+}
+
+static bool
+crop_area_equal(struct crop_area *a, struct crop_area *b)
+{
+	return (a->x == b->x) && (a->y == b->y) &&
+		(a->width == b->width) && (a->height == b->height);
+}
+
+/* whether b sticks out of a anywhere */
+static bool
+crop_area_grows(struct crop_area *a, struct crop_area *b)
+{
+	return (b->x < a->x) || (b->y < a->y) ||
+		((b->x + b->width) > (a->x + a->width)) ||
+		((b->y + b->height) > (a->y + a->height));
+}
+
+/*
+ * Called by capture, between stage_begin() and stage_end().
+ */
+void
+crop_frame(struct crop *crop, struct stage *stage, uint64_t now)
+{
+	struct crop_area area[1];
+	int left = stage->width, right = 0, i, plane;
+
+	if ((stage->width != crop->frame_width) ||
+	    (stage->height != crop->frame_height)) {
+		struct crop_area full = {
+			.width = stage->width,
+			.height = stage->height,
+		};
+
+		pthread_mutex_lock(crop->mutex);
+		crop->frame_width = stage->width;
+		crop->frame_height = stage->height;
+		*crop->area = full;
+		pthread_mutex_unlock(crop->mutex);
+
+		crop->top = 0;
+		crop->bottom = stage->height;
+		*crop->candidate = full;
+		crop->candidate_since = now;
+	}
+
+	for (i = 0; i < CROP_LINES; i++) {
+		int line = ((2 * i + 1) * stage->height) / (2 * CROP_LINES);
+
+		for (plane = 0; plane < 3; plane++) {
+			const uint8_t *row = stage_row(stage, plane, line);
+			int first = crop_first(row, stage->width), last;
+
+			/* nothing on this line */
+			if (first == stage->width)
+				continue;
+
+			if (first < left)
+				left = first;
+
+			last = crop_last(row, stage->width);
+			if (last > right)
+				right = last;
+		}
+	}
+
+	/* black, there is nothing to go on. */
+	if (right <= left)
+		return;
+
+	crop_edges_vertical(crop, stage);
+	if (crop->bottom <= crop->top)
+		return;
+
+	area->x = left;
+	area->y = crop->top;
+	area->width = right - left;
+	area->height = crop->bottom - crop->top;
+
+	crop_area_sanitize(area, stage->width, stage->height);
+
+	/* only we write the area, so we can look at it without the lock */
+	if (crop_area_equal(area, crop->area)) {
+		*crop->candidate = *area;
+		crop->candidate_since = now;
+		return;
+	}
+
+	if (!crop_area_grows(crop->area, area)) {
+		if (!crop_area_equal(area, crop->candidate)) {
+			*crop->candidate = *area;
+			crop->candidate_since = now;
+			return;
+		}
+
+		if ((now - crop->candidate_since) < CROP_SHRINK_TIME)
+			return;
+	}
+
+	pthread_mutex_lock(crop->mutex);
+	*crop->area = *area;
+	pthread_mutex_unlock(crop->mutex);
+
+	*crop->candidate = *area;
+	crop->candidate_since = now;
+
+	log_info("Crop: active area is %dx%d at %d,%d.\n", area->width,
+		 area->height, area->x, area->y);
+}
+
+/*
+ * Returns the active area of a width x height frame, or -EINVAL when we
+ * have not seen frames of that size.
+ */
+int
+crop_area_get(struct crop *crop, int width, int height,
+	      struct crop_area *area)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(crop->mutex);
+	if ((width == crop->frame_width) && (height == crop->frame_height))
+		*area = *crop->area;
+	else
+		ret = -EINVAL;
+	pthread_mutex_unlock(crop->mutex);
+
+	return ret;
+}
+
+/*
+ * Capture restarted, start over with the full frame.
+ */
+void
+crop_reset(struct crop *crop)
+{
+	pthread_mutex_lock(crop->mutex);
+	crop->frame_width = 0;
+	crop->frame_height = 0;
+	pthread_mutex_unlock(crop->mutex);
+}
+
+struct crop *
+crop_create(void)
+{
+	struct crop *crop;
+
+	crop = calloc(1, sizeof(struct crop));
+	if (!crop) {
+		fprintf(stderr, "%s(): failed to allocate crop.\n", __func__);
+		return NULL;
+	}
+
+	pthread_mutex_init(crop->mutex, NULL);
+
+	return crop;
+}
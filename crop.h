@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_CROP_H_
+#define _HAVE_CROP_H_ 1
+
+struct stage;
+
+/* in capture pixels */
+struct crop_area {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+struct crop {
+	pthread_mutex_t mutex[1];
+
+	int frame_width;
+	int frame_height;
+
+	/* edges as we last found them, bottom and right are exclusive */
+	int top;
+	int bottom;
+
+	/* a smaller area has to stick around before we shrink to it */
+	struct crop_area candidate[1];
+	uint64_t candidate_since;
+
+	/* what is applied, protect with mutex */
+	struct crop_area area[1];
+};
+
+struct crop *crop_create(void);
+void crop_reset(struct crop *crop);
+
+void crop_frame(struct crop *crop, struct stage *stage, uint64_t now);
+
+int crop_area_get(struct crop *crop, int width, int height,
+		  struct crop_area *area);
+
+#endif /* _HAVE_CROP_H_ */
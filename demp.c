@@ -14,20 +14,27 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
+
+/*
+ * Streaming engine for the sun4i_demp mem2mem device, which converts
+ * planar R8_G8_B8 to NV12, with several buffers in flight on both sides.
+ *
+ * When there is no demp, demp_software.c does the same on the cpu,
+ * behind the same interface.
+ */
+
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <stdlib.h>
-#include <sysexits.h>
 #include <sys/mman.h>
 
-#include <png.h>
-
 #include <linux/videodev2.h>
 
 #if defined(__LINUX_VIDEODEV2_H) && !defined(V4L2_PIX_FMT_R8_G8_B8)
@@ -38,36 +45,14 @@
 #define V4L2_PIX_FMT_R8_G8_B8 v4l2_fourcc('P', 'R', 'G', 'B') /* 24bit planar RGB */
 #endif
 
-#include <xf86drm.h>
-#include <xf86drmMode.h>
-#include <drm_fourcc.h>
-
-#include "kms.h"
+#include "juggler.h"
+#include "demp.h"
+#include "log.h"
+#include "thread.h"
 
 #define DRIVER_NAME "sun4i_demp"
 
-static int demp_fd;
-
-static struct demp_buffer {
-	int width;
-	int height;
-
-	uint32_t *png_rgba;
-
-	struct {
-		uint8_t *map;
-		size_t size;
-	} inputs[3];
-	int input_count;
-
-	struct {
-		uint8_t *map;
-		size_t size;
-		int export_fd;
-		uint32_t prime_handle;
-	} outputs[3];
-	int output_count;
-} demp_buffer[1];
+#define DEMP_STATISTICS_COUNT 600
 
 static int
 demp_device_open_and_verify(int number)
@@ -84,7 +69,8 @@ demp_device_open_and_verify(int number)
 		return ret;
 	}
 
-	fd = open(filename, O_RDWR);
+	/* we get to poll, so never block on DQBUF. */
+	fd = open(filename, O_RDWR | O_NONBLOCK);
 	if (fd < 0) {
 		if ((errno == ENODEV) || (errno == ENOENT)) {
 			return 0; /* next! */
@@ -211,52 +197,6 @@ demp_device_find(void)
 	return -ENODEV;
 }
 
-static int
-demp_png_load(const char *filename)
-{
-	png_image image[1] = {{
-		.version = PNG_IMAGE_VERSION,
-	}};
-	int ret;
-
-	ret = png_image_begin_read_from_file(image, filename);
-	if (ret != 1) {
-		fprintf(stderr, "Error: %s():begin_read(): %s\n",
-			__func__, image->message);
-		return ret;
-	}
-
-	image->format = PNG_FORMAT_RGBA;
-
-	printf("Reading from %s: %dx%d (%dbytes)\n", filename,
-	       image->width, image->height, PNG_IMAGE_SIZE(*image));
-
-	demp_buffer->width = image->width;
-	demp_buffer->height = image->height;
-
-	demp_buffer->png_rgba = calloc(demp_buffer->width * demp_buffer->height,
-				      sizeof(uint32_t));
-	if (!demp_buffer->png_rgba) {
-		fprintf(stderr, "Error: %s(): calloc(): %s\n",
-			__func__, strerror(errno));
-		png_image_free(image);
-		return errno;
-	}
-
-	ret = png_image_finish_read(image, NULL, demp_buffer->png_rgba,
-				    0, NULL);
-	if (ret != 1) {
-		fprintf(stderr, "Error: %s():finish_read(): %s\n",
-			__func__, image->message);
-		free(demp_buffer->png_rgba);
-		png_image_free(image);
-		return ret;
-	}
-
-	png_image_free(image);
-
-	return 0;
-}
 
 static void
 demp_format_print(struct v4l2_pix_format_mplane *format)
@@ -277,586 +217,613 @@ demp_format_print(struct v4l2_pix_format_mplane *format)
 		       format->plane_fmt[i].sizeimage);
 }
 
+static const char *
+demp_type_string(int type)
+{
+	if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		return "input";
+	else
+		return "output";
+}
+
+/*
+ * Set the format and create, query and map count buffers of either side.
+ */
 static int
-demp_input_create(void)
+demp_buffers_create(struct demp *demp, int type, uint32_t pixelformat,
+		    struct demp_buffer *buffers, int *count, bool import)
 {
 	struct v4l2_format format[1] = {{
-		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+		.type = type,
 	}};
 	struct v4l2_requestbuffers request[1] = {{
-		.count = 1,
-		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
-		.memory = V4L2_MEMORY_MMAP,
+		.count = *count,
+		.type = type,
+		.memory = import ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP,
 	}};
-	struct v4l2_plane planes_query[3] = {{ 0 }};
-	struct v4l2_buffer query[1] = {{
-		.index = 0, /* we only have 1 buffer, so index is 0 */
-		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
-		.memory = V4L2_MEMORY_MMAP,
-		.length = 3,
-		.m.planes = planes_query,
-	}};
-	int i, ret;
-
-	ret = ioctl(demp_fd, VIDIOC_G_FMT, format);
+	struct v4l2_plane_pix_format *plane_format =
+		format->fmt.pix_mp.plane_fmt;
+	int prot = (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) ?
+		PROT_WRITE : PROT_READ;
+	const char *name = demp_type_string(type);
+	int i, j, ret;
+
+	ret = ioctl(demp->fd, VIDIOC_G_FMT, format);
 	if (ret) {
-		fprintf(stderr, "Error: %s():ioctl(G_FMT(input)): %s\n",
-			__func__, strerror(errno));
+		fprintf(stderr, "Error: %s():ioctl(G_FMT(%s)): %s\n",
+			__func__, name, strerror(errno));
 		return errno;
 	}
 
-	format->fmt.pix_mp.width = demp_buffer->width;
-	format->fmt.pix_mp.height = demp_buffer->height;
-	format->fmt.pix_mp.pixelformat = V4L2_PIX_FMT_R8_G8_B8;
+	format->fmt.pix_mp.width = demp->width;
+	format->fmt.pix_mp.height = demp->height;
+	format->fmt.pix_mp.pixelformat = pixelformat;
 
-	ret = ioctl(demp_fd, VIDIOC_S_FMT, format);
+	ret = ioctl(demp->fd, VIDIOC_S_FMT, format);
 	if (ret) {
-		fprintf(stderr, "Error: %s():ioctl(S_FMT(input)): %s\n",
-			__func__, strerror(errno));
+		fprintf(stderr, "Error: %s():ioctl(S_FMT(%s)): %s\n",
+			__func__, name, strerror(errno));
 		return errno;
 	}
 
-	printf("Input format:\n");
+	printf("Demp %s format:\n", name);
 	demp_format_print(&format->fmt.pix_mp);
 
-	ret = ioctl(demp_fd, VIDIOC_REQBUFS, request);
+	ret = ioctl(demp->fd, VIDIOC_REQBUFS, request);
 	if (ret) {
-		fprintf(stderr, "Error: %s():ioctl(REQBUFS): %s\n",
-			__func__, strerror(errno));
+		fprintf(stderr, "Error: %s():ioctl(REQBUFS(%s)): %s\n",
+			__func__, name, strerror(errno));
 		return errno;
 	}
 
 	if (request->count < 1) {
-		fprintf(stderr, "Error: %s(): Not enough buffers available.\n",
-			__func__);
+		fprintf(stderr, "Error: %s(): Not enough %s buffers "
+			"available.\n", __func__, name);
 		return -ENOMEM;
 	}
 
-	ret = ioctl(demp_fd, VIDIOC_QUERYBUF, query);
-	if (ret) {
-		fprintf(stderr, "Error: %s():ioctl(QUERYBUF): %s\n",
-			__func__, strerror(errno));
-		return errno;
-	}
+	if (request->count > DEMP_BUFFER_COUNT_MAX)
+		request->count = DEMP_BUFFER_COUNT_MAX;
 
-	for (i = 0; i < format->fmt.pix_mp.num_planes; i++) {
-		off_t offset = query->m.planes[i].m.mem_offset;
-		size_t size = query->m.planes[i].length;
-		void *map;
+	if (request->count != *count)
+		printf("Demp: got %d instead of %d %s buffers.\n",
+		       request->count, *count, name);
+	*count = request->count;
 
-		printf("%s: plane %d: 0x%08lX (%dbytes)\n",
-		       __func__, i, offset, (int) size);
+	for (i = 0; i < *count; i++) {
+		struct demp_buffer *buffer = &buffers[i];
+		struct v4l2_plane planes_query[3] = {{ 0 }};
+		struct v4l2_buffer query[1] = {{
+			.index = i,
+			.type = type,
+			.memory = V4L2_MEMORY_MMAP,
+			.length = 3,
+			.m.planes = planes_query,
+		}};
+
+		buffer->index = i;
+		buffer->plane_count = format->fmt.pix_mp.num_planes;
+
+		/* the memory comes along with every QBUF. */
+		if (import) {
+			for (j = 0; j < buffer->plane_count; j++) {
+				buffer->planes[j].size =
+					plane_format[j].sizeimage;
+				buffer->planes[j].pitch =
+					plane_format[j].bytesperline;
+				buffer->planes[j].export_fd = -1;
+			}
+			continue;
+		}
 
-		map = mmap(NULL, size, PROT_WRITE, MAP_SHARED, demp_fd, offset);
-		if (map == MAP_FAILED) {
-			fprintf(stderr, "Error: %s():mmap(%d): %s\n",
-				__func__, 0, strerror(errno));
+		ret = ioctl(demp->fd, VIDIOC_QUERYBUF, query);
+		if (ret) {
+			fprintf(stderr, "Error: %s():ioctl(QUERYBUF(%s, %d)): "
+				"%s\n", __func__, name, i, strerror(errno));
 			return errno;
 		}
-		demp_buffer->inputs[i].map = map;
-		demp_buffer->inputs[i].size = size;
+
+		for (j = 0; j < buffer->plane_count; j++) {
+			off_t offset = query->m.planes[j].m.mem_offset;
+			size_t size = query->m.planes[j].length;
+			void *map;
+
+			map = mmap(NULL, size, prot, MAP_SHARED, demp->fd,
+				   offset);
+			if (map == MAP_FAILED) {
+				fprintf(stderr, "Error: %s():mmap(%s, %d, %d):"
+					" %s\n", __func__, name, i, j,
+					strerror(errno));
+				return errno;
+			}
+
+			buffer->planes[j].map = map;
+			buffer->planes[j].size = size;
+			buffer->planes[j].pitch = plane_format[j].bytesperline;
+			buffer->planes[j].export_fd = -1;
+		}
 	}
-	demp_buffer->input_count = i;
 
 	return 0;
 }
 
+/*
+ * When given dmabuf fds, these get queued instead of our own memory.
+ */
 static int
-demp_output_create(void)
+demp_buffer_queue(struct demp *demp, int type, struct demp_buffer *buffer,
+		  const int *fds)
 {
-	struct v4l2_format format[1] = {{
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
-	}};
-	struct v4l2_requestbuffers request[1] = {{
-		.count = 1,
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
-		.memory = V4L2_MEMORY_MMAP,
-	}};
-	struct v4l2_plane planes_query[3] = {{ 0 }};
-	struct v4l2_buffer query[1] = {{
-		.index = 0, /* we only have 1 buffer, so index is 0 */
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
-		.memory = V4L2_MEMORY_MMAP,
-		.length = 3,
-		.m.planes = planes_query,
+	struct v4l2_plane planes[3] = {{ 0 }};
+	struct v4l2_buffer queue[1] = {{
+		.index = buffer->index,
+		.type = type,
+		.memory = fds ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP,
+		.m.planes = planes,
+		.length = buffer->plane_count,
 	}};
-	int i, ret;
-
-	ret = ioctl(demp_fd, VIDIOC_G_FMT, format);
-	if (ret) {
-		fprintf(stderr, "Error: %s():ioctl(G_FMT(format)): %s\n",
-			__func__, strerror(errno));
-		return errno;
-	}
-
-	format->fmt.pix_mp.pixelformat = V4L2_PIX_FMT_NV12;
+	int ret, i;
 
-	ret = ioctl(demp_fd, VIDIOC_S_FMT, format);
-	if (ret) {
-		fprintf(stderr, "Error: %s():ioctl(S_FMT(input)): %s\n",
-			__func__, strerror(errno));
-		return errno;
+	if (buffer->queued) {
+		fprintf(stderr, "Error: %s(): %s buffer %d is already "
+			"queued.\n", __func__, demp_type_string(type),
+			buffer->index);
+		return -EBUSY;
 	}
 
-	printf("Output format:\n");
-	demp_format_print(&format->fmt.pix_mp);
+	if (demp->software) {
+		ret = demp_software_queue(demp,
+			type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			buffer->index, fds);
+		if (ret)
+			return ret;
 
-	ret = ioctl(demp_fd, VIDIOC_REQBUFS, request);
-	if (ret) {
-		fprintf(stderr, "Error: %s():ioctl(REQBUFS): %s\n",
-			__func__, strerror(errno));
-		return errno;
+		buffer->queued = true;
+		return 0;
 	}
 
-	if (request->count < 1) {
-		fprintf(stderr, "Error: %s(): Not enough buffers available.\n",
-			__func__);
-		return -ENOMEM;
+	for (i = 0; i < buffer->plane_count; i++) {
+		planes[i].bytesused = buffer->planes[i].size;
+		if (fds) {
+			planes[i].m.fd = fds[i];
+			planes[i].length = buffer->planes[i].size;
+		}
 	}
 
-	ret = ioctl(demp_fd, VIDIOC_QUERYBUF, query);
+	ret = ioctl(demp->fd, VIDIOC_QBUF, queue);
 	if (ret) {
-		fprintf(stderr, "Error: %s():ioctl(QUERYBUF): %s\n",
-			__func__, strerror(errno));
-		return errno;
+		log_error("%s():ioctl(QBUF(%s, %d)): %s\n", __func__,
+			  demp_type_string(type), buffer->index,
+			  strerror(errno));
+		return -errno;
 	}
 
-	for (i = 0; i < format->fmt.pix_mp.num_planes; i++) {
-		off_t offset = query->m.planes[i].m.mem_offset;
-		size_t size = query->m.planes[i].length;
-		void *map;
-
-		printf("%s: plane %d: 0x%08lX (%dbytes)\n",
-		       __func__, i, offset, (int) size);
-
-		map = mmap(NULL, size, PROT_READ, MAP_SHARED, demp_fd, offset);
-		if (map == MAP_FAILED) {
-			fprintf(stderr, "Error: %s():mmap(%d): %s\n",
-				__func__, 0, strerror(errno));
-			return errno;
-		}
-		demp_buffer->outputs[i].map = map;
-		demp_buffer->outputs[i].size = size;
-	}
-	demp_buffer->output_count = i;
+	buffer->queued = true;
 
 	return 0;
 }
 
-static void
-demp_input_load(void)
-{
-	struct rgba {
-		uint8_t red;
-		uint8_t green;
-		uint8_t blue;
-		uint8_t alpha;
-	} *pixels = (struct rgba *) demp_buffer->png_rgba;
-	int i;
-
-	for (i = 0; i < demp_buffer->inputs[0].size; i++) {
-		demp_buffer->inputs[0].map[i] = pixels[i].red;
-		demp_buffer->inputs[1].map[i] = pixels[i].green;
-		demp_buffer->inputs[2].map[i] = pixels[i].blue;
-	}
-}
-
+/*
+ * Returns the index of the dequeued buffer, or -EAGAIN when there is
+ * nothing to dequeue.
+ */
 static int
-demp_streaming_start(void)
+demp_buffer_dequeue(struct demp *demp, int type,
+		    struct demp_buffer *buffers, bool import)
 {
-	struct v4l2_plane planes_input[3] = {{ 0 }};
-	struct v4l2_buffer queue_input[1] = {{
-		.index = 0, /* we only have 1 buffer, so index is 0 */
-		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
-		.memory = V4L2_MEMORY_MMAP,
-		.m.planes = planes_input,
-		.length = 3,
-	}};
-	struct v4l2_plane planes_output[3] = {{ 0 }};
-	struct v4l2_buffer queue_output[1] = {{
-		.index = 0, /* we only have 1 buffer, so index is 0 */
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
-		.memory = V4L2_MEMORY_MMAP,
-		.m.planes = planes_output,
+	struct v4l2_plane planes[3] = {{ 0 }};
+	struct v4l2_buffer dequeue[1] = {{
+		.type = type,
+		.memory = import ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP,
+		.m.planes = planes,
 		.length = 3,
 	}};
-	int type_input = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	int type_output = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	int ret;
 
-	ret = ioctl(demp_fd, VIDIOC_QBUF, queue_input);
-	if (ret) {
-		fprintf(stderr, "Error: %s()ioctl(QBUF(input)): %s\n",
-			__func__, strerror(errno));
-		return errno;
-	}
+	if (demp->software) {
+		ret = demp_software_dequeue(demp,
+			type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+		if (ret < 0)
+			return ret;
 
-	ret = ioctl(demp_fd, VIDIOC_STREAMON, &type_input);
-	if (ret) {
-		fprintf(stderr, "Error: %s(): ioctl(STREAMON(input)): %s\n",
-			__func__, strerror(errno));
-		return errno;
+		buffers[ret].queued = false;
+		return ret;
 	}
-	printf("Input stream started!\n");
 
-	ret = ioctl(demp_fd, VIDIOC_QBUF, queue_output);
+	ret = ioctl(demp->fd, VIDIOC_DQBUF, dequeue);
 	if (ret) {
-		fprintf(stderr, "Error: %s()ioctl(QBUF(output)): %s\n",
-			__func__, strerror(errno));
-		return errno;
-	}
+		if (errno == EAGAIN)
+			return -EAGAIN;
 
-	ret = ioctl(demp_fd, VIDIOC_STREAMON, &type_output);
-	if (ret) {
-		fprintf(stderr, "Error: %s(): ioctl(STREAMON(output)): %s\n",
-			__func__, strerror(errno));
-		return errno;
+		log_error("%s():ioctl(DQBUF(%s)): %s\n", __func__,
+			  demp_type_string(type), strerror(errno));
+		return -errno;
 	}
-	printf("Output stream started!\n");
 
-	return 0;
+	buffers[dequeue->index].queued = false;
+
+	return dequeue->index;
 }
 
 static int
-demp_buffers_dequeue(void)
+demp_input_queue_fds(struct demp *demp, int index, const int *fds)
 {
-	struct v4l2_plane planes_input[3] = {{ 0 }};
-	struct v4l2_buffer dequeue_input[1] = {{
-		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
-		.memory = V4L2_MEMORY_MMAP,
-		.m.planes = planes_input,
-		.length = 3,
-	}};
-	struct v4l2_plane planes_output[3] = {{ 0 }};
-	struct v4l2_buffer dequeue_output[1] = {{
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
-		.memory = V4L2_MEMORY_MMAP,
-		.m.planes = planes_output,
-		.length = 3,
-	}};
 	int ret;
 
-	ret = ioctl(demp_fd, VIDIOC_DQBUF, dequeue_input);
-	if (ret) {
-		fprintf(stderr, "Error: %s():ioctl(DQBUF(input): %s\n",
-			__func__, strerror(errno));
+	ret = demp_buffer_queue(demp, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+				&demp->inputs[index], fds);
+	if (ret)
 		return ret;
-	}
-	printf("Input buffer %d dequeued.\n", dequeue_input->index);
 
-	ret = ioctl(demp_fd, VIDIOC_DQBUF, dequeue_output);
-	if (ret) {
-		fprintf(stderr, "Error: %s():ioctl(DQBUF(output): %s\n",
-			__func__, strerror(errno));
-		return ret;
-	}
-	printf("Output buffer %d dequeued.\n", dequeue_output->index);
+	demp->queued_times[demp->queued_head] = thread_time_get();
+	demp->queued_head = (demp->queued_head + 1) % DEMP_QUEUED_MAX;
 
 	return 0;
 }
 
-static struct kms_plane *
-demp_kms_plane_get(int crtc_index)
+int
+demp_input_queue(struct demp *demp, int index)
 {
-	drmModePlaneRes *resources_plane = NULL;
-	struct kms_plane *kms_plane = NULL;
-	int i;
+	if (demp->input_import) {
+		fprintf(stderr, "Error: %s(): our inputs are dmabufs.\n",
+			__func__);
+		return -EINVAL;
+	}
 
-	/* Get plane resources so we can start sifting through the planes */
-	resources_plane = drmModeGetPlaneResources(kms_fd);
-	if (!resources_plane) {
-		fprintf(stderr, "%s: Failed to get KMS plane resources\n",
+	return demp_input_queue_fds(demp, index, NULL);
+}
+
+/*
+ * Queue someone else's dmabufs, one fd per plane, as input index. The
+ * demp has them until this index gets dequeued again.
+ */
+int
+demp_input_import_queue(struct demp *demp, int index, const int *fds)
+{
+	if (!demp->input_import) {
+		fprintf(stderr, "Error: %s(): our inputs are mmapped.\n",
 			__func__);
-		goto error;
+		return -EINVAL;
 	}
 
-	/* now cycle through the planes to find one for our crtc */
-	for (i = 0; i < (int) resources_plane->count_planes; i++) {
-		drmModePlane *plane;
-		uint32_t plane_id = resources_plane->planes[i];
-		int j;
+	return demp_input_queue_fds(demp, index, fds);
+}
 
-		plane = drmModeGetPlane(kms_fd, plane_id);
-		if (!plane) {
-			fprintf(stderr, "%s: failed to get Plane %u: %s\n",
-				__func__, plane_id, strerror(errno));
-			goto error;
-		}
+int
+demp_input_dequeue(struct demp *demp)
+{
+	return demp_buffer_dequeue(demp, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+				   demp->inputs, demp->input_import);
+}
 
-		if (!(plane->possible_crtcs & (1 << crtc_index)))
-			goto plane_next;
+int
+demp_output_queue(struct demp *demp, int index)
+{
+	return demp_buffer_queue(demp, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+				 &demp->outputs[index], NULL);
+}
 
-		for (j = 0; j < (int) plane->count_formats; j++)
-			if (plane->formats[j] == DRM_FORMAT_NV12)
-				break;
+static void
+demp_statistics_print(struct demp *demp, uint64_t now)
+{
+	uint64_t elapsed = now - demp->statistics_start;
+	uint64_t rate = 0, average = 0;
+
+	if (elapsed)
+		rate = demp->frames * 1000000000000ULL / elapsed;
+	if (demp->frames)
+		average = demp->latency_total / demp->frames;
+
+	log_info("Demp: %d frames at %"PRIu64".%03"PRIu64"fps, latency "
+		 "%"PRIu64"us (min %"PRIu64"us, max %"PRIu64"us).\n",
+		 demp->frames, rate / 1000, rate % 1000, average / 1000,
+		 demp->latency_min / 1000, demp->latency_max / 1000);
+
+	demp->statistics_start = now;
+	demp->frames = 0;
+	demp->latency_total = 0;
+	demp->latency_min = 0;
+	demp->latency_max = 0;
+}
+
+int
+demp_output_dequeue(struct demp *demp)
+{
+	uint64_t now, latency;
+	int index;
 
-		if (j == (int) plane->count_formats)
-			goto plane_next;
+	index = demp_buffer_dequeue(demp, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+				    demp->outputs, false);
+	if (index < 0)
+		return index;
 
-		printf("NV12 Plane: ");
-		kms_plane = kms_plane_create(plane->plane_id);
-		if (!kms_plane)
-			goto plane_error;
+	now = thread_time_get();
 
-		break;
+	if (demp->queued_tail != demp->queued_head) {
+		latency = now - demp->queued_times[demp->queued_tail];
+		demp->queued_tail =
+			(demp->queued_tail + 1) % DEMP_QUEUED_MAX;
 
-	plane_next:
-		drmModeFreePlane(plane);
-		continue;
-	plane_error:
-		drmModeFreePlane(plane);
-		break;
+		demp->latency_total += latency;
+		if (!demp->latency_min || (latency < demp->latency_min))
+			demp->latency_min = latency;
+		if (latency > demp->latency_max)
+			demp->latency_max = latency;
 	}
 
- error:
-	drmModeFreePlaneResources(resources_plane);
-	return kms_plane;
+	demp->frames++;
+	if (demp->frames == DEMP_STATISTICS_COUNT)
+		demp_statistics_print(demp, now);
+
+	return index;
 }
 
-static int
-demp_v4l2_buffers_export(void)
+/*
+ * Export the planes of an output buffer as dmabufs, so that they can be
+ * imported into kms.
+ */
+int
+demp_output_export(struct demp *demp, int index)
 {
+	struct demp_buffer *buffer = &demp->outputs[index];
 	struct v4l2_exportbuffer export[1] = {{
-		.index = 0, /* single buffer anyway */
+		.index = index,
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
 		.flags = O_RDONLY,
 	}};
 	int i, ret;
 
-	for (i = 0; i < demp_buffer->output_count; i++) {
+	for (i = 0; i < buffer->plane_count; i++) {
+		if (buffer->planes[i].export_fd >= 0)
+			continue;
+
+		/* those were exported from kms when they were created */
+		if (demp->software) {
+			fprintf(stderr, "Error: %s: no kms buffers to export."
+				"\n", __func__);
+			return -ENODEV;
+		}
+
 		export->plane = i;
 
-		ret = ioctl(demp_fd, VIDIOC_EXPBUF, export);
+		ret = ioctl(demp->fd, VIDIOC_EXPBUF, export);
 		if (ret) {
-			fprintf(stderr, "Error: %s: ioctl(EXPBUF(%d)): %s\n",
-				__func__, i, strerror(errno));
-			return ret;
+			fprintf(stderr, "Error: %s: ioctl(EXPBUF(%d, %d)): "
+				"%s\n", __func__, index, i, strerror(errno));
+			return -errno;
 		}
 
-		demp_buffer->outputs[i].export_fd = export->fd;
-
-		printf("Exported output buffer %d to %d.\n", i, export->fd);
+		buffer->planes[i].export_fd = export->fd;
 	}
 
 	return 0;
 }
 
-static int
-demp_kms_buffer_import(uint32_t *fb_id)
+int
+demp_streaming_start(struct demp *demp)
 {
-	uint32_t handles[4] = { 0 };
-	uint32_t pitches[4] = { 0 };
-	uint32_t offsets[4] = { 0 };
-	int ret, i;
-
-	for (i = 0; i < demp_buffer->output_count; i++) {
-		struct drm_prime_handle prime[1] = {{
-				.fd = demp_buffer->outputs[i].export_fd,
-			}};
+	int type_input = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	int type_output = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	int ret;
 
-		ret = drmIoctl(kms_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, prime);
-		if (ret) {
-			fprintf(stderr, "%s: drmIoctl(PRIME_FD_TO_HANDLE, %d) "
-				"failed: %s\n", __func__,
-				demp_buffer->outputs[i].export_fd,
-				strerror(errno));
+	if (demp->software) {
+		ret = demp_software_streaming_start(demp);
+		if (ret)
 			return ret;
+	} else {
+		ret = ioctl(demp->fd, VIDIOC_STREAMON, &type_input);
+		if (ret) {
+			fprintf(stderr, "Error: %s(): ioctl(STREAMON(input)):"
+				" %s\n", __func__, strerror(errno));
+			return -errno;
 		}
 
-		demp_buffer->outputs[i].prime_handle = prime->handle;
-		handles[i] = prime->handle;
-		pitches[i] = demp_buffer->width;
-	}
-
-	printf("%s(): prime handles: %02X, %02X, %02X\n",
-	       __func__, demp_buffer->outputs[0].prime_handle,
-	       demp_buffer->outputs[1].prime_handle,
-	       demp_buffer->outputs[2].prime_handle);
-
-	ret = drmModeAddFB2(kms_fd, demp_buffer->width, demp_buffer->height,
-			    DRM_FORMAT_NV12, handles, pitches, offsets,
-			    fb_id, 0);
-	if (ret) {
-		fprintf(stderr, "%s(): failed to create fb: %s\n",
-			__func__, strerror(errno));
-		return -errno;
+		ret = ioctl(demp->fd, VIDIOC_STREAMON, &type_output);
+		if (ret) {
+			fprintf(stderr, "Error: %s(): ioctl(STREAMON(output)):"
+				" %s\n", __func__, strerror(errno));
+			ioctl(demp->fd, VIDIOC_STREAMOFF, &type_input);
+			return -errno;
+		}
 	}
 
-	printf("%s(): FB %02u.\n", __func__, *fb_id);
+	demp->streaming = true;
+	demp->statistics_start = thread_time_get();
 
 	return 0;
 }
 
-static int
-demp_kms_fb_show(uint32_t crtc_id, struct kms_plane *plane, uint32_t fb_id)
+/*
+ * This also returns all buffers to us, without them being dequeued.
+ */
+int
+demp_streaming_stop(struct demp *demp)
 {
-	drmModeAtomicReqPtr request;
-	int ret;
+	int type_input = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	int type_output = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	int ret, i;
 
-	request = drmModeAtomicAlloc();
-
-	drmModeAtomicAddProperty(request, plane->plane_id,
-				 plane->property_crtc_id, crtc_id);
-
-	/* Full crtc size */
-	drmModeAtomicAddProperty(request, plane->plane_id,
-				 plane->property_crtc_x, 0);
-	drmModeAtomicAddProperty(request, plane->plane_id,
-				 plane->property_crtc_y, 0);
-	drmModeAtomicAddProperty(request, plane->plane_id,
-				 plane->property_crtc_w,
-				 demp_buffer->width);
-	drmModeAtomicAddProperty(request, plane->plane_id,
-				 plane->property_crtc_h,
-				 demp_buffer->height);
-
-	/* read in full size image */
-	drmModeAtomicAddProperty(request, plane->plane_id,
-				 plane->property_src_x, 0);
-	drmModeAtomicAddProperty(request, plane->plane_id,
-				 plane->property_src_y, 0);
-	drmModeAtomicAddProperty(request, plane->plane_id,
-				 plane->property_src_w,
-				 demp_buffer->width << 16);
-	drmModeAtomicAddProperty(request, plane->plane_id,
-				 plane->property_src_h,
-				 demp_buffer->height << 16);
-
-	plane->active = true;
-
-	/* actual flip. */
-	drmModeAtomicAddProperty(request, plane->plane_id,
-				 plane->property_fb_id, fb_id);
-
-	ret = drmModeAtomicCommit(kms_fd, request,
-				  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
-
-	drmModeAtomicFree(request);
+	if (!demp->streaming)
+		return 0;
 
-	if (ret) {
-		fprintf(stderr, "Error: %s(): drmModeAtomicCommit(): %s\n",
-			__func__, strerror(errno));
-		return errno;
+	if (demp->software) {
+		demp_software_streaming_stop(demp);
+	} else {
+		ret = ioctl(demp->fd, VIDIOC_STREAMOFF, &type_input);
+		if (ret) {
+			fprintf(stderr, "Error: %s(): ioctl(STREAMOFF(input)):"
+				" %s\n", __func__, strerror(errno));
+			return -errno;
+		}
+
+		ret = ioctl(demp->fd, VIDIOC_STREAMOFF, &type_output);
+		if (ret) {
+			fprintf(stderr, "Error: %s(): ioctl(STREAMOFF(output)):"
+				" %s\n", __func__, strerror(errno));
+			return -errno;
+		}
 	}
 
+	for (i = 0; i < demp->input_count; i++)
+		demp->inputs[i].queued = false;
+	for (i = 0; i < demp->output_count; i++)
+		demp->outputs[i].queued = false;
+
+	demp->queued_tail = demp->queued_head;
+	demp->streaming = false;
+
 	return 0;
 }
 
-static int
-demp_kms_show(void)
+/*
+ * Returns POLLOUT when inputs can be dequeued, POLLIN when outputs can,
+ * 0 on timeout (in ms), or a negative error.
+ */
+int
+demp_poll(struct demp *demp, int timeout)
 {
-	struct kms_plane *plane;
-	bool connected, mode_ok;
-	uint32_t connector_id, encoder_id, crtc_id, fb_id;
-	int crtc_width, crtc_height, crtc_index;
+	struct pollfd pollfd[1] = {{
+		.fd = demp->fd,
+		.events = demp->poll_events,
+	}};
 	int ret;
 
-	ret = kms_init();
-	if (ret)
-		return ret;
-
-	ret = kms_connector_id_get(DRM_MODE_CONNECTOR_HDMIA, &connector_id);
-	if (ret)
-		return ret;
+	ret = poll(pollfd, 1, timeout);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
 
-	ret = kms_connection_check(connector_id, &connected, &encoder_id);
-	if (ret)
-		return ret;
+		log_error("%s(): poll(): %s\n", __func__,
+			  strerror(errno));
+		return -errno;
+	}
 
-	ret = kms_crtc_id_get(encoder_id, &crtc_id,
-			      &mode_ok, &crtc_width, &crtc_height);
-	if (ret)
-		return ret;
+	if (!ret)
+		return 0;
 
-	printf("Using CRTC %X (%dx%d), connector %X (%s).\n",
-	       crtc_id, crtc_width, crtc_height, connector_id,
-	       kms_connector_string(DRM_MODE_CONNECTOR_HDMIA));
+	if (pollfd->revents & POLLERR) {
+		log_error("%s(): poll() error.\n", __func__);
+		return -EIO;
+	}
 
-	ret = kms_crtc_index_get(crtc_id);
-	if (ret < 0)
-		return ret;
+	/* the cpu hands back input and output of a frame together */
+	if (demp->software && (pollfd->revents & POLLIN))
+		return POLLIN | POLLOUT;
 
-	crtc_index = ret;
+	return pollfd->revents & (POLLIN | POLLOUT);
+}
 
-	plane = demp_kms_plane_get(crtc_index);
-	if (!plane)
-		return -1;
+static void
+demp_buffers_destroy(struct demp_buffer *buffers, int count)
+{
+	int i, j;
 
-	ret = demp_v4l2_buffers_export();
-	if (ret)
-		return ret;
+	for (i = 0; i < count; i++) {
+		struct demp_buffer *buffer = &buffers[i];
 
-	ret = demp_kms_buffer_import(&fb_id);
-	if (ret)
-		return ret;
+		for (j = 0; j < buffer->plane_count; j++) {
+			if (buffer->planes[j].map)
+				munmap(buffer->planes[j].map,
+				       buffer->planes[j].size);
+			if (buffer->planes[j].export_fd >= 0)
+				close(buffer->planes[j].export_fd);
+		}
+	}
+}
 
-	ret = demp_kms_fb_show(crtc_id, plane, fb_id);
-	if (ret)
-		return ret;
+/*
+ * Whoever imported our outputs needs to have let go of them already.
+ */
+void
+demp_destroy(struct demp *demp)
+{
+	if (demp->software) {
+		demp_streaming_stop(demp);
+		demp_software_destroy(demp);
+	} else if (demp->fd > 0) {
+		demp_streaming_stop(demp);
 
-	printf("Displaying converted NV12 buffer.\n");
+		demp_buffers_destroy(demp->inputs, demp->input_count);
+		demp_buffers_destroy(demp->outputs, demp->output_count);
 
-	sleep(600);
+		/* closing the device also frees the v4l2 buffers. */
+		close(demp->fd);
+	}
 
-	return 0;
+	free(demp);
 }
 
-int main(int argc, char *argv[])
+/*
+ * With software set, the conversion happens on the cpu, for when there is
+ * no demp, or to check the demp against.
+ */
+struct demp *
+demp_create(int width, int height, int input_count, int output_count,
+	    bool input_import, bool software)
 {
-	int ret;
+	struct demp *demp;
+	int ret, i, j;
 
-	if (argc < 2) {
-		fprintf(stderr, "Error: missing .png argument.\n");
-		return EX_USAGE;
+	if ((input_count < 1) || (input_count > DEMP_BUFFER_COUNT_MAX) ||
+	    (output_count < 1) || (output_count > DEMP_BUFFER_COUNT_MAX)) {
+		fprintf(stderr, "Error: %s(): invalid buffer count %d/%d.\n",
+			__func__, input_count, output_count);
+		return NULL;
 	}
 
-	demp_fd = demp_device_find();
-	if (demp_fd < 0)
-		return -demp_fd;
+	demp = calloc(1, sizeof(struct demp));
+	if (!demp)
+		return NULL;
 
-	ret = demp_png_load(argv[1]);
-	if (ret) {
-		fprintf(stderr, "Error: demp_png_load(): %s\n",
-			strerror(ret));
-		return ret;
-	}
+	demp->width = width;
+	demp->height = height;
+	demp->input_import = input_import;
 
-	ret = demp_input_create();
-	if (ret) {
-		fprintf(stderr, "Error: demp_input_create(): %s\n",
-			strerror(ret));
-		return ret;
-	}
+	for (i = 0; i < DEMP_BUFFER_COUNT_MAX; i++)
+		for (j = 0; j < 3; j++) {
+			demp->inputs[i].planes[j].export_fd = -1;
+			demp->outputs[i].planes[j].export_fd = -1;
+		}
 
-	ret = demp_output_create();
-	if (ret) {
-		fprintf(stderr, "Error: demp_output_create(): %s\n",
-			strerror(ret));
-		return ret;
-	}
+	if (software) {
+		demp->input_count = input_count;
+		demp->output_count = output_count;
 
-	demp_input_load();
+		ret = demp_software_create(demp);
+		if (ret)
+			goto error;
 
-	ret = demp_streaming_start();
-	if (ret) {
-		fprintf(stderr, "Error: demp_streaming_start(): %s\n",
-			strerror(ret));
-		return ret;
+		printf("Demp: %dx%d on the cpu, %d input and %d output "
+		       "buffers.\n", width, height, demp->input_count,
+		       demp->output_count);
+		return demp;
 	}
 
-	ret = demp_buffers_dequeue();
-	if (ret) {
-		fprintf(stderr, "Error: demp_buffers_dequeue(): %s\n",
-			strerror(ret));
-		return ret;
-	}
+	demp->fd = demp_device_find();
+	if (demp->fd < 0)
+		goto error;
+	demp->poll_events = POLLIN | POLLOUT;
 
-	ret = demp_kms_show();
-	if (ret) {
-		fprintf(stderr, "Error: demp_kms_show(): %s\n",
-			strerror(ret));
-		return ret;
-	}
+	demp->input_count = input_count;
+	ret = demp_buffers_create(demp, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+				  V4L2_PIX_FMT_R8_G8_B8, demp->inputs,
+				  &demp->input_count, input_import);
+	if (ret)
+		goto error;
 
-	return 0;
+	demp->output_count = output_count;
+	ret = demp_buffers_create(demp, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+				  V4L2_PIX_FMT_NV12, demp->outputs,
+				  &demp->output_count, false);
+	if (ret)
+		goto error;
+
+	printf("Demp: %dx%d, %d input and %d output buffers.\n", width,
+	       height, demp->input_count, demp->output_count);
+
+	return demp;
+
+ error:
+	demp_destroy(demp);
+	return NULL;
 }
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2019-2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_DEMP_H_
+#define _HAVE_DEMP_H_ 1
+
+#define DEMP_BUFFER_COUNT_MAX 8
+/*
+ * inputs in flight, plus outputs not yet dequeued, plus one: these rings
+ * tell empty from full by head == tail, so one slot always stays free.
+ */
+#define DEMP_QUEUED_MAX (2 * DEMP_BUFFER_COUNT_MAX + 1)
+
+struct demp_buffer {
+	int index;
+	bool queued;
+
+	int plane_count;
+	struct demp_plane {
+		uint8_t *map;
+		size_t size;
+		int pitch;
+		int export_fd;
+		uint32_t prime_handle;
+	} planes[3];
+};
+
+struct demp_software;
+
+struct demp {
+	int fd;
+	/* what to poll fd for */
+	short poll_events;
+
+	/* converting on the cpu, see demp_software.c */
+	struct demp_software *software;
+
+	int width;
+	int height;
+
+	/* v4l2 m2m speak: we output to the input, and capture the output */
+	struct demp_buffer inputs[DEMP_BUFFER_COUNT_MAX];
+	int input_count;
+	/* inputs are dmabufs from elsewhere, instead of our own mmaps */
+	bool input_import;
+	struct demp_buffer outputs[DEMP_BUFFER_COUNT_MAX];
+	int output_count;
+
+	bool streaming;
+
+	/*
+	 * The demp works through its input in order, so we only need to
+	 * remember when each input was queued, to know how long it took
+	 * to come out again.
+	 */
+	uint64_t queued_times[DEMP_QUEUED_MAX];
+	int queued_head;
+	int queued_tail;
+
+	/* statistics, reset every DEMP_STATISTICS_COUNT frames */
+	uint64_t statistics_start;
+	int frames;
+	uint64_t latency_total;
+	uint64_t latency_min;
+	uint64_t latency_max;
+};
+
+struct demp *demp_create(int width, int height, int input_count,
+			 int output_count, bool input_import, bool software);
+void demp_destroy(struct demp *demp);
+
+int demp_input_queue(struct demp *demp, int index);
+int demp_input_import_queue(struct demp *demp, int index, const int *fds);
+int demp_input_dequeue(struct demp *demp);
+int demp_output_queue(struct demp *demp, int index);
+int demp_output_dequeue(struct demp *demp);
+int demp_output_export(struct demp *demp, int index);
+
+int demp_streaming_start(struct demp *demp);
+int demp_streaming_stop(struct demp *demp);
+int demp_poll(struct demp *demp, int timeout);
+
+/* demp_software.c, only for use by demp.c */
+int demp_software_create(struct demp *demp);
+void demp_software_destroy(struct demp *demp);
+int demp_software_queue(struct demp *demp, bool input, int index,
+			const int *fds);
+int demp_software_dequeue(struct demp *demp, bool input);
+int demp_software_streaming_start(struct demp *demp);
+void demp_software_streaming_stop(struct demp *demp);
+
+#endif /* _HAVE_DEMP_H_ */
@@ -0,0 +1,601 @@
+/*
+ * Copyright (c) 2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The demp, on the cpu: planar R8_G8_B8 in, NV12 out, through convert.c.
+ *
+ * This keeps the streaming model of the m2m device: inputs and outputs
+ * get queued, a frame gets converted as soon as there is one of each, and
+ * both come back out in order. A thread per core takes bands of each
+ * frame, so that all cores help out. Our outputs are dmabufs from kms, so
+ * they can be imported and shown just like those of the real demp.
+ *
+ * Our fd is an eventfd, which becomes readable when a frame is done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <linux/dma-buf.h>
+
+#include "juggler.h"
+#include "demp.h"
+#include "kms.h"
+#include "convert.h"
+#include "log.h"
+#include "thread.h"
+
+#define DEMP_SOFTWARE_THREADS_MAX 4
+/* more bands than threads, so that nobody waits long for the last one */
+#define DEMP_SOFTWARE_BANDS_PER_THREAD 2
+
+struct demp_software_fifo {
+	int indices[DEMP_BUFFER_COUNT_MAX];
+	int head;
+	int count;
+};
+
+struct demp_software {
+	pthread_mutex_t mutex[1];
+	pthread_cond_t cond[1];
+
+	pthread_t threads[DEMP_SOFTWARE_THREADS_MAX];
+	int thread_count;
+	bool quit;
+	bool streaming;
+
+	struct demp_software_fifo inputs_queued[1];
+	struct demp_software_fifo outputs_queued[1];
+	struct demp_software_fifo inputs_done[1];
+	struct demp_software_fifo outputs_done[1];
+
+	/* the frame which is being converted right now */
+	bool busy;
+	int input;
+	int output;
+	int band_height;
+	int band_count;
+	int band_next;
+	int bands_done;
+
+	/* imported inputs, which we need to sync */
+	int input_fds[DEMP_BUFFER_COUNT_MAX][3];
+
+	struct kms_buffer *dmabufs[DEMP_BUFFER_COUNT_MAX][2];
+};
+
+static void
+demp_software_fifo_push(struct demp_software_fifo *fifo, int index)
+{
+	int tail = (fifo->head + fifo->count) % DEMP_BUFFER_COUNT_MAX;
+
+	fifo->indices[tail] = index;
+	fifo->count++;
+}
+
+static int
+demp_software_fifo_pop(struct demp_software_fifo *fifo)
+{
+	int index;
+
+	if (!fifo->count)
+		return -EAGAIN;
+
+	index = fifo->indices[fifo->head];
+	fifo->head = (fifo->head + 1) % DEMP_BUFFER_COUNT_MAX;
+	fifo->count--;
+
+	return index;
+}
+
+static void
+demp_software_sync(int fd, uint64_t flags)
+{
+	struct dma_buf_sync sync[1] = {{
+			.flags = flags,
+		}};
+	int ret;
+
+	if (fd < 0)
+		return;
+
+	ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, sync);
+	if (ret)
+		log_ratelimited(LOG_ERROR, "%s(%d): ioctl(DMA_BUF_IOCTL_SYNC):"
+				" %s\n", __func__, fd, strerror(errno));
+}
+
+static void
+demp_software_band_convert(struct demp *demp, int band)
+{
+	struct demp_software *software = demp->software;
+	struct demp_buffer *input = &demp->inputs[software->input];
+	struct demp_buffer *output = &demp->outputs[software->output];
+	struct convert_image in[1] = {{ 0 }}, out[1] = {{ 0 }};
+	int y = band * software->band_height;
+	int height = software->band_height;
+	int ret, i;
+
+	if ((y + height) > demp->height)
+		height = demp->height - y;
+
+	in->width = demp->width;
+	in->height = height;
+	for (i = 0; i < 3; i++) {
+		in->planes[i] = input->planes[i].map +
+			y * input->planes[i].pitch;
+		in->pitches[i] = input->planes[i].pitch;
+	}
+
+	out->width = demp->width;
+	out->height = height;
+	out->planes[0] = output->planes[0].map + y * output->planes[0].pitch;
+	out->pitches[0] = output->planes[0].pitch;
+	out->planes[1] = output->planes[1].map +
+		(y / 2) * output->planes[1].pitch;
+	out->pitches[1] = output->planes[1].pitch;
+
+	ret = convert_planar_to_nv12(in, out, CONVERT_BT601,
+				     CONVERT_RANGE_LIMITED);
+	if (ret)
+		log_ratelimited(LOG_ERROR, "%s(%d): conversion failed: %s\n",
+				__func__, band, strerror(-ret));
+}
+
+/*
+ * Called with the mutex held.
+ */
+static void
+demp_software_frame_start(struct demp *demp)
+{
+	struct demp_software *software = demp->software;
+	int i;
+
+	if (!software->streaming || !software->inputs_queued->count ||
+	    !software->outputs_queued->count)
+		return;
+
+	software->input = demp_software_fifo_pop(software->inputs_queued);
+	software->output = demp_software_fifo_pop(software->outputs_queued);
+	software->band_next = 0;
+	software->bands_done = 0;
+	software->busy = true;
+
+	for (i = 0; i < 2; i++)
+		demp_software_sync(
+			demp->outputs[software->output].planes[i].export_fd,
+			DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+
+	/* there is work for everyone now */
+	pthread_cond_broadcast(software->cond);
+}
+
+/*
+ * Called with the mutex held.
+ */
+static void
+demp_software_frame_finish(struct demp *demp)
+{
+	struct demp_software *software = demp->software;
+	uint64_t one = 1;
+	int i;
+
+	for (i = 0; i < 2; i++)
+		demp_software_sync(
+			demp->outputs[software->output].planes[i].export_fd,
+			DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+
+	demp_software_fifo_push(software->inputs_done, software->input);
+	demp_software_fifo_push(software->outputs_done, software->output);
+	software->busy = false;
+
+	if (write(demp->fd, &one, sizeof(one)) != sizeof(one))
+		log_error("%s(): write(): %s\n", __func__, strerror(errno));
+
+	/* for streaming_stop() */
+	pthread_cond_broadcast(software->cond);
+}
+
+static void *
+demp_software_thread(void *arg)
+{
+	struct demp *demp = arg;
+	struct demp_software *software = demp->software;
+	int band;
+
+	pthread_mutex_lock(software->mutex);
+
+	while (!software->quit) {
+		if (!software->busy)
+			demp_software_frame_start(demp);
+
+		if (!software->busy ||
+		    (software->band_next == software->band_count)) {
+			pthread_cond_wait(software->cond, software->mutex);
+			continue;
+		}
+
+		band = software->band_next;
+		software->band_next++;
+
+		pthread_mutex_unlock(software->mutex);
+
+		demp_software_band_convert(demp, band);
+
+		pthread_mutex_lock(software->mutex);
+
+		software->bands_done++;
+		if (software->bands_done == software->band_count)
+			demp_software_frame_finish(demp);
+	}
+
+	pthread_mutex_unlock(software->mutex);
+
+	return NULL;
+}
+
+static void
+demp_software_input_unmap(struct demp *demp, int index)
+{
+	struct demp_buffer *buffer = &demp->inputs[index];
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (!buffer->planes[i].map)
+			continue;
+
+		demp_software_sync(demp->software->input_fds[index][i],
+				   DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+		munmap(buffer->planes[i].map, buffer->planes[i].size);
+		buffer->planes[i].map = NULL;
+	}
+}
+
+static int
+demp_software_input_map(struct demp *demp, int index, const int *fds)
+{
+	struct demp_buffer *buffer = &demp->inputs[index];
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		void *map = mmap(NULL, buffer->planes[i].size, PROT_READ,
+				 MAP_SHARED, fds[i], 0);
+
+		if (map == MAP_FAILED) {
+			log_error("%s(%d, %d): mmap(): %s\n", __func__, index,
+				  i, strerror(errno));
+			demp_software_input_unmap(demp, index);
+			return -errno;
+		}
+
+		buffer->planes[i].map = map;
+		demp->software->input_fds[index][i] = fds[i];
+		demp_software_sync(fds[i],
+				   DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+	}
+
+	return 0;
+}
+
+int
+demp_software_queue(struct demp *demp, bool input, int index,
+		    const int *fds)
+{
+	struct demp_software *software = demp->software;
+	int ret;
+
+	if (input && fds) {
+		ret = demp_software_input_map(demp, index, fds);
+		if (ret)
+			return ret;
+	}
+
+	pthread_mutex_lock(software->mutex);
+	if (input)
+		demp_software_fifo_push(software->inputs_queued, index);
+	else
+		demp_software_fifo_push(software->outputs_queued, index);
+	pthread_cond_signal(software->cond);
+	pthread_mutex_unlock(software->mutex);
+
+	return 0;
+}
+
+/*
+ * Called with the mutex held. Once everything that was done has been
+ * picked up, our fd should no longer poll as readable.
+ */
+static void
+demp_software_event_clear(struct demp *demp)
+{
+	struct demp_software *software = demp->software;
+	uint64_t count;
+
+	if (software->inputs_done->count || software->outputs_done->count)
+		return;
+
+	if ((read(demp->fd, &count, sizeof(count)) < 0) && (errno != EAGAIN))
+		log_error("%s(): read(): %s\n", __func__, strerror(errno));
+}
+
+/*
+ * Returns the index of the dequeued buffer, or -EAGAIN when there is
+ * nothing to dequeue.
+ */
+int
+demp_software_dequeue(struct demp *demp, bool input)
+{
+	struct demp_software *software = demp->software;
+	int index;
+
+	pthread_mutex_lock(software->mutex);
+	if (input)
+		index = demp_software_fifo_pop(software->inputs_done);
+	else
+		index = demp_software_fifo_pop(software->outputs_done);
+	demp_software_event_clear(demp);
+	pthread_mutex_unlock(software->mutex);
+
+	if ((index >= 0) && input && demp->input_import)
+		demp_software_input_unmap(demp, index);
+
+	return index;
+}
+
+int
+demp_software_streaming_start(struct demp *demp)
+{
+	struct demp_software *software = demp->software;
+
+	pthread_mutex_lock(software->mutex);
+	software->streaming = true;
+	pthread_cond_broadcast(software->cond);
+	pthread_mutex_unlock(software->mutex);
+
+	return 0;
+}
+
+/*
+ * Like STREAMOFF, this finishes the current frame and then hands all
+ * buffers back, without them being dequeued.
+ */
+void
+demp_software_streaming_stop(struct demp *demp)
+{
+	struct demp_software *software = demp->software;
+	int i;
+
+	pthread_mutex_lock(software->mutex);
+
+	software->streaming = false;
+	while (software->busy)
+		pthread_cond_wait(software->cond, software->mutex);
+
+	memset(software->inputs_queued, 0, sizeof(struct demp_software_fifo));
+	memset(software->outputs_queued, 0,
+	       sizeof(struct demp_software_fifo));
+	memset(software->inputs_done, 0, sizeof(struct demp_software_fifo));
+	memset(software->outputs_done, 0, sizeof(struct demp_software_fifo));
+	demp_software_event_clear(demp);
+
+	pthread_mutex_unlock(software->mutex);
+
+	if (demp->input_import)
+		for (i = 0; i < demp->input_count; i++)
+			demp_software_input_unmap(demp, i);
+}
+
+static int
+demp_software_buffers_create(struct demp *demp)
+{
+	struct demp_software *software = demp->software;
+	int i, j;
+
+	for (i = 0; i < demp->input_count; i++) {
+		struct demp_buffer *buffer = &demp->inputs[i];
+
+		buffer->index = i;
+		buffer->plane_count = 3;
+
+		for (j = 0; j < 3; j++) {
+			buffer->planes[j].pitch = demp->width;
+			buffer->planes[j].size = demp->width * demp->height;
+			software->input_fds[i][j] = -1;
+
+			/* imports get mapped when they get queued */
+			if (demp->input_import)
+				continue;
+
+			buffer->planes[j].map = calloc(1,
+						       buffer->planes[j].size);
+			if (!buffer->planes[j].map)
+				return -ENOMEM;
+		}
+	}
+
+	for (i = 0; i < demp->output_count; i++) {
+		struct demp_buffer *buffer = &demp->outputs[i];
+
+		buffer->index = i;
+		buffer->plane_count = 2;
+
+		for (j = 0; j < 2; j++) {
+			struct demp_plane *plane = &buffer->planes[j];
+			int height = j ? (demp->height / 2) : demp->height;
+			struct kms_buffer *dmabuf;
+
+			/* without kms, we can still benchmark. */
+			if (kms_fd < 0) {
+				plane->pitch = demp->width;
+				plane->size = demp->width * height;
+				plane->map = calloc(1, plane->size);
+				if (!plane->map)
+					return -ENOMEM;
+				continue;
+			}
+
+			dmabuf = kms_buffer_dmabuf_get(demp->width, height, 8);
+			if (!dmabuf)
+				return -ENOMEM;
+
+			software->dmabufs[i][j] = dmabuf;
+			plane->map = dmabuf->map;
+			plane->pitch = dmabuf->pitch;
+			plane->size = dmabuf->pitch * height;
+			plane->export_fd = dmabuf->export_fd;
+		}
+	}
+
+	return 0;
+}
+
+static void
+demp_software_buffers_destroy(struct demp *demp)
+{
+	struct demp_software *software = demp->software;
+	int i, j;
+
+	for (i = 0; i < demp->input_count; i++) {
+		if (demp->input_import) {
+			demp_software_input_unmap(demp, i);
+			continue;
+		}
+
+		for (j = 0; j < 3; j++)
+			free(demp->inputs[i].planes[j].map);
+	}
+
+	for (i = 0; i < demp->output_count; i++)
+		for (j = 0; j < 2; j++) {
+			if (software->dmabufs[i][j])
+				kms_buffer_dmabuf_put(software->dmabufs[i][j]);
+			else
+				free(demp->outputs[i].planes[j].map);
+
+			demp->outputs[i].planes[j].map = NULL;
+			demp->outputs[i].planes[j].export_fd = -1;
+		}
+}
+
+void
+demp_software_destroy(struct demp *demp)
+{
+	struct demp_software *software = demp->software;
+	int i;
+
+	if (!software)
+		return;
+
+	pthread_mutex_lock(software->mutex);
+	software->quit = true;
+	pthread_cond_broadcast(software->cond);
+	pthread_mutex_unlock(software->mutex);
+
+	for (i = 0; i < software->thread_count; i++)
+		pthread_join(software->threads[i], NULL);
+
+	demp_software_buffers_destroy(demp);
+
+	if (demp->fd >= 0)
+		close(demp->fd);
+	demp->fd = -1;
+
+	pthread_cond_destroy(software->cond);
+	pthread_mutex_destroy(software->mutex);
+
+	free(software);
+	demp->software = NULL;
+}
+
+int
+demp_software_create(struct demp *demp)
+{
+	struct demp_software *software;
+	int bands, ret, i;
+	long cpus;
+
+	if ((demp->width & 1) || (demp->height & 1)) {
+		fprintf(stderr, "Error: %s(): NV12 needs an even size, not "
+			"%dx%d.\n", __func__, demp->width, demp->height);
+		return -EINVAL;
+	}
+
+	software = calloc(1, sizeof(struct demp_software));
+	if (!software)
+		return -ENOMEM;
+
+	pthread_mutex_init(software->mutex, NULL);
+	pthread_cond_init(software->cond, NULL);
+
+	demp->fd = -1;
+	demp->software = software;
+
+	demp->fd = eventfd(0, EFD_NONBLOCK);
+	if (demp->fd < 0) {
+		fprintf(stderr, "Error: %s(): eventfd(): %s\n", __func__,
+			strerror(errno));
+		return -errno;
+	}
+	demp->poll_events = POLLIN;
+
+	ret = demp_software_buffers_create(demp);
+	if (ret) {
+		fprintf(stderr, "Error: %s(): failed to create buffers: %s\n",
+			__func__, strerror(-ret));
+		return ret;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	else if (cpus > DEMP_SOFTWARE_THREADS_MAX)
+		cpus = DEMP_SOFTWARE_THREADS_MAX;
+
+	bands = cpus * DEMP_SOFTWARE_BANDS_PER_THREAD;
+	/* whole lines of chroma only */
+	software->band_height = ((demp->height + bands - 1) / bands + 1) & ~1;
+	software->band_count = (demp->height + software->band_height - 1) /
+		software->band_height;
+
+	for (i = 0; i < cpus; i++) {
+		ret = thread_create(&software->threads[i],
+				    THREAD_ROLE_CONVERT, demp_software_thread,
+				    demp);
+		if (ret) {
+			fprintf(stderr, "Error: %s(): thread creation failed: "
+				"%s\n", __func__, strerror(ret));
+			return -ret;
+		}
+		software->thread_count++;
+	}
+
+	printf("Demp: converting on %d cpus (%s), in %d bands of %d lines."
+	       "\n", software->thread_count, convert_simd_name(),
+	       software->band_count, software->band_height);
+
+	return 0;
+}
@@ -0,0 +1,609 @@
+/*
+ * Copyright (c) 2019-2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Feed a png through the demp, continuously, to see whether it keeps up,
+ * and then show the last converted NV12 frame.
+ *
+ * The same is then done on the cpu, through demp_software.c, and the
+ * output of both is compared. Without a demp, only the cpu gets timed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+#include <png.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "juggler.h"
+#include "kms.h"
+#include "demp.h"
+#include "thread.h"
+#include "convert.h"
+
+static struct png {
+	int width;
+	int height;
+
+	uint32_t *rgba;
+} png[1];
+
+static int
+demp_png_load(const char *filename)
+{
+	png_image image[1] = {{
+		.version = PNG_IMAGE_VERSION,
+	}};
+	int ret;
+
+	ret = png_image_begin_read_from_file(image, filename);
+	if (ret != 1) {
+		fprintf(stderr, "Error: %s():begin_read(): %s\n",
+			__func__, image->message);
+		return ret;
+	}
+
+	image->format = PNG_FORMAT_RGBA;
+
+	printf("Reading from %s: %dx%d (%dbytes)\n", filename,
+	       image->width, image->height, PNG_IMAGE_SIZE(*image));
+
+	png->width = image->width;
+	png->height = image->height;
+
+	png->rgba = calloc(png->width * png->height, sizeof(uint32_t));
+	if (!png->rgba) {
+		fprintf(stderr, "Error: %s(): calloc(): %s\n",
+			__func__, strerror(errno));
+		png_image_free(image);
+		return errno;
+	}
+
+	ret = png_image_finish_read(image, NULL, png->rgba, 0, NULL);
+	if (ret != 1) {
+		fprintf(stderr, "Error: %s():finish_read(): %s\n",
+			__func__, image->message);
+		free(png->rgba);
+		png_image_free(image);
+		return ret;
+	}
+
+	png_image_free(image);
+
+	return 0;
+}
+
+static int
+demp_input_load(struct demp_buffer *buffer)
+{
+	struct convert_image in[1] = {{
+		.width = png->width,
+		.height = png->height,
+		.planes[0] = (uint8_t *) png->rgba,
+		.pitches[0] = 4 * png->width,
+	}};
+	struct convert_image out[1] = {{
+		.width = png->width,
+		.height = png->height,
+	}};
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		out->planes[i] = buffer->planes[i].map;
+		out->pitches[i] = buffer->planes[i].pitch;
+	}
+
+	return convert_rgba_to_planar(in, out);
+}
+
+static struct kms_plane *
+demp_kms_plane_get(int crtc_index)
+{
+	drmModePlaneRes *resources_plane = NULL;
+	struct kms_plane *kms_plane = NULL;
+	int i;
+
+	/* Get plane resources so we can start sifting through the planes */
+	resources_plane = drmModeGetPlaneResources(kms_fd);
+	if (!resources_plane) {
+		fprintf(stderr, "%s: Failed to get KMS plane resources\n",
+			__func__);
+		goto error;
+	}
+
+	/* now cycle through the planes to find one for our crtc */
+	for (i = 0; i < (int) resources_plane->count_planes; i++) {
+		drmModePlane *plane;
+		uint32_t plane_id = resources_plane->planes[i];
+		int j;
+
+		plane = drmModeGetPlane(kms_fd, plane_id);
+		if (!plane) {
+			fprintf(stderr, "%s: failed to get Plane %u: %s\n",
+				__func__, plane_id, strerror(errno));
+			goto error;
+		}
+
+		if (!(plane->possible_crtcs & (1 << crtc_index)))
+			goto plane_next;
+
+		for (j = 0; j < (int) plane->count_formats; j++)
+			if (plane->formats[j] == DRM_FORMAT_NV12)
+				break;
+
+		if (j == (int) plane->count_formats)
+			goto plane_next;
+
+		printf("NV12 Plane: ");
+		kms_plane = kms_plane_create(plane->plane_id);
+		if (!kms_plane)
+			goto plane_error;
+
+		break;
+
+	plane_next:
+		drmModeFreePlane(plane);
+		continue;
+	plane_error:
+		drmModeFreePlane(plane);
+		break;
+	}
+
+ error:
+	drmModeFreePlaneResources(resources_plane);
+	return kms_plane;
+}
+
+
+static int
+demp_kms_buffer_import(struct demp *demp, struct demp_buffer *buffer,
+		       uint32_t *fb_id)
+{
+	uint32_t handles[4] = { 0 };
+	uint32_t pitches[4] = { 0 };
+	uint32_t offsets[4] = { 0 };
+	int ret, i;
+
+	for (i = 0; i < buffer->plane_count; i++) {
+		struct drm_prime_handle prime[1] = {{
+				.fd = buffer->planes[i].export_fd,
+			}};
+
+		ret = drmIoctl(kms_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, prime);
+		if (ret) {
+			fprintf(stderr, "%s: drmIoctl(PRIME_FD_TO_HANDLE, %d) "
+				"failed: %s\n", __func__,
+				buffer->planes[i].export_fd, strerror(errno));
+			return ret;
+		}
+
+		buffer->planes[i].prime_handle = prime->handle;
+		handles[i] = prime->handle;
+		pitches[i] = buffer->planes[i].pitch;
+	}
+
+	ret = drmModeAddFB2(kms_fd, demp->width, demp->height,
+			    DRM_FORMAT_NV12, handles, pitches, offsets,
+			    fb_id, 0);
+	if (ret) {
+		fprintf(stderr, "%s(): failed to create fb: %s\n",
+			__func__, strerror(errno));
+		return -errno;
+	}
+
+	printf("%s(): FB %02u.\n", __func__, *fb_id);
+
+	return 0;
+}
+
+static int
+demp_kms_fb_show(struct demp *demp, uint32_t crtc_id,
+		 struct kms_plane *plane, uint32_t fb_id)
+{
+	drmModeAtomicReqPtr request;
+	int ret;
+
+	request = drmModeAtomicAlloc();
+
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_crtc_id, crtc_id);
+
+	/* Full crtc size */
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_crtc_x, 0);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_crtc_y, 0);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_crtc_w, demp->width);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_crtc_h, demp->height);
+
+	/* read in full size image */
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_src_x, 0);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_src_y, 0);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_src_w, demp->width << 16);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_src_h, demp->height << 16);
+
+	plane->active = true;
+
+	/* actual flip. */
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_fb_id, fb_id);
+
+	ret = drmModeAtomicCommit(kms_fd, request,
+				  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+
+	drmModeAtomicFree(request);
+
+	if (ret) {
+		fprintf(stderr, "Error: %s(): drmModeAtomicCommit(): %s\n",
+			__func__, strerror(errno));
+		return errno;
+	}
+
+	return 0;
+}
+
+static int
+demp_kms_show(struct demp *demp, int index)
+{
+	struct kms_plane *plane;
+	bool connected, mode_ok;
+	uint32_t connector_id, encoder_id, crtc_id, fb_id;
+	int crtc_width, crtc_height, crtc_index;
+	int ret;
+
+	ret = kms_connector_id_get(DRM_MODE_CONNECTOR_HDMIA, &connector_id);
+	if (ret)
+		return ret;
+
+	ret = kms_connection_check(connector_id, &connected, &encoder_id);
+	if (ret)
+		return ret;
+
+	ret = kms_crtc_id_get(encoder_id, &crtc_id,
+			      &mode_ok, &crtc_width, &crtc_height);
+	if (ret)
+		return ret;
+
+	printf("Using CRTC %X (%dx%d), connector %X (%s).\n",
+	       crtc_id, crtc_width, crtc_height, connector_id,
+	       kms_connector_string(DRM_MODE_CONNECTOR_HDMIA));
+
+	ret = kms_crtc_index_get(crtc_id);
+	if (ret < 0)
+		return ret;
+
+	crtc_index = ret;
+
+	plane = demp_kms_plane_get(crtc_index);
+	if (!plane)
+		return -1;
+
+	ret = demp_output_export(demp, index);
+	if (ret)
+		return ret;
+
+	ret = demp_kms_buffer_import(demp, &demp->outputs[index], &fb_id);
+	if (ret)
+		return ret;
+
+	ret = demp_kms_fb_show(demp, crtc_id, plane, fb_id);
+	if (ret)
+		return ret;
+
+	printf("Displaying converted NV12 buffer.\n");
+
+	sleep(600);
+
+	return 0;
+}
+
+/*
+ * Keep all buffers in flight, and requeue them as soon as the demp is
+ * done with them. The input never changes, so this measures the demp and
+ * not how fast we are at filling buffers.
+ *
+ * Returns the index of the last output buffer, which is not requeued.
+ */
+static int
+demp_stream(struct demp *demp, int count)
+{
+	uint64_t start, elapsed, rate;
+	int queued = 0, done = 0, last = -1;
+	int ret, i;
+
+	for (i = 0; i < demp->output_count; i++) {
+		ret = demp_output_queue(demp, i);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; (i < demp->input_count) && (queued < count); i++) {
+		ret = demp_input_queue(demp, i);
+		if (ret)
+			return ret;
+		queued++;
+	}
+
+	ret = demp_streaming_start(demp);
+	if (ret)
+		return ret;
+
+	start = thread_time_get();
+
+	while (done < count) {
+		int index;
+
+		ret = demp_poll(demp, 1000);
+		if (ret < 0)
+			return ret;
+		if (!ret) {
+			fprintf(stderr, "Error: %s(): demp timed out after %d "
+				"frames.\n", __func__, done);
+			return -ETIMEDOUT;
+		}
+
+		while ((index = demp_input_dequeue(demp)) >= 0) {
+			if (queued == count)
+				continue;
+
+			ret = demp_input_queue(demp, index);
+			if (ret)
+				return ret;
+			queued++;
+		}
+		if (index != -EAGAIN)
+			return index;
+
+		while ((index = demp_output_dequeue(demp)) >= 0) {
+			done++;
+			if (done == count) {
+				last = index;
+				break;
+			}
+
+			ret = demp_output_queue(demp, index);
+			if (ret)
+				return ret;
+		}
+		if ((index < 0) && (index != -EAGAIN))
+			return index;
+	}
+
+	elapsed = thread_time_get() - start;
+	rate = done * 1000000000000ULL / elapsed;
+
+	printf("Converted %d %dx%d frames on the %s in %"PRIu64"ms: %"PRIu64
+	       ".%03"PRIu64"fps.\n", done, demp->width, demp->height,
+	       demp->software ? "cpu" : "demp", elapsed / 1000000,
+	       rate / 1000, rate % 1000);
+
+	ret = demp_streaming_stop(demp);
+	if (ret)
+		return ret;
+
+	return last;
+}
+
+/*
+ * The demp might hand us NV12 as a single plane, with chroma straight
+ * after luma.
+ */
+static const uint8_t *
+demp_output_plane(struct demp *demp, int index, int plane, int *pitch)
+{
+	struct demp_buffer *buffer = &demp->outputs[index];
+
+	if (plane < buffer->plane_count) {
+		*pitch = buffer->planes[plane].pitch;
+		return buffer->planes[plane].map;
+	}
+
+	*pitch = buffer->planes[0].pitch;
+	return buffer->planes[0].map + buffer->planes[0].pitch * demp->height;
+}
+
+/*
+ * Compare what the demp made of our png with what the cpu made of it.
+ * Returns the number of bytes which differ.
+ */
+static int
+demp_compare(struct demp *hardware, int hardware_index,
+	     struct demp *software, int software_index)
+{
+	static const char *names[2] = { "Y", "UV" };
+	int differ_total = 0, i, x, y;
+
+	for (i = 0; i < 2; i++) {
+		const uint8_t *expected, *actual;
+		int expected_pitch, actual_pitch;
+		int height = i ? (hardware->height / 2) : hardware->height;
+		int differ = 0, max = 0, first_x = 0, first_y = 0;
+
+		expected = demp_output_plane(software, software_index, i,
+					     &expected_pitch);
+		actual = demp_output_plane(hardware, hardware_index, i,
+					   &actual_pitch);
+
+		for (y = 0; y < height; y++) {
+			const uint8_t *a = expected + y * expected_pitch;
+			const uint8_t *b = actual + y * actual_pitch;
+
+			for (x = 0; x < hardware->width; x++) {
+				int delta = abs(a[x] - b[x]);
+
+				if (!delta)
+					continue;
+
+				if (!differ) {
+					first_x = x;
+					first_y = y;
+				}
+				differ++;
+				if (delta > max)
+					max = delta;
+			}
+		}
+
+		if (differ)
+			printf("%s: %d of %d bytes differ, by up to %d, the "
+			       "first at %d,%d.\n", names[i], differ,
+			       hardware->width * height, max, first_x,
+			       first_y);
+		else
+			printf("%s: bit exact.\n", names[i]);
+
+		differ_total += differ;
+	}
+
+	return differ_total;
+}
+
+static int
+demp_inputs_load(struct demp *demp)
+{
+	int ret, i;
+
+	for (i = 0; i < demp->input_count; i++) {
+		ret = demp_input_load(&demp->inputs[i]);
+		if (ret) {
+			fprintf(stderr, "Error: demp_input_load(): %s\n",
+				strerror(-ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	printf("Usage:\n");
+	printf("%s  <file.png>  [framecount [buffercount]]\n", name);
+	printf("Converts file.png framecount times (default 600), with\n");
+	printf("buffercount buffers (default 4, max %d) in flight on both\n",
+	       DEMP_BUFFER_COUNT_MAX);
+	printf("sides, on the demp and then on the cpu. The results get\n");
+	printf("compared, and the last converted frame is displayed.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct demp *hardware, *software;
+	int count = 600, buffer_count = 4;
+	int hardware_last = -1, software_last, differ = 0;
+	bool kms;
+	int ret;
+
+	if ((argc < 2) || (argc > 4)) {
+		usage(argv[0]);
+		return EX_USAGE;
+	}
+
+	if ((argc > 2) &&
+	    ((sscanf(argv[2], "%d", &count) != 1) || (count < 1))) {
+		usage(argv[0]);
+		return EX_USAGE;
+	}
+
+	if ((argc > 3) &&
+	    ((sscanf(argv[3], "%d", &buffer_count) != 1) ||
+	     (buffer_count < 1) || (buffer_count > DEMP_BUFFER_COUNT_MAX))) {
+		usage(argv[0]);
+		return EX_USAGE;
+	}
+
+	ret = demp_png_load(argv[1]);
+	if (ret) {
+		fprintf(stderr, "Error: demp_png_load(): %s\n",
+			strerror(ret));
+		return ret;
+	}
+
+	/* the cpu outputs to kms dmabufs, so that they can be shown. */
+	kms = !kms_init();
+	if (!kms)
+		printf("No kms, only converting.\n");
+
+	hardware = demp_create(png->width, png->height, buffer_count,
+			       buffer_count, false, false);
+	if (hardware) {
+		ret = demp_inputs_load(hardware);
+		if (ret)
+			return -ret;
+
+		hardware_last = demp_stream(hardware, count);
+		if (hardware_last < 0) {
+			fprintf(stderr, "Error: demp_stream(): %s\n",
+				strerror(-hardware_last));
+			return -hardware_last;
+		}
+	} else
+		printf("No demp, only converting on the cpu.\n");
+
+	software = demp_create(png->width, png->height, buffer_count,
+			       buffer_count, false, true);
+	if (!software)
+		return -1;
+
+	ret = demp_inputs_load(software);
+	if (ret)
+		return -ret;
+
+	software_last = demp_stream(software, count);
+	if (software_last < 0) {
+		fprintf(stderr, "Error: demp_stream(): %s\n",
+			strerror(-software_last));
+		return -software_last;
+	}
+
+	if (hardware)
+		differ = demp_compare(hardware, hardware_last, software,
+				      software_last);
+
+	if (kms) {
+		if (hardware)
+			ret = demp_kms_show(hardware, hardware_last);
+		else
+			ret = demp_kms_show(software, software_last);
+		if (ret) {
+			fprintf(stderr, "Error: demp_kms_show(): %s\n",
+				strerror(ret));
+			return ret;
+		}
+	}
+
+	if (differ)
+		return EX_DATAERR;
+
+	return 0;
+}
@@ -0,0 +1,857 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * EDID parsing: the base block, CEA-861 extensions and DisplayID
+ * extensions, so that we can tell what a display natively does.
+ *
+ * We also build simple base blocks, for programming our tfp401 modules.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "juggler.h"
+#include "edid.h"
+
+struct edid_vic {
+	int width;
+	int height;
+	int refresh; /* Hz */
+	bool interlaced;
+};
+
+/* The CEA-861 video identification codes that we might come across. */
+static const struct edid_vic edid_vics[] = {
+	[1] = { 640, 480, 60, false },
+	[2] = { 720, 480, 60, false },
+	[3] = { 720, 480, 60, false },
+	[4] = { 1280, 720, 60, false },
+	[5] = { 1920, 1080, 60, true },
+	[6] = { 1440, 480, 60, true },
+	[7] = { 1440, 480, 60, true },
+	[8] = { 1440, 240, 60, false },
+	[9] = { 1440, 240, 60, false },
+	[10] = { 2880, 480, 60, true },
+	[11] = { 2880, 480, 60, true },
+	[12] = { 2880, 240, 60, false },
+	[13] = { 2880, 240, 60, false },
+	[14] = { 1440, 480, 60, false },
+	[15] = { 1440, 480, 60, false },
+	[16] = { 1920, 1080, 60, false },
+	[17] = { 720, 576, 50, false },
+	[18] = { 720, 576, 50, false },
+	[19] = { 1280, 720, 50, false },
+	[20] = { 1920, 1080, 50, true },
+	[21] = { 1440, 576, 50, true },
+	[22] = { 1440, 576, 50, true },
+	[23] = { 1440, 288, 50, false },
+	[24] = { 1440, 288, 50, false },
+	[25] = { 2880, 576, 50, true },
+	[26] = { 2880, 576, 50, true },
+	[27] = { 2880, 288, 50, false },
+	[28] = { 2880, 288, 50, false },
+	[29] = { 1440, 576, 50, false },
+	[30] = { 1440, 576, 50, false },
+	[31] = { 1920, 1080, 50, false },
+	[32] = { 1920, 1080, 24, false },
+	[33] = { 1920, 1080, 25, false },
+	[34] = { 1920, 1080, 30, false },
+	[35] = { 2880, 480, 60, false },
+	[36] = { 2880, 480, 60, false },
+	[37] = { 2880, 576, 50, false },
+	[38] = { 2880, 576, 50, false },
+	[39] = { 1920, 1080, 50, true },
+	[40] = { 1920, 1080, 100, true },
+	[41] = { 1280, 720, 100, false },
+	[42] = { 720, 576, 100, false },
+	[43] = { 720, 576, 100, false },
+	[44] = { 1440, 576, 100, true },
+	[45] = { 1440, 576, 100, true },
+	[46] = { 1920, 1080, 120, true },
+	[47] = { 1280, 720, 120, false },
+	[48] = { 720, 480, 120, false },
+	[49] = { 720, 480, 120, false },
+	[50] = { 1440, 480, 120, true },
+	[51] = { 1440, 480, 120, true },
+	[52] = { 720, 576, 200, false },
+	[53] = { 720, 576, 200, false },
+	[54] = { 1440, 576, 200, true },
+	[55] = { 1440, 576, 200, true },
+	[56] = { 720, 480, 240, false },
+	[57] = { 720, 480, 240, false },
+	[58] = { 1440, 480, 240, true },
+	[59] = { 1440, 480, 240, true },
+	[60] = { 1280, 720, 24, false },
+	[61] = { 1280, 720, 25, false },
+	[62] = { 1280, 720, 30, false },
+	[63] = { 1920, 1080, 120, false },
+	[64] = { 1920, 1080, 100, false },
+};
+#define EDID_VIC_COUNT (sizeof(edid_vics) / sizeof(struct edid_vic))
+
+/* in bit order, starting with bit 7 of byte 0x23 */
+static const struct edid_vic edid_established[] = {
+	{ 720, 400, 70, false },
+	{ 720, 400, 88, false },
+	{ 640, 480, 60, false },
+	{ 640, 480, 67, false },
+	{ 640, 480, 72, false },
+	{ 640, 480, 75, false },
+	{ 800, 600, 56, false },
+	{ 800, 600, 60, false },
+	{ 800, 600, 72, false },
+	{ 800, 600, 75, false },
+	{ 832, 624, 75, false },
+	{ 1024, 768, 87, true },
+	{ 1024, 768, 60, false },
+	{ 1024, 768, 70, false },
+	{ 1024, 768, 75, false },
+	{ 1280, 1024, 75, false },
+	{ 1152, 870, 75, false },
+};
+#define EDID_ESTABLISHED_COUNT \
+	(sizeof(edid_established) / sizeof(struct edid_vic))
+
+static bool
+edid_checksum_ok(const uint8_t *data, size_t size)
+{
+	uint8_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		sum += data[i];
+
+	return !sum;
+}
+
+static struct edid_timing *
+edid_timing_add(struct edid *edid, enum edid_timing_source source)
+{
+	struct edid_timing *timing;
+
+	if (edid->timing_count == EDID_TIMINGS_MAX)
+		return NULL;
+
+	timing = &edid->timings[edid->timing_count];
+	edid->timing_count++;
+
+	memset(timing, 0, sizeof(struct edid_timing));
+	timing->source = source;
+
+	return timing;
+}
+
+static void
+edid_timing_simple_add(struct edid *edid, enum edid_timing_source source,
+		       int width, int height, int refresh, bool interlaced)
+{
+	struct edid_timing *timing = edid_timing_add(edid, source);
+
+	if (!timing)
+		return;
+
+	timing->width = width;
+	timing->height = height;
+	timing->refresh = refresh * 1000;
+	timing->interlaced = interlaced;
+}
+
+static int
+edid_timing_refresh(int clock, int htotal, int vtotal, bool interlaced)
+{
+	uint64_t refresh;
+
+	if (!htotal || !vtotal)
+		return 0;
+
+	refresh = (uint64_t) clock * 1000000ULL / htotal / vtotal;
+	if (interlaced)
+		refresh *= 2;
+
+	return refresh;
+}
+
+/*
+ * The 18 byte detailed timing descriptor, as used by the base block and
+ * CEA-861 extensions.
+ */
+static void
+edid_detailed_timing_parse(struct edid *edid, const uint8_t *data,
+			   enum edid_timing_source source)
+{
+	struct edid_timing *timing;
+	int hblank, vblank, hsync_offset, hsync_width;
+	int vsync_offset, vsync_width;
+
+	timing = edid_timing_add(edid, source);
+	if (!timing)
+		return;
+
+	timing->clock = (data[0] | (data[1] << 8)) * 10;
+
+	timing->width = data[2] | ((data[4] & 0xF0) << 4);
+	hblank = data[3] | ((data[4] & 0x0F) << 8);
+	timing->height = data[5] | ((data[7] & 0xF0) << 4);
+	vblank = data[6] | ((data[7] & 0x0F) << 8);
+
+	hsync_offset = data[8] | ((data[11] & 0xC0) << 2);
+	hsync_width = data[9] | ((data[11] & 0x30) << 4);
+	vsync_offset = (data[10] >> 4) | ((data[11] & 0x0C) << 2);
+	vsync_width = (data[10] & 0x0F) | ((data[11] & 0x03) << 4);
+
+	timing->hsync_start = timing->width + hsync_offset;
+	timing->hsync_end = timing->hsync_start + hsync_width;
+	timing->htotal = timing->width + hblank;
+	timing->vsync_start = timing->height + vsync_offset;
+	timing->vsync_end = timing->vsync_start + vsync_width;
+	timing->vtotal = timing->height + vblank;
+
+	timing->interlaced = data[17] & 0x80;
+	/* only digital separate sync tells us the polarities */
+	if ((data[17] & 0x18) == 0x18) {
+		timing->vsync_positive = data[17] & 0x04;
+		timing->hsync_positive = data[17] & 0x02;
+	}
+
+	timing->refresh = edid_timing_refresh(timing->clock, timing->htotal,
+					      timing->vtotal,
+					      timing->interlaced);
+}
+
+static void
+edid_descriptor_string(char *string, const uint8_t *data)
+{
+	int i;
+
+	for (i = 0; i < 13; i++) {
+		if ((data[i] == 0x0A) || !data[i])
+			break;
+		string[i] = data[i];
+	}
+	string[i] = 0;
+
+	while (i && (string[i - 1] == ' '))
+		string[--i] = 0;
+}
+
+static void
+edid_descriptor_parse(struct edid *edid, const uint8_t *data)
+{
+	switch (data[3]) {
+	case 0xFC: /* name */
+		edid_descriptor_string(edid->name, &data[5]);
+		break;
+	case 0xFD: /* range limits */
+		edid->vrefresh_min = data[5];
+		edid->vrefresh_max = data[6];
+		edid->hfrequency_min = data[7];
+		edid->hfrequency_max = data[8];
+		edid->clock_max = data[9] * 10000;
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+edid_standard_timing_parse(struct edid *edid, const uint8_t *data)
+{
+	int width, height, refresh;
+
+	if ((data[0] == 0x01) && (data[1] == 0x01))
+		return;
+	if (!data[0])
+		return;
+
+	width = (data[0] + 31) * 8;
+	refresh = (data[1] & 0x3F) + 60;
+
+	switch (data[1] >> 6) {
+	case 0:
+		height = width * 10 / 16;
+		break;
+	case 1:
+		height = width * 3 / 4;
+		break;
+	case 2:
+		height = width * 4 / 5;
+		break;
+	case 3:
+	default:
+		height = width * 9 / 16;
+		break;
+	}
+
+	edid_timing_simple_add(edid, EDID_TIMING_STANDARD, width, height,
+			       refresh, false);
+}
+
+static int
+edid_base_parse(struct edid *edid, const uint8_t *data)
+{
+	static const uint8_t header[8] =
+		{ 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+	uint16_t vendor;
+	int i;
+
+	if (memcmp(data, header, 8)) {
+		fprintf(stderr, "%s: wrong EDID header.\n", __func__);
+		return -EINVAL;
+	}
+
+	if (!edid_checksum_ok(data, EDID_BLOCK_SIZE)) {
+		fprintf(stderr, "%s: wrong EDID checksum.\n", __func__);
+		return -EINVAL;
+	}
+
+	vendor = (data[8] << 8) | data[9];
+	edid->vendor[0] = '@' + ((vendor >> 10) & 0x1F);
+	edid->vendor[1] = '@' + ((vendor >> 5) & 0x1F);
+	edid->vendor[2] = '@' + (vendor & 0x1F);
+	edid->vendor[3] = 0;
+
+	edid->product = data[10] | (data[11] << 8);
+	edid->serial = data[12] | (data[13] << 8) | (data[14] << 16) |
+		(data[15] << 24);
+
+	for (i = 0; i < (int) EDID_ESTABLISHED_COUNT; i++) {
+		const struct edid_vic *vic = &edid_established[i];
+
+		if (data[0x23 + (i / 8)] & (0x80 >> (i % 8)))
+			edid_timing_simple_add(edid,
+					       EDID_TIMING_ESTABLISHED,
+					       vic->width, vic->height,
+					       vic->refresh, vic->interlaced);
+	}
+
+	for (i = 0; i < 8; i++)
+		edid_standard_timing_parse(edid, &data[0x26 + 2 * i]);
+
+	for (i = 0; i < 4; i++) {
+		const uint8_t *descriptor = &data[0x36 + 18 * i];
+
+		if (descriptor[0] || descriptor[1]) {
+			edid_detailed_timing_parse(edid, descriptor,
+						   EDID_TIMING_DETAILED);
+			/* the first detailed timing is the preferred one */
+			if (!i) {
+				edid->timings[edid->timing_count - 1].
+					preferred = true;
+				edid->timings[edid->timing_count - 1].
+					native = true;
+			}
+		} else
+			edid_descriptor_parse(edid, descriptor);
+	}
+
+	return data[0x7E];
+}
+
+static void
+edid_cea_parse(struct edid *edid, const uint8_t *data)
+{
+	int offset, dtd = data[2], i;
+
+	if (dtd > (EDID_BLOCK_SIZE - 18))
+		dtd = EDID_BLOCK_SIZE - 18;
+
+	/* data block collection, only present from revision 3 */
+	for (offset = 4; (data[1] >= 3) && (offset < dtd);) {
+		int tag = data[offset] >> 5;
+		int length = data[offset] & 0x1F;
+
+		if ((offset + 1 + length) > dtd)
+			break;
+
+		/* video data block */
+		if (tag == 2) {
+			for (i = 1; i <= length; i++) {
+				const struct edid_vic *vic;
+				struct edid_timing *timing;
+				int code = data[offset + i];
+				bool native = false;
+
+				/* codes 129-192 are 1-64, flagged native */
+				if ((code >= 129) && (code <= 192)) {
+					code &= 0x7F;
+					native = true;
+				}
+
+				if ((code >= (int) EDID_VIC_COUNT) ||
+				    !edid_vics[code].width)
+					continue;
+
+				vic = &edid_vics[code];
+				timing = edid_timing_add(edid,
+							 EDID_TIMING_CEA_VIC);
+				if (!timing)
+					break;
+
+				timing->width = vic->width;
+				timing->height = vic->height;
+				timing->refresh = vic->refresh * 1000;
+				timing->interlaced = vic->interlaced;
+				timing->native = native;
+			}
+		}
+
+		offset += 1 + length;
+	}
+
+	for (offset = data[2]; offset && (offset <= (EDID_BLOCK_SIZE - 19));
+	     offset += 18) {
+		if (!data[offset] && !data[offset + 1])
+			break;
+
+		edid_detailed_timing_parse(edid, &data[offset],
+					   EDID_TIMING_CEA_DETAILED);
+	}
+}
+
+/*
+ * DisplayID type I detailed timing: 20 bytes, everything stored minus
+ * one.
+ */
+static void
+edid_displayid_timing_parse(struct edid *edid, const uint8_t *data)
+{
+	struct edid_timing *timing;
+	int hblank, vblank;
+
+	timing = edid_timing_add(edid, EDID_TIMING_DISPLAYID);
+	if (!timing)
+		return;
+
+	timing->clock = ((data[0] | (data[1] << 8) | (data[2] << 16)) + 1) *
+		10;
+	timing->preferred = data[3] & 0x80;
+	timing->interlaced = data[3] & 0x10;
+
+	timing->width = (data[4] | (data[5] << 8)) + 1;
+	hblank = (data[6] | (data[7] << 8)) + 1;
+	timing->hsync_start = timing->width +
+		((data[8] | ((data[9] & 0x7F) << 8)) + 1);
+	timing->hsync_positive = data[9] & 0x80;
+	timing->hsync_end = timing->hsync_start +
+		(data[10] | (data[11] << 8)) + 1;
+	timing->htotal = timing->width + hblank;
+
+	timing->height = (data[12] | (data[13] << 8)) + 1;
+	vblank = (data[14] | (data[15] << 8)) + 1;
+	timing->vsync_start = timing->height +
+		((data[16] | ((data[17] & 0x7F) << 8)) + 1);
+	timing->vsync_positive = data[17] & 0x80;
+	timing->vsync_end = timing->vsync_start +
+		(data[18] | (data[19] << 8)) + 1;
+	timing->vtotal = timing->height + vblank;
+
+	timing->refresh = edid_timing_refresh(timing->clock, timing->htotal,
+					      timing->vtotal,
+					      timing->interlaced);
+	if (timing->preferred)
+		timing->native = true;
+}
+
+static void
+edid_displayid_parse(struct edid *edid, const uint8_t *data)
+{
+	int size = data[2], offset, i;
+
+	/* section: version, size, product type, extension count, checksum */
+	if ((size + 5) > (EDID_BLOCK_SIZE - 1))
+		return;
+
+	if (!edid_checksum_ok(&data[1], size + 5))
+		return;
+
+	for (offset = 5; (offset + 3) <= (size + 5);) {
+		int tag = data[offset];
+		int length = data[offset + 2];
+
+		if ((offset + 3 + length) > (size + 5))
+			break;
+
+		if (tag == 0x03)
+			for (i = 0; (i + 20) <= length; i += 20)
+				edid_displayid_timing_parse(edid,
+							    &data[offset + 3 +
+								  i]);
+
+		offset += 3 + length;
+	}
+}
+
+struct edid *
+edid_parse(const uint8_t *data, size_t size)
+{
+	struct edid *edid;
+	int count, i;
+
+	if (size < EDID_BLOCK_SIZE) {
+		fprintf(stderr, "%s: EDID too short: %d bytes.\n", __func__,
+			(int) size);
+		return NULL;
+	}
+
+	edid = calloc(1, sizeof(struct edid));
+	if (!edid)
+		return NULL;
+
+	count = edid_base_parse(edid, data);
+	if (count < 0) {
+		free(edid);
+		return NULL;
+	}
+
+	for (i = 1; (i <= count) && ((i + 1) * EDID_BLOCK_SIZE <= size);
+	     i++) {
+		const uint8_t *block = &data[i * EDID_BLOCK_SIZE];
+
+		if (!edid_checksum_ok(block, EDID_BLOCK_SIZE)) {
+			fprintf(stderr, "%s: wrong checksum for extension "
+				"%d.\n", __func__, i);
+			continue;
+		}
+
+		switch (block[0]) {
+		case 0x02:
+			edid_cea_parse(edid, block);
+			break;
+		case 0x70:
+			edid_displayid_parse(edid, block);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return edid;
+}
+
+/*
+ * Parsed EDIDs are kept around, keyed by a hash of the blob, so that
+ * reprobing after hotplug is cheap.
+ *
+ * This cache is for the projector thread only, which is the only one
+ * probing displays. There is no locking and no reference counting: an
+ * EDID we return is only good until the next call, which might evict it.
+ */
+#define EDID_CACHE_SIZE 8
+static struct edid *edid_cache[EDID_CACHE_SIZE];
+static int edid_cache_next;
+
+/* FNV-1a */
+static uint32_t
+edid_hash(const uint8_t *data, size_t size)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+struct edid *
+edid_get(const uint8_t *data, size_t size)
+{
+	struct edid *edid, *old;
+	uint32_t hash = edid_hash(data, size);
+	int i;
+
+	for (i = 0; i < EDID_CACHE_SIZE; i++) {
+		edid = edid_cache[i];
+
+		/* the hash only gets us there quickly, the blob decides */
+		if (edid && (edid->hash == hash) &&
+		    (edid->blob_size == size) &&
+		    !memcmp(edid->blob, data, size))
+			return edid;
+	}
+
+	edid = edid_parse(data, size);
+	if (!edid)
+		return NULL;
+
+	edid->blob = malloc(size);
+	if (!edid->blob) {
+		free(edid);
+		return NULL;
+	}
+	memcpy(edid->blob, data, size);
+	edid->blob_size = size;
+	edid->hash = hash;
+
+	old = edid_cache[edid_cache_next];
+	if (old) {
+		free(old->blob);
+		free(old);
+	}
+
+	edid_cache[edid_cache_next] = edid;
+	edid_cache_next = (edid_cache_next + 1) % EDID_CACHE_SIZE;
+
+	return edid;
+}
+
+/*
+ * What the display natively is: its preferred detailed timing, or
+ * otherwise the first timing flagged native.
+ */
+struct edid_timing *
+edid_timing_native(struct edid *edid)
+{
+	int i;
+
+	for (i = 0; i < edid->timing_count; i++)
+		if (edid->timings[i].preferred)
+			return &edid->timings[i];
+
+	for (i = 0; i < edid->timing_count; i++)
+		if (edid->timings[i].native)
+			return &edid->timings[i];
+
+	return NULL;
+}
+
+void
+edid_print(struct edid *edid)
+{
+	struct edid_timing *native = edid_timing_native(edid);
+
+	printf("EDID: %s \"%s\" (0x%04X), %d timings", edid->vendor,
+	       edid->name, edid->product, edid->timing_count);
+	if (native)
+		printf(", native %dx%d%s@%d.%03dHz", native->width,
+		       native->height, native->interlaced ? "i" : "",
+		       native->refresh / 1000, native->refresh % 1000);
+	if (edid->clock_max)
+		printf(", max %dMHz", edid->clock_max / 1000);
+	printf(".\n");
+}
+
+static void
+edid_descriptor_string_set(uint8_t *data, uint8_t tag, const char *string)
+{
+	int i;
+
+	memset(data, 0, 18);
+	data[3] = tag;
+
+	for (i = 0; (i < 13) && string[i]; i++)
+		data[5 + i] = string[i];
+
+	if (i < 13)
+		data[5 + i++] = 0x0A;
+
+	for (; i < 13; i++)
+		data[5 + i] = ' ';
+}
+
+static int
+edid_detailed_timing_set(uint8_t *data, const struct edid_timing *timing)
+{
+	int hblank = timing->htotal - timing->width;
+	int vblank = timing->vtotal - timing->height;
+	int hsync_offset = timing->hsync_start - timing->width;
+	int hsync_width = timing->hsync_end - timing->hsync_start;
+	int vsync_offset = timing->vsync_start - timing->height;
+	int vsync_width = timing->vsync_end - timing->vsync_start;
+	int clock = timing->clock / 10;
+
+	if ((clock <= 0) || (clock > 0xFFFF) ||
+	    (timing->width <= 0) || (timing->width > 0xFFF) ||
+	    (timing->height <= 0) || (timing->height > 0xFFF) ||
+	    (hblank <= 0) || (hblank > 0xFFF) ||
+	    (vblank <= 0) || (vblank > 0xFFF) ||
+	    (hsync_offset < 0) || (hsync_offset > 0x3FF) ||
+	    (hsync_width < 0) || (hsync_width > 0x3FF) ||
+	    (vsync_offset < 0) || (vsync_offset > 0x3F) ||
+	    (vsync_width < 0) || (vsync_width > 0x3F)) {
+		fprintf(stderr, "%s: timing %dx%d does not fit a detailed "
+			"timing descriptor.\n", __func__, timing->width,
+			timing->height);
+		return -EINVAL;
+	}
+
+	data[0] = clock;
+	data[1] = clock >> 8;
+
+	data[2] = timing->width;
+	data[3] = hblank;
+	data[4] = ((timing->width >> 4) & 0xF0) | ((hblank >> 8) & 0x0F);
+	data[5] = timing->height;
+	data[6] = vblank;
+	data[7] = ((timing->height >> 4) & 0xF0) | ((vblank >> 8) & 0x0F);
+
+	data[8] = hsync_offset;
+	data[9] = hsync_width;
+	data[10] = ((vsync_offset & 0x0F) << 4) | (vsync_width & 0x0F);
+	data[11] = ((hsync_offset >> 2) & 0xC0) | ((hsync_width >> 4) & 0x30) |
+		((vsync_offset >> 2) & 0x0C) | ((vsync_width >> 4) & 0x03);
+
+	/* 444x250mm, like the original blob. */
+	data[12] = 0xBC;
+	data[13] = 0xFA;
+	data[14] = 0x10;
+	data[15] = 0;
+	data[16] = 0;
+
+	/* digital separate sync */
+	data[17] = 0x18;
+	if (timing->vsync_positive)
+		data[17] |= 0x04;
+	if (timing->hsync_positive)
+		data[17] |= 0x02;
+
+	return 0;
+}
+
+/*
+ * Encode our timing as the first standard timing, when it can be
+ * expressed as one. Otherwise, the slot stays unused.
+ */
+static void
+edid_standard_timing_set(uint8_t *data, const struct edid_timing *timing,
+			 int refresh)
+{
+	int aspect;
+
+	data[0] = 0x01;
+	data[1] = 0x01;
+
+	if ((timing->width & 0x07) || (timing->width < 256) ||
+	    (timing->width > 2288))
+		return;
+
+	refresh = (refresh + 500) / 1000;
+	if ((refresh < 60) || (refresh > 123))
+		return;
+
+	if ((timing->height * 16) == (timing->width * 10))
+		aspect = 0;
+	else if ((timing->height * 4) == (timing->width * 3))
+		aspect = 1;
+	else if ((timing->height * 5) == (timing->width * 4))
+		aspect = 2;
+	else if ((timing->height * 16) == (timing->width * 9))
+		aspect = 3;
+	else
+		return;
+
+	data[0] = (timing->width / 8) - 31;
+	data[1] = (aspect << 6) | (refresh - 60);
+}
+
+/*
+ * Build an EDID 1.3 base block which advertises just this one timing,
+ * with range limits tight around it, so that the source has no other
+ * choice.
+ */
+int
+edid_build(uint8_t *data, const struct edid_timing *timing,
+	   const char *vendor, const char *name)
+{
+	static const uint8_t header[8] =
+		{ 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+	/* taken over from the original tfp401 module blob */
+	static const uint8_t chromaticity[10] =
+		{ 0x5E, 0xC0, 0xA4, 0x59, 0x4A, 0x98, 0x25, 0x20, 0x50, 0x54 };
+	uint8_t *range = &data[0x5A];
+	uint16_t id;
+	int refresh, hfrequency, sum, ret, i;
+
+	if ((strlen(vendor) != 3) ||
+	    (vendor[0] < 'A') || (vendor[0] > 'Z') ||
+	    (vendor[1] < 'A') || (vendor[1] > 'Z') ||
+	    (vendor[2] < 'A') || (vendor[2] > 'Z')) {
+		fprintf(stderr, "%s: invalid vendor \"%s\".\n", __func__,
+			vendor);
+		return -EINVAL;
+	}
+
+	memset(data, 0, EDID_BLOCK_SIZE);
+	memcpy(data, header, 8);
+
+	id = ((vendor[0] - '@') << 10) | ((vendor[1] - '@') << 5) |
+		(vendor[2] - '@');
+	data[0x08] = id >> 8;
+	data[0x09] = id;
+
+	data[0x10] = 5; /* week */
+	data[0x11] = 2020 - 1990;
+	data[0x12] = 1; /* version 1.3 */
+	data[0x13] = 3;
+
+	data[0x14] = 0x80; /* digital */
+	data[0x15] = 44; /* cm */
+	data[0x16] = 25;
+	data[0x17] = 0x78; /* gamma 2.2 */
+	/*
+	 * DPMS standby, suspend and off, RGB, preferred timing is the
+	 * first DTD.
+	 */
+	data[0x18] = 0xEA;
+
+	memcpy(&data[0x19], chromaticity, 10);
+
+	refresh = edid_timing_refresh(timing->clock, timing->htotal,
+				      timing->vtotal, false);
+
+	/* no established timings, only our mode as a standard timing. */
+	edid_standard_timing_set(&data[0x26], timing, refresh);
+	for (i = 0x28; i < 0x36; i++)
+		data[i] = 0x01;
+
+	ret = edid_detailed_timing_set(&data[0x36], timing);
+	if (ret)
+		return ret;
+
+	edid_descriptor_string_set(&data[0x48], 0xFF, "Linux #0");
+
+	hfrequency = timing->clock / timing->htotal; /* kHz */
+
+	memset(range, 0, 18);
+	range[3] = 0xFD;
+	range[5] = (refresh / 1000) - 1;
+	range[6] = (refresh + 999) / 1000 + 1;
+	range[7] = hfrequency - 1;
+	range[8] = (timing->clock + timing->htotal - 1) / timing->htotal + 1;
+	range[9] = (timing->clock + 9999) / 10000;
+	range[10] = 0x00; /* no GTF */
+	range[11] = 0x0A;
+	for (i = 12; i < 18; i++)
+		range[i] = ' ';
+
+	edid_descriptor_string_set(&data[0x6C], 0xFC, name);
+
+	data[0x7E] = 0; /* no extensions */
+
+	for (sum = 0, i = 0; i < (EDID_BLOCK_SIZE - 1); i++)
+		sum += data[i];
+	data[0x7F] = -sum;
+
+	return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _HAVE_EDID_H_
+#define _HAVE_EDID_H_ 1
+
+#define EDID_BLOCK_SIZE 128
+#define EDID_TIMINGS_MAX 64
+
+enum edid_timing_source {
+	EDID_TIMING_ESTABLISHED = 0,
+	EDID_TIMING_STANDARD,
+	EDID_TIMING_DETAILED,
+	EDID_TIMING_CEA_VIC,
+	EDID_TIMING_CEA_DETAILED,
+	EDID_TIMING_DISPLAYID,
+};
+
+struct edid_timing {
+	enum edid_timing_source source;
+	bool preferred;
+	bool native;
+	bool interlaced;
+
+	int width;
+	int height;
+	int refresh; /* mHz */
+
+	/* only for detailed timings, otherwise 0 */
+	int clock; /* kHz */
+	int hsync_start;
+	int hsync_end;
+	int htotal;
+	int vsync_start;
+	int vsync_end;
+	int vtotal;
+	bool hsync_positive;
+	bool vsync_positive;
+};
+
+struct edid {
+	uint32_t hash;
+	/* a copy of what we parsed, so that the cache can compare */
+	uint8_t *blob;
+	size_t blob_size;
+
+	char vendor[4];
+	uint16_t product;
+	uint32_t serial;
+	char name[14];
+
+	/* monitor range limits, 0 when not provided */
+	int vrefresh_min; /* Hz */
+	int vrefresh_max;
+	int hfrequency_min; /* kHz */
+	int hfrequency_max;
+	int clock_max; /* kHz */
+
+	int timing_count;
+	struct edid_timing timings[EDID_TIMINGS_MAX];
+};
+
+struct edid *edid_parse(const uint8_t *data, size_t size);
+struct edid *edid_get(const uint8_t *data, size_t size);
+struct edid_timing *edid_timing_native(struct edid *edid);
+void edid_print(struct edid *edid);
+
+int edid_build(uint8_t *data, const struct edid_timing *timing,
+	       const char *vendor, const char *name);
+
+#endif /* _HAVE_EDID_H_ */
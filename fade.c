@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fades of a whole plane, through its alpha property, so that the display
+ * engine blends against the black crtc background, and the cpu does
+ * nothing but add a property to a commit which was happening anyway.
+ *
+ * Every commit moves us one step closer to where we want to be, and the
+ * display thread commits every vblank for as long as we are busy, so a
+ * fade takes length vblanks. A fade can be turned around halfway, it then
+ * simply walks back from where it is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "juggler.h"
+#include "kms.h"
+#include "fade.h"
+
+#define FADE_ALPHA_MAX 0xFFFF
+
+/*
+ * Smoothstep, so that we ease in and out, instead of starting and
+ * stopping with a jolt.
+ */
+static uint16_t
+fade_alpha(struct fade *fade)
+{
+	uint64_t position = fade->position;
+	uint64_t length = fade->length;
+
+	return FADE_ALPHA_MAX * position * position *
+		(3 * length - 2 * position) / (length * length * length);
+}
+
+void
+fade_in(struct fade *fade)
+{
+	fade->target = fade->length;
+}
+
+void
+fade_out(struct fade *fade)
+{
+	fade->target = 0;
+}
+
+bool
+fade_busy(struct fade *fade)
+{
+	return (fade->position != fade->target) ||
+		(fade->shown != fade->position);
+}
+
+/*
+ * Whether scanout has gone fully dark, so our plane can be switched over
+ * to something else without anyone noticing.
+ */
+bool
+fade_dark(struct fade *fade)
+{
+	return !fade->shown;
+}
+
+/*
+ * Take the next step, and add it to the commit for this vblank.
+ */
+void
+fade_set(struct fade *fade, drmModeAtomicReqPtr request)
+{
+	struct kms_plane *plane = fade->plane;
+
+	if (fade->position < fade->target)
+		fade->position++;
+	else if (fade->position > fade->target)
+		fade->position--;
+
+	if (fade->position == fade->shown)
+		return;
+
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_alpha, fade_alpha(fade));
+}
+
+void
+fade_commit_done(struct fade *fade)
+{
+	fade->shown = fade->position;
+}
+
+/*
+ * Have our alpha reprogrammed on our next commit.
+ */
+void
+fade_reset(struct fade *fade)
+{
+	fade->shown = -1;
+}
+
+struct fade *
+fade_create(const char *name, struct kms_plane *plane, int length)
+{
+	struct fade *fade;
+
+	/* our caller checks for this, and goes without. */
+	if (!plane->property_alpha) {
+		fprintf(stderr, "%s: plane %u has no alpha property.\n",
+			name, plane->plane_id);
+		return NULL;
+	}
+
+	fade = calloc(1, sizeof(struct fade));
+	if (!fade) {
+		fprintf(stderr, "%s: failed to allocate fade.\n", name);
+		return NULL;
+	}
+
+	fade->plane = plane;
+	fade->length = length;
+	fade->position = length;
+	fade->target = length;
+	fade->shown = -1;
+
+	return fade;
+}
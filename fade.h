@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_FADE_H_
+#define _HAVE_FADE_H_ 1
+
+struct kms_plane;
+struct _drmModeAtomicReq;
+
+struct fade {
+	struct kms_plane *plane;
+
+	/* in commits, which are one per vblank while we are busy. */
+	int length;
+	/* 0 is dark, length is fully shown. */
+	int position;
+	int target;
+	/* what scanout has, -1 when our plane needs reprogramming. */
+	int shown;
+};
+
+struct fade *fade_create(const char *name, struct kms_plane *plane,
+			 int length);
+
+void fade_in(struct fade *fade);
+void fade_out(struct fade *fade);
+bool fade_busy(struct fade *fade);
+bool fade_dark(struct fade *fade);
+
+void fade_set(struct fade *fade, struct _drmModeAtomicReq *request);
+void fade_commit_done(struct fade *fade);
+void fade_reset(struct fade *fade);
+
+#endif /* _HAVE_FADE_H_ */
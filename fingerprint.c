@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Frame fingerprints: spot a source which is connected, and which keeps
+ * sending frames, but which is frozen, asleep or blanked.
+ *
+ * We never touch the capture buffers ourselves, we work off the luma of
+ * the smallest level of the pyramid, so 1/8th of the frame each way, and
+ * average that into cells. As a pyramid image is built over several
+ * frames, we only get to look at every few frames.
+ *
+ * A mouse cursor blinking is lost in the averaging. This is fine, frozen
+ * is informational only: a static slide looks exactly the same.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include "juggler.h"
+#include "log.h"
+#include "pyramid.h"
+#include "thread.h"
+#include "fingerprint.h"
+
+/* about every 10s at 60Hz, with a pyramid image every 8 frames */
+#define FINGERPRINT_STATISTICS_COUNT 75
+
+/*
+ * A state has to persist this long before we report it, in ns. Each
+ * pyramid image already spans 8 frames, so this only asks for two images
+ * in a row: at 60Hz, that is 267ms of input, and black gets reported
+ * 267-400ms after it happened. Frozen needs one image more.
+ */
+#define FINGERPRINT_DETECT_TIME 100000000ULL
+
+/*
+ * No cell brighter than this is black. Cells are averages, so noise is
+ * gone, but a limited range source still sends black as 16.
+ */
+#define FINGERPRINT_BLACK_MAX 24
+/* the difference between brightest and darkest cell of a uniform frame */
+#define FINGERPRINT_UNIFORM_RANGE 6
+/* the largest cell change which still counts as frozen */
+#define FINGERPRINT_FROZEN_DELTA 2
+
+static const char *fingerprint_state_strings[] = {
+	[FINGERPRINT_LIVE] = "live",
+	[FINGERPRINT_FROZEN] = "frozen",
+	[FINGERPRINT_BLACK] = "black",
+	[FINGERPRINT_UNIFORM] = "uniform",
+};
+
+const char *
+fingerprint_state_string(enum fingerprint_state state)
+{
+	if (state >= FINGERPRINT_STATE_COUNT)
+		return "(invalid)";
+	return fingerprint_state_strings[state];
+}
+
+/*
+ * Fill in the signature from the luma of the smallest pyramid level.
+ * Returns the lowest and highest cell luma.
+ */
+static void
+fingerprint_signature(struct fingerprint *fingerprint,
+		      struct pyramid_image *image, int *min, int *max)
+{
+	struct pyramid_level *level = &image->levels[PYRAMID_LEVELS - 1];
+	int x, y, i, j;
+
+	*min = 255;
+	*max = 0;
+
+	for (y = 0; y < FINGERPRINT_ROWS; y++) {
+		int top = (y * level->height) / FINGERPRINT_ROWS;
+		int bottom = ((y + 1) * level->height) / FINGERPRINT_ROWS;
+
+		for (x = 0; x < FINGERPRINT_COLUMNS; x++) {
+			int left = (x * level->width) / FINGERPRINT_COLUMNS;
+			int right = ((x + 1) * level->width) /
+				FINGERPRINT_COLUMNS;
+			uint32_t sum = 0;
+			int luma;
+
+			for (j = top; j < bottom; j++) {
+				const uint8_t *row =
+					image->luma + j * level->width;
+
+				for (i = left; i < right; i++)
+					sum += row[i];
+			}
+
+			luma = sum / ((bottom - top) * (right - left));
+			fingerprint->signature[y][x] = luma;
+
+			if (luma < *min)
+				*min = luma;
+			if (luma > *max)
+				*max = luma;
+		}
+	}
+}
+
+static int
+fingerprint_delta(struct fingerprint *fingerprint)
+{
+	int delta = 0, x, y;
+
+	for (y = 0; y < FINGERPRINT_ROWS; y++)
+		for (x = 0; x < FINGERPRINT_COLUMNS; x++) {
+			int diff = fingerprint->signature[y][x] -
+				fingerprint->signature_previous[y][x];
+
+			if (diff < 0)
+				diff = -diff;
+			if (diff > delta)
+				delta = diff;
+		}
+
+	return delta;
+}
+
+static void
+fingerprint_statistics_print(struct fingerprint *fingerprint)
+{
+	struct fingerprint_statistics *statistics = fingerprint->statistics;
+
+	log_info("Fingerprint: %d images, %d live, %d frozen, %d black, %d "
+		 "uniform, %"PRIu64"us average, %"PRIu64"us max.\n",
+		 statistics->images,
+		 statistics->states[FINGERPRINT_LIVE],
+		 statistics->states[FINGERPRINT_FROZEN],
+		 statistics->states[FINGERPRINT_BLACK],
+		 statistics->states[FINGERPRINT_UNIFORM],
+		 statistics->time_total / (1000 * statistics->images),
+		 statistics->time_max / 1000);
+}
+
+/*
+ * Called by capture for every new pyramid image, with now being the time
+ * at which its last frame was handed to the displays.
+ */
+void
+fingerprint_frame(struct fingerprint *fingerprint,
+		  struct pyramid_image *image, uint64_t now)
+{
+	struct fingerprint_statistics *statistics = fingerprint->statistics;
+	enum fingerprint_state candidate;
+	uint64_t start = thread_time_get(), elapsed;
+	int min, max;
+
+	if ((image->levels[PYRAMID_LEVELS - 1].width < FINGERPRINT_COLUMNS) ||
+	    (image->levels[PYRAMID_LEVELS - 1].height < FINGERPRINT_ROWS))
+		return;
+
+	fingerprint_signature(fingerprint, image, &min, &max);
+
+	if (max <= FINGERPRINT_BLACK_MAX)
+		candidate = FINGERPRINT_BLACK;
+	else if ((max - min) <= FINGERPRINT_UNIFORM_RANGE)
+		candidate = FINGERPRINT_UNIFORM;
+	else if (fingerprint->signature_valid &&
+		 (fingerprint_delta(fingerprint) <= FINGERPRINT_FROZEN_DELTA))
+		candidate = FINGERPRINT_FROZEN;
+	else
+		candidate = FINGERPRINT_LIVE;
+
+	memcpy(fingerprint->signature_previous, fingerprint->signature,
+	       sizeof(fingerprint->signature));
+	fingerprint->signature_valid = true;
+
+	pthread_mutex_lock(fingerprint->mutex);
+
+	if (candidate != fingerprint->candidate) {
+		fingerprint->candidate = candidate;
+		fingerprint->candidate_since = now;
+	}
+
+	/* going live is immediate, anything else needs to persist. */
+	if ((candidate != fingerprint->state) &&
+	    ((candidate == FINGERPRINT_LIVE) ||
+	     ((now - fingerprint->candidate_since) >=
+	      FINGERPRINT_DETECT_TIME))) {
+		if (candidate == FINGERPRINT_LIVE)
+			log_info("Fingerprint: input was %s for %"PRIu64
+				 "ms.\n",
+				 fingerprint_state_string(fingerprint->state),
+				 (now - fingerprint->state_since) / 1000000);
+		else
+			log_info("Fingerprint: input is %s.\n",
+				 fingerprint_state_string(candidate));
+
+		fingerprint->state = candidate;
+		fingerprint->state_since = fingerprint->candidate_since;
+	}
+
+	elapsed = thread_time_get() - start;
+
+	statistics->images++;
+	statistics->states[fingerprint->state]++;
+	statistics->time_total += elapsed;
+	if (elapsed > statistics->time_max)
+		statistics->time_max = elapsed;
+
+	if (statistics->images == FINGERPRINT_STATISTICS_COUNT) {
+		fingerprint_statistics_print(fingerprint);
+		memset(statistics, 0, sizeof(struct fingerprint_statistics));
+	}
+
+	pthread_mutex_unlock(fingerprint->mutex);
+}
+
+/*
+ * Returns the current state, and the time since which it holds.
+ */
+enum fingerprint_state
+fingerprint_state_get(struct fingerprint *fingerprint, uint64_t *since)
+{
+	enum fingerprint_state state;
+
+	pthread_mutex_lock(fingerprint->mutex);
+	state = fingerprint->state;
+	if (since)
+		*since = fingerprint->state_since;
+	pthread_mutex_unlock(fingerprint->mutex);
+
+	return state;
+}
+
+/*
+ * Capture restarted, so whatever we saw before no longer counts.
+ */
+void
+fingerprint_reset(struct fingerprint *fingerprint)
+{
+	uint64_t now = thread_time_get();
+
+	pthread_mutex_lock(fingerprint->mutex);
+
+	fingerprint->signature_valid = false;
+	fingerprint->candidate = FINGERPRINT_LIVE;
+	fingerprint->candidate_since = now;
+	fingerprint->state = FINGERPRINT_LIVE;
+	fingerprint->state_since = now;
+
+	pthread_mutex_unlock(fingerprint->mutex);
+}
+
+struct fingerprint *
+fingerprint_create(void)
+{
+	struct fingerprint *fingerprint;
+
+	fingerprint = calloc(1, sizeof(struct fingerprint));
+	if (!fingerprint) {
+		fprintf(stderr, "%s(): failed to allocate fingerprint.\n",
+			__func__);
+		return NULL;
+	}
+
+	pthread_mutex_init(fingerprint->mutex, NULL);
+	fingerprint_reset(fingerprint);
+
+	return fingerprint;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_FINGERPRINT_H_
+#define _HAVE_FINGERPRINT_H_ 1
+
+struct pyramid_image;
+
+/*
+ * A coarse luma signature of the picture: the average luma of each cell
+ * of a grid.
+ */
+#define FINGERPRINT_ROWS 16
+#define FINGERPRINT_COLUMNS 32
+
+enum fingerprint_state {
+	FINGERPRINT_LIVE = 0, /* the picture changes */
+	FINGERPRINT_FROZEN, /* nothing changed, could be a static slide */
+	FINGERPRINT_BLACK, /* source is asleep, or blanked */
+	FINGERPRINT_UNIFORM, /* a single colour, no content */
+	FINGERPRINT_STATE_COUNT,
+};
+
+struct fingerprint_statistics {
+	int images;
+	/* images spent in each state */
+	int states[FINGERPRINT_STATE_COUNT];
+	uint64_t time_total;
+	uint64_t time_max;
+};
+
+struct fingerprint {
+	pthread_mutex_t mutex[1];
+
+	uint8_t signature[FINGERPRINT_ROWS][FINGERPRINT_COLUMNS];
+	uint8_t signature_previous[FINGERPRINT_ROWS][FINGERPRINT_COLUMNS];
+	bool signature_valid;
+
+	/* what the last frame looked like, and since when */
+	enum fingerprint_state candidate;
+	uint64_t candidate_since;
+
+	/* what we report, once the candidate stuck around long enough */
+	enum fingerprint_state state;
+	uint64_t state_since;
+
+	struct fingerprint_statistics statistics[1];
+};
+
+struct fingerprint *fingerprint_create(void);
+void fingerprint_reset(struct fingerprint *fingerprint);
+
+void fingerprint_frame(struct fingerprint *fingerprint,
+		       struct pyramid_image *image, uint64_t now);
+
+enum fingerprint_state fingerprint_state_get(struct fingerprint *fingerprint,
+					     uint64_t *since);
+const char *fingerprint_state_string(enum fingerprint_state state);
+
+#endif /* _HAVE_FINGERPRINT_H_ */
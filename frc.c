@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Frame rate conversion between capture and display.
+ *
+ * Laptops come in at 50, 59.94, 60 or even 75Hz, while our displays run
+ * at whatever rate they were set up with. Rather than a mailbox, each
+ * display gets a short queue of frames, and at each vblank a policy
+ * picks which frame to show:
+ *
+ *  - latency: the newest frame, whatever the cadence.
+ *  - smooth: the newest frame which was timestamped a fixed time before
+ *    this vblank, so the cadence follows the timestamps and not the
+ *    jitter of our own delivery.
+ *  - locked: every frame exactly once, in order, only dropping when we
+ *    fall behind. Best combined with display clock tracking.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include "juggler.h"
+#include "log.h"
+#include "capture.h"
+#include "frc.h"
+
+#define FRC_STATISTICS_COUNT 600
+
+static const char *frc_policy_strings[] = {
+	[FRC_POLICY_LATENCY] = "latency",
+	[FRC_POLICY_SMOOTH] = "smooth",
+	[FRC_POLICY_LOCKED] = "locked",
+};
+
+const char *
+frc_policy_string(enum frc_policy policy)
+{
+	if (policy > FRC_POLICY_LOCKED)
+		return "unknown";
+
+	return frc_policy_strings[policy];
+}
+
+int
+frc_policy_parse(const char *string, enum frc_policy *policy)
+{
+	int i;
+
+	for (i = 0; i <= FRC_POLICY_LOCKED; i++)
+		if (!strcmp(string, frc_policy_strings[i])) {
+			*policy = i;
+			return 0;
+		}
+
+	fprintf(stderr, "%s(): unknown policy \"%s\".\n", __func__, string);
+	return -EINVAL;
+}
+
+static uint64_t
+frc_buffer_time(struct capture_buffer *buffer)
+{
+	return buffer->timestamp.tv_sec * 1000000000ULL +
+		buffer->timestamp.tv_usec * 1000ULL;
+}
+
+/*
+ * Remove the buffer at the given queue position. Call with mutex held.
+ */
+static struct capture_buffer *
+frc_queue_take(struct frc *frc, int index)
+{
+	struct capture_buffer *buffer = frc->queue[index];
+	int i;
+
+	for (i = index; i < (frc->queue_count - 1); i++)
+		frc->queue[i] = frc->queue[i + 1];
+
+	frc->queue_count--;
+	frc->queue[frc->queue_count] = NULL;
+
+	return buffer;
+}
+
+/*
+ * Called from the capture thread.
+ */
+void
+frc_push(struct frc *frc, struct capture_buffer *buffer)
+{
+	struct capture_buffer *old = NULL;
+
+	pthread_mutex_lock(frc->mutex);
+
+	if (frc->queue_count == FRC_QUEUE_DEPTH) {
+		old = frc_queue_take(frc, 0);
+		frc->statistics->dropped++;
+	}
+
+	frc->queue[frc->queue_count] = buffer;
+	frc->queue_count++;
+	frc->statistics->frames++;
+
+	pthread_mutex_unlock(frc->mutex);
+
+	if (old)
+		capture_buffer_display_release(old);
+}
+
+/*
+ * Drop everything still queued, for when capture stops.
+ */
+void
+frc_flush(struct frc *frc)
+{
+	struct capture_buffer *queue[FRC_QUEUE_DEPTH];
+	int count, i;
+
+	pthread_mutex_lock(frc->mutex);
+
+	count = frc->queue_count;
+	for (i = 0; i < count; i++) {
+		queue[i] = frc->queue[i];
+		frc->queue[i] = NULL;
+	}
+	frc->queue_count = 0;
+
+	pthread_mutex_unlock(frc->mutex);
+
+	for (i = 0; i < count; i++)
+		capture_buffer_display_release(queue[i]);
+}
+
+/*
+ * Returns the index of the frame to show, or -1 to repeat the current
+ * one. Call with mutex held.
+ */
+static int
+frc_policy_pick(struct frc *frc, uint64_t cutoff)
+{
+	int i;
+
+	if (!frc->queue_count)
+		return -1;
+
+	switch (frc->policy) {
+	case FRC_POLICY_SMOOTH:
+		for (i = frc->queue_count - 1; i >= 0; i--)
+			if (frc_buffer_time(frc->queue[i]) <= cutoff)
+				return i;
+
+		/* no frame is old enough, but do not let capture starve */
+		if (frc->queue_count == FRC_QUEUE_DEPTH)
+			return 0;
+		return -1;
+	case FRC_POLICY_LOCKED:
+		return 0;
+	case FRC_POLICY_LATENCY:
+	default:
+		return frc->queue_count - 1;
+	}
+}
+
+static void
+frc_statistics_print(struct frc *frc)
+{
+	struct frc_statistics *statistics = frc->statistics;
+
+	log_info("%s: %s: %d vblanks, %d frames, %d shown, %d repeated, %d "
+		 "dropped, cadence %d/%d/%d/%d.\n", frc->name,
+		 frc_policy_string(frc->policy), statistics->vblanks,
+		 statistics->frames, statistics->shown, statistics->repeated,
+		 statistics->dropped, statistics->cadence[0],
+		 statistics->cadence[1], statistics->cadence[2],
+		 statistics->cadence[3]);
+}
+
+/*
+ * Called by the display thread right before it commits. The cutoff is
+ * the latest timestamp that the smooth policy accepts for this vblank.
+ *
+ * Returns the frame to show, or NULL when the current one should stay.
+ */
+struct capture_buffer *
+frc_pick(struct frc *frc, uint64_t cutoff)
+{
+	struct capture_buffer *dropped[FRC_QUEUE_DEPTH];
+	struct capture_buffer *buffer = NULL;
+	struct frc_statistics *statistics = frc->statistics;
+	int drop_count = 0, index, i;
+
+	pthread_mutex_lock(frc->mutex);
+
+	index = frc_policy_pick(frc, cutoff);
+	if (index >= 0) {
+		/* everything older than what we show is lost. */
+		for (i = 0; i < index; i++)
+			dropped[drop_count++] = frc_queue_take(frc, 0);
+
+		buffer = frc_queue_take(frc, 0);
+
+		/* locked: only keep a single frame of backlog. */
+		if (frc->policy == FRC_POLICY_LOCKED)
+			while (frc->queue_count > 1)
+				dropped[drop_count++] = frc_queue_take(frc, 0);
+	}
+
+	statistics->vblanks++;
+	statistics->dropped += drop_count;
+
+	if (buffer) {
+		if (frc->shown_count) {
+			if (frc->shown_count > FRC_CADENCE_MAX)
+				frc->shown_count = FRC_CADENCE_MAX;
+			statistics->cadence[frc->shown_count - 1]++;
+		}
+		frc->shown_count = 1;
+		statistics->shown++;
+	} else if (frc->shown_count) {
+		frc->shown_count++;
+		statistics->repeated++;
+	}
+
+	if (statistics->vblanks == FRC_STATISTICS_COUNT) {
+		frc_statistics_print(frc);
+		*frc->statistics_last = *statistics;
+		memset(statistics, 0, sizeof(struct frc_statistics));
+	}
+
+	pthread_mutex_unlock(frc->mutex);
+
+	for (i = 0; i < drop_count; i++)
+		capture_buffer_display_release(dropped[i]);
+
+	return buffer;
+}
+
+void
+frc_statistics_get(struct frc *frc, struct frc_statistics *statistics)
+{
+	pthread_mutex_lock(frc->mutex);
+	*statistics = *frc->statistics_last;
+	pthread_mutex_unlock(frc->mutex);
+}
+
+struct frc *
+frc_create(const char *name, enum frc_policy policy)
+{
+	struct frc *frc;
+
+	frc = calloc(1, sizeof(struct frc));
+	if (!frc)
+		return NULL;
+
+	frc->name = name;
+	frc->policy = policy;
+	pthread_mutex_init(frc->mutex, NULL);
+
+	printf("%s: using %s frame rate conversion.\n", name,
+	       frc_policy_string(policy));
+
+	return frc;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _HAVE_FRC_H_
+#define _HAVE_FRC_H_ 1
+
+struct capture_buffer;
+
+enum frc_policy {
+	FRC_POLICY_LATENCY = 0, /* always the newest frame */
+	FRC_POLICY_SMOOTH, /* pick frames by timestamp, at a fixed delay */
+	FRC_POLICY_LOCKED, /* every frame exactly once, in order */
+};
+
+#define FRC_QUEUE_DEPTH 3
+#define FRC_CADENCE_MAX 4
+
+struct frc_statistics {
+	int vblanks;
+	int frames; /* received from capture */
+	int shown;
+	int repeated; /* vblanks at which we had no new frame */
+	int dropped; /* frames that never made it to the screen */
+	/* how many frames were shown for 1, 2, 3, 4 or more vblanks */
+	int cadence[FRC_CADENCE_MAX];
+};
+
+struct frc {
+	const char *name;
+	enum frc_policy policy;
+
+	pthread_mutex_t mutex[1];
+	struct capture_buffer *queue[FRC_QUEUE_DEPTH];
+	int queue_count;
+
+	/* vblanks for which the current frame has been up */
+	int shown_count;
+
+	struct frc_statistics statistics[1];
+	/* the last full window, for others to look at */
+	struct frc_statistics statistics_last[1];
+};
+
+struct frc *frc_create(const char *name, enum frc_policy policy);
+void frc_push(struct frc *frc, struct capture_buffer *buffer);
+struct capture_buffer *frc_pick(struct frc *frc, uint64_t cutoff);
+void frc_flush(struct frc *frc);
+void frc_statistics_get(struct frc *frc, struct frc_statistics *statistics);
+
+int frc_policy_parse(const char *string, enum frc_policy *policy);
+const char *frc_policy_string(enum frc_policy policy);
+
+#endif /* _HAVE_FRC_H_ */
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Listen to kernel uevents, so that we notice when the projector gets
+ * unplugged or power-cycled, and only reprobe the connector involved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include <pthread.h>
+
+#include "juggler.h"
+#include "log.h"
+#include "thread.h"
+#include "hotplug.h"
+#include "frc.h"
+#include "projector.h"
+
+static pthread_t hotplug_thread[1];
+static int hotplug_fd = -1;
+
+#define HOTPLUG_MESSAGE_SIZE 4096
+
+/*
+ * A kernel uevent is "action@devpath", followed by KEY=value pairs, all
+ * nul-terminated. We are only interested in drm hotplug events, which
+ * might name the connector.
+ */
+static void
+hotplug_message_parse(char *message, int length)
+{
+	bool drm = false, hotplug = false;
+	uint32_t connector_id = 0;
+	int i;
+
+	for (i = 0; i < length; i += strlen(&message[i]) + 1) {
+		const char *line = &message[i];
+
+		if (!strcmp(line, "SUBSYSTEM=drm"))
+			drm = true;
+		else if (!strcmp(line, "HOTPLUG=1"))
+			hotplug = true;
+		else if (!strncmp(line, "CONNECTOR=", 10))
+			connector_id = strtoul(&line[10], NULL, 10);
+	}
+
+	if (!drm || !hotplug)
+		return;
+
+	if (connector_id)
+		log_info("Hotplug: connector %u changed.\n", connector_id);
+	else
+		log_info("Hotplug: a connector changed.\n");
+
+	kms_projector_hotplug(connector_id);
+}
+
+static void *
+hotplug_thread_handler(void *arg)
+{
+	char message[HOTPLUG_MESSAGE_SIZE + 1];
+	ssize_t length;
+
+	while (true) {
+		length = recv(hotplug_fd, message, HOTPLUG_MESSAGE_SIZE, 0);
+		if (length < 0) {
+			if ((errno == EINTR) || (errno == ENOBUFS))
+				continue;
+
+			log_error("%s: recv(): %s\n", __func__,
+				  strerror(errno));
+			break;
+		}
+
+		message[length] = 0;
+		hotplug_message_parse(message, length);
+	}
+
+	log_info("%s: done!\n", __func__);
+
+	return NULL;
+}
+
+int
+hotplug_init(void)
+{
+	struct sockaddr_nl address[1] = {{
+			.nl_family = AF_NETLINK,
+			.nl_pid = 0,
+			.nl_groups = 1, /* kernel uevents */
+		}};
+	int ret;
+
+	hotplug_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+			    NETLINK_KOBJECT_UEVENT);
+	if (hotplug_fd < 0) {
+		fprintf(stderr, "%s: failed to open uevent socket: %s\n",
+			__func__, strerror(errno));
+		return -errno;
+	}
+
+	ret = bind(hotplug_fd, (struct sockaddr *) address,
+		   sizeof(struct sockaddr_nl));
+	if (ret) {
+		fprintf(stderr, "%s: failed to bind uevent socket: %s\n",
+			__func__, strerror(errno));
+		ret = -errno;
+		close(hotplug_fd);
+		hotplug_fd = -1;
+		return ret;
+	}
+
+	ret = thread_create(hotplug_thread, THREAD_ROLE_HOTPLUG,
+			    hotplug_thread_handler, NULL);
+	if (ret) {
+		fprintf(stderr, "%s() hotplug thread creation failed: %s\n",
+			__func__, strerror(ret));
+		return ret;
+	}
+
+	printf("Listening for display hotplug events.\n");
+
+	return 0;
+}
@@ -15,6 +15,7 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
@@ -25,22 +26,76 @@
 #include <sys/time.h>
 
 #include "juggler.h"
+#include "log.h"
 #include "capture.h"
 #include "kms.h"
 #include "status.h"
+#include "frc.h"
 #include "projector.h"
+#include "thread.h"
+#include "vblank.h"
+#include "hotplug.h"
+#include "nv12.h"
+#include "slides.h"
+#include "colour.h"
 
 static bool capture_test = false;
+static bool capture_calibrate = false;
+static enum log_level log_level = LOG_INFO;
 static int capture_hoffset = -1;
 static int capture_voffset = -1;
+static bool thread_realtime = false;
+static enum frc_policy frc_policy = FRC_POLICY_LATENCY;
+static bool clock_tracking = false;
+static bool mode_matching = false;
+static bool capture_nv12 = false;
+static bool capture_crop = false;
+static struct _drmModeModeInfo *projector_mode;
+static const char *slides_directory;
+static bool projector_timecode = false;
+static bool status_timecode = false;
+static struct colour_profile *colour_profile;
 
 void
 usage(const char *name)
 {
 	printf("%s: the central FOSDEM video capture hardware tool.\n", name);
-	printf("usage: %s [-t] [hoffset] [voffset]\n", name);
+	printf("usage: %s [-v] [-R] [-P role=prio[@cpu]] [-m margin] "
+	       "[-f policy] [-M mode] [-l] [-e] [-n] [-a] [-s dir] "
+	       "[-T output] [-C profile] [-t] [-c] [hoffset] [voffset]\n",
+	       name);
+	printf("  -v\t\tVerbose, also log debug messages.\n");
+	printf("  -R\t\tRun our threads realtime, pinned, with locked "
+	       "memory.\n");
+	printf("  -P\t\tSet the realtime priority and cpu of one of the "
+	       "capture,\n\t\tprojector, status, log, hotplug, nv12, convert "
+	       "or\n\t\tslides threads. Without @cpu, the thread keeps its "
+	       "default\n\t\tcpu, @-1 lets it run on any. Implies -R.\n");
+	printf("  -m\t\tCommit frames margin us before vblank (default "
+	       "2000).\n");
+	printf("  -f\t\tProjector frame rate conversion: latency "
+	       "(default), smooth\n\t\tor locked.\n");
+	printf("  -M\t\tSet the projector to <width>x<height>@<refresh>, "
+	       "append\n\t\t-rb for reduced blanking or -tfp401, or use\n"
+	       "\t\t<width>x<height>@<clock>MHz.\n");
+	printf("  -l\t\tTune the projector pixel clock to the capture "
+	       "rate.\n");
+	printf("  -e\t\tSet the projector to the mode from its EDID "
+	       "which best\n\t\tmatches capture.\n");
+	printf("  -n\t\tConvert capture to NV12 with the demp (or the cpu "
+	       "when there\n\t\tis no demp), for the projector.\n");
+	printf("  -a\t\tCrop black borders off capture, so that the "
+	       "content\n\t\tfills the projector.\n");
+	printf("  -s\t\tWrite a png of every new slide to dir, listed in "
+	       "\n\t\tdir/index.txt.\n");
+	printf("  -T\t\tBurn the capture time and sequence number into "
+	       "the\n\t\tprojector or status output. Can be repeated.\n");
+	printf("  -C\t\tCorrect the colours of the projector according to "
+	       "the\n\t\tgiven room profile.\n");
 	printf("  -t\t\tTest frames for position markers to validate "
 	       "integrity.\n");
+	printf("  -c\t\tCalibrate hoffset and voffset against the "
+	       "test_output pattern.\n");
 	printf("  hoffset\tCSI capture starts hoffset pixels after HSync.\n");
 	printf("  voffset\tCSI capture starts voffset lines after VSync.\n");
 	printf("\n");
@@ -55,10 +110,101 @@ args_parse(int argc, char *argv[])
 	if (i == argc) /* no args */
 		return 0;
 
-	if (!strcmp(argv[i], "-t")) {
-		capture_test = true;
-		i++;
-		if (i == argc)
+	for (; argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-v"))
+			log_level = LOG_DEBUG;
+		else if (!strcmp(argv[i], "-l"))
+			clock_tracking = true;
+		else if (!strcmp(argv[i], "-e"))
+			mode_matching = true;
+		else if (!strcmp(argv[i], "-n"))
+			capture_nv12 = true;
+		else if (!strcmp(argv[i], "-a"))
+			capture_crop = true;
+		else if (!strcmp(argv[i], "-R"))
+			thread_realtime = true;
+		else if (!strcmp(argv[i], "-P")) {
+			i++;
+			if (i == argc)
+				goto error;
+
+			ret = thread_policy_parse(argv[i]);
+			if (ret)
+				goto error;
+
+			thread_realtime = true;
+		} else if (!strcmp(argv[i], "-m")) {
+			int margin;
+
+			i++;
+			if (i == argc)
+				goto error;
+
+			ret = sscanf(argv[i], "%i", &margin);
+			if ((ret != 1) || (margin < 0) || (margin > 16000)) {
+				fprintf(stderr, "\n%s: invalid margin \"%s\"."
+					"\n\n", __func__, argv[i]);
+				goto error;
+			}
+
+			vblank_margin_set(margin);
+		} else if (!strcmp(argv[i], "-f")) {
+			i++;
+			if (i == argc)
+				goto error;
+
+			ret = frc_policy_parse(argv[i], &frc_policy);
+			if (ret)
+				goto error;
+		} else if (!strcmp(argv[i], "-M")) {
+			i++;
+			if (i == argc)
+				goto error;
+
+			free(projector_mode);
+			projector_mode = kms_modeline_string_parse(argv[i]);
+			if (!projector_mode)
+				goto error;
+		} else if (!strcmp(argv[i], "-s")) {
+			i++;
+			if (i == argc)
+				goto error;
+
+			slides_directory = argv[i];
+		} else if (!strcmp(argv[i], "-T")) {
+			i++;
+			if (i == argc)
+				goto error;
+
+			if (!strcmp(argv[i], "projector"))
+				projector_timecode = true;
+			else if (!strcmp(argv[i], "status"))
+				status_timecode = true;
+			else {
+				fprintf(stderr, "\n%s: invalid timecode output"
+					" \"%s\".\n\n", __func__, argv[i]);
+				goto error;
+			}
+		} else if (!strcmp(argv[i], "-C")) {
+			i++;
+			if (i == argc)
+				goto error;
+
+			free(colour_profile);
+			colour_profile = colour_profile_read(argv[i]);
+			if (!colour_profile)
+				goto error;
+		} else if (!strcmp(argv[i], "-t"))
+			capture_test = true;
+		else if (!strcmp(argv[i], "-c"))
+			capture_calibrate = true;
+		else {
+			fprintf(stderr, "\n%s: unknown option \"%s\".\n\n",
+				__func__, argv[i]);
+			goto error;
+		}
+
+		if ((i + 1) == argc)
 			return 0;
 	}
 
@@ -97,19 +243,47 @@ int main(int argc, char *argv[])
 	if (ret)
 		return ret;
 
+	ret = thread_policy_init(thread_realtime);
+	if (ret)
+		return ret;
+
+	ret = log_init(log_level);
+	if (ret)
+		return ret;
+
 	ret = kms_init();
 	if (ret)
 		return ret;
 
-	ret = kms_status_init();
+	ret = kms_status_init(status_timecode);
 	if (ret)
 		return ret;
 
-	ret = kms_projector_init();
+	ret = kms_projector_init(projector_mode, frc_policy, clock_tracking,
+				 mode_matching, projector_timecode,
+				 colour_profile);
 	if (ret)
 		return ret;
 
-	ret = capture_init(capture_test, capture_hoffset, capture_voffset);
+	/* we can live without, we then just do not notice replugs. */
+	ret = hotplug_init();
+	if (ret)
+		fprintf(stderr, "Failed to set up hotplug monitoring.\n");
+
+	if (capture_nv12) {
+		ret = nv12_init();
+		if (ret)
+			return ret;
+	}
+
+	if (slides_directory) {
+		ret = slides_init(slides_directory);
+		if (ret)
+			return ret;
+	}
+
+	ret = capture_init(capture_test, capture_calibrate, capture_hoffset,
+			   capture_voffset, capture_nv12, capture_crop);
 	if (ret)
 		return ret;
 
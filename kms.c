@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 
 #include <xf86drm.h>
@@ -32,6 +33,7 @@
 #include "juggler.h"
 #include "kms.h"
 #include "capture.h"
+#include "edid.h"
 
 /* so that our capture side can use this separately. */
 int kms_fd = -1;
@@ -319,13 +321,424 @@ kms_crtc_id_get(uint32_t encoder_id, uint32_t *crtc_id, bool *ok,
 	return 0;
 }
 
+/*
+ * Sanity check a mode, and give it a name and a vrefresh.
+ */
+static int
+kms_modeline_check(struct _drmModeModeInfo *mode)
+{
+	float refresh;
+
+	refresh = (mode->clock * 1000.0) /
+		(mode->htotal * mode->vtotal);
+
+	snprintf(mode->name, DRM_DISPLAY_MODE_LEN, "%dx%d@%2.2fHz",
+		 mode->hdisplay, mode->vdisplay, refresh);
+	mode->vrefresh = refresh + 0.5;
+
+	if (mode->clock < 1000.0) {
+		fprintf(stderr, "Error: clock %2.2f is too low.\n",
+			mode->clock / 1000.0);
+		return -EINVAL;
+	}
+
+	if (mode->clock > 500000.0) {
+		fprintf(stderr, "Error: clock %2.2f is too low.\n",
+			mode->clock / 1000.0);
+		return -EINVAL;
+	}
+
+	if ((mode->hdisplay <= 0) || (mode->hdisplay > 4096)) {
+		fprintf(stderr, "Error: Invalid HDisplay %d\n",
+			mode->hdisplay);
+		return -EINVAL;
+	}
+
+	if ((mode->hsync_start <= 0) || (mode->hsync_start > 4096)) {
+		fprintf(stderr, "Error: Invalid HSync Start %d\n",
+			mode->hsync_start);
+		return -EINVAL;
+	}
+
+	if ((mode->hsync_end <= 0) || (mode->hsync_end > 4096)) {
+		fprintf(stderr, "Error: Invalid HSync End %d\n",
+			mode->hsync_end);
+		return -EINVAL;
+	}
+
+	if ((mode->htotal <= 0) || (mode->htotal > 4096)) {
+		fprintf(stderr, "Error: Invalid HTotal %d\n",
+			mode->htotal);
+		return -EINVAL;
+	}
+
+	if ((mode->vdisplay <= 0) || (mode->vdisplay > 4096)) {
+		fprintf(stderr, "Error: Invalid VDisplay %d\n",
+			mode->vdisplay);
+		return -EINVAL;
+	}
+
+	if ((mode->vsync_start <= 0) || (mode->vsync_start > 4096)) {
+		fprintf(stderr, "Error: Invalid VSync Start %d\n",
+			mode->vsync_start);
+		return -EINVAL;
+	}
+
+	if ((mode->vsync_end <= 0) || (mode->vsync_end > 4096)) {
+		fprintf(stderr, "Error: Invalid VSync End %d\n",
+			mode->vsync_end);
+		return -EINVAL;
+	}
+
+	if ((mode->vtotal <= 0) || (mode->vtotal > 4096)) {
+		fprintf(stderr, "Error: Invalid VTotal %d\n",
+			mode->vtotal);
+		return -EINVAL;
+	}
+
+	if (mode->hdisplay > mode->hsync_start) {
+		fprintf(stderr, "Error: HDisplay %d is above HSync Start %d\n",
+			mode->hdisplay, mode->hsync_start);
+		return -EINVAL;
+	}
+
+	if (mode->hsync_start > mode->hsync_end) {
+		fprintf(stderr, "Error: HSync Start %d is above HSync End %d\n",
+			mode->hsync_start, mode->hsync_end);
+		return -EINVAL;
+	}
+
+	if (mode->hsync_end > mode->htotal) {
+		fprintf(stderr, "Error: HSync End %d is above HTotal %d\n",
+			mode->hsync_end, mode->htotal);
+		return -EINVAL;
+	}
+
+	if (mode->vdisplay > mode->vsync_start) {
+		fprintf(stderr, "Error: VDisplay %d is above VSync Start %d\n",
+			mode->vdisplay, mode->vsync_start);
+		return -EINVAL;
+	}
+
+	if (mode->vsync_start > mode->vsync_end) {
+		fprintf(stderr, "Error: VSync Start %d is above VSync End %d\n",
+			mode->vsync_start, mode->vsync_end);
+		return -EINVAL;
+	}
+
+	if (mode->vsync_end > mode->vtotal) {
+		fprintf(stderr, "Error: VSync End %d is above VTotal %d\n",
+			mode->vsync_end, mode->vtotal);
+		return -EINVAL;
+	}
+
+	/*
+	 * Here we lock down the vertical refresh to around 60Hz, as we
+	 * do not want to run our displays too far from 60Hz, even when
+	 * playing with the timing.
+	 *
+	 */
+	if (refresh < 55.0) {
+		fprintf(stderr, "Error: refresh rate too low: %2.2f\n",
+			refresh);
+		return -EINVAL;
+	}
+
+	if (refresh > 65.0) {
+		fprintf(stderr, "Error: refresh rate too high: %2.2f\n",
+			refresh);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * VESA Coordinated Video Timings, as per the CVT 1.1 spreadsheet, for
+ * progressive modes without margins.
+ */
+#define CVT_CELL_GRANULARITY 8
+#define CVT_CLOCK_STEP 250 /* kHz */
+#define CVT_MIN_V_PORCH 3
+#define CVT_MIN_V_BPORCH 6
+#define CVT_MIN_VSYNC_BP 550.0 /* us */
+#define CVT_HSYNC_PERCENTAGE 8
+#define CVT_C_PRIME 30.0
+#define CVT_M_PRIME 300.0
+
+#define CVT_RB_MIN_VBLANK 460.0 /* us */
+#define CVT_RB_H_SYNC 32
+#define CVT_RB_H_BLANK 160
+#define CVT_RB_V_FPORCH 3
+
+/* the vsync width encodes the aspect ratio. */
+static int
+kms_cvt_vsync(int width, int height)
+{
+	if (!(height % 3) && ((height * 4 / 3) == width))
+		return 4;
+	else if (!(height % 9) && ((height * 16 / 9) == width))
+		return 5;
+	else if (!(height % 10) && ((height * 16 / 10) == width))
+		return 6;
+	else if (!(height % 4) && ((height * 5 / 4) == width))
+		return 7;
+	else if (!(height % 9) && ((height * 15 / 9) == width))
+		return 7;
+	else
+		return 10;
+}
+
+/*
+ * Generate a CVT or a CVT reduced blanking mode, refresh is in mHz.
+ *
+ * Reduced blanking gives us a much lower pixel clock for the same
+ * refresh rate, which is useful when we are at the edge of what our
+ * link or the tfp401 is able to handle.
+ */
+struct _drmModeModeInfo *
+kms_modeline_cvt(int width, int height, int refresh, bool reduced)
+{
+	struct _drmModeModeInfo *mode;
+	int vsync = kms_cvt_vsync(width, height);
+	double hperiod;
+	int ret;
+
+	if ((width <= 0) || (height <= 0) || (refresh <= 0)) {
+		fprintf(stderr, "%s: invalid mode %dx%d@%d.%03dHz\n",
+			__func__, width, height, refresh / 1000,
+			refresh % 1000);
+		return NULL;
+	}
+
+	mode = calloc(1, sizeof(struct _drmModeModeInfo));
+	if (!mode) {
+		fprintf(stderr, "%s(): failed to allocated mode.\n",
+			__func__);
+		return NULL;
+	}
+
+	width -= width % CVT_CELL_GRANULARITY;
+	mode->hdisplay = width;
+	mode->vdisplay = height;
+
+	if (!reduced) {
+		double hblank_percentage;
+		int vsync_bp, hblank;
+
+		/* horizontal period estimate, in us */
+		hperiod = (1000000000.0 / refresh - CVT_MIN_VSYNC_BP) /
+			(height + CVT_MIN_V_PORCH);
+
+		vsync_bp = CVT_MIN_VSYNC_BP / hperiod + 1;
+		if (vsync_bp < (vsync + CVT_MIN_V_BPORCH))
+			vsync_bp = vsync + CVT_MIN_V_BPORCH;
+
+		mode->vsync_start = height + CVT_MIN_V_PORCH;
+		mode->vsync_end = mode->vsync_start + vsync;
+		mode->vtotal = height + vsync_bp + CVT_MIN_V_PORCH;
+
+		hblank_percentage = CVT_C_PRIME - CVT_M_PRIME * hperiod /
+			1000.0;
+		if (hblank_percentage < 20.0)
+			hblank_percentage = 20.0;
+
+		hblank = width * hblank_percentage /
+			(100.0 - hblank_percentage);
+		hblank -= hblank % (2 * CVT_CELL_GRANULARITY);
+
+		mode->htotal = width + hblank;
+		mode->hsync_end = width + hblank / 2;
+		mode->hsync_start = mode->hsync_end -
+			(mode->htotal * CVT_HSYNC_PERCENTAGE) / 100;
+		mode->hsync_start += CVT_CELL_GRANULARITY -
+			mode->hsync_start % CVT_CELL_GRANULARITY;
+
+		mode->clock = mode->htotal * 1000.0 / hperiod;
+
+		mode->flags = DRM_MODE_FLAG_NHSYNC | DRM_MODE_FLAG_PVSYNC;
+	} else {
+		int vbi;
+
+		hperiod = (1000000000.0 / refresh - CVT_RB_MIN_VBLANK) /
+			height;
+
+		vbi = CVT_RB_MIN_VBLANK / hperiod + 1;
+		if (vbi < (CVT_RB_V_FPORCH + vsync + CVT_MIN_V_BPORCH))
+			vbi = CVT_RB_V_FPORCH + vsync + CVT_MIN_V_BPORCH;
+
+		mode->vsync_start = height + CVT_RB_V_FPORCH;
+		mode->vsync_end = mode->vsync_start + vsync;
+		mode->vtotal = height + vbi;
+
+		mode->htotal = width + CVT_RB_H_BLANK;
+		mode->hsync_end = width + CVT_RB_H_BLANK / 2;
+		mode->hsync_start = mode->hsync_end - CVT_RB_H_SYNC;
+
+		mode->clock = (uint64_t) refresh * mode->htotal *
+			mode->vtotal / 1000000;
+
+		mode->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_NVSYNC;
+	}
+
+	mode->clock -= mode->clock % CVT_CLOCK_STEP;
+
+	ret = kms_modeline_check(mode);
+	if (ret) {
+		free(mode);
+		return NULL;
+	}
+
+	return mode;
+}
+
+/*
+ * Limits of the tfp401 receiver on our capture board.
+ */
+#define TFP401_CLOCK_MIN 25000 /* kHz */
+#define TFP401_CLOCK_MAX 165000 /* kHz */
+#define TFP401_V_FPORCH 5
+#define TFP401_V_SYNC 5
+#define TFP401_V_BPORCH 20
+
+/*
+ * A reduced blanking mode, tuned for what the tfp401 module is known to
+ * take, see the 720p modeline in our README: both syncs positive, and
+ * a CEA-861 like vertical blank, so that the CSI has lines to spare
+ * for its voffset.
+ *
+ * The clock is rounded up to a whole CVT clock step, and htotal is then
+ * stretched so that we still land on the requested refresh rate.
+ */
+struct _drmModeModeInfo *
+kms_modeline_tfp401(int width, int height, int refresh)
+{
+	struct _drmModeModeInfo *mode;
+	int clock, ret;
+
+	mode = kms_modeline_cvt(width, height, refresh, true);
+	if (!mode)
+		return NULL;
+
+	mode->vsync_start = mode->vdisplay + TFP401_V_FPORCH;
+	mode->vsync_end = mode->vsync_start + TFP401_V_SYNC;
+	if (mode->vtotal < (mode->vsync_end + TFP401_V_BPORCH))
+		mode->vtotal = mode->vsync_end + TFP401_V_BPORCH;
+
+	clock = ((uint64_t) refresh * mode->htotal * mode->vtotal /
+		 1000000) + CVT_CLOCK_STEP - 1;
+	clock -= clock % CVT_CLOCK_STEP;
+	mode->clock = clock;
+
+	mode->htotal = ((uint64_t) clock * 1000000 / mode->vtotal +
+			refresh / 2) / refresh;
+
+	mode->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_PVSYNC;
+
+	if ((clock < TFP401_CLOCK_MIN) || (clock > TFP401_CLOCK_MAX)) {
+		fprintf(stderr, "Error: clock %2.2fMHz is outside of what "
+			"the tfp401 handles (%d-%dMHz).\n", clock / 1000.0,
+			TFP401_CLOCK_MIN / 1000, TFP401_CLOCK_MAX / 1000);
+		goto error;
+	}
+
+	ret = kms_modeline_check(mode);
+	if (ret)
+		goto error;
+
+	return mode;
+
+ error:
+	free(mode);
+	return NULL;
+}
+
+/*
+ * Generate a 60Hz reduced blanking mode for a given pixel clock, by
+ * stretching the horizontal blank.
+ */
+static struct _drmModeModeInfo *
+kms_modeline_clock(int width, int height, int clock)
+{
+	struct _drmModeModeInfo *mode;
+	int htotal, ret;
+
+	mode = kms_modeline_cvt(width, height, 60000, true);
+	if (!mode)
+		return NULL;
+
+	htotal = (uint64_t) clock * 1000000 / (60000ULL * mode->vtotal);
+	if (htotal < mode->htotal) {
+		fprintf(stderr, "Error: clock %2.2fMHz is too low for "
+			"%dx%d@60Hz, need at least %2.2fMHz.\n",
+			clock / 1000.0, width, height, mode->clock / 1000.0);
+		goto error;
+	}
+
+	/* grow the back porch, the sync stays where cvt put it. */
+	mode->htotal = htotal;
+	mode->clock = clock;
+
+	ret = kms_modeline_check(mode);
+	if (ret)
+		goto error;
+
+	return mode;
+
+ error:
+	free(mode);
+	return NULL;
+}
+
+/*
+ * Parse a mode string:
+ *	<width>x<height>@<refresh>		CVT
+ *	<width>x<height>@<refresh>-rb		CVT reduced blanking
+ *	<width>x<height>@<refresh>-tfp401	tuned for the tfp401
+ *	<width>x<height>@<clock>MHz		60Hz at the given clock
+ *
+ * where refresh is in Hz, and both refresh and clock can be fractional.
+ */
+struct _drmModeModeInfo *
+kms_modeline_string_parse(const char *string)
+{
+	int width, height, count = 0, ret;
+	float value;
+	const char *suffix;
+
+	ret = sscanf(string, "%dx%d@%f%n", &width, &height, &value, &count);
+	if ((ret != 3) || !count) {
+		fprintf(stderr, "Failed to read a mode from \"%s\".\n",
+			string);
+		return NULL;
+	}
+
+	suffix = string + count;
+
+	if (!suffix[0])
+		return kms_modeline_cvt(width, height, value * 1000, false);
+	else if (!strcmp(suffix, "-rb"))
+		return kms_modeline_cvt(width, height, value * 1000, true);
+	else if (!strcmp(suffix, "-tfp401"))
+		return kms_modeline_tfp401(width, height, value * 1000);
+	else if (!strcmp(suffix, "MHz"))
+		return kms_modeline_clock(width, height, value * 1000);
+
+	fprintf(stderr, "Unknown mode type \"%s\" in \"%s\".\n", suffix,
+		string);
+	return NULL;
+}
+
 struct _drmModeModeInfo *
 kms_modeline_arguments_parse(int argc, char *argv[])
 {
 	struct _drmModeModeInfo *mode;
-	float dotclock, refresh;
+	float dotclock;
 	int ret, val;
 
+	if (argc == 1)
+		return kms_modeline_string_parse(argv[0]);
+
 	if (argc != 11) {
 		fprintf(stderr, "Error: not enough arguments.\n");
 		return NULL;
@@ -433,305 +846,549 @@ kms_modeline_arguments_parse(int argc, char *argv[])
 		goto error;
 	}
 
-	refresh = (mode->clock * 1000.0) /
-		(mode->htotal * mode->vtotal);
-
-	snprintf(mode->name, DRM_DISPLAY_MODE_LEN, "%dx%d@%2.2fHz",
-		 mode->hdisplay, mode->vdisplay, refresh);
-	mode->vrefresh = refresh;
-
-	if (mode->clock < 1000.0) {
-		fprintf(stderr, "Error: clock %2.2f is too low.\n",
-			mode->clock / 1000.0);
+	ret = kms_modeline_check(mode);
+	if (ret)
 		goto error;
-	}
 
-	if (mode->clock > 500000.0) {
-		fprintf(stderr, "Error: clock %2.2f is too low.\n",
-			mode->clock / 1000.0);
-		goto error;
+	return mode;
+
+ error:
+	free(mode);
+	return NULL;
+}
+
+void
+kms_modeline_print(struct _drmModeModeInfo *mode)
+{
+	printf("Modeline  \"%s\"  %.2f  %d %d %d %d  %d %d %d %d  "
+	       "%chsync %cvsync\n", mode->name, mode->clock / 1000.0,
+	       mode->hdisplay, mode->hsync_start, mode->hsync_end, mode->htotal,
+	       mode->vdisplay, mode->vsync_start, mode->vsync_end, mode->vtotal,
+	       (mode->flags & DRM_MODE_FLAG_PHSYNC) ? '+' : '-',
+	       (mode->flags & DRM_MODE_FLAG_PVSYNC) ? '+' : '-');
+}
+
+struct _drmModeModeInfo *
+kms_crtc_modeline_get(uint32_t crtc_id)
+{
+	drmModePropertyBlobRes *blob;
+	drmModeObjectProperties *properties;
+	struct _drmModeModeInfo *mode;
+	uint32_t blob_id;
+	int i;
+
+	properties = drmModeObjectGetProperties(kms_fd, crtc_id,
+						DRM_MODE_OBJECT_CRTC);
+	if (!properties) {
+		/* yes, if there are no properties, this returns EINVAL */
+		if (errno != EINVAL) {
+			fprintf(stderr,
+				"%s(0x%02X): Failed to get properties: %s\n",
+				__func__, crtc_id, strerror(errno));
+			return NULL;
+		}
+
+		return NULL;
 	}
 
-	if ((mode->hdisplay <= 0) || (mode->hdisplay > 4096)) {
-		fprintf(stderr, "Error: Invalid HDisplay %d\n",
-			mode->hdisplay);
-		goto error;
+	for (i = 0; i < (int) properties->count_props; i++) {
+		drmModePropertyRes *property;
+
+		property = drmModeGetProperty(kms_fd,
+					      properties->props[i]);
+		if (!property) {
+			fprintf(stderr, "%s(0x%02X): Failed to get property"
+				" %u: %s\n", __func__, crtc_id,
+				properties->props[i], strerror(errno));
+			continue;
+		}
+
+		if (!strcmp(property->name, "MODE_ID")) {
+			/*
+			 * So, wait, a blob id value comes from the list of
+			 * properties, and is not separately present in the
+			 * actual property? WTF?
+			 */
+			blob_id = (uint32_t) properties->prop_values[i];
+			drmModeFreeProperty(property);
+			break;
+		}
+
+		drmModeFreeProperty(property);
 	}
 
-	if ((mode->hsync_start <= 0) || (mode->hsync_start > 4096)) {
-		fprintf(stderr, "Error: Invalid HSync Start %d\n",
-			mode->hsync_start);
-		goto error;
+	if (i == (int) properties->count_props) {
+		fprintf(stderr, "%s(0x%02X): Failed to get MODE_ID property\n",
+			__func__, crtc_id);
+		drmModeFreeObjectProperties(properties);
+		return NULL;
 	}
 
-	if ((mode->hsync_end <= 0) || (mode->hsync_end > 4096)) {
-		fprintf(stderr, "Error: Invalid HSync End %d\n",
-			mode->hsync_end);
-		goto error;
+	drmModeFreeObjectProperties(properties);
+
+	blob = drmModeGetPropertyBlob(kms_fd, blob_id);
+	if (!blob) {
+		fprintf(stderr, "%s(0x%02X): Failed to get property blob "
+			"%X: %s\n", __func__, crtc_id, blob_id,
+			strerror(errno));
+		return NULL;
 	}
 
-	if ((mode->htotal <= 0) || (mode->htotal > 4096)) {
-		fprintf(stderr, "Error: Invalid HTotal %d\n",
-			mode->htotal);
-		goto error;
+	if (blob->length != sizeof(drmModeModeInfo)) {
+		fprintf(stderr, "%s(0x%02X): wrong blob size: "
+			"%d should be %d\n", __func__, crtc_id,
+			blob->length, (int) sizeof(drmModeModeInfo));
+		drmModeFreePropertyBlob(blob);
+		return NULL;
 	}
 
-	if ((mode->vdisplay <= 0) || (mode->vdisplay > 4096)) {
-		fprintf(stderr, "Error: Invalid VDisplay %d\n",
-			mode->vdisplay);
-		goto error;
+	mode = calloc(1, sizeof(struct _drmModeModeInfo));
+	memcpy(mode, blob->data, sizeof(struct _drmModeModeInfo));
+
+	drmModeFreePropertyBlob(blob);
+
+	return mode;
+}
+
+int
+kms_crtc_modeline_set(uint32_t crtc_id, struct _drmModeModeInfo *mode)
+{
+	drmModeObjectProperties *properties;
+	drmModeAtomicReqPtr request;
+	uint32_t prop_id, blob_id;
+	int i, ret;
+
+	properties = drmModeObjectGetProperties(kms_fd, crtc_id,
+						DRM_MODE_OBJECT_CRTC);
+	if (!properties) {
+		/* yes, if there are no properties, this returns EINVAL */
+		if (errno != EINVAL) {
+			fprintf(stderr,
+				"%s(0x%02X): Failed to get properties: %s\n",
+				__func__, crtc_id, strerror(errno));
+			return -errno;
+		}
+
+		return -1;
 	}
 
-	if ((mode->vsync_start <= 0) || (mode->vsync_start > 4096)) {
-		fprintf(stderr, "Error: Invalid VSync Start %d\n",
-			mode->vsync_start);
-		goto error;
+	for (i = 0; i < (int) properties->count_props; i++) {
+		drmModePropertyRes *property;
+
+		property = drmModeGetProperty(kms_fd,
+					      properties->props[i]);
+		if (!property) {
+			fprintf(stderr, "%s(0x%02X): Failed to get property"
+				" %u: %s\n", __func__, crtc_id,
+				properties->props[i], strerror(errno));
+			continue;
+		}
+
+		if (!strcmp(property->name, "MODE_ID")) {
+			prop_id = property->prop_id;
+			drmModeFreeProperty(property);
+			break;
+		}
+
+		drmModeFreeProperty(property);
 	}
 
-	if ((mode->vsync_end <= 0) || (mode->vsync_end > 4096)) {
-		fprintf(stderr, "Error: Invalid VSync End %d\n",
-			mode->vsync_end);
-		goto error;
+	if (i == (int) properties->count_props) {
+		fprintf(stderr, "%s(0x%02X): Failed to get MODE_ID property\n",
+			__func__, crtc_id);
+		drmModeFreeObjectProperties(properties);
+		return -1;
 	}
 
-	if ((mode->vtotal <= 0) || (mode->vtotal > 4096)) {
-		fprintf(stderr, "Error: Invalid VTotal %d\n",
-			mode->vtotal);
-		goto error;
+	drmModeFreeObjectProperties(properties);
+
+	ret = drmModeCreatePropertyBlob(kms_fd, mode,
+					sizeof(struct _drmModeModeInfo),
+					&blob_id);
+	if (ret) {
+		fprintf(stderr,  "%s(0x%02X): Failed to get PropertyBlob: %s\n",
+			__func__, crtc_id, strerror(errno));
+		return ret;
 	}
 
-	if (mode->hdisplay > mode->hsync_start) {
-		fprintf(stderr, "Error: HDisplay %d is above HSync Start %d\n",
-			mode->hdisplay, mode->hsync_start);
-		goto error;
+	request = drmModeAtomicAlloc();
+
+	drmModeAtomicAddProperty(request, crtc_id, prop_id, blob_id);
+
+	ret = drmModeAtomicCommit(kms_fd, request,
+				  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+
+	drmModeAtomicFree(request);
+	drmModeDestroyPropertyBlob(kms_fd, blob_id);
+
+	if (ret) {
+		fprintf(stderr, "%s(0x%02X): failed to set mode blob: %s\n",
+			__func__, crtc_id, strerror(errno));
+		return ret;
 	}
 
-	if (mode->hsync_start > mode->hsync_end) {
-		fprintf(stderr, "Error: HSync Start %d is above HSync End %d\n",
-			mode->hsync_start, mode->hsync_end);
-		goto error;
+	return 0;
+}
+
+/*
+ * Find the id of the named property of the given kms object, or 0.
+ */
+static uint32_t
+kms_property_id_get(uint32_t object_id, uint32_t object_type,
+		    const char *name)
+{
+	drmModeObjectProperties *properties;
+	uint32_t prop_id = 0;
+	int i;
+
+	properties = drmModeObjectGetProperties(kms_fd, object_id,
+						object_type);
+	if (!properties)
+		return 0;
+
+	for (i = 0; i < (int) properties->count_props; i++) {
+		drmModePropertyRes *property;
+
+		property = drmModeGetProperty(kms_fd, properties->props[i]);
+		if (!property)
+			continue;
+
+		if (!strcmp(property->name, name))
+			prop_id = property->prop_id;
+
+		drmModeFreeProperty(property);
+
+		if (prop_id)
+			break;
 	}
 
-	if (mode->hsync_end > mode->htotal) {
-		fprintf(stderr, "Error: HSync End %d is above HTotal %d\n",
-			mode->hsync_end, mode->htotal);
-		goto error;
+	drmModeFreeObjectProperties(properties);
+
+	return prop_id;
+}
+
+/*
+ * (Re-)connect a connector to a crtc, with the given mode. Needed after
+ * the display was unplugged, and something disabled our crtc.
+ */
+int
+kms_crtc_enable(uint32_t crtc_id, uint32_t connector_id,
+		struct _drmModeModeInfo *mode)
+{
+	drmModeAtomicReqPtr request;
+	uint32_t connector_crtc, crtc_mode, crtc_active, blob_id;
+	int ret;
+
+	connector_crtc = kms_property_id_get(connector_id,
+					     DRM_MODE_OBJECT_CONNECTOR,
+					     "CRTC_ID");
+	crtc_mode = kms_property_id_get(crtc_id, DRM_MODE_OBJECT_CRTC,
+					"MODE_ID");
+	crtc_active = kms_property_id_get(crtc_id, DRM_MODE_OBJECT_CRTC,
+					  "ACTIVE");
+	if (!connector_crtc || !crtc_mode || !crtc_active) {
+		fprintf(stderr, "%s(0x%02X): Failed to get properties.\n",
+			__func__, crtc_id);
+		return -EINVAL;
 	}
 
-	if (mode->vdisplay > mode->vsync_start) {
-		fprintf(stderr, "Error: VDisplay %d is above VSync Start %d\n",
-			mode->vdisplay, mode->vsync_start);
-		goto error;
+	ret = drmModeCreatePropertyBlob(kms_fd, mode,
+					sizeof(struct _drmModeModeInfo),
+					&blob_id);
+	if (ret) {
+		fprintf(stderr,  "%s(0x%02X): Failed to get PropertyBlob: %s\n",
+			__func__, crtc_id, strerror(errno));
+		return ret;
 	}
 
-	if (mode->vsync_start > mode->vsync_end) {
-		fprintf(stderr, "Error: VSync Start %d is above VSync End %d\n",
-			mode->vsync_start, mode->vsync_end);
-		goto error;
+	request = drmModeAtomicAlloc();
+
+	drmModeAtomicAddProperty(request, connector_id, connector_crtc,
+				 crtc_id);
+	drmModeAtomicAddProperty(request, crtc_id, crtc_mode, blob_id);
+	drmModeAtomicAddProperty(request, crtc_id, crtc_active, 1);
+
+	ret = drmModeAtomicCommit(kms_fd, request,
+				  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+
+	drmModeAtomicFree(request);
+	drmModeDestroyPropertyBlob(kms_fd, blob_id);
+
+	if (ret) {
+		fprintf(stderr, "%s(0x%02X): failed to enable crtc: %s\n",
+			__func__, crtc_id, strerror(errno));
+		return -errno;
 	}
 
-	if (mode->vsync_end > mode->vtotal) {
-		fprintf(stderr, "Error: VSync End %d is above VTotal %d\n",
-			mode->vsync_end, mode->vtotal);
-		goto error;
+	return 0;
+}
+
+/*
+ * Find out which of the colour management properties our crtc has, and
+ * how large its luts are.
+ */
+int
+kms_crtc_colour_get(uint32_t crtc_id, struct kms_crtc_colour *colour)
+{
+	drmModeObjectProperties *properties;
+	int i;
+
+	memset(colour, 0, sizeof(struct kms_crtc_colour));
+
+	properties = drmModeObjectGetProperties(kms_fd, crtc_id,
+						DRM_MODE_OBJECT_CRTC);
+	if (!properties) {
+		fprintf(stderr, "%s(0x%02X): Failed to get properties: %s\n",
+			__func__, crtc_id, strerror(errno));
+		return -errno;
 	}
 
-	/*
-	 * Here we lock down the vertical refresh to around 60Hz, as we
-	 * do not want to run our displays too far from 60Hz, even when
-	 * playing with the timing.
-	 *
-	 */
-	if (refresh < 55.0) {
-		fprintf(stderr, "Error: refresh rate too low: %2.2f\n",
-			refresh);
-		goto error;
+	for (i = 0; i < (int) properties->count_props; i++) {
+		drmModePropertyRes *property;
+		uint64_t value = properties->prop_values[i];
+
+		property = drmModeGetProperty(kms_fd, properties->props[i]);
+		if (!property)
+			continue;
+
+		if (!strcmp(property->name, "DEGAMMA_LUT"))
+			colour->property_degamma_lut = property->prop_id;
+		else if (!strcmp(property->name, "DEGAMMA_LUT_SIZE"))
+			colour->degamma_lut_size = value;
+		else if (!strcmp(property->name, "CTM"))
+			colour->property_ctm = property->prop_id;
+		else if (!strcmp(property->name, "GAMMA_LUT"))
+			colour->property_gamma_lut = property->prop_id;
+		else if (!strcmp(property->name, "GAMMA_LUT_SIZE"))
+			colour->gamma_lut_size = value;
+
+		drmModeFreeProperty(property);
+	}
+
+	drmModeFreeObjectProperties(properties);
+
+	/* a lut without a size is of no use to us. */
+	if (!colour->degamma_lut_size)
+		colour->property_degamma_lut = 0;
+	if (!colour->gamma_lut_size)
+		colour->property_gamma_lut = 0;
+
+	return 0;
+}
+
+/*
+ * Get the value of the named entry of an enum property.
+ */
+int
+kms_property_enum_get(uint32_t property_id, const char *name,
+		      uint64_t *value)
+{
+	drmModePropertyRes *property;
+	int i, ret = -ENOENT;
+
+	property = drmModeGetProperty(kms_fd, property_id);
+	if (!property)
+		return -errno;
+
+	for (i = 0; i < property->count_enums; i++)
+		if (!strcmp(property->enums[i].name, name)) {
+			*value = property->enums[i].value;
+			ret = 0;
+			break;
+		}
+
+	drmModeFreeProperty(property);
+
+	return ret;
+}
+
+/*
+ * Check whether what is now behind our connector still takes our mode,
+ * and if not, return the preferred mode of the display instead.
+ *
+ * Returns NULL when the mode is fine, or a freshly allocated mode.
+ */
+struct _drmModeModeInfo *
+kms_connector_mode_validate(uint32_t connector_id,
+			    struct _drmModeModeInfo *mode)
+{
+	drmModeConnector *connector;
+	struct _drmModeModeInfo *preferred = NULL;
+	int i;
+
+	connector = drmModeGetConnector(kms_fd, connector_id);
+	if (!connector) {
+		fprintf(stderr, "%s: failed to get Connector %u: %s\n",
+			__func__, connector_id, strerror(errno));
+		return NULL;
+	}
+
+	/* no modes means no edid, we then just keep trying ours. */
+	for (i = 0; i < connector->count_modes; i++) {
+		drmModeModeInfo *test = &connector->modes[i];
+
+		if ((test->hdisplay == mode->hdisplay) &&
+		    (test->vdisplay == mode->vdisplay) &&
+		    (test->vrefresh == mode->vrefresh))
+			break;
+
+		if (!preferred && (test->type & DRM_MODE_TYPE_PREFERRED))
+			preferred = test;
 	}
 
-	if (refresh > 65.0) {
-		fprintf(stderr, "Error: refresh rate too high: %2.2f\n",
-			refresh);
-		goto error;
+	if (!connector->count_modes || (i < connector->count_modes)) {
+		drmModeFreeConnector(connector);
+		return NULL;
 	}
 
-	return mode;
+	if (!preferred)
+		preferred = &connector->modes[0];
 
- error:
-	free(mode);
-	return NULL;
-}
+	mode = calloc(1, sizeof(struct _drmModeModeInfo));
+	if (mode)
+		memcpy(mode, preferred, sizeof(struct _drmModeModeInfo));
 
-void
-kms_modeline_print(struct _drmModeModeInfo *mode)
-{
-	printf("Modeline  \"%s\"  %.2f  %d %d %d %d  %d %d %d %d  "
-	       "%chsync %cvsync\n", mode->name, mode->clock / 1000.0,
-	       mode->hdisplay, mode->hsync_start, mode->hsync_end, mode->htotal,
-	       mode->vdisplay, mode->vsync_start, mode->vsync_end, mode->vtotal,
-	       (mode->flags & DRM_MODE_FLAG_PHSYNC) ? '+' : '-',
-	       (mode->flags & DRM_MODE_FLAG_PVSYNC) ? '+' : '-');
+	drmModeFreeConnector(connector);
+
+	return mode;
 }
 
-struct _drmModeModeInfo *
-kms_crtc_modeline_get(uint32_t crtc_id)
+/*
+ * Get the parsed EDID of whatever is attached to our connector, or NULL.
+ */
+struct edid *
+kms_connector_edid_get(uint32_t connector_id)
 {
-	drmModePropertyBlobRes *blob;
 	drmModeObjectProperties *properties;
-	struct _drmModeModeInfo *mode;
-	uint32_t blob_id;
+	drmModePropertyBlobRes *blob;
+	struct edid *edid;
+	uint32_t blob_id = 0;
 	int i;
 
-	properties = drmModeObjectGetProperties(kms_fd, crtc_id,
-						DRM_MODE_OBJECT_CRTC);
-	if (!properties) {
-		/* yes, if there are no properties, this returns EINVAL */
-		if (errno != EINVAL) {
-			fprintf(stderr,
-				"%s(0x%02X): Failed to get properties: %s\n",
-				__func__, crtc_id, strerror(errno));
-			return NULL;
-		}
-
+	properties = drmModeObjectGetProperties(kms_fd, connector_id,
+						DRM_MODE_OBJECT_CONNECTOR);
+	if (!properties)
 		return NULL;
-	}
 
 	for (i = 0; i < (int) properties->count_props; i++) {
 		drmModePropertyRes *property;
 
-		property = drmModeGetProperty(kms_fd,
-					      properties->props[i]);
-		if (!property) {
-			fprintf(stderr, "%s(0x%02X): Failed to get property"
-				" %u: %s\n", __func__, crtc_id,
-				properties->props[i], strerror(errno));
+		property = drmModeGetProperty(kms_fd, properties->props[i]);
+		if (!property)
 			continue;
-		}
 
-		if (!strcmp(property->name, "MODE_ID")) {
-			/*
-			 * So, wait, a blob id value comes from the list of
-			 * properties, and is not separately present in the
-			 * actual property? WTF?
-			 */
+		if (!strcmp(property->name, "EDID"))
 			blob_id = (uint32_t) properties->prop_values[i];
-			drmModeFreeProperty(property);
-			break;
-		}
 
 		drmModeFreeProperty(property);
-	}
 
-	if (i == (int) properties->count_props) {
-		fprintf(stderr, "%s(0x%02X): Failed to get MODE_ID property\n",
-			__func__, crtc_id);
-		drmModeFreeObjectProperties(properties);
-		return NULL;
+		if (blob_id)
+			break;
 	}
 
 	drmModeFreeObjectProperties(properties);
 
-	blob = drmModeGetPropertyBlob(kms_fd, blob_id);
-	if (!blob) {
-		fprintf(stderr, "%s(0x%02X): Failed to get property blob "
-			"%X: %s\n", __func__, crtc_id, blob_id,
-			strerror(errno));
+	if (!blob_id)
 		return NULL;
-	}
 
-	if (blob->length != sizeof(drmModeModeInfo)) {
-		fprintf(stderr, "%s(0x%02X): wrong blob size: "
-			"%d should be %d\n", __func__, crtc_id,
-			blob->length, (int) sizeof(drmModeModeInfo));
-		drmModeFreePropertyBlob(blob);
+	blob = drmModeGetPropertyBlob(kms_fd, blob_id);
+	if (!blob) {
+		fprintf(stderr, "%s(%u): Failed to get EDID blob %u: %s\n",
+			__func__, connector_id, blob_id, strerror(errno));
 		return NULL;
 	}
 
-	mode = calloc(1, sizeof(struct _drmModeModeInfo));
-	memcpy(mode, blob->data, sizeof(struct _drmModeModeInfo));
+	edid = edid_get(blob->data, blob->length);
 
 	drmModeFreePropertyBlob(blob);
 
-	return mode;
+	return edid;
 }
 
-int
-kms_crtc_modeline_set(uint32_t crtc_id, struct _drmModeModeInfo *mode)
+/* refresh rate of a kms mode, in mHz */
+static int
+kms_mode_refresh(drmModeModeInfo *mode)
 {
-	drmModeObjectProperties *properties;
-	drmModeAtomicReqPtr request;
-	uint32_t prop_id, blob_id;
-	int i, ret;
+	if (!mode->htotal || !mode->vtotal)
+		return 0;
 
-	properties = drmModeObjectGetProperties(kms_fd, crtc_id,
-						DRM_MODE_OBJECT_CRTC);
-	if (!properties) {
-		/* yes, if there are no properties, this returns EINVAL */
-		if (errno != EINVAL) {
-			fprintf(stderr,
-				"%s(0x%02X): Failed to get properties: %s\n",
-				__func__, crtc_id, strerror(errno));
-			return -errno;
-		}
+	return (uint64_t) mode->clock * 1000000ULL / mode->htotal /
+		mode->vtotal;
+}
 
-		return -1;
-	}
+/*
+ * Pick the mode of our connector which best matches what we capture:
+ * exact size first, so that we get to show it 1:1, then the rate, then
+ * what the display natively is.
+ *
+ * Returns a freshly allocated mode, or NULL.
+ */
+struct _drmModeModeInfo *
+kms_connector_mode_select(uint32_t connector_id, int width, int height,
+			  int refresh)
+{
+	drmModeConnector *connector;
+	struct _drmModeModeInfo *mode = NULL;
+	struct edid_timing *native = NULL;
+	struct edid *edid;
+	int64_t score, best_score = -1;
+	int i, best = -1;
 
-	for (i = 0; i < (int) properties->count_props; i++) {
-		drmModePropertyRes *property;
+	connector = drmModeGetConnector(kms_fd, connector_id);
+	if (!connector) {
+		fprintf(stderr, "%s: failed to get Connector %u: %s\n",
+			__func__, connector_id, strerror(errno));
+		return NULL;
+	}
 
-		property = drmModeGetProperty(kms_fd,
-					      properties->props[i]);
-		if (!property) {
-			fprintf(stderr, "%s(0x%02X): Failed to get property"
-				" %u: %s\n", __func__, crtc_id,
-				properties->props[i], strerror(errno));
-			continue;
-		}
+	edid = kms_connector_edid_get(connector_id);
+	if (edid)
+		native = edid_timing_native(edid);
 
-		if (!strcmp(property->name, "MODE_ID")) {
-			prop_id = property->prop_id;
-			drmModeFreeProperty(property);
-			break;
-		}
+	for (i = 0; i < connector->count_modes; i++) {
+		drmModeModeInfo *test = &connector->modes[i];
+		int delta;
 
-		drmModeFreeProperty(property);
-	}
+		/* we only ever capture progressive */
+		if (test->flags & DRM_MODE_FLAG_INTERLACE)
+			continue;
 
-	if (i == (int) properties->count_props) {
-		fprintf(stderr, "%s(0x%02X): Failed to get MODE_ID property\n",
-			__func__, crtc_id);
-		drmModeFreeObjectProperties(properties);
-		return -1;
-	}
+		delta = abs(kms_mode_refresh(test) - refresh);
+		if (delta > 0xFFFF)
+			delta = 0xFFFF;
 
-	drmModeFreeObjectProperties(properties);
+		score = 0xFFFF - delta;
 
-	ret = drmModeCreatePropertyBlob(kms_fd, mode,
-					sizeof(struct _drmModeModeInfo),
-					&blob_id);
-	if (ret) {
-		fprintf(stderr,  "%s(0x%02X): Failed to get PropertyBlob: %s\n",
-			__func__, crtc_id, strerror(errno));
-		return ret;
-	}
+		if ((test->hdisplay == width) && (test->vdisplay == height))
+			score += 1 << 20;
 
-	request = drmModeAtomicAlloc();
+		/* close enough for frame rate conversion or clock tracking */
+		if (delta <= (refresh / 100))
+			score += 1 << 19;
 
-	drmModeAtomicAddProperty(request, crtc_id, prop_id, blob_id);
+		if (native && (test->hdisplay == native->width) &&
+		    (test->vdisplay == native->height))
+			score += 1 << 18;
 
-	ret = drmModeAtomicCommit(kms_fd, request,
-				  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+		if (test->type & DRM_MODE_TYPE_PREFERRED)
+			score += 1 << 17;
 
-	drmModeAtomicFree(request);
-	drmModeDestroyPropertyBlob(kms_fd, blob_id);
+		if (score > best_score) {
+			best_score = score;
+			best = i;
+		}
+	}
 
-	if (ret) {
-		fprintf(stderr, "%s(0x%02X): failed to set mode blob: %s\n",
-			__func__, crtc_id, strerror(errno));
-		return ret;
+	if (best >= 0) {
+		mode = calloc(1, sizeof(struct _drmModeModeInfo));
+		if (mode)
+			memcpy(mode, &connector->modes[best],
+			       sizeof(struct _drmModeModeInfo));
 	}
 
-	return 0;
+	drmModeFreeConnector(connector);
+
+	return mode;
 }
 
 struct kms_plane *
@@ -796,12 +1453,20 @@ kms_plane_create(uint32_t plane_id)
 			plane->property_src_formats = property->prop_id;
 		else if (!strcmp(property->name, "alpha"))
 			plane->property_alpha = property->prop_id;
-		else if (!strcmp(property->name, "zpos"))
+		else if (!strcmp(property->name, "zpos")) {
 			plane->property_zpos = property->prop_id;
-		else if (!strcmp(property->name, "type"))
+			/* so that we can put things on top */
+			if ((property->flags & DRM_MODE_PROP_RANGE) &&
+			    (property->count_values == 2))
+				plane->zpos_max = property->values[1];
+		} else if (!strcmp(property->name, "type"))
 			plane->property_type = property->prop_id;
 		else if (!strcmp(property->name, "IN_FENCE_FD"))
 			plane->property_in_fence_id = property->prop_id;
+		else if (!strcmp(property->name, "COLOR_ENCODING"))
+			plane->property_color_encoding = property->prop_id;
+		else if (!strcmp(property->name, "COLOR_RANGE"))
+			plane->property_color_range = property->prop_id;
 		else
 			printf("Unhandled property: %s\n", property->name);
 
@@ -815,32 +1480,26 @@ kms_plane_create(uint32_t plane_id)
 	return plane;
 }
 
-struct kms_buffer *
-kms_buffer_get(int width, int height, uint32_t format)
+/*
+ * Create and map a dumb buffer, for an already filled in size.
+ */
+static int
+kms_buffer_dumb_create(struct kms_buffer *buffer, int bpp)
 {
-	struct kms_buffer *buffer;
 	struct drm_mode_create_dumb buffer_create = { 0 };
 	struct drm_mode_map_dumb buffer_map = { 0 };
-	uint32_t handles[4] = { 0 };
-	uint32_t pitches[4] = { 0 };
-	uint32_t offsets[4] = { 0 };
 	int ret;
 
-	buffer_create.width = width;
-	buffer_create.height = height;
-	buffer_create.bpp = 32;
+	buffer_create.width = buffer->width;
+	buffer_create.height = buffer->height;
+	buffer_create.bpp = bpp;
 	ret = drmIoctl(kms_fd, DRM_IOCTL_MODE_CREATE_DUMB, &buffer_create);
 	if (ret) {
 		fprintf(stderr, "%s: failed to create buffer: %s\n",
 			__func__, strerror(errno));
-		return NULL;
+		return -errno;
 	}
 
-	buffer = calloc(1, sizeof(struct kms_buffer));
-	buffer->width = width;
-	buffer->height = height;
-	buffer->format = format;
-
 	buffer->handle = buffer_create.handle;
 	buffer->size = buffer_create.size;
 	buffer->pitch = buffer_create.pitch;
@@ -850,7 +1509,7 @@ kms_buffer_get(int width, int height, uint32_t format)
 	if (ret) {
 		fprintf(stderr, "%s: failed to map buffer: %s\n",
 			__func__, strerror(errno));
-		return NULL;
+		return -errno;
 	}
 
 	buffer->map_offset = buffer_map.offset;
@@ -860,6 +1519,34 @@ kms_buffer_get(int width, int height, uint32_t format)
 	if (buffer->map == MAP_FAILED) {
 		fprintf(stderr, "%s: failed to mmap buffer: %s\n",
 			__func__, strerror(errno));
+		buffer->map = NULL;
+		return -errno;
+	}
+
+	return 0;
+}
+
+struct kms_buffer *
+kms_buffer_get(int width, int height, uint32_t format)
+{
+	struct kms_buffer *buffer;
+	uint32_t handles[4] = { 0 };
+	uint32_t pitches[4] = { 0 };
+	uint32_t offsets[4] = { 0 };
+	int ret;
+
+	buffer = calloc(1, sizeof(struct kms_buffer));
+	if (!buffer)
+		return NULL;
+
+	buffer->width = width;
+	buffer->height = height;
+	buffer->format = format;
+	buffer->export_fd = -1;
+
+	ret = kms_buffer_dumb_create(buffer, 32);
+	if (ret) {
+		kms_buffer_put(buffer);
 		return NULL;
 	}
 
@@ -872,6 +1559,7 @@ kms_buffer_get(int width, int height, uint32_t format)
 	if (ret) {
 		fprintf(stderr, "%s: failed to create fb: %s\n",
 			__func__, strerror(errno));
+		kms_buffer_put(buffer);
 		return NULL;
 	}
 
@@ -881,6 +1569,88 @@ kms_buffer_get(int width, int height, uint32_t format)
 	return buffer;
 }
 
+/*
+ * Undo kms_buffer_get().
+ */
+void
+kms_buffer_put(struct kms_buffer *buffer)
+{
+	if (!buffer)
+		return;
+
+	if (buffer->fb_id)
+		drmModeRmFB(kms_fd, buffer->fb_id);
+
+	kms_buffer_dmabuf_put(buffer);
+}
+
+/*
+ * A dumb buffer which only lives on as a dmabuf and a cpu mapping, for
+ * when we are the ones providing buffers to the display, like a v4l2
+ * device would. Importing the dmabuf gets kms a handle of its own, so
+ * kms_buffer_release() does not close a handle from under us.
+ */
+struct kms_buffer *
+kms_buffer_dmabuf_get(int width, int height, int bpp)
+{
+	struct kms_buffer *buffer;
+	struct drm_gem_close gem_close[1] = {{ 0 }};
+	int ret;
+
+	buffer = calloc(1, sizeof(struct kms_buffer));
+	if (!buffer)
+		return NULL;
+
+	buffer->width = width;
+	buffer->height = height;
+	buffer->export_fd = -1;
+
+	ret = kms_buffer_dumb_create(buffer, bpp);
+	if (ret)
+		goto error;
+
+	ret = drmPrimeHandleToFD(kms_fd, buffer->handle, DRM_CLOEXEC,
+				 &buffer->export_fd);
+	if (ret) {
+		fprintf(stderr, "%s: failed to export buffer: %s\n",
+			__func__, strerror(errno));
+		goto error;
+	}
+
+	gem_close->handle = buffer->handle;
+	drmIoctl(kms_fd, DRM_IOCTL_GEM_CLOSE, gem_close);
+	buffer->handle = 0;
+
+	return buffer;
+
+ error:
+	kms_buffer_dmabuf_put(buffer);
+	return NULL;
+}
+
+void
+kms_buffer_dmabuf_put(struct kms_buffer *buffer)
+{
+	if (!buffer)
+		return;
+
+	if (buffer->map)
+		munmap(buffer->map, buffer->size);
+
+	if (buffer->export_fd >= 0)
+		close(buffer->export_fd);
+
+	if (buffer->handle) {
+		struct drm_gem_close gem_close[1] = {{
+			.handle = buffer->handle,
+		}};
+
+		drmIoctl(kms_fd, DRM_IOCTL_GEM_CLOSE, gem_close);
+	}
+
+	free(buffer);
+}
+
 /*
  *
  */
@@ -892,7 +1662,7 @@ kms_buffer_import(struct capture_buffer *buffer)
 	uint32_t offsets[4] = { 0 };
 	int ret, i;
 
-	for (i = 0; i < 3; i++) {
+	for (i = 0; i < buffer->plane_count; i++) {
 		struct drm_prime_handle prime[1] = {{
 				.fd = buffer->planes[i].export_fd,
 			}};
@@ -946,7 +1716,7 @@ kms_buffer_release(struct capture_buffer *buffer)
 		return ret;
 	}
 
-	for (i = 0; i < 3; i++) {
+	for (i = 0; i < buffer->plane_count; i++) {
 		struct drm_gem_close gem_close[1] = {{
 			.handle = buffer->planes[i].prime_handle,
 		}};
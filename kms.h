@@ -27,6 +27,7 @@
 #endif
 
 struct capture_buffer;
+struct edid;
 struct _drmModeAtomicReq;
 struct _drmModeModeInfo;
 
@@ -46,6 +47,8 @@ struct kms_buffer {
 	void *map;
 
 	uint32_t fb_id;
+
+	int export_fd; /* dmabuf, when there is no handle */
 };
 
 struct kms_plane {
@@ -66,8 +69,24 @@ struct kms_plane {
 	uint32_t property_src_formats;
 	uint32_t property_alpha;
 	uint32_t property_zpos;
+	uint64_t zpos_max;
 	uint32_t property_type;
 	uint32_t property_in_fence_id;
+	/* how yuv gets converted to rgb */
+	uint32_t property_color_encoding;
+	uint32_t property_color_range;
+};
+
+/*
+ * Colour management of a crtc: degamma lut, colour transformation matrix
+ * and gamma lut, in that order. Zero where the hardware does not have it.
+ */
+struct kms_crtc_colour {
+	uint32_t property_degamma_lut;
+	uint32_t degamma_lut_size;
+	uint32_t property_ctm;
+	uint32_t property_gamma_lut;
+	uint32_t gamma_lut_size;
 };
 
 int kms_connector_id_get(uint32_t type, uint32_t *id_ret);
@@ -77,17 +96,37 @@ int kms_connection_check(uint32_t connector_id, bool *connected,
 int kms_crtc_id_get(uint32_t encoder_id, uint32_t *crtc_id, bool *ok,
 		    int *width, int *height);
 
+struct _drmModeModeInfo *kms_modeline_cvt(int width, int height, int refresh,
+					  bool reduced);
+struct _drmModeModeInfo *kms_modeline_tfp401(int width, int height,
+					     int refresh);
+struct _drmModeModeInfo *kms_modeline_string_parse(const char *string);
 struct _drmModeModeInfo *kms_modeline_arguments_parse(int argc, char *argv[]);
 void kms_modeline_print(struct _drmModeModeInfo *mode);
 struct _drmModeModeInfo *kms_crtc_modeline_get(uint32_t crtc_id);
 int kms_crtc_modeline_set(uint32_t crtc_id, struct _drmModeModeInfo *mode);
 int kms_crtc_index_get(uint32_t id);
+int kms_crtc_enable(uint32_t crtc_id, uint32_t connector_id,
+		    struct _drmModeModeInfo *mode);
+int kms_crtc_colour_get(uint32_t crtc_id, struct kms_crtc_colour *colour);
+int kms_property_enum_get(uint32_t property_id, const char *name,
+			  uint64_t *value);
+struct _drmModeModeInfo *
+kms_connector_mode_validate(uint32_t connector_id,
+			    struct _drmModeModeInfo *mode);
+struct edid *kms_connector_edid_get(uint32_t connector_id);
+struct _drmModeModeInfo *
+kms_connector_mode_select(uint32_t connector_id, int width, int height,
+			  int refresh);
 
 struct kms_plane *kms_plane_create(uint32_t plane_id);
 void kms_plane_disable(struct kms_plane *kms_plane,
 		       struct _drmModeAtomicReq *request);
 
 struct kms_buffer *kms_buffer_get(int width, int height, uint32_t format);
+void kms_buffer_put(struct kms_buffer *buffer);
+struct kms_buffer *kms_buffer_dmabuf_get(int width, int height, int bpp);
+void kms_buffer_dmabuf_put(struct kms_buffer *buffer);
 struct kms_buffer *kms_png_read(const char *filename);
 
 int kms_buffer_import(struct capture_buffer *buffer);
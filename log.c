@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Logging for our capture and display threads, which are not allowed to
+ * block on a (serial) console.
+ *
+ * Each thread formats its messages into its own single producer, single
+ * consumer ring, and a background thread writes them out. When a ring is
+ * full, messages are dropped and counted, never waited for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "juggler.h"
+#include "log.h"
+#include "thread.h"
+
+#define LOG_RING_SIZE 64 /* power of two */
+#define LOG_MESSAGE_SIZE 248
+
+/* per call site, per second */
+#define LOG_RATELIMIT_BURST 10
+#define LOG_RATELIMIT_WINDOW 1000000000ULL
+
+/* how long the writer sleeps when there is nothing to do */
+#define LOG_WRITER_SLEEP 10000
+
+struct log_message {
+	enum log_level level;
+	char text[LOG_MESSAGE_SIZE];
+};
+
+struct log_ring {
+	struct log_ring *next;
+
+	atomic_uint head; /* written by the owning thread only */
+	atomic_uint tail; /* written by the log writer only */
+	atomic_uint dropped;
+
+	struct log_message messages[LOG_RING_SIZE];
+};
+
+static _Atomic(struct log_ring *) log_rings;
+static __thread struct log_ring *log_ring_self;
+
+static enum log_level log_level = LOG_INFO;
+static bool log_threaded;
+
+static pthread_t log_thread[1];
+
+static uint64_t
+log_time_get(void)
+{
+	struct timespec now[1];
+
+	clock_gettime(CLOCK_MONOTONIC, now);
+
+	return now->tv_sec * 1000000000ULL + now->tv_nsec;
+}
+
+/*
+ * Rings are never freed, and the list only grows at its head, so
+ * registering a new thread needs no lock either.
+ */
+static struct log_ring *
+log_ring_get(void)
+{
+	struct log_ring *ring = log_ring_self;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(struct log_ring));
+	if (!ring)
+		return NULL;
+
+	ring->next = atomic_load(&log_rings);
+	while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring))
+		;
+
+	log_ring_self = ring;
+	return ring;
+}
+
+static void
+log_message_write(struct log_message *message)
+{
+	FILE *file = (message->level <= LOG_WARNING) ? stderr : stdout;
+
+	fputs(message->text, file);
+}
+
+void
+log_printf(enum log_level level, const char *format, ...)
+{
+	struct log_ring *ring;
+	struct log_message *message;
+	unsigned int head, tail;
+	va_list arguments;
+
+	if (level > log_level)
+		return;
+
+	va_start(arguments, format);
+
+	if (!log_threaded) {
+		/* no writer (yet), so there is nothing to hand off to. */
+		vfprintf((level <= LOG_WARNING) ? stderr : stdout, format,
+			 arguments);
+		va_end(arguments);
+		return;
+	}
+
+	ring = log_ring_get();
+	if (!ring) {
+		va_end(arguments);
+		return;
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if ((head - tail) >= LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1,
+					  memory_order_relaxed);
+		va_end(arguments);
+		return;
+	}
+
+	message = &ring->messages[head & (LOG_RING_SIZE - 1)];
+	message->level = level;
+	vsnprintf(message->text, LOG_MESSAGE_SIZE, format, arguments);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	va_end(arguments);
+}
+
+/*
+ * Returns whether a message at this call site may go through. Once a new
+ * window starts, we tell how many messages we swallowed.
+ */
+bool
+log_ratelimit_check(struct log_ratelimit *ratelimit)
+{
+	uint64_t now = log_time_get();
+
+	if ((now - ratelimit->window_start) > LOG_RATELIMIT_WINDOW) {
+		if (ratelimit->suppressed)
+			log_printf(LOG_WARNING, "(%d similar messages "
+				   "suppressed)\n", ratelimit->suppressed);
+
+		ratelimit->window_start = now;
+		ratelimit->count = 0;
+		ratelimit->suppressed = 0;
+	}
+
+	if (ratelimit->count >= LOG_RATELIMIT_BURST) {
+		ratelimit->suppressed++;
+		return false;
+	}
+
+	ratelimit->count++;
+	return true;
+}
+
+static int
+log_ring_flush(struct log_ring *ring)
+{
+	unsigned int head, tail, dropped;
+	int count = 0;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	for (; tail != head; tail++, count++) {
+		log_message_write(&ring->messages[tail & (LOG_RING_SIZE - 1)]);
+		atomic_store_explicit(&ring->tail, tail + 1,
+				      memory_order_release);
+	}
+
+	dropped = atomic_exchange_explicit(&ring->dropped, 0,
+					   memory_order_relaxed);
+	if (dropped)
+		fprintf(stderr, "Log: dropped %u messages.\n", dropped);
+
+	return count;
+}
+
+static void *
+log_thread_handler(void *arg)
+{
+	while (true) {
+		struct log_ring *ring;
+		int count = 0;
+
+		for (ring = atomic_load(&log_rings); ring; ring = ring->next)
+			count += log_ring_flush(ring);
+
+		if (count) {
+			fflush(stdout);
+			fflush(stderr);
+		} else
+			usleep(LOG_WRITER_SLEEP);
+	}
+
+	return NULL;
+}
+
+int
+log_init(enum log_level level)
+{
+	int ret;
+
+	log_level = level;
+
+	ret = thread_create(log_thread, THREAD_ROLE_LOG, log_thread_handler,
+			    NULL);
+	if (ret) {
+		fprintf(stderr, "%s() log thread creation failed: %s\n",
+			__func__, strerror(ret));
+		return ret;
+	}
+
+	log_threaded = true;
+
+	return 0;
+}
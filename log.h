@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_LOG_H_
+#define _HAVE_LOG_H_ 1
+
+enum log_level {
+	LOG_ERROR = 0,
+	LOG_WARNING,
+	LOG_INFO,
+	LOG_DEBUG,
+};
+
+struct log_ratelimit {
+	uint64_t window_start;
+	int count;
+	int suppressed;
+};
+
+void log_printf(enum log_level level, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+bool log_ratelimit_check(struct log_ratelimit *ratelimit);
+
+#define log_error(...) log_printf(LOG_ERROR, __VA_ARGS__)
+#define log_warning(...) log_printf(LOG_WARNING, __VA_ARGS__)
+#define log_info(...) log_printf(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_printf(LOG_DEBUG, __VA_ARGS__)
+
+/*
+ * Every call site gets its own budget of messages per second.
+ */
+#define log_ratelimited(level, ...) \
+	do { \
+		static struct log_ratelimit _ratelimit[1]; \
+		if (log_ratelimit_check(_ratelimit)) \
+			log_printf((level), __VA_ARGS__); \
+	} while (0)
+
+int log_init(enum log_level level);
+
+#endif /* _HAVE_LOG_H_ */
@@ -0,0 +1,531 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Route capture buffers through the demp as dmabufs, and hand the NV12
+ * buffers it produces to the projector, so that no cpu touches a pixel.
+ * NV12 is half the size of our planar 24bit rgb, which halves what the
+ * projector scaler needs to read. Without a demp, the cpu does the
+ * conversion instead.
+ *
+ * Our thread owns the demp, the capture and projector threads only hand
+ * us buffers through a small mailbox.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include <linux/videodev2.h>
+
+#include <drm_fourcc.h>
+
+#include "juggler.h"
+#include "log.h"
+#include "thread.h"
+#include "capture.h"
+#include "kms.h"
+#include "demp.h"
+#include "frc.h"
+#include "projector.h"
+#include "nv12.h"
+
+/* inputs only need to cover capture running ahead of the demp */
+#define NV12_INPUT_COUNT 2
+/* the projector holds on to its current frame and its frc queue */
+#define NV12_OUTPUT_COUNT 6
+
+static pthread_t nv12_thread[1];
+static int nv12_event_fd = -1;
+
+/* mailbox, filled by the capture and projector threads */
+static pthread_mutex_t nv12_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+static struct capture_buffer *nv12_pending;
+static bool nv12_stop_pending;
+static uint32_t nv12_released;
+static bool nv12_broken;
+
+/* only touched by our own thread */
+static struct demp *nv12_demp;
+static bool nv12_stopping;
+static uint32_t nv12_held; /* outputs that the projector is using */
+static struct capture_buffer *nv12_inputs[DEMP_BUFFER_COUNT_MAX];
+static struct capture_buffer nv12_outputs[DEMP_BUFFER_COUNT_MAX];
+
+/* the demp works in order, so we can tell which output was which frame */
+static struct nv12_frame {
+	uint32_t sequence;
+	struct timeval timestamp;
+} nv12_frames[DEMP_QUEUED_MAX];
+static int nv12_frames_head;
+static int nv12_frames_tail;
+
+static void
+nv12_signal(void)
+{
+	uint64_t one = 1;
+
+	if (write(nv12_event_fd, &one, sizeof(one)) != sizeof(one))
+		log_error("%s(): write(): %s\n", __func__, strerror(errno));
+}
+
+/*
+ * Called by whoever drops the last reference on one of our outputs.
+ */
+static void
+nv12_output_requeue(struct capture_buffer *buffer)
+{
+	pthread_mutex_lock(nv12_mutex);
+	nv12_released |= 1 << buffer->index;
+	pthread_mutex_unlock(nv12_mutex);
+
+	nv12_signal();
+}
+
+void
+nv12_capture_display(struct capture_buffer *buffer)
+{
+	struct capture_buffer *old;
+	bool broken;
+
+	pthread_mutex_lock(nv12_mutex);
+	broken = nv12_broken;
+	old = nv12_pending;
+	if (!broken)
+		nv12_pending = buffer;
+	pthread_mutex_unlock(nv12_mutex);
+
+	/* we failed to set up the demp, so just show capture directly */
+	if (broken) {
+		kms_projector_capture_display(buffer);
+		return;
+	}
+
+	/* the demp is behind, only the newest frame matters. */
+	if (old)
+		capture_buffer_display_release(old);
+
+	nv12_signal();
+}
+
+void
+nv12_capture_stop(void)
+{
+	struct capture_buffer *old;
+
+	pthread_mutex_lock(nv12_mutex);
+	old = nv12_pending;
+	nv12_pending = NULL;
+	nv12_stop_pending = true;
+	pthread_mutex_unlock(nv12_mutex);
+
+	if (old)
+		capture_buffer_display_release(old);
+
+	nv12_signal();
+}
+
+static int
+nv12_outputs_import(struct demp *demp)
+{
+	int ret, i, j;
+
+	for (i = 0; i < demp->output_count; i++) {
+		struct demp_buffer *output = &demp->outputs[i];
+		struct capture_buffer *buffer = &nv12_outputs[i];
+
+		ret = demp_output_export(demp, i);
+		if (ret)
+			return ret;
+
+		buffer->index = i;
+		buffer->width = demp->width;
+		buffer->height = demp->height;
+		buffer->pitch = output->planes[0].pitch;
+		buffer->plane_size = output->planes[0].size;
+		buffer->v4l2_fourcc = V4L2_PIX_FMT_NV12;
+		buffer->drm_format = DRM_FORMAT_NV12;
+		buffer->plane_count = output->plane_count;
+		for (j = 0; j < output->plane_count; j++)
+			buffer->planes[j].export_fd =
+				output->planes[j].export_fd;
+		buffer->requeue = nv12_output_requeue;
+
+		ret = kms_buffer_import(buffer);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void
+nv12_outputs_release(struct demp *demp)
+{
+	int i;
+
+	for (i = 0; i < demp->output_count; i++) {
+		if (nv12_outputs[i].kms_fb_id)
+			kms_buffer_release(&nv12_outputs[i]);
+		nv12_outputs[i].kms_fb_id = 0;
+	}
+}
+
+static int
+nv12_demp_setup(struct capture_buffer *buffer)
+{
+	struct demp *demp;
+	int ret, i, j;
+
+	demp = demp_create(buffer->width, buffer->height, NV12_INPUT_COUNT,
+			   NV12_OUTPUT_COUNT, true, false);
+	if (!demp) {
+		log_info("NV12: no demp, converting on the cpu.\n");
+		demp = demp_create(buffer->width, buffer->height,
+				   NV12_INPUT_COUNT, NV12_OUTPUT_COUNT, true,
+				   true);
+	}
+	if (!demp)
+		return -ENODEV;
+
+	if (demp->software) {
+		/* the cpu takes capture planes as they come. */
+		for (i = 0; i < demp->input_count; i++)
+			for (j = 0; j < 3; j++) {
+				demp->inputs[i].planes[j].pitch =
+					buffer->pitch;
+				demp->inputs[i].planes[j].size =
+					buffer->plane_size;
+			}
+	} else if (demp->inputs[0].planes[0].pitch != (int) buffer->pitch) {
+		/* the demp gets no say in how capture lays out its planes */
+		log_error("%s(): demp wants a %d byte pitch, capture has "
+			  "%d.\n", __func__, demp->inputs[0].planes[0].pitch,
+			  (int) buffer->pitch);
+		demp_destroy(demp);
+		return -EINVAL;
+	}
+
+	ret = nv12_outputs_import(demp);
+	if (ret)
+		goto error;
+
+	for (i = 0; i < demp->output_count; i++) {
+		ret = demp_output_queue(demp, i);
+		if (ret)
+			goto error;
+	}
+
+	ret = demp_streaming_start(demp);
+	if (ret)
+		goto error;
+
+	nv12_frames_head = 0;
+	nv12_frames_tail = 0;
+	nv12_held = 0;
+	nv12_demp = demp;
+
+	log_info("NV12: converting %dx%d capture.\n", demp->width,
+		 demp->height);
+
+	return 0;
+
+ error:
+	nv12_outputs_release(demp);
+	demp_destroy(demp);
+	return ret;
+}
+
+/*
+ * Only once the projector has let go of all our outputs, we can get rid
+ * of the demp, as capture might come back with a different size.
+ */
+static void
+nv12_demp_teardown(void)
+{
+	struct demp *demp = nv12_demp;
+
+	nv12_outputs_release(demp);
+	demp_destroy(demp);
+	nv12_demp = NULL;
+	nv12_stopping = false;
+
+	log_info("NV12: stopped.\n");
+}
+
+static void
+nv12_inputs_release(void)
+{
+	int i;
+
+	for (i = 0; i < DEMP_BUFFER_COUNT_MAX; i++)
+		if (nv12_inputs[i]) {
+			capture_buffer_display_release(nv12_inputs[i]);
+			nv12_inputs[i] = NULL;
+		}
+}
+
+static void
+nv12_stop(void)
+{
+	if (!nv12_demp)
+		return;
+
+	/* this gives us back all buffers, without dequeueing. */
+	demp_streaming_stop(nv12_demp);
+
+	nv12_inputs_release();
+	nv12_stopping = true;
+}
+
+static void
+nv12_frame_queue(struct capture_buffer *buffer)
+{
+	struct demp *demp;
+	struct nv12_frame *frame;
+	int fds[3], ret, i;
+
+	if (nv12_stopping) {
+		capture_buffer_display_release(buffer);
+		return;
+	}
+
+	if (!nv12_demp) {
+		ret = nv12_demp_setup(buffer);
+		if (ret) {
+			log_error("NV12: failed to set up the demp, showing "
+				  "capture directly.\n");
+
+			pthread_mutex_lock(nv12_mutex);
+			nv12_broken = true;
+			pthread_mutex_unlock(nv12_mutex);
+
+			kms_projector_capture_display(buffer);
+			return;
+		}
+	}
+
+	demp = nv12_demp;
+
+	for (i = 0; i < demp->input_count; i++)
+		if (!nv12_inputs[i])
+			break;
+
+	if (i == demp->input_count) {
+		log_ratelimited(LOG_DEBUG, "NV12: demp is behind, dropping "
+				"frame %u.\n", buffer->sequence);
+		capture_buffer_display_release(buffer);
+		return;
+	}
+
+	fds[0] = buffer->planes[0].export_fd;
+	fds[1] = buffer->planes[1].export_fd;
+	fds[2] = buffer->planes[2].export_fd;
+
+	ret = demp_input_import_queue(demp, i, fds);
+	if (ret) {
+		capture_buffer_display_release(buffer);
+		return;
+	}
+
+	nv12_inputs[i] = buffer;
+
+	frame = &nv12_frames[nv12_frames_head];
+	frame->sequence = buffer->sequence;
+	frame->timestamp = buffer->timestamp;
+	nv12_frames_head = (nv12_frames_head + 1) % DEMP_QUEUED_MAX;
+}
+
+/*
+ * Pick up whatever the other threads left for us.
+ */
+static void
+nv12_mailbox_handle(void)
+{
+	struct capture_buffer *pending;
+	uint32_t released;
+	bool stop;
+	int i;
+
+	pthread_mutex_lock(nv12_mutex);
+	pending = nv12_pending;
+	nv12_pending = NULL;
+	stop = nv12_stop_pending;
+	nv12_stop_pending = false;
+	released = nv12_released;
+	nv12_released = 0;
+	pthread_mutex_unlock(nv12_mutex);
+
+	for (i = 0; i < DEMP_BUFFER_COUNT_MAX; i++) {
+		if (!(released & (1 << i)))
+			continue;
+
+		nv12_held &= ~(1 << i);
+		if (nv12_demp && !nv12_stopping)
+			demp_output_queue(nv12_demp, i);
+	}
+
+	if (stop)
+		nv12_stop();
+
+	if (nv12_stopping && !nv12_held)
+		nv12_demp_teardown();
+
+	if (pending)
+		nv12_frame_queue(pending);
+}
+
+static void
+nv12_demp_handle(void)
+{
+	struct demp *demp = nv12_demp;
+	int index;
+
+	while ((index = demp_input_dequeue(demp)) >= 0) {
+		struct capture_buffer *buffer = nv12_inputs[index];
+
+		nv12_inputs[index] = NULL;
+		if (buffer)
+			capture_buffer_display_release(buffer);
+	}
+
+	while ((index = demp_output_dequeue(demp)) >= 0) {
+		struct capture_buffer *buffer = &nv12_outputs[index];
+		struct nv12_frame *frame = &nv12_frames[nv12_frames_tail];
+
+		if (nv12_frames_tail != nv12_frames_head) {
+			buffer->sequence = frame->sequence;
+			buffer->timestamp = frame->timestamp;
+			nv12_frames_tail =
+				(nv12_frames_tail + 1) % DEMP_QUEUED_MAX;
+		}
+
+		pthread_mutex_lock(buffer->reference_count_mutex);
+		buffer->reference_count = 1;
+		pthread_mutex_unlock(buffer->reference_count_mutex);
+
+		buffer->queued = thread_time_get();
+		nv12_held |= 1 << index;
+
+		kms_projector_capture_display(buffer);
+	}
+}
+
+/* m2m poll errors out when nothing is queued, so check first. */
+static bool
+nv12_demp_busy(void)
+{
+	struct demp *demp = nv12_demp;
+	int i;
+
+	if (!demp || nv12_stopping)
+		return false;
+
+	for (i = 0; i < demp->input_count; i++)
+		if (demp->inputs[i].queued)
+			return true;
+
+	for (i = 0; i < demp->output_count; i++)
+		if (demp->outputs[i].queued)
+			return true;
+
+	return false;
+}
+
+static void *
+nv12_thread_handler(void *arg)
+{
+	while (true) {
+		struct pollfd fds[2] = {
+			{
+				.fd = nv12_event_fd,
+				.events = POLLIN,
+			}, {
+				.fd = -1,
+			},
+		};
+		bool busy = nv12_demp_busy();
+		uint64_t count;
+		int ret;
+
+		if (busy) {
+			fds[1].fd = nv12_demp->fd;
+			fds[1].events = nv12_demp->poll_events;
+		}
+
+		ret = poll(fds, 2, 1000);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			log_error("%s(): poll(): %s\n", __func__,
+				  strerror(errno));
+			return NULL;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			if (read(nv12_event_fd, &count, sizeof(count)) < 0)
+				log_error("%s(): read(): %s\n", __func__,
+					  strerror(errno));
+		}
+
+		if (busy)
+			nv12_demp_handle();
+
+		nv12_mailbox_handle();
+	}
+
+	return NULL;
+}
+
+int
+nv12_init(void)
+{
+	int ret, i;
+
+	for (i = 0; i < DEMP_BUFFER_COUNT_MAX; i++) {
+		pthread_mutex_init(nv12_outputs[i].reference_count_mutex,
+				   NULL);
+		pthread_mutex_init(nv12_outputs[i].map_mutex, NULL);
+	}
+
+	nv12_event_fd = eventfd(0, EFD_NONBLOCK);
+	if (nv12_event_fd < 0) {
+		fprintf(stderr, "%s(): eventfd(): %s\n", __func__,
+			strerror(errno));
+		return -errno;
+	}
+
+	ret = thread_create(nv12_thread, THREAD_ROLE_NV12,
+			    nv12_thread_handler, NULL);
+	if (ret) {
+		fprintf(stderr, "%s() thread creation failed: %s\n",
+			__func__, strerror(ret));
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Text overlay for the status lcd.
+ *
+ * A fixed grid of character cells, rendered into a pair of ARGB8888 dumb
+ * buffers. The font is rasterized once, at creation time, into an atlas
+ * of complete cells, background included, so drawing a character is
+ * nothing but copying rows. Each buffer remembers which text it holds,
+ * and only the cells which differ get copied, so a typical update of a
+ * few digits costs a handful of small memcpys. When the text did not
+ * change at all, nothing is rendered and there is nothing to flip.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#include <drm_fourcc.h>
+
+#include "juggler.h"
+#include "log.h"
+#include "kms.h"
+#include "overlay.h"
+
+/* print our statistics about every 5 minutes, at one render a second. */
+#define OVERLAY_STATISTICS_COUNT 300
+
+#define OVERLAY_GLYPH_FIRST 0x20
+#define OVERLAY_GLYPH_LAST 0x7E
+#define OVERLAY_GLYPH_COUNT (OVERLAY_GLYPH_LAST - OVERLAY_GLYPH_FIRST + 1)
+
+/* 5x7 glyphs, scaled up 2x, with a column and 2 rows of spacing. */
+#define OVERLAY_GLYPH_WIDTH 5
+#define OVERLAY_GLYPH_HEIGHT 7
+#define OVERLAY_GLYPH_SCALE 2
+
+#define OVERLAY_COLOUR_TEXT 0xFFFFFFFF
+#define OVERLAY_COLOUR_BACKGROUND 0xA0000000
+
+/*
+ * The classic 5x7 lcd font, one byte per column, top row in bit 0.
+ */
+static const uint8_t overlay_font[OVERLAY_GLYPH_COUNT][OVERLAY_GLYPH_WIDTH] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00 }, /* space */
+	{ 0x00, 0x00, 0x5F, 0x00, 0x00 }, /* ! */
+	{ 0x00, 0x07, 0x00, 0x07, 0x00 }, /* " */
+	{ 0x14, 0x7F, 0x14, 0x7F, 0x14 }, /* # */
+	{ 0x24, 0x2A, 0x7F, 0x2A, 0x12 }, /* $ */
+	{ 0x23, 0x13, 0x08, 0x64, 0x62 }, /* % */
+	{ 0x36, 0x49, 0x55, 0x22, 0x50 }, /* & */
+	{ 0x00, 0x05, 0x03, 0x00, 0x00 }, /* ' */
+	{ 0x00, 0x1C, 0x22, 0x41, 0x00 }, /* ( */
+	{ 0x00, 0x41, 0x22, 0x1C, 0x00 }, /* ) */
+	{ 0x14, 0x08, 0x3E, 0x08, 0x14 }, /* * */
+	{ 0x08, 0x08, 0x3E, 0x08, 0x08 }, /* + */
+	{ 0x00, 0x50, 0x30, 0x00, 0x00 }, /* , */
+	{ 0x08, 0x08, 0x08, 0x08, 0x08 }, /* - */
+	{ 0x00, 0x60, 0x60, 0x00, 0x00 }, /* . */
+	{ 0x20, 0x10, 0x08, 0x04, 0x02 }, /* / */
+	{ 0x3E, 0x51, 0x49, 0x45, 0x3E }, /* 0 */
+	{ 0x00, 0x42, 0x7F, 0x40, 0x00 }, /* 1 */
+	{ 0x42, 0x61, 0x51, 0x49, 0x46 }, /* 2 */
+	{ 0x21, 0x41, 0x45, 0x4B, 0x31 }, /* 3 */
+	{ 0x18, 0x14, 0x12, 0x7F, 0x10 }, /* 4 */
+	{ 0x27, 0x45, 0x45, 0x45, 0x39 }, /* 5 */
+	{ 0x3C, 0x4A, 0x49, 0x49, 0x30 }, /* 6 */
+	{ 0x01, 0x71, 0x09, 0x05, 0x03 }, /* 7 */
+	{ 0x36, 0x49, 0x49, 0x49, 0x36 }, /* 8 */
+	{ 0x06, 0x49, 0x49, 0x29, 0x1E }, /* 9 */
+	{ 0x00, 0x36, 0x36, 0x00, 0x00 }, /* : */
+	{ 0x00, 0x56, 0x36, 0x00, 0x00 }, /* ; */
+	{ 0x08, 0x14, 0x22, 0x41, 0x00 }, /* < */
+	{ 0x14, 0x14, 0x14, 0x14, 0x14 }, /* = */
+	{ 0x00, 0x41, 0x22, 0x14, 0x08 }, /* > */
+	{ 0x02, 0x01, 0x51, 0x09, 0x06 }, /* ? */
+	{ 0x32, 0x49, 0x79, 0x41, 0x3E }, /* @ */
+	{ 0x7E, 0x11, 0x11, 0x11, 0x7E }, /* A */
+	{ 0x7F, 0x49, 0x49, 0x49, 0x36 }, /* B */
+	{ 0x3E, 0x41, 0x41, 0x41, 0x22 }, /* C */
+	{ 0x7F, 0x41, 0x41, 0x22, 0x1C }, /* D */
+	{ 0x7F, 0x49, 0x49, 0x49, 0x41 }, /* E */
+	{ 0x7F, 0x09, 0x09, 0x09, 0x01 }, /* F */
+	{ 0x3E, 0x41, 0x49, 0x49, 0x7A }, /* G */
+	{ 0x7F, 0x08, 0x08, 0x08, 0x7F }, /* H */
+	{ 0x00, 0x41, 0x7F, 0x41, 0x00 }, /* I */
+	{ 0x20, 0x40, 0x41, 0x3F, 0x01 }, /* J */
+	{ 0x7F, 0x08, 0x14, 0x22, 0x41 }, /* K */
+	{ 0x7F, 0x40, 0x40, 0x40, 0x40 }, /* L */
+	{ 0x7F, 0x02, 0x0C, 0x02, 0x7F }, /* M */
+	{ 0x7F, 0x04, 0x08, 0x10, 0x7F }, /* N */
+	{ 0x3E, 0x41, 0x41, 0x41, 0x3E }, /* O */
+	{ 0x7F, 0x09, 0x09, 0x09, 0x06 }, /* P */
+	{ 0x3E, 0x41, 0x51, 0x21, 0x5E }, /* Q */
+	{ 0x7F, 0x09, 0x19, 0x29, 0x46 }, /* R */
+	{ 0x46, 0x49, 0x49, 0x49, 0x31 }, /* S */
+	{ 0x01, 0x01, 0x7F, 0x01, 0x01 }, /* T */
+	{ 0x3F, 0x40, 0x40, 0x40, 0x3F }, /* U */
+	{ 0x1F, 0x20, 0x40, 0x20, 0x1F }, /* V */
+	{ 0x3F, 0x40, 0x38, 0x40, 0x3F }, /* W */
+	{ 0x63, 0x14, 0x08, 0x14, 0x63 }, /* X */
+	{ 0x07, 0x08, 0x70, 0x08, 0x07 }, /* Y */
+	{ 0x61, 0x51, 0x49, 0x45, 0x43 }, /* Z */
+	{ 0x00, 0x7F, 0x41, 0x41, 0x00 }, /* [ */
+	{ 0x02, 0x04, 0x08, 0x10, 0x20 }, /* \ */
+	{ 0x00, 0x41, 0x41, 0x7F, 0x00 }, /* ] */
+	{ 0x04, 0x02, 0x01, 0x02, 0x04 }, /* ^ */
+	{ 0x40, 0x40, 0x40, 0x40, 0x40 }, /* _ */
+	{ 0x00, 0x01, 0x02, 0x04, 0x00 }, /* ` */
+	{ 0x20, 0x54, 0x54, 0x54, 0x78 }, /* a */
+	{ 0x7F, 0x48, 0x44, 0x44, 0x38 }, /* b */
+	{ 0x38, 0x44, 0x44, 0x44, 0x20 }, /* c */
+	{ 0x38, 0x44, 0x44, 0x48, 0x7F }, /* d */
+	{ 0x38, 0x54, 0x54, 0x54, 0x18 }, /* e */
+	{ 0x08, 0x7E, 0x09, 0x01, 0x02 }, /* f */
+	{ 0x0C, 0x52, 0x52, 0x52, 0x3E }, /* g */
+	{ 0x7F, 0x08, 0x04, 0x04, 0x78 }, /* h */
+	{ 0x00, 0x44, 0x7D, 0x40, 0x00 }, /* i */
+	{ 0x20, 0x40, 0x44, 0x3D, 0x00 }, /* j */
+	{ 0x7F, 0x10, 0x28, 0x44, 0x00 }, /* k */
+	{ 0x00, 0x41, 0x7F, 0x40, 0x00 }, /* l */
+	{ 0x7C, 0x04, 0x18, 0x04, 0x78 }, /* m */
+	{ 0x7C, 0x08, 0x04, 0x04, 0x78 }, /* n */
+	{ 0x38, 0x44, 0x44, 0x44, 0x38 }, /* o */
+	{ 0x7C, 0x14, 0x14, 0x14, 0x08 }, /* p */
+	{ 0x08, 0x14, 0x14, 0x18, 0x7C }, /* q */
+	{ 0x7C, 0x08, 0x04, 0x04, 0x08 }, /* r */
+	{ 0x48, 0x54, 0x54, 0x54, 0x20 }, /* s */
+	{ 0x04, 0x3F, 0x44, 0x40, 0x20 }, /* t */
+	{ 0x3C, 0x40, 0x40, 0x20, 0x7C }, /* u */
+	{ 0x1C, 0x20, 0x40, 0x20, 0x1C }, /* v */
+	{ 0x3C, 0x40, 0x30, 0x40, 0x3C }, /* w */
+	{ 0x44, 0x28, 0x10, 0x28, 0x44 }, /* x */
+	{ 0x0C, 0x50, 0x50, 0x50, 0x3C }, /* y */
+	{ 0x44, 0x64, 0x54, 0x4C, 0x44 }, /* z */
+	{ 0x00, 0x08, 0x36, 0x41, 0x00 }, /* { */
+	{ 0x00, 0x00, 0x7F, 0x00, 0x00 }, /* | */
+	{ 0x00, 0x41, 0x36, 0x08, 0x00 }, /* } */
+	{ 0x08, 0x04, 0x08, 0x10, 0x08 }, /* ~ */
+};
+
+uint32_t *
+overlay_atlas_create(void)
+{
+	int cell_size = OVERLAY_CELL_WIDTH * OVERLAY_CELL_HEIGHT;
+	uint32_t *atlas;
+	int i, x, y;
+
+	atlas = malloc(OVERLAY_GLYPH_COUNT * cell_size * sizeof(uint32_t));
+	if (!atlas)
+		return NULL;
+
+	for (i = 0; i < OVERLAY_GLYPH_COUNT; i++) {
+		uint32_t *cell = atlas + i * cell_size;
+
+		for (y = 0; y < OVERLAY_CELL_HEIGHT; y++) {
+			/* leave a row of spacing above the glyph */
+			int row = y / OVERLAY_GLYPH_SCALE - 1;
+
+			for (x = 0; x < OVERLAY_CELL_WIDTH; x++) {
+				int column = x / OVERLAY_GLYPH_SCALE;
+				bool set = false;
+
+				if ((row >= 0) && (row < OVERLAY_GLYPH_HEIGHT)
+				    && (column < OVERLAY_GLYPH_WIDTH))
+					set = overlay_font[i][column] &
+						(1 << row);
+
+				cell[y * OVERLAY_CELL_WIDTH + x] = set ?
+					OVERLAY_COLOUR_TEXT :
+					OVERLAY_COLOUR_BACKGROUND;
+			}
+		}
+	}
+
+	return atlas;
+}
+
+void
+overlay_atlas_blit(const uint32_t *atlas, struct kms_buffer *buffer,
+		   int x, int y, char c)
+{
+	const uint32_t *cell;
+	uint8_t *to;
+	int i;
+
+	if ((c < OVERLAY_GLYPH_FIRST) || (c > OVERLAY_GLYPH_LAST))
+		c = '?';
+
+	cell = atlas + (c - OVERLAY_GLYPH_FIRST) *
+		OVERLAY_CELL_WIDTH * OVERLAY_CELL_HEIGHT;
+
+	to = (uint8_t *) buffer->map + y * buffer->pitch +
+		x * sizeof(uint32_t);
+
+	for (i = 0; i < OVERLAY_CELL_HEIGHT; i++) {
+		memcpy(to, cell, OVERLAY_CELL_WIDTH * sizeof(uint32_t));
+		to += buffer->pitch;
+		cell += OVERLAY_CELL_WIDTH;
+	}
+}
+
+void
+overlay_printf(struct overlay *overlay, int row, const char *format, ...)
+{
+	char *line = overlay->line;
+	va_list arguments;
+	int length;
+
+	if ((row < 0) || (row >= overlay->rows))
+		return;
+
+	va_start(arguments, format);
+	length = vsnprintf(line, overlay->columns + 1, format, arguments);
+	va_end(arguments);
+
+	if (length < 0)
+		length = 0;
+	else if (length > overlay->columns)
+		length = overlay->columns;
+
+	memset(line + length, ' ', overlay->columns - length);
+
+	memcpy(overlay->text + row * overlay->columns, line,
+	       overlay->columns);
+}
+
+static void
+overlay_statistics_print(struct overlay *overlay)
+{
+	struct overlay_statistics *statistics = overlay->statistics;
+
+	log_info("Overlay: %d renders, %d.%02d cells per render.\n",
+		 statistics->renders, statistics->cells / statistics->renders,
+		 (100 * statistics->cells / statistics->renders) % 100);
+}
+
+struct kms_buffer *
+overlay_render(struct overlay *overlay)
+{
+	struct overlay_statistics *statistics = overlay->statistics;
+	int size = overlay->columns * overlay->rows;
+	int back = overlay->front ^ 1;
+	struct kms_buffer *buffer = overlay->buffers[back];
+	char *contents = overlay->contents[back];
+	int column, row;
+
+	if (!memcmp(overlay->text, overlay->contents[overlay->front], size))
+		return NULL;
+
+	for (row = 0; row < overlay->rows; row++) {
+		for (column = 0; column < overlay->columns; column++) {
+			int i = row * overlay->columns + column;
+
+			if (contents[i] == overlay->text[i])
+				continue;
+
+			overlay_atlas_blit(overlay->atlas, buffer,
+					   column * OVERLAY_CELL_WIDTH,
+					   row * OVERLAY_CELL_HEIGHT,
+					   overlay->text[i]);
+			contents[i] = overlay->text[i];
+			statistics->cells++;
+		}
+	}
+
+	overlay->front = back;
+
+	statistics->renders++;
+	if (statistics->renders == OVERLAY_STATISTICS_COUNT) {
+		overlay_statistics_print(overlay);
+		memset(statistics, 0, sizeof(struct overlay_statistics));
+	}
+
+	return buffer;
+}
+
+struct overlay *
+overlay_create(int columns, int rows)
+{
+	struct overlay *overlay;
+	int size = columns * rows;
+	int i;
+
+	overlay = calloc(1, sizeof(struct overlay));
+	if (!overlay)
+		return NULL;
+
+	overlay->columns = columns;
+	overlay->rows = rows;
+
+	overlay->atlas = overlay_atlas_create();
+	if (!overlay->atlas)
+		goto error;
+
+	overlay->text = malloc(size);
+	if (!overlay->text)
+		goto error;
+	memset(overlay->text, ' ', size);
+
+	overlay->line = malloc(columns + 1);
+	if (!overlay->line)
+		goto error;
+
+	for (i = 0; i < 2; i++) {
+		overlay->buffers[i] =
+			kms_buffer_get(columns * OVERLAY_CELL_WIDTH,
+				       rows * OVERLAY_CELL_HEIGHT,
+				       DRM_FORMAT_ARGB8888);
+		if (!overlay->buffers[i])
+			goto error;
+
+		/* 0 is no character, so every cell gets rendered once. */
+		overlay->contents[i] = calloc(1, size);
+		if (!overlay->contents[i])
+			goto error;
+	}
+
+	/* the first render goes to buffer 0. */
+	overlay->front = 1;
+
+	return overlay;
+
+ error:
+	fprintf(stderr, "%s(): failed to create a %dx%d overlay.\n",
+		__func__, columns, rows);
+	for (i = 0; i < 2; i++) {
+		kms_buffer_put(overlay->buffers[i]);
+		free(overlay->contents[i]);
+	}
+	free(overlay->line);
+	free(overlay->text);
+	free(overlay->atlas);
+	free(overlay);
+	return NULL;
+}
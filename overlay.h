@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_OVERLAY_H_
+#define _HAVE_OVERLAY_H_ 1
+
+struct kms_buffer;
+
+/* one cell of the text grid, in pixels */
+#define OVERLAY_CELL_WIDTH 12
+#define OVERLAY_CELL_HEIGHT 18
+
+struct overlay_statistics {
+	int renders;
+	int cells; /* actually blitted */
+};
+
+struct overlay {
+	int columns;
+	int rows;
+
+	/* every printable ascii character, pre-rasterized as a full cell */
+	uint32_t *atlas;
+
+	/* what the next render should show */
+	char *text;
+	/* for formatting a row */
+	char *line;
+
+	/*
+	 * Two ARGB8888 buffers, and the text that each of them currently
+	 * holds, so that only the cells which differ get blitted.
+	 */
+	struct kms_buffer *buffers[2];
+	char *contents[2];
+	/* the buffer which was handed out last */
+	int front;
+
+	struct overlay_statistics statistics[1];
+};
+
+/*
+ * The font, rasterized into whole cells, for those who compose text
+ * themselves. x and y are in pixels.
+ */
+uint32_t *overlay_atlas_create(void);
+void overlay_atlas_blit(const uint32_t *atlas, struct kms_buffer *buffer,
+			int x, int y, char c);
+
+struct overlay *overlay_create(int columns, int rows);
+
+/* Sets a full row, which gets truncated or padded with spaces. */
+void overlay_printf(struct overlay *overlay, int row, const char *format, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/*
+ * Returns the buffer to flip to, or NULL when nothing changed. We render
+ * into the buffer which was not returned last time, so the caller has to
+ * have flipped to the last returned buffer before calling us again.
+ */
+struct kms_buffer *overlay_render(struct overlay *overlay);
+
+#endif /* _HAVE_OVERLAY_H_ */
@@ -37,8 +37,18 @@
 
 #include "juggler.h"
 #include "kms.h"
+#include "log.h"
+#include "frc.h"
+#include "timecode.h"
+#include "fade.h"
+#include "colour.h"
 #include "projector.h"
 #include "capture.h"
+#include "fingerprint.h"
+#include "crop.h"
+#include "thread.h"
+#include "vblank.h"
+#include "edid.h"
 
 static pthread_t kms_projector_thread[1];
 
@@ -75,9 +85,10 @@ struct kms_projector {
 	 */
 	struct capture_buffer *capture_buffer_next;
 	/*
-	 * This is the upcoming buffer that was last queued by capture.
+	 * Upcoming buffers queued by capture, and which one of those we
+	 * show at which vblank.
 	 */
-	struct capture_buffer *capture_buffer_new;
+	struct frc *frc;
 
 	/*
 	 * Count the number of frames not updated, so we can implement
@@ -88,9 +99,60 @@ struct kms_projector {
 
 	struct kms_buffer *capture_stalled_buffer;
 
+	/*
+	 * A source which is asleep or blanked still sends frames, but
+	 * black ones. Show the same as when stalled.
+	 */
+	bool capture_black;
+
+	/*
+	 * Switching between capture and our no input image fades through
+	 * black. This is what our plane currently has, even halfway a fade.
+	 */
+	struct fade *fade;
+	bool no_input_shown;
+
+	/* the part of capture that we currently scale up */
+	struct crop_area crop[1];
+
+	/* burn-in of capture time and sequence, when asked for */
+	struct timecode *timecode;
+
+	/* the colour correction for this room, when given one */
+	struct colour *colour;
+
+	/* decides when and what we commit */
+	struct vblank *vblank;
+
+	/*
+	 * Display clock tracking: we measure the capture rate, and tune
+	 * the pixel clock of our mode to match it.
+	 */
+	bool clock_tracking;
+	struct _drmModeModeInfo *mode;
+	uint32_t clock_current;
+	uint64_t clock_time_first;
+	uint64_t clock_time;
+	uint32_t clock_sequence_first;
+	uint32_t clock_sequence;
+	bool clock_measuring;
+	bool clock_done;
+
+	/* Pick the mode of our display which best matches capture. */
+	bool mode_matching;
+	bool mode_matched;
+	int capture_width;
+	int capture_height;
+	uint32_t edid_hash;
+
 	/* Flag the stream stopping, protect with capture_buffer_mutex */
 	bool capture_stopped;
 	uint32_t capture_stopped_count;
+
+	/* Flag our connector changing, protect with capture_buffer_mutex */
+	bool hotplug;
+	/* after a reprobe, we need to show something, even when stopped */
+	bool repaint;
 };
 static struct kms_projector *kms_projector;
 
@@ -191,6 +253,23 @@ kms_projector_planes_get(struct kms_projector *projector)
 	return ret;
 }
 
+/*
+ * When capture is looking for black borders, only show what is inside.
+ */
+static void
+kms_projector_crop_get(struct capture_buffer *buffer, struct crop_area *area)
+{
+	struct crop *crop = capture_crop_get();
+
+	area->x = 0;
+	area->y = 0;
+	area->width = buffer->width;
+	area->height = buffer->height;
+
+	if (crop)
+		crop_area_get(crop, buffer->width, buffer->height, area);
+}
+
 /*
  * Show input buffer on projector, scaled, with borders.
  */
@@ -200,23 +279,47 @@ kms_projector_capture_set(struct kms_projector *projector,
 			  drmModeAtomicReqPtr request)
 {
 	struct kms_plane *plane = projector->capture_scaling;
+	struct crop_area area[1] = {{ 0 }};
 	int width, height;
 	uint32_t fb_id;
-	bool stopped = false;
+	bool stopped = false, no_input;
 
 	pthread_mutex_lock(projector->capture_buffer_mutex);
 	stopped = projector->capture_stopped;
 	pthread_mutex_unlock(projector->capture_buffer_mutex);
 
-	if (stopped || projector->capture_stalled) {
+	no_input = stopped || projector->capture_stalled ||
+		projector->capture_black;
+
+	/* only switch over once we faded to black, and have a frame. */
+	if (no_input != projector->no_input_shown) {
+		if (projector->fade && !fade_dark(projector->fade))
+			fade_out(projector->fade);
+		else if (no_input || buffer) {
+			projector->no_input_shown = no_input;
+			plane->active = false;
+		}
+	}
+
+	if ((no_input == projector->no_input_shown) && projector->fade)
+		fade_in(projector->fade);
+
+	if (projector->no_input_shown) {
 		width = projector->capture_stalled_buffer->width;
 		height = projector->capture_stalled_buffer->height;
 		fb_id = projector->capture_stalled_buffer->fb_id;
 		plane->active = false;
 	} else if (buffer) {
-		width = buffer->width;
-		height = buffer->height;
+		kms_projector_crop_get(buffer, area);
+		width = area->width;
+		height = area->height;
 		fb_id = buffer->kms_fb_id;
+
+		/* the active area changed, so redo our source and borders */
+		if (memcmp(area, projector->crop, sizeof(struct crop_area))) {
+			*projector->crop = *area;
+			plane->active = false;
+		}
 	} else
 		return;
 
@@ -261,11 +364,11 @@ kms_projector_capture_set(struct kms_projector *projector,
 		drmModeAtomicAddProperty(request, plane->plane_id,
 					 plane->property_crtc_h, h);
 
-		/* read in full size image */
+		/* read in the active area, or the full image */
 		drmModeAtomicAddProperty(request, plane->plane_id,
-					 plane->property_src_x, 0);
+					 plane->property_src_x, area->x << 16);
 		drmModeAtomicAddProperty(request, plane->plane_id,
-					 plane->property_src_y, 0);
+					 plane->property_src_y, area->y << 16);
 		drmModeAtomicAddProperty(request, plane->plane_id,
 					 plane->property_src_w,
 					 width << 16);
@@ -291,6 +394,21 @@ kms_projector_frame_update(struct kms_projector *projector,
 
 	kms_projector_capture_set(projector, buffer, request);
 
+	if (projector->fade)
+		fade_set(projector->fade, request);
+
+	if (projector->colour)
+		colour_set(projector->colour, request);
+
+	if (projector->timecode) {
+		if (buffer && !projector->no_input_shown)
+			timecode_set(projector->timecode, request, buffer,
+				     projector->crtc_width,
+				     projector->crtc_height);
+		else
+			timecode_disable(projector->timecode, request);
+	}
+
 	if (projector->plane_disable && projector->plane_disable->active)
 		kms_plane_disable(projector->plane_disable, request);
 
@@ -300,14 +418,392 @@ kms_projector_frame_update(struct kms_projector *projector,
 	drmModeAtomicFree(request);
 
 	if (ret) {
-		fprintf(stderr, "%s: failed to show frame %d: %s\n",
-			__func__, frame, strerror(errno));
 		ret = -errno;
+		log_ratelimited(LOG_ERROR, "%s: failed to show frame %d: %s\n",
+				__func__, frame, strerror(-ret));
+
+		/* perhaps our display went away, go have a look */
+		pthread_mutex_lock(projector->capture_buffer_mutex);
+		projector->hotplug = true;
+		pthread_mutex_unlock(projector->capture_buffer_mutex);
+	} else {
+		vblank_commit_done(projector->vblank, buffer);
+		if (projector->fade)
+			fade_commit_done(projector->fade);
+		if (projector->colour)
+			colour_commit_done(projector->colour);
+		if (projector->timecode)
+			timecode_commit_done(projector->timecode);
+		projector->repaint = false;
 	}
 
 	return ret;
 }
 
+/* how long to sleep, and how often to look, while disconnected */
+#define PROJECTOR_DISCONNECTED_SLEEP 100000 /* us */
+#define PROJECTOR_REPROBE_PERIOD 10
+
+/* how many vblanks fading in or out takes */
+#define PROJECTOR_FADE_LENGTH 20
+
+/*
+ * Only trust the measured capture rate after this many frames, and
+ * consider the first this many frames of a stream as a quiet period in
+ * which we can still do a modeset.
+ */
+#define PROJECTOR_CLOCK_FRAMES_MIN 120
+#define PROJECTOR_CLOCK_FRAMES_QUIET 300
+/* beyond this, it is a different rate, and a job for frame rate conversion */
+#define PROJECTOR_CLOCK_PPM_MAX 10000
+/* and below this, it is not worth a modeset */
+#define PROJECTOR_CLOCK_PPM_MIN 20
+
+static void
+kms_projector_clock_measure(struct kms_projector *projector,
+			    struct capture_buffer *buffer)
+{
+	uint64_t time = buffer->timestamp.tv_sec * 1000000000ULL +
+		buffer->timestamp.tv_usec * 1000ULL;
+
+	if (!projector->clock_tracking && !projector->mode_matching)
+		return;
+
+	/* capture restarted */
+	if (!projector->clock_measuring ||
+	    (buffer->sequence <= projector->clock_sequence)) {
+		projector->clock_time_first = time;
+		projector->clock_sequence_first = buffer->sequence;
+		projector->clock_measuring = true;
+		projector->clock_done = false;
+		projector->mode_matched = false;
+	}
+
+	projector->capture_width = buffer->width;
+	projector->capture_height = buffer->height;
+
+	projector->clock_time = time;
+	projector->clock_sequence = buffer->sequence;
+}
+
+/*
+ * A modeset costs us a frame or two, so we only retune our pixel clock
+ * right after capture (re)started, or when capture stalls.
+ */
+static void
+kms_projector_clock_update(struct kms_projector *projector, bool quiet)
+{
+	struct _drmModeModeInfo mode[1];
+	uint64_t period, refresh;
+	uint32_t frames, clock;
+	int64_t ppm;
+	int ret;
+
+	if (!projector->clock_tracking || !projector->clock_measuring ||
+	    projector->clock_done)
+		return;
+
+	frames = projector->clock_sequence - projector->clock_sequence_first;
+	if (frames < PROJECTOR_CLOCK_FRAMES_MIN)
+		return;
+
+	if (!quiet && (frames > PROJECTOR_CLOCK_FRAMES_QUIET))
+		return;
+
+	projector->clock_done = true;
+
+	period = (projector->clock_time - projector->clock_time_first) /
+		frames;
+	if (!period)
+		return;
+
+	*mode = *projector->mode;
+
+	clock = (uint64_t) mode->htotal * mode->vtotal * 1000000ULL / period;
+	refresh = 1000000000000ULL / period;
+
+	ppm = ((int64_t) clock - mode->clock) * 1000000 / mode->clock;
+	if (llabs(ppm) > PROJECTOR_CLOCK_PPM_MAX) {
+		log_info("Projector: capture runs at %d.%03dHz, too far off "
+			 "our mode to track.\n", (int) (refresh / 1000),
+			 (int) (refresh % 1000));
+		return;
+	}
+
+	ppm = ((int64_t) clock - projector->clock_current) * 1000000 /
+		projector->clock_current;
+	if (llabs(ppm) < PROJECTOR_CLOCK_PPM_MIN)
+		return;
+
+	mode->clock = clock;
+	mode->vrefresh = (refresh + 500) / 1000;
+
+	ret = kms_crtc_modeline_set(projector->crtc_id, mode);
+	if (ret) {
+		log_error("Projector: failed to set pixel clock %dkHz, "
+			  "disabling clock tracking.\n", clock);
+		projector->clock_tracking = false;
+		return;
+	}
+
+	log_info("Projector: pixel clock %dkHz -> %dkHz, to track capture "
+		 "at %d.%03dHz.\n", projector->clock_current, clock,
+		 (int) (refresh / 1000), (int) (refresh % 1000));
+
+	projector->clock_current = clock;
+
+	/* have vblank start measuring our new period afresh. */
+	projector->vblank->period = period;
+	projector->vblank->time = 0;
+}
+
+/*
+ * Have everything fully reprogrammed on our next commit.
+ */
+static void
+kms_projector_planes_reset(struct kms_projector *projector)
+{
+	if (projector->capture_scaling)
+		projector->capture_scaling->active = false;
+	if (projector->capture_yuv)
+		projector->capture_yuv->active = false;
+	if (projector->plane_disable)
+		projector->plane_disable->active = true;
+	if (projector->fade)
+		fade_reset(projector->fade);
+	if (projector->colour)
+		colour_reset(projector->colour);
+	if (projector->timecode)
+		timecode_reset(projector->timecode);
+}
+
+static void
+kms_projector_edid_print(struct kms_projector *projector)
+{
+	struct edid *edid = kms_connector_edid_get(projector->connector_id);
+
+	if (!edid || (edid->hash == projector->edid_hash))
+		return;
+
+	edid_print(edid);
+	projector->edid_hash = edid->hash;
+}
+
+/*
+ * Something changed on our connector. Find out what, and get our crtc
+ * back into shape when needed.
+ */
+static int
+kms_projector_reprobe(struct kms_projector *projector)
+{
+	struct _drmModeModeInfo *mode;
+	uint32_t encoder_id = 0, crtc_id = 0;
+	bool connected = false, mode_ok = false;
+	int width = 0, height = 0, ret;
+
+	ret = kms_connection_check(projector->connector_id, &connected,
+				   &encoder_id);
+	if (ret)
+		return ret;
+
+	if (!connected) {
+		if (projector->connected)
+			log_warning("Projector: disconnected.\n");
+		projector->connected = false;
+		return 0;
+	}
+
+	if (!projector->mode) {
+		log_error("%s: we do not know which mode to set.\n",
+			  __func__);
+		return -EINVAL;
+	}
+
+	kms_projector_edid_print(projector);
+
+	/* This might be a different display, which does not take our mode */
+	mode = kms_connector_mode_validate(projector->connector_id,
+					   projector->mode);
+	if (mode) {
+		log_info("Projector: display does not take %dx%d@%d, using "
+			 "%dx%d@%d instead.\n", projector->mode->hdisplay,
+			 projector->mode->vdisplay, projector->mode->vrefresh,
+			 mode->hdisplay, mode->vdisplay, mode->vrefresh);
+		free(projector->mode);
+		projector->mode = mode;
+	} else if (encoder_id) {
+		/* this complains loudly when our crtc is off, ignore. */
+		kms_crtc_id_get(encoder_id, &crtc_id, &mode_ok, &width,
+				&height);
+		if (crtc_id != projector->crtc_id)
+			mode_ok = false;
+	}
+
+	if (!mode_ok) {
+		ret = kms_crtc_enable(projector->crtc_id,
+				      projector->connector_id,
+				      projector->mode);
+		if (ret)
+			return ret;
+
+		width = projector->mode->hdisplay;
+		height = projector->mode->vdisplay;
+	}
+
+	projector->crtc_width = width;
+	projector->crtc_height = height;
+
+	kms_projector_planes_reset(projector);
+
+	vblank_reset(projector->vblank);
+
+	projector->clock_current = projector->mode->clock;
+	projector->clock_measuring = false;
+
+	if (!projector->connected)
+		log_info("Projector: connected, %dx%d.\n", width, height);
+
+	projector->connected = true;
+	projector->repaint = true;
+	projector->capture_stall_count = 0;
+
+	return 0;
+}
+
+/*
+ * Nothing to show our frames on, so do not hold on to them.
+ */
+static void
+kms_projector_disconnected(struct kms_projector *projector)
+{
+	struct capture_buffer *old = projector->capture_buffer_current;
+
+	frc_flush(projector->frc);
+
+	projector->capture_buffer_current = NULL;
+	if (old)
+		capture_buffer_display_release(old);
+}
+
+/*
+ * Switch to the mode of our display which best matches what we capture,
+ * ideally so that we show it 1:1. Like clock tracking, this is a modeset,
+ * so we only do this right after capture (re)started.
+ */
+static void
+kms_projector_mode_match(struct kms_projector *projector)
+{
+	struct _drmModeModeInfo *mode, *old = projector->mode;
+	uint32_t frames;
+	uint64_t period;
+	int refresh, ret;
+
+	if (!projector->mode_matching || projector->mode_matched ||
+	    !projector->clock_measuring)
+		return;
+
+	frames = projector->clock_sequence - projector->clock_sequence_first;
+	if ((frames < PROJECTOR_CLOCK_FRAMES_MIN) ||
+	    (frames > PROJECTOR_CLOCK_FRAMES_QUIET))
+		return;
+
+	projector->mode_matched = true;
+
+	period = (projector->clock_time - projector->clock_time_first) /
+		frames;
+	if (!period)
+		return;
+	refresh = 1000000000000ULL / period;
+
+	mode = kms_connector_mode_select(projector->connector_id,
+					 projector->capture_width,
+					 projector->capture_height, refresh);
+	if (!mode)
+		return;
+
+	if (old && (old->hdisplay == mode->hdisplay) &&
+	    (old->vdisplay == mode->vdisplay) &&
+	    (old->htotal == mode->htotal) && (old->vtotal == mode->vtotal) &&
+	    (old->clock == mode->clock)) {
+		free(mode);
+		return;
+	}
+
+	ret = kms_crtc_enable(projector->crtc_id, projector->connector_id,
+			      mode);
+	if (ret) {
+		log_error("Projector: failed to set %dx%d mode.\n",
+			  mode->hdisplay, mode->vdisplay);
+		free(mode);
+		return;
+	}
+
+	log_info("Projector: now %dx%d@%dHz, for capture at %dx%d@%d.%03dHz"
+		 ".\n", mode->hdisplay, mode->vdisplay, mode->vrefresh,
+		 projector->capture_width, projector->capture_height,
+		 refresh / 1000, refresh % 1000);
+
+	free(old);
+	projector->mode = mode;
+	projector->crtc_width = mode->hdisplay;
+	projector->crtc_height = mode->vdisplay;
+
+	kms_projector_planes_reset(projector);
+	vblank_reset(projector->vblank);
+
+	projector->clock_current = mode->clock;
+}
+
+static void
+kms_projector_black_check(struct kms_projector *projector)
+{
+	struct fingerprint *fingerprint = capture_fingerprint_get();
+	bool black;
+
+	if (!fingerprint)
+		return;
+
+	black = fingerprint_state_get(fingerprint, NULL) == FINGERPRINT_BLACK;
+	if (black == projector->capture_black)
+		return;
+
+	if (black)
+		log_warning("Projector: No input! (black)\n");
+	else
+		log_info("Projector: Input is back.\n");
+
+	projector->capture_black = black;
+}
+
+/*
+ * No new frame for this vblank: carry on with a fade, or with switching to
+ * our no input image, and let go of capture once it is off screen.
+ */
+static void
+kms_projector_frame_idle(struct kms_projector *projector, bool stopped,
+			 int frame)
+{
+	struct capture_buffer *old = projector->capture_buffer_current;
+	bool gone = stopped || projector->capture_stalled;
+	bool no_input = gone || projector->capture_black;
+
+	if (projector->repaint || (no_input != projector->no_input_shown) ||
+	    (projector->fade && fade_busy(projector->fade))) {
+		if (kms_projector_frame_update(projector, NULL, frame))
+			return;
+	}
+
+	/* a black source still sends frames, only drop a stream that left. */
+	if (!gone || !projector->no_input_shown || !old)
+		return;
+
+	projector->capture_buffer_current = NULL;
+	capture_buffer_display_release(old);
+
+	kms_projector_clock_update(projector, true);
+	projector->clock_measuring = false;
+}
+
 static void *
 kms_projector_thread_handler(void *arg)
 {
@@ -317,20 +813,57 @@ kms_projector_thread_handler(void *arg)
 
 	for (i = 0; true; i++) {
 		struct capture_buffer *new, *old = NULL;
+		bool hotplug;
 
 		pthread_mutex_lock(projector->capture_buffer_mutex);
+		hotplug = projector->hotplug;
+		projector->hotplug = false;
+		pthread_mutex_unlock(projector->capture_buffer_mutex);
 
-		new = projector->capture_buffer_new;
-		projector->capture_buffer_new = NULL;
+		/*
+		 * While disconnected, we also look every second, in case
+		 * we missed an event.
+		 */
+		if (!projector->connected && !(i % PROJECTOR_REPROBE_PERIOD))
+			hotplug = true;
+
+		if (hotplug) {
+			ret = kms_projector_reprobe(projector);
+			if (ret) {
+				log_error("Projector: reprobe failed: %s\n",
+					  strerror(-ret));
+				projector->connected = false;
+			}
+		}
 
-		stopped = projector->capture_stopped;
+		if (!projector->connected) {
+			kms_projector_disconnected(projector);
+			thread_sleep(PROJECTOR_DISCONNECTED_SLEEP);
+			continue;
+		}
 
+		thread_sleep_until(vblank_deadline_next(projector->vblank));
+
+		pthread_mutex_lock(projector->capture_buffer_mutex);
+		stopped = projector->capture_stopped;
 		pthread_mutex_unlock(projector->capture_buffer_mutex);
 
+		new = frc_pick(projector->frc,
+			       vblank_capture_cutoff(projector->vblank));
+
 		if (new) {
+			vblank_capture_update(projector->vblank, new);
+			kms_projector_black_check(projector);
+
 			ret = kms_projector_frame_update(projector, new, i);
-			if (ret)
-				return NULL;
+			if (ret) {
+				capture_buffer_display_release(new);
+				continue;
+			}
+
+			kms_projector_clock_measure(projector, new);
+			kms_projector_mode_match(projector);
+			kms_projector_clock_update(projector, false);
 
 			old = projector->capture_buffer_current;
 			projector->capture_buffer_current = new;
@@ -340,58 +873,38 @@ kms_projector_thread_handler(void *arg)
 
 			if (projector->capture_stall_count) {
 				if (projector->capture_stall_count > 2)
-					printf("Projector: Capture stalled for"
-					       " %d frames.\n",
-					       projector->capture_stall_count);
+					log_info("Projector: Capture stalled "
+						 "for %d frames.\n", projector->
+						 capture_stall_count);
 				projector->capture_stall_count = 0;
 				projector->capture_stalled = false;
 			}
 			if (projector->capture_stopped_count) {
-				printf("Projector: Capture stopped for"
-				       " %d frames.\n",
-				       projector->capture_stopped_count);
+				log_info("Projector: Capture stopped for"
+					 " %d frames.\n",
+					 projector->capture_stopped_count);
 				projector->capture_stopped_count = 0;
 			}
-		} else if (stopped) {
-			projector->capture_stopped_count++;
-
-			if (projector->capture_buffer_current) {
-				printf("Projector: No input! (stopped)\n");
-
-				ret = kms_projector_frame_update(projector,
-								 NULL, i);
-				if (ret)
-					return NULL;
-
-				old = projector->capture_buffer_current;
-				projector->capture_buffer_current = NULL;
-				capture_buffer_display_release(old);
-			}
-
-			usleep(16667);
 		} else {
-			projector->capture_stall_count++;
-
-			if (projector->capture_stall_count == 5) {
-				printf("Projector: No input! (stalled)\n");
-				projector->capture_stalled = true;
-
-				ret = kms_projector_frame_update(projector,
-								 NULL, i);
-				if (ret)
-					return NULL;
-
-				old = projector->capture_buffer_current;
-				projector->capture_buffer_current = NULL;
-				if (old)
-					capture_buffer_display_release(old);
+			if (stopped) {
+				if (!projector->capture_stopped_count)
+					log_warning("Projector: No input! "
+						    "(stopped)\n");
+				projector->capture_stopped_count++;
+			} else {
+				projector->capture_stall_count++;
+				if (projector->capture_stall_count == 5) {
+					log_warning("Projector: No input! "
+						    "(stalled)\n");
+					projector->capture_stalled = true;
+				}
 			}
 
-			usleep(16667);
+			kms_projector_frame_idle(projector, stopped, i);
 		}
 	}
 
-	printf("%s: done!\n", __func__);
+	log_info("%s: done!\n", __func__);
 
 	return NULL;
 }
@@ -400,27 +913,38 @@ void
 kms_projector_capture_stop(void)
 {
 	struct kms_projector *projector = kms_projector;
-	struct capture_buffer *new;
 
 	pthread_mutex_lock(projector->capture_buffer_mutex);
+	projector->capture_stopped = true;
+	pthread_mutex_unlock(projector->capture_buffer_mutex);
 
-	new = projector->capture_buffer_new;
-	projector->capture_buffer_new = NULL;
+	frc_flush(projector->frc);
+}
 
-	projector->capture_stopped = true;
+/*
+ * Called from the hotplug thread, with 0 when we do not know which
+ * connector changed.
+ */
+void
+kms_projector_hotplug(uint32_t connector_id)
+{
+	struct kms_projector *projector = kms_projector;
 
-	pthread_mutex_unlock(projector->capture_buffer_mutex);
+	if (!projector)
+		return;
 
-	if (new)
-		capture_buffer_display_release(new);
+	if (connector_id && (connector_id != projector->connector_id))
+		return;
 
+	pthread_mutex_lock(projector->capture_buffer_mutex);
+	projector->hotplug = true;
+	pthread_mutex_unlock(projector->capture_buffer_mutex);
 }
 
 void
 kms_projector_capture_display(struct capture_buffer *buffer)
 {
 	struct kms_projector *projector = kms_projector;
-	struct capture_buffer *old;
 
 	if (!projector) {
 		capture_buffer_display_release(buffer);
@@ -428,20 +952,36 @@ kms_projector_capture_display(struct capture_buffer *buffer)
 	}
 
 	pthread_mutex_lock(projector->capture_buffer_mutex);
+	projector->capture_stopped = false;
+	pthread_mutex_unlock(projector->capture_buffer_mutex);
 
-	old = projector->capture_buffer_new;
-	projector->capture_buffer_new = buffer;
+	frc_push(projector->frc, buffer);
+}
 
-	projector->capture_stopped = false;
+/*
+ * For the status lcd: how our last statistics window went.
+ */
+int
+kms_projector_statistics_get(struct frc_statistics *frc, uint64_t *latency,
+			     uint64_t *latency_max)
+{
+	struct kms_projector *projector = kms_projector;
 
-	pthread_mutex_unlock(projector->capture_buffer_mutex);
+	/* the status thread might already be running while we set up. */
+	if (!projector || !projector->frc)
+		return -ENODEV;
 
-	if (old)
-		capture_buffer_display_release(old);
+	frc_statistics_get(projector->frc, frc);
+	vblank_latency_get(projector->vblank, latency, latency_max);
+
+	return 0;
 }
 
 int
-kms_projector_init(void)
+kms_projector_init(struct _drmModeModeInfo *mode,
+		   enum frc_policy frc_policy, bool clock_tracking,
+		   bool mode_matching, bool timecode,
+		   struct colour_profile *colour_profile)
 {
 	struct kms_projector *projector;
 	int ret;
@@ -483,13 +1023,106 @@ kms_projector_init(void)
 	if (ret)
 		return ret;
 
+	if (timecode) {
+		uint32_t used[3] = { 0 };
+
+		if (projector->capture_scaling)
+			used[0] = projector->capture_scaling->plane_id;
+		if (projector->capture_yuv)
+			used[1] = projector->capture_yuv->plane_id;
+		if (projector->plane_disable)
+			used[2] = projector->plane_disable->plane_id;
+
+		projector->timecode =
+			timecode_create("Projector", projector->crtc_id,
+					projector->crtc_index, used, 3);
+		if (!projector->timecode)
+			return -1;
+	}
+
+	if (colour_profile) {
+		projector->colour = colour_create("Projector",
+						  projector->crtc_id,
+						  projector->capture_scaling,
+						  colour_profile);
+		if (!projector->colour)
+			return -1;
+	}
+
+	projector->vblank = vblank_create("Projector", projector->crtc_id,
+					  projector->crtc_index);
+	if (!projector->vblank)
+		return -ENOMEM;
+
+	projector->frc = frc_create("Projector", frc_policy);
+	if (!projector->frc)
+		return -ENOMEM;
+
+	/* we need this to restore our crtc after hotplug. */
+	projector->mode = kms_crtc_modeline_get(projector->crtc_id);
+
+	kms_projector_edid_print(projector);
+
+	if (mode) {
+		printf("Projector: setting mode ");
+		kms_modeline_print(mode);
+
+		/* otherwise, hotplug will set it for us later on. */
+		if (projector->connected) {
+			ret = kms_crtc_enable(projector->crtc_id,
+					      projector->connector_id, mode);
+			if (ret)
+				return ret;
+
+			projector->mode_ok = true;
+			projector->crtc_width = mode->hdisplay;
+			projector->crtc_height = mode->vdisplay;
+		}
+
+		free(projector->mode);
+		projector->mode = mode;
+
+		if (mode_matching) {
+			printf("Projector: mode given, not matching our mode "
+			       "to capture.\n");
+			mode_matching = false;
+		}
+	}
+
+	projector->mode_matching = mode_matching;
+	if (mode_matching)
+		printf("Projector: matching our mode to capture.\n");
+
+	if (clock_tracking) {
+		if (!projector->mode || !projector->mode->clock) {
+			fprintf(stderr, "%s: failed to get our mode, no clock "
+				"tracking.\n", __func__);
+		} else {
+			projector->clock_tracking = true;
+			projector->clock_current = projector->mode->clock;
+			printf("Projector: tracking the capture clock from "
+			       "%dkHz.\n", projector->clock_current);
+		}
+	}
+
 	projector->capture_stalled_buffer = kms_png_read("capture_stalled.png");
 	if (!projector->capture_stalled_buffer)
 		return -1;
 
-	ret = pthread_create(kms_projector_thread, NULL,
-			     kms_projector_thread_handler,
-			     (void *) kms_projector);
+	/* without alpha, we just switch, like we always did. */
+	if (projector->capture_scaling->property_alpha) {
+		projector->fade = fade_create("Projector",
+					      projector->capture_scaling,
+					      PROJECTOR_FADE_LENGTH);
+		if (!projector->fade)
+			return -ENOMEM;
+	} else
+		printf("Projector: plane %u has no alpha property, no fades.\n",
+		       projector->capture_scaling->plane_id);
+
+	ret = thread_create(kms_projector_thread, THREAD_ROLE_PROJECTOR,
+			    kms_projector_thread_handler,
+			    (void *) kms_projector);
 	if (ret) {
 		fprintf(stderr, "%s() projector thread creation failed: %s\n",
 			__func__, strerror(ret));
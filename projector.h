@@ -19,10 +19,19 @@
 #define _HAVE_PROJECTOR_H_ 1
 
 struct capture_buffer;
+struct _drmModeModeInfo;
+struct frc_statistics;
+struct colour_profile;
 
 void kms_projector_capture_display(struct capture_buffer *buffer);
 void kms_projector_capture_stop(void);
+void kms_projector_hotplug(uint32_t connector_id);
+int kms_projector_statistics_get(struct frc_statistics *frc,
+				 uint64_t *latency, uint64_t *latency_max);
 
-int kms_projector_init(void);
+int kms_projector_init(struct _drmModeModeInfo *mode,
+		       enum frc_policy frc_policy, bool clock_tracking,
+		       bool mode_matching, bool timecode,
+		       struct colour_profile *colour_profile);
 
 #endif /* _HAVE_PROJECTOR_H_ */
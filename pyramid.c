@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Downscaled preview pyramid: 1/2, 1/4 and 1/8 of each captured frame,
+ * in our own cached memory.
+ *
+ * Freeze detection, slide detection, and whatever wants a thumbnail, all
+ * want to look at the whole frame, and reading a 1280x720 planar buffer
+ * from uncached memory once per consumer does not fit our cpu budget. So
+ * we read it once, here, and everyone else looks at the pyramid.
+ *
+ * Even once is too much for a single frame, so an image is built in bands
+ * over several frames, with each band of rows 2x2 box filtered down level
+ * after level.
+ *
+ * There is just the one image, and no locking: all consumers run on the
+ * capture thread, right after pyramid_frame() completed an image, and copy
+ * out whatever they want to keep, before the next frame starts a new one.
+ * Should a consumer ever move to another thread, it will need a pool of
+ * images and reference counting, which we do not pay for today.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "juggler.h"
+#include "log.h"
+#include "thread.h"
+#include "capture.h"
+#include "stage.h"
+#include "pyramid.h"
+
+/* print our statistics about every 10s at 60Hz, with 8 bands */
+#define PYRAMID_STATISTICS_COUNT 75
+
+/* rows of the full frame which end up in one row of the smallest level */
+#define PYRAMID_BLOCK (1 << PYRAMID_LEVELS)
+
+/*
+ * 2x2 box filter of rows a and b into to, which is width wide.
+ */
+static void
+pyramid_halve(uint8_t *to, const uint8_t *a, const uint8_t *b, int width)
+{
+	int x = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for (; (x + 8) <= width; x += 8) {
+		uint16x8_t sum = vpaddlq_u8(vld1q_u8(a + 2 * x));
+
+		sum = vpadalq_u8(sum, vld1q_u8(b + 2 * x));
+		vst1_u8(to + x, vrshrn_n_u16(sum, 2));
+	}
+#elif defined(__SSE2__)
+	__m128i mask = _mm_set1_epi16(0x00FF);
+	__m128i two = _mm_set1_epi16(2);
+
+	for (; (x + 8) <= width; x += 8) {
+		__m128i top = _mm_loadu_si128((const __m128i *) (a + 2 * x));
+		__m128i bottom =
+			_mm_loadu_si128((const __m128i *) (b + 2 * x));
+		__m128i sum;
+
+		sum = _mm_add_epi16(_mm_and_si128(top, mask),
+				    _mm_srli_epi16(top, 8));
+		sum = _mm_add_epi16(sum, _mm_and_si128(bottom, mask));
+		sum = _mm_add_epi16(sum, _mm_srli_epi16(bottom, 8));
+		sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+
+		_mm_storel_epi64((__m128i *) (to + x),
+				 _mm_packus_epi16(sum, sum));
+	}
+#endif
+
+	for (; x < width; x++)
+		to[x] = (a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] +
+			 2) >> 2;
+}
+
+void
+pyramid_luma(uint8_t *luma, const uint8_t *blue, const uint8_t *green,
+	     const uint8_t *red, int count)
+{
+	int i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for (; (i + 8) <= count; i += 8) {
+		uint16x8_t sum = vmull_u8(vld1_u8(red + i), vdup_n_u8(77));
+
+		sum = vmlal_u8(sum, vld1_u8(green + i), vdup_n_u8(150));
+		sum = vmlal_u8(sum, vld1_u8(blue + i), vdup_n_u8(29));
+		vst1_u8(luma + i, vshrn_n_u16(sum, 8));
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+
+	for (; (i + 8) <= count; i += 8) {
+		__m128i r = _mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i *) (red + i)), zero);
+		__m128i g = _mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i *) (green + i)), zero);
+		__m128i b = _mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i *) (blue + i)), zero);
+		__m128i sum;
+
+		/* these weights add up to 256, so this fits 16bits */
+		sum = _mm_mullo_epi16(r, _mm_set1_epi16(77));
+		sum = _mm_add_epi16(sum,
+				    _mm_mullo_epi16(g, _mm_set1_epi16(150)));
+		sum = _mm_add_epi16(sum,
+				    _mm_mullo_epi16(b, _mm_set1_epi16(29)));
+		sum = _mm_srli_epi16(sum, 8);
+
+		_mm_storel_epi64((__m128i *) (luma + i),
+				 _mm_packus_epi16(sum, sum));
+	}
+#endif
+
+	for (; i < count; i++)
+		luma[i] = (77 * red[i] + 150 * green[i] + 29 * blue[i]) >> 8;
+}
+
+/*
+ * Turns PYRAMID_BLOCK rows of the frame, starting at block * PYRAMID_BLOCK,
+ * into a single row of the smallest level, and everything in between.
+ */
+static void
+pyramid_block(struct pyramid_image *image, struct stage *stage, int block)
+{
+	struct pyramid_level *smallest = &image->levels[PYRAMID_LEVELS - 1];
+	int y = block * PYRAMID_BLOCK;
+	int offset = block * smallest->width;
+	int plane, level, count, i;
+
+	for (plane = 0; plane < 3; plane++) {
+		struct pyramid_level *to = &image->levels[0];
+
+		count = PYRAMID_BLOCK / 2;
+		for (i = 0; i < count; i++)
+			pyramid_halve(to->planes[plane] +
+				      ((y / 2) + i) * to->width,
+				      stage_row(stage, plane, y + 2 * i),
+				      stage_row(stage, plane, y + 2 * i + 1),
+				      to->width);
+
+		for (level = 1; level < PYRAMID_LEVELS; level++) {
+			struct pyramid_level *from = &image->levels[level - 1];
+			int from_y = y >> level;
+
+			to = &image->levels[level];
+			count /= 2;
+
+			for (i = 0; i < count; i++) {
+				const uint8_t *row = from->planes[plane] +
+					(from_y + 2 * i) * from->width;
+
+				pyramid_halve(to->planes[plane] +
+					      ((from_y / 2) + i) * to->width,
+					      row, row + from->width,
+					      to->width);
+			}
+		}
+	}
+
+	pyramid_luma(image->luma + offset, smallest->planes[0] + offset,
+		     smallest->planes[1] + offset, smallest->planes[2] + offset,
+		     smallest->width);
+}
+
+static void
+pyramid_statistics_print(struct pyramid *pyramid)
+{
+	struct pyramid_statistics *statistics = pyramid->statistics;
+
+	log_info("Pyramid: %d images, %"PRIu64"kB staged and %"PRIu64"us per "
+		 "frame on average, %"PRIu64"us max.\n", statistics->images,
+		 statistics->bytes_total / (1024 * statistics->frames),
+		 statistics->time_total / (1000 * statistics->frames),
+		 statistics->time_max / 1000);
+}
+
+/*
+ * Called by capture, between stage_begin() and stage_end(). Adds the next
+ * band of this frame to the image being built, and when that completes
+ * it, returns it. It stays valid until the next call.
+ */
+struct pyramid_image *
+pyramid_frame(struct pyramid *pyramid, struct stage *stage,
+	      struct capture_buffer *buffer)
+{
+	struct pyramid_statistics *statistics = pyramid->statistics;
+	struct pyramid_image *image = pyramid->image;
+	int blocks = pyramid->height / PYRAMID_BLOCK;
+	int first, last, block;
+	size_t bytes = stage->bytes_frame;
+	uint64_t start, elapsed;
+
+	if ((stage->width != pyramid->width) ||
+	    (stage->height != pyramid->height))
+		return NULL;
+
+	start = thread_time_get();
+
+	first = (pyramid->band * blocks) / pyramid->bands;
+	last = ((pyramid->band + 1) * blocks) / pyramid->bands;
+	for (block = first; block < last; block++)
+		pyramid_block(image, stage, block);
+
+	elapsed = thread_time_get() - start;
+	statistics->frames++;
+	/* we are the first to stage rows, so these are ours */
+	statistics->bytes_total += stage->bytes_frame - bytes;
+	statistics->time_total += elapsed;
+	if (elapsed > statistics->time_max)
+		statistics->time_max = elapsed;
+
+	pyramid->band++;
+	if (pyramid->band < pyramid->bands)
+		return NULL;
+
+	image->sequence = buffer->sequence;
+	image->time = buffer->queued;
+
+	pyramid->band = 0;
+
+	statistics->images++;
+	if (statistics->images == PYRAMID_STATISTICS_COUNT) {
+		pyramid_statistics_print(pyramid);
+		memset(statistics, 0, sizeof(struct pyramid_statistics));
+	}
+
+	return image;
+}
+
+struct pyramid *
+pyramid_create(int width, int height, int bands)
+{
+	struct pyramid *pyramid;
+	struct pyramid_image *image;
+	int blocks = height / PYRAMID_BLOCK;
+	size_t size = 0;
+	uint8_t *memory;
+	int level, plane;
+
+	if ((width < PYRAMID_BLOCK) || !blocks || (bands < 1)) {
+		fprintf(stderr, "%s(): invalid %dx%d in %d bands.\n",
+			__func__, width, height, bands);
+		return NULL;
+	}
+
+	pyramid = calloc(1, sizeof(struct pyramid));
+	if (!pyramid) {
+		fprintf(stderr, "%s(): failed to allocate pyramid.\n",
+			__func__);
+		return NULL;
+	}
+
+	pyramid->width = width;
+	pyramid->height = height;
+	pyramid->bands = (bands > blocks) ? blocks : bands;
+
+	for (level = 0; level < PYRAMID_LEVELS; level++)
+		size += 3 * (width >> (level + 1)) *
+			((blocks * PYRAMID_BLOCK) >> (level + 1));
+	/* luma of the smallest level */
+	size += (width >> PYRAMID_LEVELS) * blocks;
+
+	pyramid->arena = malloc(size);
+	if (!pyramid->arena) {
+		fprintf(stderr, "%s(): failed to allocate %zdbytes.\n",
+			__func__, size);
+		free(pyramid);
+		return NULL;
+	}
+
+	memory = pyramid->arena;
+	image = pyramid->image;
+
+	for (level = 0; level < PYRAMID_LEVELS; level++) {
+		struct pyramid_level *to = &image->levels[level];
+
+		to->width = width >> (level + 1);
+		to->height = (blocks * PYRAMID_BLOCK) >> (level + 1);
+
+		for (plane = 0; plane < 3; plane++) {
+			to->planes[plane] = memory;
+			memory += to->width * to->height;
+		}
+	}
+
+	image->luma = memory;
+
+	printf("%s(): %dx%d in %d bands (%zdkB)\n", __func__, width,
+	       height, pyramid->bands, size >> 10);
+
+	return pyramid;
+}
+
+void
+pyramid_destroy(struct pyramid *pyramid)
+{
+	if (!pyramid)
+		return;
+
+	free(pyramid->arena);
+	free(pyramid);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_PYRAMID_H_
+#define _HAVE_PYRAMID_H_ 1
+
+struct stage;
+struct capture_buffer;
+
+/* 1/2, 1/4 and 1/8 */
+#define PYRAMID_LEVELS 3
+
+struct pyramid_level {
+	int width;
+	int height;
+	/* just like capture: blue, green, red. pitch is width. */
+	uint8_t *planes[3];
+};
+
+struct pyramid_image {
+	/* the capture frame which completed this image */
+	uint32_t sequence;
+	uint64_t time;
+
+	struct pyramid_level levels[PYRAMID_LEVELS];
+	/* bt601 full range luma of the smallest level */
+	uint8_t *luma;
+};
+
+struct pyramid_statistics {
+	int frames;
+	int images;
+	/* bytes of the capture buffers staged for us */
+	uint64_t bytes_total;
+	uint64_t time_total;
+	uint64_t time_max;
+};
+
+struct pyramid {
+	int width;
+	int height;
+
+	/* an image is built over this many frames */
+	int bands;
+
+	/*
+	 * Only one image, which gets overwritten as soon as the next one is
+	 * started, so consumers have to be done with it by then.
+	 */
+	struct pyramid_image image[1];
+	uint8_t *arena;
+
+	/* the band which the next frame adds */
+	int band;
+
+	struct pyramid_statistics statistics[1];
+};
+
+/* bt601 full range luma of count pixels of blue, green and red. */
+void pyramid_luma(uint8_t *luma, const uint8_t *blue, const uint8_t *green,
+		  const uint8_t *red, int count);
+
+struct pyramid *pyramid_create(int width, int height, int bands);
+void pyramid_destroy(struct pyramid *pyramid);
+
+struct pyramid_image *pyramid_frame(struct pyramid *pyramid,
+				    struct stage *stage,
+				    struct capture_buffer *buffer);
+
+#endif /* _HAVE_PYRAMID_H_ */
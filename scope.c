@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Signal levels, for the status lcd: per channel histograms, how much of
+ * the picture is clipped to black or white, and a luma waveform.
+ *
+ * Like everyone else, we do not read capture buffers, we look at the 1/4
+ * level of the pyramid, and only at every other pyramid image, so a few
+ * times a second. That is plenty to spot a camera or laptop which sends
+ * limited range, or which blows out its highlights. Luma is computed
+ * with the simd code of the pyramid, the rest is counting.
+ *
+ * Capture builds the result, the status thread takes a copy of the latest
+ * and draws it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "juggler.h"
+#include "log.h"
+#include "thread.h"
+#include "kms.h"
+#include "pyramid.h"
+#include "scope.h"
+
+/* about every 10s at 60Hz, with every other pyramid image */
+#define SCOPE_STATISTICS_COUNT 37
+
+/* which pyramid level we look at: 1/4 */
+#define SCOPE_PYRAMID_LEVEL 1
+/* and how many pyramid images we skip over */
+#define SCOPE_DECIMATE 2
+
+/* these bins, at both ends, count as clipped */
+#define SCOPE_CLIP_BINS 2
+
+#define SCOPE_COLOUR_BACKGROUND 0xA0000000
+
+static int
+scope_columns_update(struct scope *scope, int width)
+{
+	int x;
+
+	if (scope->width == width)
+		return 0;
+
+	free(scope->columns);
+	free(scope->luma);
+	scope->width = 0;
+
+	scope->columns = malloc(width * sizeof(uint16_t));
+	scope->luma = malloc(width);
+	if (!scope->columns || !scope->luma) {
+		free(scope->columns);
+		free(scope->luma);
+		scope->columns = NULL;
+		scope->luma = NULL;
+		return -ENOMEM;
+	}
+
+	for (x = 0; x < width; x++)
+		scope->columns[x] = x * SCOPE_WIDTH / width;
+
+	scope->width = width;
+	return 0;
+}
+
+static void
+scope_statistics_print(struct scope *scope)
+{
+	struct scope_statistics *statistics = scope->statistics;
+
+	log_info("Scope: %d images, %"PRIu64"us per image on average, %"
+		 PRIu64"us max.\n", statistics->images,
+		 statistics->time_total / (1000 * statistics->images),
+		 statistics->time_max / 1000);
+}
+
+/*
+ * Called by capture, for every pyramid image.
+ */
+void
+scope_frame(struct scope *scope, struct pyramid_image *image)
+{
+	struct scope_statistics *statistics = scope->statistics;
+	struct pyramid_level *level = &image->levels[SCOPE_PYRAMID_LEVEL];
+	struct scope_result *result = scope->result;
+	uint32_t count = result->count;
+	uint64_t start, elapsed;
+	int x, y;
+
+	scope->skip++;
+	if (scope->skip < SCOPE_DECIMATE)
+		return;
+	scope->skip = 0;
+
+	if (scope_columns_update(scope, level->width))
+		return;
+
+	start = thread_time_get();
+
+	memset(result, 0, sizeof(struct scope_result));
+	result->count = count + 1;
+	result->pixels = level->width * level->height;
+
+	for (y = 0; y < level->height; y++) {
+		const uint8_t *blue = level->planes[0] + y * level->width;
+		const uint8_t *green = level->planes[1] + y * level->width;
+		const uint8_t *red = level->planes[2] + y * level->width;
+
+		for (x = 0; x < level->width; x++) {
+			result->histograms[0][blue[x]]++;
+			result->histograms[1][green[x]]++;
+			result->histograms[2][red[x]]++;
+		}
+
+		pyramid_luma(scope->luma, blue, green, red, level->width);
+
+		for (x = 0; x < level->width; x++) {
+			int luma = (SCOPE_LEVELS - 1) -
+				(scope->luma[x] * SCOPE_LEVELS) / 256;
+
+			result->waveform[luma][scope->columns[x]]++;
+		}
+	}
+
+	pthread_mutex_lock(scope->mutex);
+	*scope->latest = *result;
+	pthread_mutex_unlock(scope->mutex);
+
+	elapsed = thread_time_get() - start;
+	statistics->images++;
+	statistics->time_total += elapsed;
+	if (elapsed > statistics->time_max)
+		statistics->time_max = elapsed;
+
+	if (statistics->images == SCOPE_STATISTICS_COUNT) {
+		scope_statistics_print(scope);
+		memset(statistics, 0, sizeof(struct scope_statistics));
+	}
+}
+
+/*
+ * Copies the latest result, when it differs from what result holds.
+ */
+bool
+scope_result_get(struct scope *scope, struct scope_result *result)
+{
+	bool new = false;
+
+	pthread_mutex_lock(scope->mutex);
+	if (scope->latest->count != result->count) {
+		*result = *scope->latest;
+		new = true;
+	}
+	pthread_mutex_unlock(scope->mutex);
+
+	return new;
+}
+
+/*
+ * Per mille of the picture which is clipped to white or to black.
+ */
+int
+scope_clipped(struct scope_result *result, int plane, bool white)
+{
+	uint32_t *histogram = result->histograms[plane];
+	uint32_t clipped = 0;
+	int i;
+
+	if (!result->pixels)
+		return 0;
+
+	for (i = 0; i < SCOPE_CLIP_BINS; i++)
+		clipped += histogram[white ? (255 - i) : i];
+
+	return (1000ULL * clipped) / result->pixels;
+}
+
+static uint32_t *
+scope_row(struct kms_buffer *buffer, int y)
+{
+	return (uint32_t *) ((uint8_t *) buffer->map + y * buffer->pitch);
+}
+
+/*
+ * Draws the rgb histograms on top, which add up to white where they
+ * overlap, and the luma waveform below that.
+ */
+void
+scope_draw(struct scope_result *result, struct kms_buffer *buffer)
+{
+	uint8_t heights[3][256];
+	uint32_t max = 1;
+	uint32_t *row;
+	int plane, x, y;
+
+	/* the clipped bins would flatten everything else, they just cap. */
+	for (plane = 0; plane < 3; plane++)
+		for (x = SCOPE_CLIP_BINS; x < (256 - SCOPE_CLIP_BINS); x++)
+			if (result->histograms[plane][x] > max)
+				max = result->histograms[plane][x];
+
+	for (plane = 0; plane < 3; plane++)
+		for (x = 0; x < 256; x++) {
+			uint64_t height = (uint64_t) SCOPE_HISTOGRAM_HEIGHT *
+				result->histograms[plane][x] / max;
+
+			if (height > SCOPE_HISTOGRAM_HEIGHT)
+				height = SCOPE_HISTOGRAM_HEIGHT;
+			heights[plane][x] = height;
+		}
+
+	for (y = 0; y < SCOPE_HISTOGRAM_HEIGHT; y++) {
+		int level = SCOPE_HISTOGRAM_HEIGHT - y;
+
+		row = scope_row(buffer, y);
+
+		for (x = 0; x < 256; x++) {
+			uint32_t pixel = 0;
+
+			if (heights[0][x] >= level)
+				pixel |= 0xFF0000FF;
+			if (heights[1][x] >= level)
+				pixel |= 0xFF00FF00;
+			if (heights[2][x] >= level)
+				pixel |= 0xFFFF0000;
+
+			row[x] = pixel ? pixel : SCOPE_COLOUR_BACKGROUND;
+		}
+	}
+
+	for (; y < (SCOPE_HISTOGRAM_HEIGHT + SCOPE_GAP); y++) {
+		row = scope_row(buffer, y);
+
+		for (x = 0; x < SCOPE_WIDTH; x++)
+			row[x] = SCOPE_COLOUR_BACKGROUND;
+	}
+
+	for (; y < SCOPE_HEIGHT; y++) {
+		int level = y - SCOPE_HISTOGRAM_HEIGHT - SCOPE_GAP;
+		uint16_t *counts = result->waveform[level];
+
+		row = scope_row(buffer, y);
+
+		for (x = 0; x < SCOPE_WIDTH; x++) {
+			int intensity;
+
+			if (!counts[x]) {
+				row[x] = SCOPE_COLOUR_BACKGROUND;
+				continue;
+			}
+
+			intensity = 64 + 24 * counts[x];
+			if (intensity > 255)
+				intensity = 255;
+
+			row[x] = 0xFF000000 | ((intensity / 2) << 16) |
+				(intensity << 8) | (intensity / 2);
+		}
+	}
+}
+
+struct scope *
+scope_create(void)
+{
+	struct scope *scope;
+
+	scope = calloc(1, sizeof(struct scope));
+	if (!scope)
+		return NULL;
+
+	pthread_mutex_init(scope->mutex, NULL);
+
+	return scope;
+}
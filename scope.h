@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_SCOPE_H_
+#define _HAVE_SCOPE_H_ 1
+
+struct pyramid_image;
+struct kms_buffer;
+
+/* the waveform is this many columns wide, the histograms have 256 bins. */
+#define SCOPE_WIDTH 256
+/* vertical resolution of the waveform */
+#define SCOPE_LEVELS 64
+
+/* what scope_draw() needs */
+#define SCOPE_HISTOGRAM_HEIGHT 64
+#define SCOPE_GAP 4
+#define SCOPE_HEIGHT (SCOPE_HISTOGRAM_HEIGHT + SCOPE_GAP + SCOPE_LEVELS)
+
+struct scope_result {
+	/* counts up with every result */
+	uint32_t count;
+	int pixels;
+
+	/* blue, green, red, just like capture */
+	uint32_t histograms[3][256];
+	/* luma, with the brightest level at the top */
+	uint16_t waveform[SCOPE_LEVELS][SCOPE_WIDTH];
+};
+
+struct scope_statistics {
+	int images;
+	uint64_t time_total;
+	uint64_t time_max;
+};
+
+struct scope {
+	/* only touched by capture */
+	int skip;
+	struct scope_result result[1];
+	/* the waveform column of each pixel of a row */
+	int width;
+	uint16_t *columns;
+	uint8_t *luma;
+
+	pthread_mutex_t mutex[1];
+	struct scope_result latest[1];
+
+	struct scope_statistics statistics[1];
+};
+
+struct scope *scope_create(void);
+void scope_frame(struct scope *scope, struct pyramid_image *image);
+
+bool scope_result_get(struct scope *scope, struct scope_result *result);
+int scope_clipped(struct scope_result *result, int plane, bool white);
+void scope_draw(struct scope_result *result, struct kms_buffer *buffer);
+
+#endif /* _HAVE_SCOPE_H_ */
@@ -0,0 +1,584 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Slide snapshots: most talks are slides, and the talk pages want images
+ * of them.
+ *
+ * We look at the luma of the smallest level of the pyramid, so 1/8th of
+ * the frame each way. For every new pyramid image, we compare blocks of it
+ * against the last snapshot and against the previous image. When enough
+ * blocks differ from the last snapshot, the slide is changing, and once
+ * nothing has moved for a while, the new slide is handed to a low priority
+ * worker thread, which copies it out and writes it as a png. Capture never
+ * waits for that worker: when it is still busy, we simply try again on the
+ * next round.
+ *
+ * Snapshots are named after the time at which they were captured, and
+ * are listed in index.txt in the same directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include <zlib.h>
+#include <png.h>
+
+#include "juggler.h"
+#include "log.h"
+#include "thread.h"
+#include "capture.h"
+#include "stage.h"
+#include "pyramid.h"
+#include "fingerprint.h"
+#include "convert.h"
+#include "slides.h"
+
+/* blocks of downscaled pixels, so 64x64 pixels of capture */
+#define SLIDES_BLOCK 8
+/* a block changed when its pixels differ by more than 3 on average */
+#define SLIDES_BLOCK_SAD (3 * SLIDES_BLOCK * SLIDES_BLOCK)
+
+/*
+ * Hysteresis: this many blocks need to differ from the last snapshot for
+ * a slide change to start, which is more than a moving mouse cursor does.
+ * The change is over once no more than SLIDES_CHANGE_LOW blocks moved for
+ * SLIDES_SETTLE_TIME, so we do not catch transitions halfway.
+ */
+#define SLIDES_CHANGE_HIGH 4
+#define SLIDES_CHANGE_LOW 2
+#define SLIDES_SETTLE_TIME 500000000ULL /* ns */
+
+/* png encoding is not urgent at all. */
+#define SLIDES_NICE 10
+/*
+ * Slides are mostly flat areas and text. The up filter and run length
+ * encoding compress those nearly as well as the defaults, at a fraction
+ * of the cpu time.
+ */
+#define SLIDES_PNG_LEVEL 3
+
+static char *slides_directory;
+
+/* detector, only touched by the capture thread */
+static int slides_width;
+static int slides_height;
+static uint8_t *slides_current;
+static uint8_t *slides_previous;
+static uint8_t *slides_reference;
+static bool slides_previous_valid;
+static bool slides_reference_valid;
+static bool slides_changing;
+static uint64_t slides_settled_since;
+
+/* mailbox to our worker */
+static pthread_t slides_thread[1];
+static pthread_mutex_t slides_mutex[1] = { PTHREAD_MUTEX_INITIALIZER };
+static pthread_cond_t slides_cond[1] = { PTHREAD_COND_INITIALIZER };
+static struct capture_buffer *slides_pending;
+static struct timespec slides_pending_time;
+static bool slides_busy;
+
+/* worker only */
+static struct stage *slides_stage;
+static uint8_t *slides_row;
+
+static int
+slides_detector_size(struct pyramid_level *level)
+{
+	int width = level->width;
+	int height = level->height;
+	size_t size = width * height;
+
+	if ((width == slides_width) && (height == slides_height))
+		return 0;
+
+	free(slides_current);
+	free(slides_previous);
+	free(slides_reference);
+
+	slides_current = calloc(1, size);
+	slides_previous = calloc(1, size);
+	slides_reference = calloc(1, size);
+	if (!slides_current || !slides_previous || !slides_reference) {
+		log_error("%s(): failed to allocate %dx%d copies.\n",
+			  __func__, width, height);
+		free(slides_current);
+		free(slides_previous);
+		free(slides_reference);
+		slides_current = NULL;
+		slides_previous = NULL;
+		slides_reference = NULL;
+		slides_width = 0;
+		slides_height = 0;
+		return -ENOMEM;
+	}
+
+	slides_width = width;
+	slides_height = height;
+
+	slides_previous_valid = false;
+	slides_reference_valid = false;
+	slides_changing = false;
+	slides_settled_since = 0;
+
+	return 0;
+}
+
+/*
+ * Returns how many blocks differ between both downscaled copies.
+ */
+static int
+slides_blocks_changed(const uint8_t *a, const uint8_t *b)
+{
+	int changed = 0, block_x, block_y, x, y;
+
+	for (block_y = 0; block_y < slides_height; block_y += SLIDES_BLOCK)
+		for (block_x = 0; block_x < slides_width;
+		     block_x += SLIDES_BLOCK) {
+			uint32_t sad = 0;
+
+			for (y = block_y; (y < (block_y + SLIDES_BLOCK)) &&
+				     (y < slides_height); y++) {
+				int offset = y * slides_width;
+
+				for (x = block_x;
+				     (x < (block_x + SLIDES_BLOCK)) &&
+					     (x < slides_width); x++) {
+					int diff = a[offset + x] -
+						b[offset + x];
+
+					sad += (diff < 0) ? -diff : diff;
+				}
+			}
+
+			if (sad > SLIDES_BLOCK_SAD)
+				changed++;
+		}
+
+	return changed;
+}
+
+/*
+ * Hand the frame to our worker. Returns -EBUSY when it is still busy with
+ * the previous one.
+ */
+static int
+slides_snapshot(struct capture_buffer *buffer)
+{
+	pthread_mutex_lock(slides_mutex);
+
+	if (slides_busy) {
+		pthread_mutex_unlock(slides_mutex);
+		return -EBUSY;
+	}
+
+	capture_buffer_display_hold(buffer);
+
+	slides_pending = buffer;
+	clock_gettime(CLOCK_REALTIME, &slides_pending_time);
+	slides_busy = true;
+
+	pthread_cond_signal(slides_cond);
+	pthread_mutex_unlock(slides_mutex);
+
+	return 0;
+}
+
+/*
+ * Called for every new pyramid image, with the frame which completed it.
+ */
+static void
+slides_detect(struct capture_buffer *buffer)
+{
+	struct fingerprint *fingerprint = capture_fingerprint_get();
+	enum fingerprint_state state = FINGERPRINT_LIVE;
+	int moved;
+
+	if (!slides_previous_valid) {
+		memcpy(slides_previous, slides_current,
+		       slides_width * slides_height);
+		slides_previous_valid = true;
+		return;
+	}
+
+	moved = slides_blocks_changed(slides_current, slides_previous);
+	memcpy(slides_previous, slides_current, slides_width * slides_height);
+
+	if (!slides_changing) {
+		if (slides_reference_valid &&
+		    (slides_blocks_changed(slides_current, slides_reference) <
+		     SLIDES_CHANGE_HIGH))
+			return;
+
+		log_debug("Slides: slide is changing.\n");
+		slides_changing = true;
+		slides_settled_since = 0;
+	}
+
+	if (moved > SLIDES_CHANGE_LOW) {
+		slides_settled_since = 0;
+		return;
+	}
+
+	if (!slides_settled_since) {
+		slides_settled_since = buffer->queued;
+		return;
+	}
+
+	if ((buffer->queued - slides_settled_since) < SLIDES_SETTLE_TIME)
+		return;
+
+	/* we might have just ended up back at the same slide. */
+	if (slides_reference_valid &&
+	    (slides_blocks_changed(slides_current, slides_reference) <
+	     SLIDES_CHANGE_HIGH)) {
+		slides_changing = false;
+		return;
+	}
+
+	/* nothing worth putting on a talk page */
+	if (fingerprint)
+		state = fingerprint_state_get(fingerprint, NULL);
+
+	if ((state != FINGERPRINT_BLACK) && (state != FINGERPRINT_UNIFORM) &&
+	    slides_snapshot(buffer))
+		return; /* try again next round */
+
+	memcpy(slides_reference, slides_current, slides_width * slides_height);
+	slides_reference_valid = true;
+	slides_changing = false;
+}
+
+/*
+ * Called by capture for every new pyramid image, with the frame which
+ * completed it. The heavy lifting is left to our worker.
+ */
+void
+slides_capture_frame(struct pyramid_image *image,
+		     struct capture_buffer *buffer)
+{
+	struct pyramid_level *level = &image->levels[PYRAMID_LEVELS - 1];
+
+	if (!slides_directory)
+		return;
+
+	if (slides_detector_size(level))
+		return;
+
+	memcpy(slides_current, image->luma, slides_width * slides_height);
+
+	slides_detect(buffer);
+}
+
+/*
+ * Copy the whole frame to our own stage, so that capture gets its buffer
+ * back as soon as possible. Always releases the buffer.
+ */
+static int
+slides_frame_copy(struct capture_buffer *buffer)
+{
+	int ret, plane, y;
+
+	if (slides_stage && ((slides_stage->width != buffer->width) ||
+			     (slides_stage->height != buffer->height))) {
+		stage_destroy(slides_stage);
+		slides_stage = NULL;
+	}
+
+	if (!slides_stage) {
+		free(slides_row);
+		slides_row = malloc(4 * buffer->width);
+		slides_stage = stage_create(buffer->width, buffer->height);
+		if (!slides_row || !slides_stage) {
+			log_error("%s(): failed to allocate for %dx%d.\n",
+				  __func__, buffer->width, buffer->height);
+			stage_destroy(slides_stage);
+			slides_stage = NULL;
+			capture_buffer_display_release(buffer);
+			return -ENOMEM;
+		}
+	}
+
+	ret = stage_begin(slides_stage, buffer);
+	if (ret) {
+		capture_buffer_display_release(buffer);
+		return ret;
+	}
+
+	for (plane = 0; plane < 3; plane++)
+		for (y = 0; y < buffer->height; y++)
+			stage_row(slides_stage, plane, y);
+
+	stage_end(slides_stage);
+	capture_buffer_display_release(buffer);
+
+	return 0;
+}
+
+static int
+slides_png_write(const char *filename)
+{
+	struct stage *stage = slides_stage;
+	png_structp png;
+	png_infop info;
+	FILE *file;
+	int y;
+
+	file = fopen(filename, "wb");
+	if (!file) {
+		log_error("%s(): failed to open %s: %s\n", __func__,
+			  filename, strerror(errno));
+		return -errno;
+	}
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+				      NULL);
+	info = png ? png_create_info_struct(png) : NULL;
+	if (!info) {
+		log_error("%s(): failed to create png structs.\n", __func__);
+		png_destroy_write_struct(&png, NULL);
+		fclose(file);
+		return -ENOMEM;
+	}
+
+	if (setjmp(png_jmpbuf(png))) {
+		log_error("%s(): failed to write %s.\n", __func__, filename);
+		png_destroy_write_struct(&png, &info);
+		fclose(file);
+		return -EIO;
+	}
+
+	png_init_io(png, file);
+
+	png_set_IHDR(png, info, stage->width, stage->height, 8,
+		     PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_UP);
+	png_set_compression_level(png, SLIDES_PNG_LEVEL);
+	png_set_compression_strategy(png, Z_RLE);
+
+	png_write_info(png, info);
+	/* we hand over rgbx, drop the x. */
+	png_set_filler(png, 0, PNG_FILLER_AFTER);
+
+	for (y = 0; y < stage->height; y++) {
+		/*
+		 * All rows were staged before the buffer was released, so
+		 * this no longer touches the capture buffer.
+		 */
+		struct convert_image in[1] = {{
+				.width = stage->width,
+				.height = 1,
+				.planes = {
+					(uint8_t *) stage_row(stage, 2, y),
+					(uint8_t *) stage_row(stage, 1, y),
+					(uint8_t *) stage_row(stage, 0, y),
+				},
+				.pitches = { stage->width, stage->width,
+					     stage->width },
+			}};
+		struct convert_image out[1] = {{
+				.width = stage->width,
+				.height = 1,
+				.planes = { slides_row },
+				.pitches = { 4 * stage->width },
+			}};
+
+		convert_planar_to_rgba(in, out);
+		png_write_row(png, slides_row);
+	}
+
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+
+	if (fclose(file)) {
+		log_error("%s(): failed to close %s: %s\n", __func__,
+			  filename, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void
+slides_index_append(const char *name, const char *time)
+{
+	char filename[PATH_MAX];
+	FILE *file;
+	int ret;
+
+	ret = snprintf(filename, sizeof(filename), "%s/index.txt",
+		       slides_directory);
+	if ((ret < 0) || (ret >= (int) sizeof(filename))) {
+		log_error("%s(): index path too long.\n", __func__);
+		return;
+	}
+
+	file = fopen(filename, "a");
+	if (!file) {
+		log_error("%s(): failed to open %s: %s\n", __func__,
+			  filename, strerror(errno));
+		return;
+	}
+
+	fprintf(file, "%s %s\n", time, name);
+	fclose(file);
+}
+
+static void
+slides_snapshot_write(struct capture_buffer *buffer,
+		      struct timespec *captured)
+{
+	char filename[PATH_MAX], temporary[PATH_MAX];
+	char name[64], stamp[32], time[64];
+	uint64_t start = thread_time_get();
+	struct tm local[1];
+	int ret;
+
+	ret = slides_frame_copy(buffer);
+	if (ret)
+		return;
+
+	localtime_r(&captured->tv_sec, local);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", local);
+	snprintf(name, sizeof(name), "slide-%s.%03ld.png", stamp,
+		 captured->tv_nsec / 1000000);
+
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", local);
+	snprintf(time, sizeof(time), "%s.%03ld", stamp,
+		 captured->tv_nsec / 1000000);
+
+	/* both need to fit, or we would rename to the wrong name. */
+	ret = snprintf(filename, sizeof(filename), "%s/%s", slides_directory,
+		       name);
+	if ((ret < 0) || (ret >= (int) sizeof(filename))) {
+		log_error("%s(): path of %s too long, skipping slide.\n",
+			  __func__, name);
+		return;
+	}
+
+	ret = snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+	if ((ret < 0) || (ret >= (int) sizeof(temporary))) {
+		log_error("%s(): path of %s too long, skipping slide.\n",
+			  __func__, name);
+		return;
+	}
+
+	/* never let anyone see a half written png. */
+	ret = slides_png_write(temporary);
+	if (ret) {
+		unlink(temporary);
+		return;
+	}
+
+	if (rename(temporary, filename)) {
+		log_error("%s(): failed to rename %s: %s\n", __func__,
+			  temporary, strerror(errno));
+		unlink(temporary);
+		return;
+	}
+
+	slides_index_append(name, time);
+
+	log_info("Slides: wrote %s in %"PRIu64"ms.\n", name,
+		 (thread_time_get() - start) / 1000000);
+}
+
+static void *
+slides_thread_handler(void *arg)
+{
+	errno = 0;
+	if ((nice(SLIDES_NICE) == -1) && errno)
+		log_error("%s(): nice(): %s\n", __func__, strerror(errno));
+
+	while (true) {
+		struct capture_buffer *buffer;
+		struct timespec captured;
+
+		pthread_mutex_lock(slides_mutex);
+		while (!slides_pending)
+			pthread_cond_wait(slides_cond, slides_mutex);
+		buffer = slides_pending;
+		captured = slides_pending_time;
+		slides_pending = NULL;
+		pthread_mutex_unlock(slides_mutex);
+
+		slides_snapshot_write(buffer, &captured);
+
+		pthread_mutex_lock(slides_mutex);
+		slides_busy = false;
+		pthread_mutex_unlock(slides_mutex);
+	}
+
+	return NULL;
+}
+
+int
+slides_init(const char *directory)
+{
+	struct stat status[1];
+	int ret;
+
+	if (stat(directory, status)) {
+		fprintf(stderr, "%s(): failed to stat %s: %s\n", __func__,
+			directory, strerror(errno));
+		return -errno;
+	}
+
+	if (!S_ISDIR(status->st_mode)) {
+		fprintf(stderr, "%s(): %s is not a directory.\n", __func__,
+			directory);
+		return -ENOTDIR;
+	}
+
+	if (access(directory, W_OK)) {
+		fprintf(stderr, "%s(): cannot write to %s: %s\n", __func__,
+			directory, strerror(errno));
+		return -errno;
+	}
+
+	slides_directory = strdup(directory);
+	if (!slides_directory)
+		return -ENOMEM;
+
+	ret = thread_create(slides_thread, THREAD_ROLE_SLIDES,
+			    slides_thread_handler, NULL);
+	if (ret) {
+		fprintf(stderr, "%s() thread creation failed: %s\n",
+			__func__, strerror(ret));
+		free(slides_directory);
+		slides_directory = NULL;
+		return -ret;
+	}
+
+	printf("Slides: writing snapshots to %s.\n", directory);
+
+	return 0;
+}
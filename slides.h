@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_SLIDES_H_
+#define _HAVE_SLIDES_H_ 1
+
+struct pyramid_image;
+struct capture_buffer;
+
+void slides_capture_frame(struct pyramid_image *image,
+			  struct capture_buffer *buffer);
+
+int slides_init(const char *directory);
+
+#endif /* _HAVE_SLIDES_H_ */
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Our capture buffers are dma memory, which the cpu sees as uncached (or
+ * at best write-combined). Reading those byte by byte is horribly slow,
+ * so before we run any analysis on a frame, we stream the rows we need
+ * into a cached arena with wide loads, and let the analysis code loose on
+ * that instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include <linux/dma-buf.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "juggler.h"
+#include "capture.h"
+#include "log.h"
+#include "stage.h"
+
+/* print our statistics every 10s at 60Hz */
+#define STAGE_STATISTICS_FRAMES 600
+
+struct stage *
+stage_create(int width, int height)
+{
+	struct stage *stage;
+
+	stage = calloc(1, sizeof(struct stage));
+	if (!stage) {
+		fprintf(stderr, "%s(): failed to allocate stage.\n", __func__);
+		return NULL;
+	}
+
+	stage->width = width;
+	stage->height = height;
+
+	stage->arena = malloc(3 * width * height);
+	stage->rows_generation = calloc(3 * height, sizeof(uint32_t));
+	if (!stage->arena || !stage->rows_generation) {
+		fprintf(stderr, "%s(): failed to allocate %dx%d arena.\n",
+			__func__, width, height);
+		stage_destroy(stage);
+		return NULL;
+	}
+
+	/* generation 0 marks a row as never copied. */
+	stage->generation = 1;
+
+	printf("%s(): %dx%d (%dkB)\n", __func__, width, height,
+	       (3 * width * height) >> 10);
+
+	return stage;
+}
+
+void
+stage_destroy(struct stage *stage)
+{
+	if (!stage)
+		return;
+
+	free(stage->arena);
+	free(stage->rows_generation);
+	free(stage);
+}
+
+/*
+ * Wide copy out of uncached memory. Straight NEON loads of 64 bytes at a
+ * time beat both memcpy and the cpu's readahead on the A20.
+ */
+void
+stage_copy(void *destination, const void *source, size_t size)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	uint8_t *to = destination;
+	const uint8_t *from = source;
+
+	for (; size >= 64; size -= 64) {
+		uint8x16_t a = vld1q_u8(from);
+		uint8x16_t b = vld1q_u8(from + 16);
+		uint8x16_t c = vld1q_u8(from + 32);
+		uint8x16_t d = vld1q_u8(from + 48);
+
+		vst1q_u8(to, a);
+		vst1q_u8(to + 16, b);
+		vst1q_u8(to + 32, c);
+		vst1q_u8(to + 48, d);
+
+		from += 64;
+		to += 64;
+	}
+
+	if (size)
+		memcpy(to, from, size);
+#else
+	memcpy(destination, source, size);
+#endif
+}
+
+static void
+stage_sync(struct capture_buffer *buffer, uint64_t flags)
+{
+	struct dma_buf_sync sync[1] = {{
+			.flags = flags | DMA_BUF_SYNC_READ,
+		}};
+	int i, ret;
+
+	for (i = 0; i < 3; i++) {
+		if (buffer->planes[i].export_fd < 0)
+			continue;
+
+		ret = ioctl(buffer->planes[i].export_fd, DMA_BUF_IOCTL_SYNC,
+			    sync);
+		if (ret)
+			log_ratelimited(LOG_ERROR, "%s(%d[%d]): "
+					"DMA_BUF_IOCTL_SYNC failed: %s\n",
+					__func__, buffer->index, i,
+					strerror(errno));
+	}
+}
+
+/*
+ * Start staging rows from the given buffer. Rows staged for the previous
+ * buffer are invalidated.
+ */
+int
+stage_begin(struct stage *stage, struct capture_buffer *buffer)
+{
+	if ((buffer->width != stage->width) ||
+	    (buffer->height != stage->height)) {
+		log_error("%s(%d): buffer is %dx%d, stage is %dx%d\n",
+			  __func__, buffer->index, buffer->width,
+			  buffer->height, stage->width, stage->height);
+		return -EINVAL;
+	}
+
+	stage->generation++;
+	if (!stage->generation) {
+		/* wrapped, make sure that no row looks valid */
+		memset(stage->rows_generation, 0,
+		       3 * stage->height * sizeof(uint32_t));
+		stage->generation = 1;
+	}
+
+	stage->buffer = buffer;
+	stage->bytes_frame = 0;
+
+	stage_sync(buffer, DMA_BUF_SYNC_START);
+
+	return 0;
+}
+
+/*
+ * Returns a cached copy of row y of the given plane, only copying it over
+ * the first time it is asked for in this frame.
+ */
+const uint8_t *
+stage_row(struct stage *stage, int plane, int y)
+{
+	struct capture_buffer *buffer = stage->buffer;
+	uint8_t *row = stage->arena +
+		((plane * stage->height) + y) * stage->width;
+	uint32_t *generation =
+		&stage->rows_generation[plane * stage->height + y];
+
+	if (*generation != stage->generation) {
+		const uint8_t *map = capture_buffer_plane_map(buffer, plane);
+
+		if (map) {
+			stage_copy(row, map + y * buffer->pitch,
+				   stage->width);
+			stage->bytes_frame += stage->width;
+		} else
+			memset(row, 0, stage->width);
+		*generation = stage->generation;
+	}
+
+	return row;
+}
+
+/*
+ * Returns the amount of bytes copied for this frame.
+ */
+size_t
+stage_end(struct stage *stage)
+{
+	struct capture_buffer *buffer = stage->buffer;
+
+	if (!buffer)
+		return 0;
+
+	stage_sync(buffer, DMA_BUF_SYNC_END);
+	stage->buffer = NULL;
+
+	stage->bytes_total += stage->bytes_frame;
+	stage->frames_total++;
+
+	if (!(stage->frames_total % STAGE_STATISTICS_FRAMES))
+		log_info("Stage: %d frames, %zdbytes this frame, %"PRIu64
+			 "bytes/frame on average.\n", stage->frames_total,
+			 stage->bytes_frame,
+			 stage->bytes_total / stage->frames_total);
+
+	return stage->bytes_frame;
+}
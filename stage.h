@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_STAGE_H_
+#define _HAVE_STAGE_H_ 1
+
+struct capture_buffer;
+
+/*
+ * Cached copies of the rows of a capture buffer, for cpu side analysis.
+ */
+struct stage {
+	int width;
+	int height;
+
+	uint8_t *arena;
+	/* frame generation for which each row was copied */
+	uint32_t *rows_generation;
+	uint32_t generation;
+
+	struct capture_buffer *buffer;
+
+	size_t bytes_frame;
+
+	/* statistics */
+	uint64_t bytes_total;
+	uint32_t frames_total;
+};
+
+struct stage *stage_create(int width, int height);
+void stage_destroy(struct stage *stage);
+
+int stage_begin(struct stage *stage, struct capture_buffer *buffer);
+const uint8_t *stage_row(struct stage *stage, int plane, int y);
+size_t stage_end(struct stage *stage);
+
+void stage_copy(void *destination, const void *source, size_t size);
+
+#endif /* _HAVE_STAGE_H_ */
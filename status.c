@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include <pthread.h>
 
@@ -30,11 +31,26 @@
 
 #include "juggler.h"
 #include "kms.h"
+#include "log.h"
 #include "status.h"
 #include "capture.h"
+#include "thread.h"
+#include "vblank.h"
+#include "frc.h"
+#include "projector.h"
+#include "overlay.h"
+#include "scope.h"
+#include "timecode.h"
+#include "fingerprint.h"
 
 static pthread_t kms_status_thread[1];
 
+/* fits "Clip hi: R 100.0 G 100.0 B 100.0%" */
+#define STATUS_OVERLAY_COLUMNS 34
+#define STATUS_OVERLAY_ROWS 9
+/* how often we look at our numbers, in ns */
+#define STATUS_OVERLAY_PERIOD 500000000ULL
+
 struct kms_status {
 	bool connected;
 	bool mode_ok;
@@ -50,11 +66,30 @@ struct kms_status {
 	struct kms_plane *capture_yuv;
 
 	struct kms_plane *text;
+	struct overlay *overlay;
+	/* the overlay buffer we have shown, or are about to show */
 	struct kms_buffer *text_buffer;
+	bool text_flip;
+	uint64_t overlay_time;
+
+	uint64_t start_time;
+	/* from /proc/stat, for the cpu load */
+	uint64_t cpu_busy;
+	uint64_t cpu_total;
 
 	struct kms_plane *logo;
 	struct kms_buffer *logo_buffer;
 
+	/* signal levels, when there is a plane left for them */
+	struct kms_plane *scope;
+	struct kms_buffer *scope_buffers[2];
+	int scope_front;
+	bool scope_flip;
+	struct scope_result *scope_result;
+
+	/* burn-in of capture time and sequence, when asked for */
+	struct timecode *timecode;
+
 	/*
 	 * it could be that the primary plane is not used by us, and
 	 * should be disabled
@@ -84,6 +119,9 @@ struct kms_status {
 	 */
 	uint32_t capture_stall_count;
 
+	/* decides when and what we commit */
+	struct vblank *vblank;
+
 	/* Flag the stream stopping, protect with capture_buffer_mutex */
 	bool capture_stopped;
 	uint32_t capture_stopped_count;
@@ -179,6 +217,14 @@ kms_status_planes_get(struct kms_status *status)
 					goto plane_error;
 				}
 				used = true;
+			} else if (!status->scope) {
+				status->scope =
+					kms_plane_create(plane->plane_id);
+				if (!status->scope) {
+					ret = -1;
+					goto plane_error;
+				}
+				used = true;
 			}
 		}
 
@@ -263,7 +309,7 @@ kms_status_capture_set(struct kms_status *status,
 		}
 #endif
 
-		printf("%s(): %4dx%4d -> %4dx%4d\n", __func__, x, y, w, h);
+		log_info("%s(): %4dx%4d -> %4dx%4d\n", __func__, x, y, w, h);
 
 		drmModeAtomicAddProperty(request, plane->plane_id,
 					 plane->property_crtc_x, x);
@@ -315,7 +361,273 @@ kms_status_capture_disable(struct kms_status *status,
 }
 
 /*
- * Show status text on bottom of the status lcd.
+ * Percentage of cpu time spent since we last looked, or -1.
+ */
+static int
+kms_status_cpu_load(struct kms_status *status)
+{
+	uint64_t user, nice, system, idle, iowait, irq, softirq;
+	uint64_t busy, total;
+	int load = -1;
+	FILE *file;
+
+	file = fopen("/proc/stat", "r");
+	if (!file)
+		return -1;
+
+	if (fscanf(file, "cpu %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64" %"
+		   SCNu64" %"SCNu64" %"SCNu64, &user, &nice, &system, &idle,
+		   &iowait, &irq, &softirq) != 7) {
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+
+	busy = user + nice + system + irq + softirq;
+	total = busy + idle + iowait;
+
+	if (status->cpu_total && (total > status->cpu_total))
+		load = 100 * (busy - status->cpu_busy) /
+			(total - status->cpu_total);
+
+	status->cpu_busy = busy;
+	status->cpu_total = total;
+
+	return load;
+}
+
+static void
+kms_status_clip_print(struct kms_status *status, int row, bool white)
+{
+	struct scope_result *result = status->scope_result;
+	const char *name = white ? "Clip hi:" : "Clip lo:";
+	int blue, green, red;
+
+	if (!result->count) {
+		overlay_printf(status->overlay, row, "%s -", name);
+		return;
+	}
+
+	blue = scope_clipped(result, 0, white);
+	green = scope_clipped(result, 1, white);
+	red = scope_clipped(result, 2, white);
+
+	overlay_printf(status->overlay, row,
+		       "%s R %d.%d G %d.%d B %d.%d%%", name,
+		       red / 10, red % 10, green / 10, green % 10,
+		       blue / 10, blue % 10);
+}
+
+/*
+ * What the fingerprint makes of the input, and for how long already.
+ */
+static void
+kms_status_signal_print(struct kms_status *status, int row, uint64_t now)
+{
+	struct fingerprint *fingerprint = capture_fingerprint_get();
+	enum fingerprint_state state;
+	uint64_t since, seconds;
+
+	if (!fingerprint) {
+		overlay_printf(status->overlay, row, "Signal:  -");
+		return;
+	}
+
+	state = fingerprint_state_get(fingerprint, &since);
+	seconds = (now > since) ? (now - since) / 1000000000ULL : 0;
+
+	overlay_printf(status->overlay, row, "Signal:  %s, %02d:%02d:%02d",
+		       fingerprint_state_string(state),
+		       (int) (seconds / 3600), (int) ((seconds / 60) % 60),
+		       (int) (seconds % 60));
+}
+
+/*
+ * Fill in the overlay with how we are doing, and render it when anything
+ * changed. Only every STATUS_OVERLAY_PERIOD, so that all of this stays
+ * well clear of our frame budget.
+ */
+static void
+kms_status_overlay_update(struct kms_status *status,
+			  struct capture_buffer *buffer)
+{
+	struct overlay *overlay = status->overlay;
+	struct frc_statistics frc[1];
+	uint64_t now = thread_time_get();
+	uint64_t latency, latency_max, bits, errors, uptime;
+	struct kms_buffer *rendered;
+	int load;
+
+	if (now < (status->overlay_time + STATUS_OVERLAY_PERIOD))
+		return;
+	status->overlay_time = now;
+
+	if (buffer && status->vblank->capture_period) {
+		uint64_t rate = 100000000000ULL /
+			status->vblank->capture_period;
+
+		overlay_printf(overlay, 0, "Input:   %dx%d @ %d.%02dHz",
+			       buffer->width, buffer->height,
+			       (int) (rate / 100), (int) (rate % 100));
+	} else if (buffer)
+		overlay_printf(overlay, 0, "Input:   %dx%d",
+			       buffer->width, buffer->height);
+	else
+		overlay_printf(overlay, 0, "Input:   none");
+
+	if (!kms_projector_statistics_get(frc, &latency, &latency_max)) {
+		overlay_printf(overlay, 1, "Dropped: %d of %d frames",
+			       frc->dropped, frc->frames);
+		overlay_printf(overlay, 2, "Latency: %d.%dms, max %d.%dms",
+			       (int) (latency / 1000000),
+			       (int) ((latency / 100000) % 10),
+			       (int) (latency_max / 1000000),
+			       (int) ((latency_max / 100000) % 10));
+	} else {
+		overlay_printf(overlay, 1, "Dropped: -");
+		overlay_printf(overlay, 2, "Latency: -");
+	}
+
+	if (capture_test_errors_get(&bits, &errors))
+		overlay_printf(overlay, 3, "BER:     no test pattern");
+	else if (!bits)
+		overlay_printf(overlay, 3, "BER:     -");
+	else if (!errors)
+		overlay_printf(overlay, 3, "BER:     0 (%.1e bits)",
+			       (double) bits);
+	else
+		overlay_printf(overlay, 3, "BER:     %.2e",
+			       (double) errors / bits);
+
+	load = kms_status_cpu_load(status);
+	if (load < 0)
+		overlay_printf(overlay, 4, "CPU:     -");
+	else
+		overlay_printf(overlay, 4, "CPU:     %d%%", load);
+
+	uptime = (now - status->start_time) / 1000000000ULL;
+	if (uptime >= 86400)
+		overlay_printf(overlay, 5, "Uptime:  %dd %02d:%02d:%02d",
+			       (int) (uptime / 86400),
+			       (int) ((uptime / 3600) % 24),
+			       (int) ((uptime / 60) % 60), (int) (uptime % 60));
+	else
+		overlay_printf(overlay, 5, "Uptime:  %02d:%02d:%02d",
+			       (int) (uptime / 3600),
+			       (int) ((uptime / 60) % 60), (int) (uptime % 60));
+
+	kms_status_clip_print(status, 6, true);
+	kms_status_clip_print(status, 7, false);
+
+	kms_status_signal_print(status, 8, now);
+
+	rendered = overlay_render(overlay);
+	if (rendered) {
+		status->text_buffer = rendered;
+		status->text_flip = true;
+	}
+}
+
+/*
+ * Draw the newest signal levels that capture came up with, if any.
+ */
+static void
+kms_status_scope_update(struct kms_status *status)
+{
+	struct scope *scope = capture_scope_get();
+
+	if (!scope || !scope_result_get(scope, status->scope_result))
+		return;
+
+	/* we still show clipping in the text overlay. */
+	if (!status->scope)
+		return;
+
+	status->scope_front ^= 1;
+	scope_draw(status->scope_result,
+		   status->scope_buffers[status->scope_front]);
+	status->scope_flip = true;
+}
+
+/*
+ * Show signal levels on the top left of the status lcd, over the capture
+ * preview.
+ */
+static void
+kms_status_scope_set(struct kms_status *status, drmModeAtomicReqPtr request)
+{
+	struct kms_plane *plane = status->scope;
+	struct kms_buffer *buffer;
+
+	if (!plane || !status->scope_flip)
+		return;
+
+	buffer = status->scope_buffers[status->scope_front];
+
+	if (!plane->active) {
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_crtc_id,
+					 status->crtc_id);
+
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_crtc_x, 8);
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_crtc_y, 8);
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_crtc_w,
+					 buffer->width);
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_crtc_h,
+					 buffer->height);
+
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_src_x, 0);
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_src_y, 0);
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_src_w,
+					 buffer->width << 16);
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_src_h,
+					 buffer->height << 16);
+
+		/*
+		 * Above the capture preview, but right below the timecode,
+		 * which takes the highest zpos. Equal zpos leaves the order
+		 * up to the driver.
+		 */
+		if (plane->property_zpos && plane->zpos_max)
+			drmModeAtomicAddProperty(request, plane->plane_id,
+						 plane->property_zpos,
+						 plane->zpos_max - 1);
+
+		plane->active = true;
+	}
+
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_fb_id,
+				 buffer->fb_id);
+
+	status->scope_flip = false;
+}
+
+/*
+ * Without input, there are no levels to show.
+ */
+static void
+kms_status_scope_disable(struct kms_status *status,
+			 drmModeAtomicReqPtr request)
+{
+	if (status->scope && status->scope->active)
+		kms_plane_disable(status->scope, request);
+
+	status->scope_flip = false;
+}
+
+/*
+ * Show our status overlay on the bottom of the status lcd. The plane only
+ * gets flipped when the overlay got rendered again.
  */
 static void
 kms_status_text_set(struct kms_status *status, drmModeAtomicReqPtr request)
@@ -323,6 +635,12 @@ kms_status_text_set(struct kms_status *status, drmModeAtomicReqPtr request)
 	struct kms_plane *plane = status->text;
 	struct kms_buffer *buffer = status->text_buffer;
 
+	if (!buffer)
+		return;
+
+	if (plane->active && !status->text_flip)
+		return;
+
 	if (!plane->active) {
 		int x, y, w, h;
 
@@ -364,6 +682,8 @@ kms_status_text_set(struct kms_status *status, drmModeAtomicReqPtr request)
 	drmModeAtomicAddProperty(request, plane->plane_id,
 				 plane->property_fb_id,
 				 buffer->fb_id);
+
+	status->text_flip = false;
 }
 
 /*
@@ -432,9 +752,14 @@ kms_status_frame_update(struct kms_status *status,
 	request = drmModeAtomicAlloc();
 
 	kms_status_capture_set(status, buffer, request);
+	kms_status_scope_set(status, request);
 	kms_status_text_set(status, request);
 	kms_status_logo_set(status, request);
 
+	if (status->timecode)
+		timecode_set(status->timecode, request, buffer,
+			     status->crtc_width, status->crtc_height);
+
 	if (status->plane_disable && status->plane_disable->active)
 		kms_plane_disable(status->plane_disable, request);
 
@@ -444,9 +769,13 @@ kms_status_frame_update(struct kms_status *status,
 	drmModeAtomicFree(request);
 
 	if (ret) {
-		fprintf(stderr, "%s: failed to show frame %d: %s\n",
-			__func__, frame, strerror(errno));
+		log_error("%s: failed to show frame %d: %s\n",
+			  __func__, frame, strerror(errno));
 		ret = -errno;
+	} else {
+		vblank_commit_done(status->vblank, buffer);
+		if (status->timecode)
+			timecode_commit_done(status->timecode);
 	}
 
 	return ret;
@@ -461,9 +790,13 @@ kms_status_frame_noinput(struct kms_status *status, int frame)
 	request = drmModeAtomicAlloc();
 
 	kms_plane_disable(status->capture_scaling, request);
+	kms_status_scope_disable(status, request);
 	kms_status_text_set(status, request);
 	kms_status_logo_set(status, request);
 
+	if (status->timecode)
+		timecode_disable(status->timecode, request);
+
 	if (status->plane_disable && status->plane_disable->active)
 		kms_plane_disable(status->plane_disable, request);
 
@@ -473,10 +806,40 @@ kms_status_frame_noinput(struct kms_status *status, int frame)
 	drmModeAtomicFree(request);
 
 	if (ret) {
-		fprintf(stderr, "%s: failed to show frame %d: %s\n",
-			__func__, frame, strerror(errno));
+		log_error("%s: failed to show frame %d: %s\n",
+			  __func__, frame, strerror(errno));
 		ret = -errno;
-	}
+	} else
+		vblank_commit_done(status->vblank, NULL);
+
+	return ret;
+}
+
+/*
+ * Nothing else to show, but our overlays changed.
+ */
+static int
+kms_status_frame_overlays(struct kms_status *status, int frame)
+{
+	drmModeAtomicReqPtr request;
+	int ret;
+
+	request = drmModeAtomicAlloc();
+
+	kms_status_scope_set(status, request);
+	kms_status_text_set(status, request);
+
+	ret = drmModeAtomicCommit(kms_fd, request,
+				  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+
+	drmModeAtomicFree(request);
+
+	if (ret) {
+		log_error("%s: failed to show frame %d: %s\n",
+			  __func__, frame, strerror(errno));
+		ret = -errno;
+	} else
+		vblank_commit_done(status->vblank, NULL);
 
 	return ret;
 }
@@ -491,6 +854,8 @@ kms_status_thread_handler(void *arg)
 	for (i = 0; true; i++) {
 		struct capture_buffer *new, *old;
 
+		thread_sleep_until(vblank_deadline_next(status->vblank));
+
 		pthread_mutex_lock(status->capture_buffer_mutex);
 
 		new = status->capture_buffer_new;
@@ -500,7 +865,13 @@ kms_status_thread_handler(void *arg)
 
 		pthread_mutex_unlock(status->capture_buffer_mutex);
 
+		kms_status_scope_update(status);
+		kms_status_overlay_update(status, new ? new :
+					  status->capture_buffer_current);
+
 		if (new) {
+			vblank_capture_update(status->vblank, new);
+
 			ret = kms_status_frame_update(status, new, i);
 			if (ret)
 				return NULL;
@@ -513,23 +884,23 @@ kms_status_thread_handler(void *arg)
 
 			if (status->capture_stall_count) {
 				if (status->capture_stall_count > 2)
-					printf("Status: Capture stalled for"
-					       " %d frames.\n",
-					       status->capture_stall_count);
+					log_info("Status: Capture stalled for"
+						 " %d frames.\n",
+						 status->capture_stall_count);
 				status->capture_stall_count = 0;
 			}
 			if (status->capture_stopped_count) {
 				if (status->capture_stopped_count > 2)
-					printf("Status: Capture stopped for"
-					       " %d frames.\n",
-					       status->capture_stopped_count);
+					log_info("Status: Capture stopped for"
+						 " %d frames.\n",
+						 status->capture_stopped_count);
 				status->capture_stopped_count = 0;
 			}
 		} else if (stopped) {
 			status->capture_stopped_count++;
 
 			if (status->capture_buffer_current) {
-				printf("Status: No input! (stopped)\n");
+				log_warning("Status: No input! (stopped)\n");
 
 				ret = kms_status_frame_noinput(status, i);
 				if (ret)
@@ -539,12 +910,10 @@ kms_status_thread_handler(void *arg)
 				status->capture_buffer_current = NULL;
 				capture_buffer_display_release(old);
 			}
-
-			usleep(16667);
 		} else {
 			status->capture_stall_count++;
 			if (status->capture_stall_count == 5) {
-				printf("Status: No input! (stalled)\n");
+				log_warning("Status: No input! (stalled)\n");
 
 				ret = kms_status_frame_noinput(status, i);
 				if (ret)
@@ -556,12 +925,20 @@ kms_status_thread_handler(void *arg)
 				if (old)
 					capture_buffer_display_release(old);
 			}
+		}
 
-			usleep(16667);
+		/*
+		 * None of the above committed, but our next overlay render
+		 * goes into the buffer that we just rendered, so flip now.
+		 */
+		if (status->text_flip || status->scope_flip) {
+			ret = kms_status_frame_overlays(status, i);
+			if (ret)
+				return NULL;
 		}
 	}
 
-	printf("%s: done!\n", __func__);
+	log_info("%s: done!\n", __func__);
 
 	return NULL;
 }
@@ -611,10 +988,10 @@ kms_status_capture_display(struct capture_buffer *buffer)
 }
 
 int
-kms_status_init(void)
+kms_status_init(bool timecode)
 {
 	struct kms_status *status;
-	int ret;
+	int ret, i;
 
 	status = calloc(1, sizeof(struct kms_status));
 	if (!status)
@@ -649,17 +1026,60 @@ kms_status_init(void)
 	if (ret)
 		return ret;
 
-	status->text_buffer = kms_png_read("status_text.png");
-	if (!status->text_buffer)
+	if (timecode) {
+		uint32_t used[6] = { 0 };
+
+		used[0] = status->capture_scaling->plane_id;
+		if (status->capture_yuv)
+			used[1] = status->capture_yuv->plane_id;
+		used[2] = status->text->plane_id;
+		used[3] = status->logo->plane_id;
+		if (status->scope)
+			used[4] = status->scope->plane_id;
+		if (status->plane_disable)
+			used[5] = status->plane_disable->plane_id;
+
+		status->timecode =
+			timecode_create("Status", status->crtc_id,
+					status->crtc_index, used, 6);
+		if (!status->timecode)
+			return -1;
+	}
+
+	status->vblank = vblank_create("Status", status->crtc_id,
+				       status->crtc_index);
+	if (!status->vblank)
+		return -ENOMEM;
+
+	status->overlay = overlay_create(STATUS_OVERLAY_COLUMNS,
+					 STATUS_OVERLAY_ROWS);
+	if (!status->overlay)
 		return -1;
 
+	status->start_time = thread_time_get();
+
+	status->scope_result = calloc(1, sizeof(struct scope_result));
+	if (!status->scope_result)
+		return -ENOMEM;
+
+	if (status->scope) {
+		for (i = 0; i < 2; i++) {
+			status->scope_buffers[i] =
+				kms_buffer_get(SCOPE_WIDTH, SCOPE_HEIGHT,
+					       DRM_FORMAT_ARGB8888);
+			if (!status->scope_buffers[i])
+				return -1;
+		}
+	} else
+		printf("Status: no plane left to show signal levels.\n");
+
 	status->logo_buffer = kms_png_read("fosdem_logo.png");
 	if (!status->logo_buffer)
 		return -1;
 
-	ret = pthread_create(kms_status_thread, NULL,
-			     kms_status_thread_handler,
-			     (void *) kms_status);
+	ret = thread_create(kms_status_thread, THREAD_ROLE_STATUS,
+			    kms_status_thread_handler,
+			    (void *) kms_status);
 	if (ret) {
 		fprintf(stderr, "%s() status thread creation failed: %s\n",
 			__func__, strerror(ret));
@@ -23,6 +23,6 @@ struct capture_buffer;
 void kms_status_capture_display(struct capture_buffer *buffer);
 void kms_status_capture_stop(void);
 
-int kms_status_init(void);
+int kms_status_init(bool timecode);
 
 #endif /* _HAVE_STATUS_H_ */
@@ -87,6 +87,14 @@ usage(const char *name)
 	printf("\t* dotclock is a float for MHz.\n");
 	printf("\t* The sync polarities are written out as '+vsync'.\n");
 	printf("\t* All other values are pixels positions, as integers.\n");
+	printf("Or:\n");
+	printf("%s  <framecount>  <width>x<height>@<refresh>[-rb|-tfp401]\n",
+	       name);
+	printf("%s  <framecount>  <width>x<height>@<dotclock>MHz\n", name);
+	printf("Which generates a mode:\n");
+	printf("\t* CVT by default, or CVT reduced blanking with -rb.\n");
+	printf("\t* -tfp401 is reduced blanking tuned for the tfp401.\n");
+	printf("\t* With a dotclock, a 60Hz mode at exactly that clock.\n");
 }
 
 /*
@@ -426,7 +434,7 @@ int main(int argc, char *argv[])
 	unsigned long count = 1000;
 	int ret, i, j;
 
-	if ((argc != 1) && (argc != 2) && (argc != 13)) {
+	if ((argc != 1) && (argc != 2) && (argc != 3) && (argc != 13)) {
 		usage(argv[0]);
 		return EX_USAGE;
 	}
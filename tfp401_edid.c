@@ -3,78 +3,283 @@
 /*
  * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
  *
- * EDID block for a mode close to standard 720, but adjusted so a tfp401
- * module can reliably capture it.
+ * Build an EDID block for a given mode, and program it into the eeprom of
+ * a tfp401 module. By default, this is standard 720p, which a tfp401
+ * module can reliably capture.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <sysexits.h>
 #include <sys/ioctl.h>
 #include <inttypes.h>
 
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "juggler.h"
+#include "kms.h"
+#include "edid.h"
+
 #define I2CDEV_NAME "/dev/i2c-1"
 #define EDID_ADDRESS 0x50
 #define EDID_SIZE 0x80
 
 /*
- * Data generated with hexdump -v  -e' 16/1 "0x%02x, " ' -e '" \* " 16/1 "%_p" " *\\n"'
+ * The 24C02 eeproms on these modules take 8 byte pages, anything longer
+ * wraps around within the page.
  */
-uint8_t edid[EDID_SIZE] = {
-#if 0 /* hacked edid */
-	0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x31, 0xd8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* "........1......." */
-	0x05, 0x16, 0x01, 0x03, 0x6d, 0x2c, 0x19, 0x78, 0xea, 0x5e, 0xc0, 0xa4, 0x59, 0x4a, 0x98, 0x25, /* "....m,.x.^..YJ.%" */
-	0x20, 0x50, 0x54, 0x00, 0x00, 0x00, 0x81, 0xc0, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, /* " PT............." */
-	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x1a, 0x1d, 0x00, 0x74, 0x51, 0xd0, 0x20, 0x20, 0x6e, 0x28, /* ".........tQ.  n(" */
-	0x55, 0x00, 0xbc, 0xfa, 0x10, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0xff, 0x00, 0x4c, 0x69, 0x6e, /* "U............Lin" */
-	0x75, 0x78, 0x20, 0x23, 0x30, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00, 0xfd, 0x00, 0x3b, /* "ux, #0.   .....;" */
-	0x3d, 0x2c, 0x2e, 0x08, 0x00, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00, 0xfc, /* "=,....      ...." */
-	0x00, 0x37, 0x32, 0x30, 0x70, 0x20, 0x54, 0x46, 0x50, 0x34, 0x30, 0x31, 0x0a, 0x20, 0x00, 0x3f, /* ".720p TFP401. .?" */
-#elif 1 /* standard edid */
-	0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x18, 0x8d, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* "................" */
-	0x05, 0x1e, 0x01, 0x03, 0x80, 0x2c, 0x19, 0x78, 0xea, 0x5e, 0xc0, 0xa4, 0x59, 0x4a, 0x98, 0x25, /* "....m,.x.^..YJ.%" */
-	0x20, 0x50, 0x54, 0x00, 0x00, 0x00, 0x81, 0xc0, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, /* " PT............." */
-	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x1d, 0x00, 0x72, 0x51, 0xd0, 0x1e, 0x20, 0x6e, 0x28, /* ".........rQ.. n(" */
-	0x55, 0x00, 0xbc, 0xfa, 0x10, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0xff, 0x00, 0x4c, 0x69, 0x6e, /* "U............Lin" */
-	0x75, 0x78, 0x20, 0x23, 0x30, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00, 0xfd, 0x00, 0x3b, /* "ux #0.    .....;" */
-	0x3d, 0x2c, 0x2e, 0x08, 0x00, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00, 0xfc, /* "=,....      ...." */
-	0x00, 0x56, 0x69, 0x64, 0x65, 0x6f, 0x62, 0x6f, 0x78, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x00, 0xad, /* ".Videobox.    .." */
-#else
-	0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x1a, 0xb3, 0x94, 0x04, 0x5a, 0x06, 0x00, 0x00, /* "............Z..." */
-	0x15, 0x0e, 0x01, 0x03, 0x80, 0x26, 0x1e, 0x78, 0xea, 0xee, 0x95, 0xa3, 0x54, 0x4c, 0x99, 0x26, /* ".....&.x....TL.&" */
-	0x0f, 0x50, 0x54, 0xa5, 0x4f, 0x00, 0x81, 0x80, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, /* ".PT.O..........." */
-	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x30, 0x2a, 0x00, 0x98, 0x51, 0x00, 0x2a, 0x40, 0x30, 0x70, /* "......0*..Q.*@0p" */
-	0x13, 0x00, 0x78, 0x2d, 0x11, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0xff, 0x00, 0x59, 0x45, 0x42, /* "..x-.........YEB" */
-	0x50, 0x30, 0x30, 0x31, 0x36, 0x32, 0x36, 0x0a, 0x20, 0x20, 0x00, 0x00, 0x00, 0xfd, 0x00, 0x37, /* "P001626.  .....7" */
-	0x4b, 0x1e, 0x52, 0x0e, 0x00, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00, 0xfc, /* "K.R...      ...." */
-	0x00, 0x50, 0x31, 0x39, 0x2d, 0x31, 0x53, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0xe5, /* ".P19-1S.      .." */
-#endif
+#define EEPROM_PAGE_SIZE 8
+/* the datasheet says 5ms at most, give it some slack. */
+#define EEPROM_WRITE_TIMEOUT 20 /* ms */
+#define EEPROM_POLL_INTERVAL 500 /* us */
+
+static char *default_modeline[] = {
+	"74.25", "1280", "1390", "1430", "1650",
+	"720", "725", "730", "750", "+hsync", "+vsync",
 };
 
-int
-main(int argc, char *argv[])
+static const char *i2cdev_name = I2CDEV_NAME;
+static const char *edid_vendor = "FDM";
+static const char *edid_name = "Videobox";
+static bool dry_run;
+
+static void
+usage(const char *name)
 {
-	uint8_t buffer[7];
+	printf("Usage:\n");
+	printf("%s [-n] [-d i2cdev] [-V vendor] [-N name] [mode]\n", name);
+	printf("  -n\t\tOnly build and show the EDID, do not write it.\n");
+	printf("  -d\t\tThe i2c device of the module (default %s).\n",
+	       I2CDEV_NAME);
+	printf("  -V\t\tThree letter vendor id (default FDM).\n");
+	printf("  -N\t\tMonitor name, up to 13 characters (default "
+	       "Videobox).\n");
+	printf("  mode\t\tEither <width>x<height>@<refresh>[-rb|-tfp401], "
+	       "or a full\n\t\txfree86 modeline, see test_output. Defaults "
+	       "to standard 720p.\n");
+}
+
+static uint64_t
+time_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/*
+ * While the eeprom is busy with its write cycle, it does not ack its
+ * address. So instead of sleeping for the worst case, we keep poking it
+ * with a harmless address write until it answers, backing off briefly
+ * between tries so that we do not hog the bus.
+ */
+static int
+eeprom_ack_poll(int fd)
+{
+	uint8_t offset = 0;
 	struct i2c_msg msg = {
 		.addr = EDID_ADDRESS,
 		.flags = 0,
-		.len = 2,
+		.len = 1,
+		.buf = &offset,
+	};
+	struct i2c_rdwr_ioctl_data data = {
+		.msgs = &msg,
+		.nmsgs = 1,
+	};
+	uint64_t start = time_ms();
+	int ret;
+
+	while (1) {
+		ret = ioctl(fd, I2C_RDWR, &data);
+		if (ret >= 0)
+			return 0;
+
+		if ((time_ms() - start) > EEPROM_WRITE_TIMEOUT) {
+			fprintf(stderr, "Error: eeprom did not come back after "
+				"%dms: %s\n", EEPROM_WRITE_TIMEOUT,
+				strerror(errno));
+			return -ETIMEDOUT;
+		}
+
+		usleep(EEPROM_POLL_INTERVAL);
+	}
+}
+
+static int
+eeprom_write(int fd, const uint8_t *edid, int size)
+{
+	uint8_t buffer[EEPROM_PAGE_SIZE + 1];
+	struct i2c_msg msg = {
+		.addr = EDID_ADDRESS,
+		.flags = 0,
+		.len = EEPROM_PAGE_SIZE + 1,
 		.buf = buffer,
 	};
 	struct i2c_rdwr_ioctl_data data = {
 		.msgs = &msg,
 		.nmsgs = 1,
 	};
+	int ret, i;
+
+	for (i = 0; i < size; i += EEPROM_PAGE_SIZE) {
+		buffer[0] = i;
+		memcpy(&buffer[1], &edid[i], EEPROM_PAGE_SIZE);
+
+		ret = ioctl(fd, I2C_RDWR, &data);
+		if (ret < 0) {
+			fprintf(stderr, "Error: Failed to write edid at 0x%02X:"
+				" %s\n", i, strerror(errno));
+			return -errno;
+		}
+
+		ret = eeprom_ack_poll(fd);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int
+eeprom_read(int fd, uint8_t *edid, int size)
+{
+	uint8_t offset = 0;
+	struct i2c_msg msgs[2] = {
+		{
+			.addr = EDID_ADDRESS,
+			.flags = 0,
+			.len = 1,
+			.buf = &offset,
+		}, {
+			.addr = EDID_ADDRESS,
+			.flags = I2C_M_RD,
+			.len = size,
+			.buf = edid,
+		},
+	};
+	struct i2c_rdwr_ioctl_data data = {
+		.msgs = msgs,
+		.nmsgs = 2,
+	};
+	int ret;
+
+	ret = ioctl(fd, I2C_RDWR, &data);
+	if (ret < 0) {
+		fprintf(stderr, "Error: Failed to read back edid: %s\n",
+			strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void
+edid_dump(const uint8_t *edid, int size)
+{
+	int i, j;
+
+	for (i = 0; i < size; i += 16) {
+		printf("\t");
+		for (j = 0; j < 16; j++)
+			printf("0x%02x,%s", edid[i + j], (j == 15) ? "" : " ");
+		printf("\n");
+	}
+}
+
+static int
+edid_from_mode(uint8_t *edid, struct _drmModeModeInfo *mode)
+{
+	struct edid_timing timing[1] = {{ 0 }};
+	struct edid *parsed;
+	int ret;
+
+	timing->clock = mode->clock;
+	timing->width = mode->hdisplay;
+	timing->hsync_start = mode->hsync_start;
+	timing->hsync_end = mode->hsync_end;
+	timing->htotal = mode->htotal;
+	timing->height = mode->vdisplay;
+	timing->vsync_start = mode->vsync_start;
+	timing->vsync_end = mode->vsync_end;
+	timing->vtotal = mode->vtotal;
+	timing->hsync_positive = mode->flags & DRM_MODE_FLAG_PHSYNC;
+	timing->vsync_positive = mode->flags & DRM_MODE_FLAG_PVSYNC;
+
+	ret = edid_build(edid, timing, edid_vendor, edid_name);
+	if (ret)
+		return ret;
+
+	/* run it past our own parser, as a sanity check. */
+	parsed = edid_parse(edid, EDID_SIZE);
+	if (!parsed)
+		return -EINVAL;
+
+	edid_print(parsed);
+	free(parsed);
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct _drmModeModeInfo *mode;
+	uint8_t edid[EDID_SIZE], readback[EDID_SIZE];
+	uint64_t start;
 	int fd, ret, i;
 
-	fd = open(I2CDEV_NAME, O_RDWR);
+	for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+		if (!strcmp(argv[i], "-n"))
+			dry_run = true;
+		else if (!strcmp(argv[i], "-d") && ((i + 1) < argc))
+			i2cdev_name = argv[++i];
+		else if (!strcmp(argv[i], "-V") && ((i + 1) < argc))
+			edid_vendor = argv[++i];
+		else if (!strcmp(argv[i], "-N") && ((i + 1) < argc))
+			edid_name = argv[++i];
+		else {
+			usage(argv[0]);
+			return EX_USAGE;
+		}
+	}
+
+	if (i == argc)
+		mode = kms_modeline_arguments_parse(11, default_modeline);
+	else
+		mode = kms_modeline_arguments_parse(argc - i, &argv[i]);
+	if (!mode) {
+		usage(argv[0]);
+		return EX_USAGE;
+	}
+
+	kms_modeline_print(mode);
+
+	ret = edid_from_mode(edid, mode);
+	free(mode);
+	if (ret)
+		return EX_DATAERR;
+
+	if (dry_run) {
+		edid_dump(edid, EDID_SIZE);
+		return 0;
+	}
+
+	fd = open(i2cdev_name, O_RDWR);
 	if (fd == -1) {
 		fprintf(stderr, "Error: Failed to open %s: %s\n",
-			I2CDEV_NAME, strerror(errno));
+			i2cdev_name, strerror(errno));
 		return errno;
 	}
 
@@ -85,21 +290,32 @@ main(int argc, char *argv[])
 		return errno;
 	}
 
-	for (i = 0; i < EDID_SIZE; i++) {
-		buffer[0] = i;
-		buffer[1] = edid[i];
+	start = time_ms();
 
-		ret = ioctl(fd, I2C_RDWR, &data);
-		if (ret < 0) {
-			fprintf(stderr, "Error: Failed to write edid at 0x%02X: %s\n",
-				i, strerror(errno));
-			return errno;
-		}
+	ret = eeprom_write(fd, edid, EDID_SIZE);
+	if (ret)
+		return -ret;
+
+	ret = eeprom_read(fd, readback, EDID_SIZE);
+	if (ret)
+		return -ret;
 
-		usleep(5000);
+	for (i = 0; i < EDID_SIZE; i++)
+		if (edid[i] != readback[i])
+			break;
+
+	if (i < EDID_SIZE) {
+		fprintf(stderr, "Error: %s:0x%02X: verification failed at "
+			"0x%02X: 0x%02X instead of 0x%02X.\n", i2cdev_name,
+			EDID_ADDRESS, i, readback[i], edid[i]);
+		return EX_IOERR;
 	}
 
-	printf("%s:0x%02X: %d bytes written.\n", I2CDEV_NAME, EDID_ADDRESS, i);
+	printf("%s:0x%02X: %d bytes written and verified in %dms.\n",
+	       i2cdev_name, EDID_ADDRESS, EDID_SIZE,
+	       (int) (time_ms() - start));
+
+	close(fd);
 
 	return 0;
 }
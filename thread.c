@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Scheduling policy for our threads.
+ *
+ * When the box is also running an encoder, or someone is logged in over
+ * ssh, the display threads need to be guaranteed to make their deadlines.
+ * So optionally, each thread role gets a SCHED_FIFO priority and is
+ * pinned to one of the two A20 cores, our memory is locked, and stacks
+ * are prefaulted. We also measure how late our threads wake up from their
+ * sleeps, so we can tell whether this is working.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "juggler.h"
+#include "log.h"
+#include "thread.h"
+
+/* how much of each stack we touch before starting the real work */
+#define THREAD_STACK_PREFAULT (64 * 1024)
+
+/* power of two buckets, from < 16us to >= 16ms */
+#define THREAD_JITTER_BUCKET_SHIFT 4
+#define THREAD_JITTER_BUCKETS 12
+/* report about once a minute for a thread waking up at 60Hz */
+#define THREAD_JITTER_REPORT 3600
+
+struct thread_policy {
+	const char *name;
+	int priority; /* 0 means SCHED_OTHER */
+	int cpu; /* -1 means any */
+};
+
+static struct thread_policy thread_policies[THREAD_ROLE_COUNT] = {
+	[THREAD_ROLE_CAPTURE] = { "capture", 70, 0 },
+	[THREAD_ROLE_PROJECTOR] = { "projector", 80, 1 },
+	[THREAD_ROLE_STATUS] = { "status", 60, 1 },
+	[THREAD_ROLE_LOG] = { "log", 0, -1 },
+	[THREAD_ROLE_HOTPLUG] = { "hotplug", 0, -1 },
+	[THREAD_ROLE_NV12] = { "nv12", 65, 0 },
+	/* several of these, one per core */
+	[THREAD_ROLE_CONVERT] = { "convert", 50, -1 },
+	/* png encoding, never realtime */
+	[THREAD_ROLE_SLIDES] = { "slides", 0, -1 },
+};
+
+static bool thread_realtime;
+
+struct thread_jitter {
+	uint32_t buckets[THREAD_JITTER_BUCKETS];
+	uint32_t count;
+	uint64_t max;
+};
+
+struct thread_start {
+	enum thread_role role;
+	void *(*handler)(void *);
+	void *arg;
+};
+
+static __thread enum thread_role thread_role_self = THREAD_ROLE_COUNT;
+static __thread struct thread_jitter thread_jitter_self[1];
+
+uint64_t
+thread_time_get(void)
+{
+	struct timespec now[1];
+
+	clock_gettime(CLOCK_MONOTONIC, now);
+
+	return now->tv_sec * 1000000000ULL + now->tv_nsec;
+}
+
+static void
+thread_jitter_report(struct thread_jitter *jitter)
+{
+	uint32_t half = jitter->count / 2;
+	uint32_t tail = jitter->count - (jitter->count / 100);
+	uint32_t sum = 0;
+	int i, median = -1, percentile = -1;
+	const char *name = "unknown";
+
+	for (i = 0; i < THREAD_JITTER_BUCKETS; i++) {
+		sum += jitter->buckets[i];
+		if ((median == -1) && (sum >= half))
+			median = i;
+		if ((percentile == -1) && (sum >= tail))
+			percentile = i;
+	}
+
+	if (thread_role_self < THREAD_ROLE_COUNT)
+		name = thread_policies[thread_role_self].name;
+
+	log_info("Thread %s: wakeup latency: 50%% < %dus, 99%% < %dus, "
+		 "max %"PRIu64"us (%u wakeups).\n", name,
+		 1 << (median + THREAD_JITTER_BUCKET_SHIFT),
+		 1 << (percentile + THREAD_JITTER_BUCKET_SHIFT),
+		 jitter->max / 1000, jitter->count);
+
+	memset(jitter, 0, sizeof(struct thread_jitter));
+}
+
+static void
+thread_jitter_add(uint64_t late)
+{
+	struct thread_jitter *jitter = thread_jitter_self;
+	uint64_t usecs = late / 1000;
+	int bucket = 0;
+
+	while ((usecs >> (bucket + THREAD_JITTER_BUCKET_SHIFT)) &&
+	       (bucket < (THREAD_JITTER_BUCKETS - 1)))
+		bucket++;
+
+	jitter->buckets[bucket]++;
+	jitter->count++;
+	if (late > jitter->max)
+		jitter->max = late;
+
+	if (jitter->count == THREAD_JITTER_REPORT)
+		thread_jitter_report(jitter);
+}
+
+/*
+ * Sleep until the given CLOCK_MONOTONIC time in ns, and keep track of how
+ * late we woke up.
+ */
+void
+thread_sleep_until(uint64_t time)
+{
+	struct timespec until[1] = {{
+			.tv_sec = time / 1000000000ULL,
+			.tv_nsec = time % 1000000000ULL,
+		}};
+	uint64_t now;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, until, NULL) ==
+	       EINTR)
+		;
+
+	now = thread_time_get();
+	if (now > time)
+		thread_jitter_add(now - time);
+	else
+		thread_jitter_add(0);
+}
+
+void
+thread_sleep(int usecs)
+{
+	thread_sleep_until(thread_time_get() + usecs * 1000ULL);
+}
+
+/*
+ * Make sure that the first THREAD_STACK_PREFAULT bytes of our stack are
+ * backed, so that we do not pagefault halfway through a frame.
+ */
+static void __attribute__((noinline))
+thread_stack_prefault(void)
+{
+	uint8_t stack[THREAD_STACK_PREFAULT];
+
+	memset(stack, 0, THREAD_STACK_PREFAULT);
+	/* do not let the compiler optimise the memset away */
+	__asm__ __volatile__("" : : "r" (stack) : "memory");
+}
+
+static void *
+thread_start_handler(void *arg)
+{
+	struct thread_start start = *((struct thread_start *) arg);
+
+	free(arg);
+
+	thread_role_self = start.role;
+
+	if (thread_realtime)
+		thread_stack_prefault();
+
+	return start.handler(start.arg);
+}
+
+static int
+thread_attributes_set(pthread_attr_t *attributes, enum thread_role role)
+{
+	struct thread_policy *policy = &thread_policies[role];
+	struct sched_param parameters[1] = {{
+			.sched_priority = policy->priority,
+		}};
+	int ret;
+
+	if (!policy->priority)
+		return 0;
+
+	ret = pthread_attr_setinheritsched(attributes,
+					   PTHREAD_EXPLICIT_SCHED);
+	if (ret)
+		return ret;
+
+	ret = pthread_attr_setschedpolicy(attributes, SCHED_FIFO);
+	if (ret)
+		return ret;
+
+	ret = pthread_attr_setschedparam(attributes, parameters);
+	if (ret)
+		return ret;
+
+	if (policy->cpu >= 0) {
+		cpu_set_t cpus[1];
+
+		CPU_ZERO(cpus);
+		CPU_SET(policy->cpu, cpus);
+
+		ret = pthread_attr_setaffinity_np(attributes, sizeof(cpu_set_t),
+						  cpus);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int
+thread_create(pthread_t *thread, enum thread_role role,
+	      void *(*handler)(void *), void *arg)
+{
+	struct thread_policy *policy = &thread_policies[role];
+	struct thread_start *start;
+	pthread_attr_t attributes[1];
+	int ret;
+
+	start = calloc(1, sizeof(struct thread_start));
+	if (!start)
+		return ENOMEM;
+
+	start->role = role;
+	start->handler = handler;
+	start->arg = arg;
+
+	if (thread_realtime) {
+		pthread_attr_init(attributes);
+
+		ret = thread_attributes_set(attributes, role);
+		if (!ret)
+			ret = pthread_create(thread, attributes,
+					     thread_start_handler, start);
+
+		pthread_attr_destroy(attributes);
+
+		if (!ret) {
+			printf("Thread %s: priority %d, cpu %d.\n",
+			       policy->name, policy->priority, policy->cpu);
+			return 0;
+		}
+
+		fprintf(stderr, "%s(%s): failed to apply realtime policy: %s."
+			" Falling back to defaults.\n", __func__,
+			policy->name, strerror(ret));
+	}
+
+	ret = pthread_create(thread, NULL, thread_start_handler, start);
+	if (ret)
+		free(start);
+
+	return ret;
+}
+
+/*
+ * Parses <role>=<priority>[@<cpu>], with a priority of 0 meaning that
+ * this role does not run realtime. Without @<cpu>, the role stays on the
+ * cpu it is pinned to by default, @-1 unpins it.
+ */
+int
+thread_policy_parse(const char *string)
+{
+	char name[16];
+	int priority, cpu, ret, i;
+
+	ret = sscanf(string, "%15[a-z]=%d@%d", name, &priority, &cpu);
+	if (ret < 2) {
+		fprintf(stderr, "%s(): failed to parse \"%s\".\n", __func__,
+			string);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < THREAD_ROLE_COUNT; i++)
+		if (!strcmp(name, thread_policies[i].name))
+			break;
+
+	if (i == THREAD_ROLE_COUNT) {
+		fprintf(stderr, "%s(): unknown thread role \"%s\".\n",
+			__func__, name);
+		return -EINVAL;
+	}
+
+	if ((priority < 0) || (priority > sched_get_priority_max(SCHED_FIFO))) {
+		fprintf(stderr, "%s(): invalid priority %d.\n", __func__,
+			priority);
+		return -EINVAL;
+	}
+
+	if (ret == 2)
+		cpu = thread_policies[i].cpu;
+
+	if ((cpu < -1) || (cpu >= CPU_SETSIZE)) {
+		fprintf(stderr, "%s(): invalid cpu %d.\n", __func__, cpu);
+		return -EINVAL;
+	}
+
+	thread_policies[i].priority = priority;
+	thread_policies[i].cpu = cpu;
+
+	return 0;
+}
+
+int
+thread_policy_init(bool realtime)
+{
+	int ret;
+
+	thread_realtime = realtime;
+	if (!thread_realtime)
+		return 0;
+
+	/* We rather not swap or fault in our buffers at display time. */
+	ret = mlockall(MCL_CURRENT | MCL_FUTURE);
+	if (ret)
+		fprintf(stderr, "%s(): mlockall() failed: %s\n", __func__,
+			strerror(errno));
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_THREAD_H_
+#define _HAVE_THREAD_H_ 1
+
+enum thread_role {
+	THREAD_ROLE_CAPTURE = 0,
+	THREAD_ROLE_PROJECTOR,
+	THREAD_ROLE_STATUS,
+	THREAD_ROLE_LOG,
+	THREAD_ROLE_HOTPLUG,
+	THREAD_ROLE_NV12,
+	THREAD_ROLE_CONVERT,
+	THREAD_ROLE_SLIDES,
+	THREAD_ROLE_COUNT,
+};
+
+int thread_create(pthread_t *thread, enum thread_role role,
+		  void *(*handler)(void *), void *arg);
+
+uint64_t thread_time_get(void);
+void thread_sleep_until(uint64_t time);
+void thread_sleep(int usecs);
+
+int thread_policy_parse(const char *string);
+int thread_policy_init(bool realtime);
+
+#endif /* _HAVE_THREAD_H_ */
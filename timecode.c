@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2020 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Timecode burn-in: the wallclock time at which a frame was captured, and
+ * its capture sequence number, on top of that frame, so that recordings
+ * can be synced up afterwards.
+ *
+ * Capture buffers are never touched, the display engine composes the
+ * timecode on top, from planes of its own, at the highest zpos.
+ *
+ * With a plane for every character, each plane shows one digit of a
+ * sprite sheet which was drawn at startup, and a frame only changes the
+ * source offsets of the characters which changed, in the same atomic
+ * commit as the frame itself.
+ *
+ * Without that many planes, which is the usual case, a single plane shows
+ * a single small buffer. We draw the characters which changed into it
+ * right after the commit of the frame they belong to returns. Scanout then
+ * just started at the top, and we sit at the bottom of the screen, so the
+ * new digits are in place long before scanout gets to them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "juggler.h"
+#include "log.h"
+#include "kms.h"
+#include "capture.h"
+#include "overlay.h"
+#include "timecode.h"
+
+/* everything that our text can hold, in the order of the sprite sheet */
+#define TIMECODE_GLYPHS "0123456789:.# "
+#define TIMECODE_GLYPH_COUNT (sizeof(TIMECODE_GLYPHS) - 1)
+
+#define TIMECODE_WIDTH (TIMECODE_LENGTH * OVERLAY_CELL_WIDTH)
+
+/*
+ * Find the planes that the display we are on has left for us.
+ */
+static int
+timecode_planes_get(struct timecode *timecode, int crtc_index,
+		    const uint32_t *used, int used_count)
+{
+	drmModePlaneRes *resources_plane;
+	uint32_t ids[TIMECODE_LENGTH];
+	int count = 0, i, j;
+
+	resources_plane = drmModeGetPlaneResources(kms_fd);
+	if (!resources_plane) {
+		fprintf(stderr, "%s: Failed to get KMS plane resources\n",
+			__func__);
+		return -ENODEV;
+	}
+
+	for (i = 0; i < (int) resources_plane->count_planes; i++) {
+		uint32_t plane_id = resources_plane->planes[i];
+		drmModePlane *plane;
+		bool argb = false;
+
+		for (j = 0; j < used_count; j++)
+			if (used[j] == plane_id)
+				break;
+		if (j < used_count)
+			continue;
+
+		plane = drmModeGetPlane(kms_fd, plane_id);
+		if (!plane) {
+			fprintf(stderr, "%s: failed to get Plane %u: %s\n",
+				__func__, plane_id, strerror(errno));
+			continue;
+		}
+
+		for (j = 0; j < (int) plane->count_formats; j++)
+			if (plane->formats[j] == DRM_FORMAT_ARGB8888)
+				argb = true;
+
+		if ((plane->possible_crtcs & (1 << crtc_index)) && argb &&
+		    (count < TIMECODE_LENGTH))
+			ids[count++] = plane_id;
+
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(resources_plane);
+
+	/* we just go without, like we do without a scope or fades. */
+	if (!count) {
+		printf("%s: no plane left for a timecode, not showing one.\n",
+		       timecode->name);
+		return 0;
+	}
+
+	timecode->sprites = (count == TIMECODE_LENGTH);
+	timecode->plane_count = timecode->sprites ? TIMECODE_LENGTH : 1;
+
+	for (i = 0; i < timecode->plane_count; i++) {
+		timecode->planes[i] = kms_plane_create(ids[i]);
+		if (!timecode->planes[i])
+			return -ENODEV;
+	}
+
+	return 0;
+}
+
+static int
+timecode_buffers_create(struct timecode *timecode)
+{
+	unsigned int i;
+
+	timecode->atlas = overlay_atlas_create();
+	if (!timecode->atlas)
+		return -ENOMEM;
+
+	if (timecode->sprites) {
+		timecode->sheet =
+			kms_buffer_get(TIMECODE_GLYPH_COUNT *
+				       OVERLAY_CELL_WIDTH,
+				       OVERLAY_CELL_HEIGHT,
+				       DRM_FORMAT_ARGB8888);
+		if (!timecode->sheet)
+			return -ENOMEM;
+
+		for (i = 0; i < TIMECODE_GLYPH_COUNT; i++)
+			overlay_atlas_blit(timecode->atlas, timecode->sheet,
+					   i * OVERLAY_CELL_WIDTH, 0,
+					   TIMECODE_GLYPHS[i]);
+	} else {
+		timecode->buffer = kms_buffer_get(TIMECODE_WIDTH,
+						  OVERLAY_CELL_HEIGHT,
+						  DRM_FORMAT_ARGB8888);
+		if (!timecode->buffer)
+			return -ENOMEM;
+
+		for (i = 0; i < TIMECODE_LENGTH; i++)
+			overlay_atlas_blit(timecode->atlas, timecode->buffer,
+					   i * OVERLAY_CELL_WIDTH, 0, ' ');
+		memset(timecode->shown, ' ', TIMECODE_LENGTH);
+	}
+
+	return 0;
+}
+
+/*
+ * Capture timestamps are monotonic, we want to show the wallclock.
+ */
+static void
+timecode_text_update(struct timecode *timecode,
+		     struct capture_buffer *buffer)
+{
+	struct timespec realtime, monotonic;
+	struct tm tm[1];
+	uint64_t time;
+	time_t seconds;
+
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	clock_gettime(CLOCK_MONOTONIC, &monotonic);
+
+	time = buffer->timestamp.tv_sec * 1000000000ULL +
+		buffer->timestamp.tv_usec * 1000ULL +
+		realtime.tv_sec * 1000000000ULL + realtime.tv_nsec -
+		(monotonic.tv_sec * 1000000000ULL + monotonic.tv_nsec);
+
+	seconds = time / 1000000000ULL;
+	localtime_r(&seconds, tm);
+
+	/* every field is bounded, so this always fits TIMECODE_LENGTH. */
+	snprintf(timecode->text, sizeof(timecode->text),
+		 "%02u:%02u:%02u.%03u #%08u",
+		 (unsigned int) tm->tm_hour % 24,
+		 (unsigned int) tm->tm_min % 60,
+		 (unsigned int) tm->tm_sec % 61,
+		 (unsigned int) ((time / 1000000) % 1000),
+		 (unsigned int) (buffer->sequence % 100000000));
+}
+
+static void
+timecode_plane_set(struct timecode *timecode, struct kms_plane *plane,
+		   drmModeAtomicReqPtr request, struct kms_buffer *buffer,
+		   int x, int y, int width)
+{
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_crtc_id, timecode->crtc_id);
+
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_crtc_x, x);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_crtc_y, y);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_crtc_w, width);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_crtc_h, OVERLAY_CELL_HEIGHT);
+
+	/* src_x is up to our caller. */
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_src_y, 0);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_src_w, width << 16);
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_src_h,
+				 OVERLAY_CELL_HEIGHT << 16);
+
+	if (plane->property_zpos)
+		drmModeAtomicAddProperty(request, plane->plane_id,
+					 plane->property_zpos,
+					 plane->zpos_max);
+
+	drmModeAtomicAddProperty(request, plane->plane_id,
+				 plane->property_fb_id, buffer->fb_id);
+
+	plane->active = true;
+}
+
+/*
+ * Add the timecode of buffer to the commit which shows buffer, in the
+ * bottom right corner.
+ */
+void
+timecode_set(struct timecode *timecode, drmModeAtomicReqPtr request,
+	     struct capture_buffer *buffer, int crtc_width, int crtc_height)
+{
+	int x = crtc_width - 8 - TIMECODE_WIDTH;
+	int y = crtc_height - 8 - OVERLAY_CELL_HEIGHT;
+	int i;
+
+	if (!timecode->plane_count)
+		return;
+
+	timecode_text_update(timecode, buffer);
+
+	if (!timecode->sprites) {
+		struct kms_plane *plane = timecode->planes[0];
+
+		if (!plane->active) {
+			timecode_plane_set(timecode, plane, request,
+					   timecode->buffer, x, y,
+					   TIMECODE_WIDTH);
+			drmModeAtomicAddProperty(request, plane->plane_id,
+						 plane->property_src_x, 0);
+		}
+		return;
+	}
+
+	for (i = 0; i < TIMECODE_LENGTH; i++) {
+		struct kms_plane *plane = timecode->planes[i];
+		const char *glyph = NULL;
+		int index = TIMECODE_GLYPH_COUNT - 1;
+
+		if (timecode->text[i])
+			glyph = strchr(TIMECODE_GLYPHS, timecode->text[i]);
+		if (glyph)
+			index = glyph - TIMECODE_GLYPHS;
+
+		if (!plane->active) {
+			timecode_plane_set(timecode, plane, request,
+					   timecode->sheet,
+					   x + i * OVERLAY_CELL_WIDTH, y,
+					   OVERLAY_CELL_WIDTH);
+			timecode->glyphs[i] = -1;
+		}
+
+		if (timecode->glyphs[i] != index) {
+			drmModeAtomicAddProperty(request, plane->plane_id,
+						 plane->property_src_x,
+						 (index * OVERLAY_CELL_WIDTH)
+						 << 16);
+			timecode->glyphs[i] = index;
+		}
+	}
+}
+
+void
+timecode_disable(struct timecode *timecode, drmModeAtomicReqPtr request)
+{
+	int i;
+
+	for (i = 0; i < timecode->plane_count; i++)
+		if (timecode->planes[i]->active)
+			kms_plane_disable(timecode->planes[i], request);
+
+	timecode->text[0] = 0;
+}
+
+/*
+ * Called right after a commit with our timecode in it went through.
+ */
+void
+timecode_commit_done(struct timecode *timecode)
+{
+	int i;
+
+	if (timecode->sprites || !timecode->text[0])
+		return;
+
+	for (i = 0; i < TIMECODE_LENGTH; i++) {
+		if (timecode->text[i] == timecode->shown[i])
+			continue;
+
+		overlay_atlas_blit(timecode->atlas, timecode->buffer,
+				   i * OVERLAY_CELL_WIDTH, 0,
+				   timecode->text[i]);
+		timecode->shown[i] = timecode->text[i];
+	}
+}
+
+/*
+ * Have everything fully reprogrammed on our next commit.
+ */
+void
+timecode_reset(struct timecode *timecode)
+{
+	int i;
+
+	for (i = 0; i < timecode->plane_count; i++)
+		timecode->planes[i]->active = false;
+}
+
+/*
+ * Only for when creation fails halfway.
+ */
+static void
+timecode_free(struct timecode *timecode)
+{
+	int i;
+
+	for (i = 0; i < TIMECODE_LENGTH; i++)
+		free(timecode->planes[i]);
+
+	kms_buffer_put(timecode->sheet);
+	kms_buffer_put(timecode->buffer);
+
+	free(timecode->atlas);
+	free(timecode);
+}
+
+struct timecode *
+timecode_create(const char *name, uint32_t crtc_id, int crtc_index,
+		const uint32_t *used, int used_count)
+{
+	struct timecode *timecode;
+	int ret;
+
+	timecode = calloc(1, sizeof(struct timecode));
+	if (!timecode)
+		return NULL;
+
+	timecode->name = name;
+	timecode->crtc_id = crtc_id;
+
+	ret = timecode_planes_get(timecode, crtc_index, used, used_count);
+	if (ret) {
+		timecode_free(timecode);
+		return NULL;
+	}
+
+	if (!timecode->plane_count)
+		return timecode;
+
+	ret = timecode_buffers_create(timecode);
+	if (ret) {
+		fprintf(stderr, "%s: failed to create timecode buffers.\n",
+			name);
+		timecode_free(timecode);
+		return NULL;
+	}
+
+	printf("%s: timecode burn-in on %s.\n", name, timecode->sprites ?
+	       "a plane per character" : "a single plane");
+
+	return timecode;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAVE_TIMECODE_H_
+#define _HAVE_TIMECODE_H_ 1
+
+struct capture_buffer;
+struct kms_plane;
+struct kms_buffer;
+struct _drmModeAtomicReq;
+
+/* "HH:MM:SS.mmm #sequence", with 8 digits of sequence. */
+#define TIMECODE_LENGTH 22
+
+struct timecode {
+	const char *name;
+	uint32_t crtc_id;
+
+	uint32_t *atlas;
+
+	/*
+	 * When there are enough planes, every character is a plane of its
+	 * own, which shows a digit from the sprite sheet. We then only
+	 * change source offsets, and never draw after startup.
+	 */
+	bool sprites;
+	struct kms_buffer *sheet;
+	int glyphs[TIMECODE_LENGTH];
+
+	/*
+	 * Otherwise, a single plane, showing a single small buffer which
+	 * we draw the changed characters into.
+	 */
+	struct kms_buffer *buffer;
+	char shown[TIMECODE_LENGTH];
+
+	/* 0 when no plane was left, we then show nothing. */
+	struct kms_plane *planes[TIMECODE_LENGTH];
+	int plane_count;
+
+	char text[TIMECODE_LENGTH + 1];
+};
+
+struct timecode *timecode_create(const char *name, uint32_t crtc_id,
+				 int crtc_index, const uint32_t *used,
+				 int used_count);
+
+void timecode_set(struct timecode *timecode,
+		  struct _drmModeAtomicReq *request,
+		  struct capture_buffer *buffer, int crtc_width,
+		  int crtc_height);
+void timecode_disable(struct timecode *timecode,
+		      struct _drmModeAtomicReq *request);
+void timecode_commit_done(struct timecode *timecode);
+void timecode_reset(struct timecode *timecode);
+
+#endif /* _HAVE_TIMECODE_H_ */
@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Vblank deadline scheduling for our display threads.
+ *
+ * Rather than committing whenever a new frame shows up, or sleeping a
+ * fixed 16.7ms, we track when the display goes through vblank, and when
+ * capture frames tend to arrive, and we then commit the newest frame at
+ * the last safe moment before the next vblank.
+ *
+ * Both vblank and v4l2 timestamps are CLOCK_MONOTONIC.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "juggler.h"
+#include "kms.h"
+#include "log.h"
+#include "capture.h"
+#include "thread.h"
+#include "vblank.h"
+
+#define VBLANK_MARGIN_DEFAULT 2000 /* us */
+/*
+ * Frames which are expected within this long of a deadline are racing
+ * it, and get shown a vblank later.
+ */
+#define VBLANK_CAPTURE_GUARD 1000000ULL /* ns */
+#define VBLANK_STATISTICS_COUNT 600
+
+static uint64_t vblank_margin = VBLANK_MARGIN_DEFAULT * 1000ULL;
+
+static uint64_t
+vblank_timeval_ns(long seconds, long useconds)
+{
+	return seconds * 1000000000ULL + useconds * 1000ULL;
+}
+
+/*
+ * Ask for the last vblank, without waiting for the next one.
+ */
+static int
+vblank_query(struct vblank *vblank)
+{
+	drmVBlank request[1];
+	uint64_t time;
+	uint32_t count;
+	int ret;
+
+	memset(request, 0, sizeof(drmVBlank));
+	request->request.type = DRM_VBLANK_RELATIVE |
+		((vblank->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+		 DRM_VBLANK_HIGH_CRTC_MASK);
+	request->request.sequence = 0;
+
+	ret = drmWaitVBlank(kms_fd, request);
+	if (ret)
+		return -errno;
+
+	time = vblank_timeval_ns(request->reply.tval_sec,
+				 request->reply.tval_usec);
+	count = request->reply.sequence - vblank->sequence;
+
+	/* refine our period, but ignore the odd outlier. */
+	if (vblank->time && count && (count < 64) && (time > vblank->time)) {
+		uint64_t period = (time - vblank->time) / count;
+
+		if ((period > (vblank->period / 2)) &&
+		    (period < (vblank->period * 2)))
+			vblank->period += ((int64_t) (period - vblank->period))
+				/ 16;
+	}
+
+	vblank->sequence = request->reply.sequence;
+	vblank->time = time;
+
+	return 0;
+}
+
+/*
+ * Predict when the frame after the last one we saw will reach us.
+ * Returns 0 when we do not (or no longer) know.
+ */
+static uint64_t
+vblank_capture_arrival(struct vblank *vblank, uint64_t now)
+{
+	uint64_t arrival;
+
+	if (!vblank->capture_period || !vblank->capture_delay)
+		return 0;
+
+	arrival = vblank->capture_time + vblank->capture_period +
+		vblank->capture_delay;
+
+	/* capture has stalled, or we lost track */
+	if ((arrival + 4 * vblank->capture_period) < now)
+		return 0;
+
+	return arrival;
+}
+
+/*
+ * Target the first vblank which we can still make when committing at the
+ * given time.
+ */
+static void
+vblank_target_set(struct vblank *vblank, uint64_t time)
+{
+	vblank->target_sequence = vblank->sequence + 1;
+	vblank->target_time = vblank->time + vblank->period;
+	while ((vblank->target_time - vblank->margin) < time) {
+		vblank->target_sequence++;
+		vblank->target_time += vblank->period;
+	}
+}
+
+/*
+ * Returns the time at which we should commit next.
+ *
+ * Usually, this is the margin before the next vblank that we can still
+ * make. But when frames are predicted to arrive too close to a deadline,
+ * we instead wait for the frame to be there for sure, and target the
+ * vblank after.
+ */
+uint64_t
+vblank_deadline_next(struct vblank *vblank)
+{
+	uint64_t now = thread_time_get();
+	uint64_t arrival, racing;
+	int64_t slack;
+	int ret;
+
+	if (vblank->broken) {
+		vblank->deadline = now + vblank->period;
+		return vblank->deadline;
+	}
+
+	ret = vblank_query(vblank);
+	if (ret) {
+		log_error("%s: %s: vblank query failed: %s\n", __func__,
+			  vblank->name, strerror(-ret));
+		vblank->broken = true;
+		vblank->deadline = now + vblank->period;
+		return vblank->deadline;
+	}
+
+	vblank_target_set(vblank, now + 1);
+	vblank->deadline = vblank->target_time - vblank->margin;
+
+	arrival = vblank_capture_arrival(vblank, now);
+	if (!arrival)
+		return vblank->deadline;
+
+	/*
+	 * How long before (or after) the nearest deadline does the next
+	 * frame arrive? Use the prediction, so jitter does not have us
+	 * flip-flop.
+	 */
+	slack = ((int64_t) (vblank->deadline - arrival)) %
+		(int64_t) vblank->period;
+	if (slack > (int64_t) (vblank->period / 2))
+		slack -= vblank->period;
+	else if (slack <= -((int64_t) (vblank->period / 2)))
+		slack += vblank->period;
+
+	if (!vblank->capture_late &&
+	    (llabs(slack) < (int64_t) VBLANK_CAPTURE_GUARD)) {
+		log_debug("%s: frames arrive %"PRIi64"us before deadline, "
+			  "showing them a vblank later.\n", vblank->name,
+			  slack / 1000);
+		vblank->capture_late = true;
+	} else if (vblank->capture_late &&
+		   (llabs(slack) > (int64_t) (3 * VBLANK_CAPTURE_GUARD))) {
+		log_debug("%s: frames arrive %"PRIi64"us before deadline, "
+			  "showing them straight away.\n", vblank->name,
+			  slack / 1000);
+		vblank->capture_late = false;
+	}
+
+	if (!vblank->capture_late)
+		return vblank->deadline;
+
+	/*
+	 * Wait until the frame is surely there, but not before the vblank
+	 * whose deadline it was racing, so that we land on the one after.
+	 */
+	racing = arrival + slack + vblank->margin;
+
+	vblank->deadline = arrival + VBLANK_CAPTURE_GUARD;
+	if (vblank->deadline < racing)
+		vblank->deadline = racing;
+	if (vblank->deadline < now)
+		vblank->deadline = now;
+
+	vblank_target_set(vblank, vblank->deadline);
+
+	return vblank->deadline;
+}
+
+/*
+ * The latest v4l2 timestamp which we consider for the vblank that we are
+ * targeting: half a capture period before the frames which only just
+ * make it, so that frame rate conversion is driven by the timestamps and
+ * not by the jitter in our own delivery.
+ */
+uint64_t
+vblank_capture_cutoff(struct vblank *vblank)
+{
+	uint64_t delay;
+
+	if (vblank->broken || !vblank->capture_period ||
+	    !vblank->capture_delay)
+		return UINT64_MAX;
+
+	delay = vblank->margin + vblank->capture_delay +
+		vblank->capture_period / 2;
+	if (delay > vblank->target_time)
+		return 0;
+
+	return vblank->target_time - delay;
+}
+
+/*
+ * Keep track of the capture cadence, from the v4l2 timestamps, and of how
+ * long it takes for frames to reach us.
+ */
+void
+vblank_capture_update(struct vblank *vblank, struct capture_buffer *buffer)
+{
+	uint64_t time = vblank_timeval_ns(buffer->timestamp.tv_sec,
+					  buffer->timestamp.tv_usec);
+	int64_t delay;
+
+	if (vblank->broken)
+		return;
+
+	if (vblank->capture_late)
+		vblank->late++;
+
+	delay = buffer->queued - time;
+	/* we are not getting monotonic timestamps, ignore capture phase */
+	if ((delay < 0) || (delay > 1000000000LL))
+		return;
+
+	if (vblank->capture_time &&
+	    (buffer->sequence > vblank->capture_sequence) &&
+	    (time > vblank->capture_time)) {
+		uint64_t period = (time - vblank->capture_time) /
+			(buffer->sequence - vblank->capture_sequence);
+
+		if (!vblank->capture_period)
+			vblank->capture_period = period;
+		else
+			vblank->capture_period +=
+				((int64_t) (period - vblank->capture_period))
+				/ 16;
+	} else if (buffer->sequence <= vblank->capture_sequence) {
+		/* capture restarted */
+		vblank->capture_period = 0;
+		vblank->capture_delay = 0;
+	}
+	vblank->capture_time = time;
+	vblank->capture_sequence = buffer->sequence;
+
+	if (!vblank->capture_delay)
+		vblank->capture_delay = delay;
+	else
+		vblank->capture_delay +=
+			(delay - (int64_t) vblank->capture_delay) / 8;
+}
+
+static void
+vblank_statistics_print(struct vblank *vblank)
+{
+	uint64_t average = 0;
+
+	if (vblank->latency_count)
+		average = vblank->latency_total / vblank->latency_count;
+
+	log_info("%s: vblank %"PRIu64".%03"PRIu64"ms, capture %"PRIu64".%03"
+		 PRIu64"ms, latency %"PRIu64".%03"PRIu64"ms (max %"PRIu64
+		 ".%03"PRIu64"ms), %d/%d frames late, %d deadlines missed.\n",
+		 vblank->name, vblank->period / 1000000,
+		 (vblank->period / 1000) % 1000,
+		 vblank->capture_period / 1000000,
+		 (vblank->capture_period / 1000) % 1000,
+		 average / 1000000, (average / 1000) % 1000,
+		 vblank->latency_max / 1000000,
+		 (vblank->latency_max / 1000) % 1000,
+		 vblank->late, vblank->commits, vblank->missed);
+
+	pthread_mutex_lock(vblank->statistics_mutex);
+	vblank->latency_last = average;
+	vblank->latency_max_last = vblank->latency_max;
+	pthread_mutex_unlock(vblank->statistics_mutex);
+
+	vblank->commits = 0;
+	vblank->missed = 0;
+	vblank->late = 0;
+	vblank->latency_count = 0;
+	vblank->latency_total = 0;
+	vblank->latency_max = 0;
+}
+
+/*
+ * Our commits are blocking, so by now, the vblank we targeted should
+ * just have passed.
+ */
+void
+vblank_commit_done(struct vblank *vblank, struct capture_buffer *buffer)
+{
+	if (vblank->broken)
+		return;
+
+	if (vblank_query(vblank))
+		return;
+
+	vblank->commits++;
+
+	if (vblank->sequence != vblank->target_sequence) {
+		vblank->missed++;
+		log_ratelimited(LOG_DEBUG, "%s: missed vblank %u (now at "
+				"%u).\n", vblank->name,
+				vblank->target_sequence, vblank->sequence);
+	}
+
+	if (buffer) {
+		uint64_t time = vblank_timeval_ns(buffer->timestamp.tv_sec,
+						  buffer->timestamp.tv_usec);
+
+		if (vblank->time > time) {
+			uint64_t latency = vblank->time - time;
+
+			vblank->latency_count++;
+			vblank->latency_total += latency;
+			if (latency > vblank->latency_max)
+				vblank->latency_max = latency;
+		}
+	}
+
+	if (vblank->commits == VBLANK_STATISTICS_COUNT)
+		vblank_statistics_print(vblank);
+}
+
+/*
+ * Capture to scanout latency, averaged over the last statistics window.
+ */
+void
+vblank_latency_get(struct vblank *vblank, uint64_t *average, uint64_t *max)
+{
+	pthread_mutex_lock(vblank->statistics_mutex);
+	*average = vblank->latency_last;
+	*max = vblank->latency_max_last;
+	pthread_mutex_unlock(vblank->statistics_mutex);
+}
+
+/*
+ * Start out with what our mode claims, we then measure.
+ */
+static void
+vblank_period_init(struct vblank *vblank)
+{
+	struct _drmModeModeInfo *mode;
+
+	mode = kms_crtc_modeline_get(vblank->crtc_id);
+	if (mode && mode->clock && mode->htotal && mode->vtotal)
+		vblank->period = (uint64_t) mode->htotal * mode->vtotal *
+			1000000ULL / mode->clock;
+	else
+		vblank->period = 16666667;
+	free(mode);
+}
+
+/*
+ * Our crtc got reprogrammed, after hotplug, so start over.
+ */
+void
+vblank_reset(struct vblank *vblank)
+{
+	vblank->broken = false;
+	vblank->sequence = 0;
+	vblank->time = 0;
+	vblank->capture_late = false;
+
+	vblank_period_init(vblank);
+
+	if (vblank_query(vblank)) {
+		log_warning("%s: vblank query failed, falling back to fixed "
+			    "sleeps.\n", vblank->name);
+		vblank->broken = true;
+	}
+}
+
+struct vblank *
+vblank_create(const char *name, uint32_t crtc_id, int crtc_index)
+{
+	struct vblank *vblank;
+	int ret;
+
+	vblank = calloc(1, sizeof(struct vblank));
+	if (!vblank)
+		return NULL;
+
+	vblank->name = name;
+	vblank->crtc_id = crtc_id;
+	vblank->crtc_index = crtc_index;
+	vblank->margin = vblank_margin;
+	pthread_mutex_init(vblank->statistics_mutex, NULL);
+
+	vblank_period_init(vblank);
+
+	ret = vblank_query(vblank);
+	if (ret) {
+		fprintf(stderr, "%s: vblank query failed: %s. Falling back "
+			"to fixed %"PRIu64"us sleeps.\n", name,
+			strerror(-ret), vblank->period / 1000);
+		vblank->broken = true;
+	} else
+		printf("%s: vblank period %"PRIu64"us, committing %"PRIu64
+		       "us before vblank.\n", name, vblank->period / 1000,
+		       vblank->margin / 1000);
+
+	return vblank;
+}
+
+void
+vblank_margin_set(int usecs)
+{
+	vblank_margin = usecs * 1000ULL;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2019 Luc Verhaegen <libv@skynet.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _HAVE_VBLANK_H_
+#define _HAVE_VBLANK_H_ 1
+
+struct capture_buffer;
+
+struct vblank {
+	const char *name;
+	uint32_t crtc_id;
+	int crtc_index;
+
+	/* our kernel does not give us vblank information */
+	bool broken;
+
+	/* how long before vblank we want our commit to have been issued */
+	uint64_t margin;
+
+	/* last vblank that we saw, and the measured refresh period, in ns */
+	uint32_t sequence;
+	uint64_t time;
+	uint64_t period;
+
+	/* the vblank which we are currently working towards */
+	uint32_t target_sequence;
+	uint64_t target_time;
+	uint64_t deadline;
+
+	/*
+	 * Capture phase: the last v4l2 timestamp and sequence, the capture
+	 * period, and the time it takes for a frame to reach us after its
+	 * timestamp.
+	 */
+	uint64_t capture_time;
+	uint32_t capture_sequence;
+	uint64_t capture_period;
+	uint64_t capture_delay;
+
+	/*
+	 * When frames are arriving too close to our deadline, we wait for
+	 * them and target the vblank after, so that we consistently show
+	 * each frame one vblank later, instead of randomly hitting or
+	 * missing.
+	 */
+	bool capture_late;
+
+	/* statistics */
+	int commits;
+	int missed;
+	int late;
+	int latency_count;
+	uint64_t latency_total;
+	uint64_t latency_max;
+
+	/* the last full window, for others to look at */
+	pthread_mutex_t statistics_mutex[1];
+	uint64_t latency_last;
+	uint64_t latency_max_last;
+};
+
+struct vblank *vblank_create(const char *name, uint32_t crtc_id,
+			     int crtc_index);
+uint64_t vblank_deadline_next(struct vblank *vblank);
+void vblank_capture_update(struct vblank *vblank,
+			   struct capture_buffer *buffer);
+uint64_t vblank_capture_cutoff(struct vblank *vblank);
+void vblank_commit_done(struct vblank *vblank,
+			struct capture_buffer *buffer);
+void vblank_latency_get(struct vblank *vblank, uint64_t *average,
+			uint64_t *max);
+
+void vblank_reset(struct vblank *vblank);
+void vblank_margin_set(int usecs);
+
+#endif /* _HAVE_VBLANK_H_ */